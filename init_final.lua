@@ -4,16 +4,25 @@
 S = { } -- Sensors (both Temp and Power (Volt+Amp)
 Update = { } -- List of sensors with update() methods
 byName = { } -- Index of conn and name fields to sensor objects
+Rules = { } -- Threshold rules, see Thresholds( )
 Types = { } -- Mapping strings to sensor functions
 -- MANY more exported below.  see _G.xxx = xxx
 
 do -- Create/extend pi (Power Insight) package
 local P = package.loaded["pi"] or {}
 
-if P.version ~= "v0.3" then
-  io.stderr:write( P.ARGV0, ": WARNING: Version mismatch between binary and .lua code\nExpected v0.3, got ", P.version, "\n" )
+if P.version ~= "v0.4" then
+  io.stderr:write( P.ARGV0, ": WARNING: Version mismatch between binary and .lua code\nExpected v0.4, got ", P.version, "\n" )
 end
 
+-- Monotonic seconds (minus start, if given) for intervals, deadlines
+--      and ages.  Unlike gettime( ) it doesn't step when the wall
+--      clock is adjusted.  See pi.monotime( ) and pi.mono2wall( )
+local function clock( start )
+  return P.monotime( ) * 1e-9 - (start or 0)
+end
+P.clock = clock
+
 -- NOTE: this function is a performance optimization that overlaps
 --      conversion and transfer for maximum performance.  But to work
 --      you need to know the *next* channel before reading the current
@@ -66,6 +75,88 @@ local function bbwain_init ( cs )
 end
 P.bbwain_init = bbwain_init
 
+-- ADC chips are initialized on first use rather than when a carrier
+--      is configured, so a query of one channel doesn't wait for every
+--      chip on the carrier (an ADS1256 SELFCAL alone takes tens of
+--      msec).  The carrier leaves an init( cs ) function in each chip
+--      select, chipReady( cs ) runs it once before the chip is touched.
+local function chipReady( cs )
+  local init = cs.init
+  if init ~= nil then
+    init( cs )
+    cs.init = nil
+  end
+end
+P.chipReady = chipReady
+
+local function ads8344_cs_init( cs )
+  if cs.spi.bank then cs.spi.bank:set(cs.bank) end
+  ads8344_init( cs.spi.fd )
+end
+P.ads8344_cs_init = ads8344_cs_init
+
+local function mcp3008_cs_init( cs ) mcp3008_init( cs.spi.fd ) end
+P.mcp3008_cs_init = mcp3008_cs_init
+
+-- NOTE: cs.scale=1/gain and cs.rate must be set (see ads1256_read)
+--      The init is in two halves, start commands the SELFCAL and
+--      finish waits for it, so chipsReady( ) can calibrate several
+--      chips at once.
+local function ads1256_cs_start( cs )
+  cs.spi.bank:set(cs.bank)
+  cs.spi:speed(2000000)
+  cs.selfcal = P.ads1256_start(cs.spi.fd, cs.rate, 1/cs.scale)
+end
+
+local function ads1256_cs_finish( cs )
+  cs.spi.bank:set(cs.bank)
+  cs.ofc, cs.sfc = P.ads1256_finish(cs.spi.fd, cs.rate, cs.selfcal)
+  cs.selfcal = nil
+end
+
+local function ads1256_cs_init( cs )
+  ads1256_cs_start( cs )
+  ads1256_cs_finish( cs )
+end
+P.ads1256_cs_init = ads1256_cs_init
+
+-- Inits that can be started and finished later, init -> { start, finish }
+local Staged = { [ads1256_cs_init]={ ads1256_cs_start, ads1256_cs_finish } }
+
+-- chipsReady( list ) -- chipReady( ) every cs in list, independent
+--      chips together: every SELFCAL is commanded first,
+--      the other chips are initialized while they calibrate, then
+--      each calibration is waited on.  Startup timing of each phase
+--      goes to stderr with -v.
+local function chipsReady( list )
+  local staged, plain, seen = { }, { }, { }
+  for _, cs in ipairs( list ) do
+    if cs.init ~= nil and not seen[cs] then
+      seen[cs] = true
+      table.insert( Staged[cs.init] and staged or plain, cs )
+    end
+  end
+  if #staged + #plain == 0 then return end
+
+  local t0 = clock( )
+  for _, cs in ipairs( staged ) do
+    Staged[cs.init][1]( cs )
+  end
+  local t1 = clock( )
+  for _, cs in ipairs( plain ) do chipReady( cs ) end
+  local t2 = clock( )
+  for _, cs in ipairs( staged ) do
+    Staged[cs.init][2]( cs )
+    cs.init = nil  -- Only once calibrated, a failed SELFCAL is retried
+  end
+  if P.verbose() > 0 then
+    io.stderr:write( string.format(
+      "# Chip init: %d SELFCAL started %.6f, %d others %.6f, calibrated %.6f sec\n",
+      #staged, t1 - t0, #plain, t2 - t1, clock( t2 ) ) )
+  end
+end
+P.chipsReady = chipsReady
+
 -- A word about "cs, mux" pairs.
 -- CS: A "cs" object (Chip Select) roughly corresponds to a specific
 --      ADC chip on some carrier.  It has links to the SPI channel (with
@@ -77,16 +168,20 @@ P.bbwain_init = bbwain_init
 --      have integrated analog mux functions and this value is used to
 --      configure that to select a specific sensor.
 -- The two together select a specific sensor (voltage, current, or temp)
+--      The readers make no tables or strings, a read of a configured
+--      sensor doesn't allocate (see t/test_alloc.c)
 local function ads8344_read( cs, mux )
+  chipReady( cs )
   local s = cs.spi
   s.bank:set(cs.bank)
-  return P.ads8344_getraw(P.spi_message(s.fd, P.ads8344_mkmsg(mux)))
+  return P.ads8344_sample(s.fd, mux)
 end
 P.ads8344_read = ads8344_read
 
 -- NOTE: At the time ads1256_init is called, be sure to save the PGA
 --      setting as cs.scale=1/gain because it's needed here!
 local function ads1256_read( cs, mux )
+  chipReady( cs )
   local s = cs.spi
   s.bank:set(cs.bank)
   if cs.cmux ~= mux then
@@ -98,28 +193,78 @@ end
 P.ads1256_read = ads1256_read
 
 local function mcp3008_read( cs, mux )
-  return P.mcp3008_getraw(P.spi_message(cs.spi.fd, P.mcp3008_mkmsg(mux)))
+  chipReady( cs )
+  return P.mcp3008_sample(cs.spi.fd, mux)
 end
 P.mcp3008_read = mcp3008_read
 
 local function bbwain_read( cs, mux )
+  chipReady( cs )
   local f = cs.file[mux]
   f:seek("set")
   return f:read("*n")
 end
 P.bbwain_read = bbwain_read
 
+-- Readers made by the factories below, so compile( ) can see what's
+--      inside them
+local Factories = setmetatable( { }, { __mode="k" } )
+
 -- Filter factory for the above XXX_read functions (readfn)
 local function filter_factory( f, readfn )
-  return function (cs, mux) cs[mux]=P.filter(cs[mux],f,readfn(cs,mux)) ; return cs[mux] end
+  local fn = function (cs, mux) cs[mux]=P.filter(cs[mux],f,readfn(cs,mux)) ; return cs[mux] end
+  Factories[fn] = { filter=f, readfn=readfn }
+  return fn
 end
 P.filter_factory = filter_factory
 
 local function cache_factory( f, readfn )
-  return function (cs, mux) cs[mux]=readfn(cs,mux) ; return cs[mux] end
+  local fn = function (cs, mux) cs[mux]=readfn(cs,mux) ; return cs[mux] end
+  Factories[fn] = { readfn=readfn }
+  return fn
 end
 P.cache_factory = cache_factory
 
+-- Oversampling factory for ads8344_read: k conversions of the channel
+--      in one SPI message (a power of 2 up to 256), averaged in C for
+--      log2(k)/2 more bits at 1/k the sample rate
+local function oversample_factory( k, readfn )
+  if readfn ~= ads8344_read then
+    error( "oversample: only ADS8344 channels can be oversampled", 2 )
+  end
+  local fn = function (cs, mux)
+      chipReady( cs )
+      local s = cs.spi
+      s.bank:set(cs.bank)
+      return P.ads8344_oversample(s.fd, mux, k)
+    end
+  Factories[fn] = { oversample=k, readfn=readfn }
+  return fn
+end
+P.oversample_factory = oversample_factory
+
+-- Apply Sensors{ oversample=k } to the sensor's ADS8344 readers
+local function oversample( s )
+  local k = s.oversample
+  if k == nil or k == 1 then return end
+  local p = 1
+  while type(k) == "number" and p < k do p = p * 2 end
+  if p ~= k or k > 256 then
+    error( "Sensor "..s.conn..": oversample must be a power of 2 up to 256" )
+  end
+  local found
+  for _, f in ipairs{ "vraw", "araw", "traw" } do
+    if s[f] == ads8344_read then
+      s[f] = oversample_factory( k, ads8344_read )
+      found = true
+    end
+  end
+  if not found then
+    error( "Sensor "..s.conn..": oversample needs ADS8344 channels" )
+  end
+end
+P.oversample = oversample
+
 -- Read the cache (either filtered or update when requested
 local function cache_read( cs, mux ) return cs[mux] end
 P.cache_read = cache_read
@@ -139,6 +284,27 @@ local function everyn_factory( n, readfn )
 end
 P.everyn_factory = everyn_factory
 
+-- Only read when the last reading is older than maxage seconds, the
+--      time-based counterpart of everyn_factory.  Acquisition times
+--      are kept per cs and mux
+local function maxage_factory( maxage, readfn )
+  local times = setmetatable( { }, { __mode="k" } )
+  return function (cs, mux)
+      local t = times[cs]
+      if t == nil then
+        t = { }
+        times[cs] = t
+      end
+      local now = clock( )
+      if t[mux] == nil or now - t[mux] > maxage then
+        cs[mux] = readfn( cs, mux )
+        t[mux] = now
+      end
+      return cs[mux]
+    end
+end
+P.maxage_factory = maxage_factory
+
 -- Object meta-functions for BANK and SPI objects
 local bank_mt
 local function bank_new ( s )
@@ -188,6 +354,51 @@ i2c_mt = {
   }
 P.i2c_new = i2c_new
 
+-- Reference sensors (Vcc and cold junctions) are refreshed the first
+--      time a sensor needs them rather than when the config is loaded,
+--      so a read only waits for its own references.  With Update.epoch
+--      (the default) they are then refreshed once per sample epoch,
+--      a scan cycle (see pi.epoch( ) and pilib_acq.c): the first
+--      sensor of a scan that needs one reads it, the others use that
+--      reading.  refresh( s ) runs s:update( ), unless it already ran
+--      in this epoch, and marks it fresh, fresh( s ) refreshes it if
+--      it's due and returns it.
+local function refresh( s )
+  local e = P.epoch( )
+  if Update.epoch and s.epoch == e then return end
+  s:update( )
+  s.fresh, s.epoch = true, e
+end
+P.refresh = refresh
+
+local function fresh( s )
+  if not s.fresh or (Update.epoch and s.epoch ~= P.epoch( )) then refresh( s ) end
+  return s
+end
+P.fresh = fresh
+
+-- A sensor sampled again in the same sample epoch starts a new one, as
+--      sampling a sensor object does (see pilib_obj.c)
+local function sampled( s )
+  local e = P.epoch( )
+  if s.sampled == e then e = P.epoch( true ) end
+  s.sampled = e
+end
+
+-- ready( sensors ) -- Initialize the chips the sensors read together
+--      (chipsReady) before the first read.  Their references are
+--      left to fresh( ), not every transfer function uses them.
+local function ready( sensors )
+  local chips = { }
+  for _, s in ipairs( sensors ) do
+    for _, f in ipairs{ "vcs", "acs", "tcs" } do
+      if type(s[f]) == "table" then table.insert( chips, s[f] ) end
+    end
+  end
+  chipsReady( chips )
+end
+P.ready = ready
+
 -- Sensor transfer functions  ALL EXPORTED
 local function volt_12v ( s ) return P.sens_12v( s.vraw(s.vcs,s.mux), s.vref ); end
 _G.volt_12v = volt_12v
@@ -209,16 +420,36 @@ local function amp_shunt25 ( s ) return P.sens_shunt25( s.araw(s.acs,s.mux), s.v
 _G.amp_shunt25 = amp_shunt25
 local function amp_shunt50 ( s ) return P.sens_shunt50( s.araw(s.acs,s.mux), s.vcc:volt() ) end
 _G.amp_shunt50 = amp_shunt50
-local function temp_typeK ( s ) return P.volt2temp_K( s.traw(s.tcs,s.mux)*s.vref + s.cj.cjtv ) end
+local function temp_typeK ( s ) return P.volt2temp_K( s.traw(s.tcs,s.mux)*s.vref + fresh(s.cj).cjtv ) end
 _G.temp_typeK = temp_typeK
 local function temp_PTS ( s ) return P.rt2temp_PTS( s.traw(s.tcs,s.mux), s.pullup ) end
 _G.temp_PTS = temp_PTS
 local function temp_44004 ( s ) return P.rt2temp_44004( s.araw(s.acs,s.mux), s.pullup ) end
 _G.temp_44004 = temp_44004
 
-local function power( s ) local v = s:volt() ; local a = s:amp() ; return v*a, v, a end
+local function power( s )
+  local o = s.obj  -- A sensor object (see bind( )) samples in C
+  if o and s.power == power then return o:sample( ) end
+  sampled( s )
+  local v = s:volt() ; local a = s:amp() ; return v*a, v, a
+end
 _G.power = power
 
+-- Reference sensors (Vcc and cold junctions) are update() sensors.
+--      update() reads the reference with s.uraw and saves the result
+--      for the sensors depending on it, the others just use the saved
+--      value.
+local function vcc_update( s ) s.vcs[s.mux] = s.uraw(s.vcs,s.mux) end
+P.vcc_update = vcc_update
+local function vcc_volt( s ) return 4.096/fresh(s).vcs[s.mux] end
+P.vcc_volt = vcc_volt
+local function cj_update( s )
+  s.cjtv = P.temp2volt_K(P.rt2temp_PTS(s.uraw(s.tcs,s.mux), s.pullup))
+end
+P.cj_update = cj_update
+local function cj_temp( s ) return P.rt2temp_PTS(fresh(s).tcs[s.mux], s.pullup) end
+P.cj_temp = cj_temp
+
 -- Types: index of sensor functions
 Types = { ["12v"] = volt_12v, ["12"] = volt_12v,
           ["5v"] = volt_5v, ["5"] = volt_5v,
@@ -236,6 +467,15 @@ Types = { ["12v"] = volt_12v, ["12"] = volt_12v,
           power = power
         }
 
+-- Transfer functions the C acquisition plan knows (see pilib_acq.c)
+local Xfer = { [volt_12v]="12v", [volt_5v]="5v", [volt_3v3]="3v3",
+               [amp_acs713_20]="acs713_20", [amp_acs713_30]="acs713_30",
+               [amp_acs723_10]="acs723_10", [amp_acs723_20]="acs723_20",
+               [amp_shunt10]="shunt10", [amp_shunt25]="shunt25",
+               [amp_shunt50]="shunt50",
+               [temp_typeK]="typeK", [temp_PTS]="PTS", [temp_44004]="Rt44004"
+             }
+
 -- Configuration support functions
 --
 -- The user configures the carriers like this:
@@ -257,6 +497,13 @@ Types = { ["12v"] = volt_12v, ["12"] = volt_12v,
 -- NOTE: The volt, amp, and temp parameters can also be a user defined
 --      function with the signature:  function (self) { }
 --      Check the code or documentation for more details on user functions
+-- NOTE: oversample=k (a power of 2 up to 256) makes each reading of a
+--      sensor's ADS8344 channels k conversions in one SPI message,
+--      averaged for log2(k)/2 more bits, eg. for shunts at low current:
+--          { conn="J3", name="GPU", volt="12v", amp="shunt10", oversample=16 }
+-- NOTE: decimate=r streams a sensor's samples through CIC and FIR
+--      decimation filters, so the stream, its file, history and rollups
+--      get one filtered sample for every r taken (see compile( ) below)
 --
 -- Sensors() adds sensor items details to the the list
 --      of sensors.  A matching connector must be found
@@ -390,16 +637,16 @@ local function MainCarrier ( s )
     local EXP4 = TCC  -- Could be used as an expansion header
     M.EXP4 = EXP4
 
-    -- Initialize the ADC on this carrier
-    spi2_0.bank:set(0) ; ads8344_init( spi2_0.fd ) ; ads8344_init( spi2_1.fd )
-    spi2_0.bank:set(1) ; ads8344_init( spi2_0.fd ) ; ads8344_init( spi2_1.fd )
+    -- The ADCs on this carrier are initialized on first use (chipReady)
+    OBD.CS0A.init, OBD.CS0B.init = ads8344_cs_init, ads8344_cs_init
+    OBD.CS1A.init, OBD.CS1B.init = ads8344_cs_init, ads8344_cs_init
 
     -- Onboard sensors
     local vccsens = {
         conn="Vcc",
-        vcs=OBD.CS0B, mux=7, vraw=cache_read,
-        update=function ( s ) s.vcs[s.mux]=ads8344_read(s.vcs,s.mux) end,
-        volt=function ( s ) return 4.096/s.vcs[s.mux] end
+        vcs=OBD.CS0B, mux=7, vraw=cache_read, uraw=ads8344_read,
+        update=vcc_update,
+        volt=vcc_volt
       }
     local tjmsens = {
         conn="Tjm",
@@ -493,16 +740,16 @@ local function MainCarrier ( s )
                 }
     M.OBD = OBD
 
-    -- Initialize the ADC on this carrier
-    mcp3008_init( spi2_0.fd ) ; mcp3008_init( spi1_0.fd )
-    mcp3008_init( spi2_1.fd ) ; bbwain_init( OBD.CS1V )
+    -- The ADCs on this carrier are initialized on first use (chipReady)
+    OBD.CS0A.init, OBD.CS0V.init = mcp3008_cs_init, mcp3008_cs_init
+    OBD.CS1A.init, OBD.CS1V.init = mcp3008_cs_init, bbwain_init
 
     -- Onboard sensors
     local vccsens = {
         conn="Vcc",
-        vcs=OBD.CS1A, mux=7, vraw=cache_read,
-        update=function ( s ) s.vcs[s.mux]=mcp3008_read(s.vcs,s.mux) end,
-        volt=function ( s ) return 4.096/s.vcs[s.mux] end
+        vcs=OBD.CS1A, mux=7, vraw=cache_read, uraw=mcp3008_read,
+        update=vcc_update,
+        volt=vcc_volt
       }
     P.addSensors( OBD, vccsens )
 
@@ -559,41 +806,29 @@ local function setHeader( hdr, PN )
     -- No prefix when Temp Expansion plugged into the TCC header
     if hdr.name == "TCC" then hdr.prefix = "" end
 
-    -- Initialize the ADC on this carrier
-    local ofc, sfc
+    -- The ADCs on this carrier are initialized (SELFCAL) on first use
+    --      (chipReady), at 2000 samples/sec and a gain of 16
     local csa=hdr.CS0A
-    csa.spi.bank:set(csa.bank)
-    csa.spi:speed(2000000)
-    ofc, sfc = P.ads1256_init(csa.spi.fd, 2000, 16)
-    csa.ofc = ofc
-    csa.sfc = sfc
-    csa.scale = 1/16
+    csa.scale, csa.rate, csa.init = 1/16, 2000, ads1256_cs_init
 
     local csb=hdr.CS0B
-    csb.spi.bank:set(csb.bank)
-    csa.spi:speed(2000000)
-    ofc, sfc = P.ads1256_init(csb.spi.fd, 2000, 16)
-    csb.ofc = ofc
-    csb.sfc = sfc
-    csb.scale = 1/16
+    csb.scale, csb.rate, csb.init = 1/16, 2000, ads1256_cs_init
 
     -- Add junction temperature sensors
-    local tja_update = filter_factory(0.8, ads1256_read)
     local tja = {
         conn="Tja",
         tcs=hdr.CS0A, mux=0x68, traw=cache_read,
-        update=function ( s ) local r=tja_update(s.tcs,s.mux)
-              s.cjtv=P.temp2volt_K(P.rt2temp_PTS(r,27)) end,
-        temp=function( s ) return P.rt2temp_PTS(s.tcs[s.mux],27) end,
+        uraw=filter_factory(0.8, ads1256_read),
+        update=cj_update,
+        temp=cj_temp,
         pullup=27
       }
-    local tjb_update = filter_factory(0.8, ads1256_read)
     local tjb = {
         conn="Tjb",
         tcs=hdr.CS0B, mux=0x68, traw=cache_read,
-        update=function ( s ) local r=tjb_update(s.tcs,s.mux)
-              s.cjtv=P.temp2volt_K(P.rt2temp_PTS(r,27)) end,
-        temp=function( s ) return P.rt2temp_PTS(s.tcs[s.mux],27) end,
+        uraw=filter_factory(0.8, ads1256_read),
+        update=cj_update,
+        temp=cj_temp,
         pullup=27
       }
     P.addSensors( hdr, tja, tjb )
@@ -638,30 +873,708 @@ _G.EXP3Header = P.EXP3Header  -- EXPORT
 -- For Users .conf files
 _G.Sensors = P.Sensors  -- EXPORT from pilib.c
 
+-- Threshold rules, declared after Sensors( ):
+--   Thresholds( { sensor="CPU1", above=150, clear=140, hold=0.002 },
+--               { sensor="ATX5", value="volt", below=4.75, clear=4.85 },
+--               { sensor="Tcpu1", above=90, clear=85, call=hot } )
+-- sensor is a name or conn, value what is checked ("watt", "volt" or
+--      "amp" of power sensors, default the first reading), above or
+--      below the limit, clear where the event ends (hysteresis,
+--      default the limit) and hold how long (seconds) the limit must
+--      be passed to count, shorter excursions are ignored.
+-- The rules are checked in C on every sample of their sensor while
+--      streaming (pi.stream, pi.stream_start), so an event is seen one
+--      sample period after it happens.  pi.stream writes the events
+--      out, in the background dispatch( ) hands them to call( ev ).
+local Values = { watt=1, power=1, volt=2, amp=3 }
+local function Thresholds( ... )
+  for _, r in ipairs{ ... } do
+    if byName[r.sensor] == nil then
+      error( "Thresholds: sensor "..tostring(r.sensor).." not found", 2 )
+    end
+    if type(r.above) ~= "number" and type(r.below) ~= "number" then
+      error( "Thresholds: "..r.sensor.." needs a number above or below", 2 )
+    end
+    if r.value ~= nil and Values[r.value] == nil then
+      error( "Thresholds: "..r.sensor.." unknown value "..tostring(r.value), 2 )
+    end
+    table.insert( Rules, r )
+  end
+end
+P.Thresholds = Thresholds
+_G.Thresholds = P.Thresholds  -- EXPORT
+
+-- Pre/post-trigger capture, declared after Sensors( ):
+--   Capture{ sensors={ "CPU1", "MEM1" }, pre=2000, post=2000,
+--            on="CPU1>150", mark="solve",
+--            gpio="/sys/class/gpio/gpio60/value", file="/tmp/cpu-%d.txt" }
+-- While streaming, the last pre samples of the sensors are kept.  When
+--      the threshold rule named on is raised ("*" for any rule), a
+--      marker tagged mark begins, the gpio goes high or pi.capture( )
+--      is called, post more samples are taken as fast as the ADC goes
+--      and the window is written to file (%d is the capture number).
+local Cap
+local function Capture( c )
+  if type(c) ~= "table" or type(c.sensors) ~= "table" then
+    error( "Capture: needs a list of sensors", 2 )
+  end
+  for _, name in ipairs( c.sensors ) do
+    if byName[name] == nil then
+      error( "Capture: sensor "..tostring(name).." not found", 2 )
+    end
+  end
+  Cap = c
+end
+P.Capture = Capture
+_G.Capture = P.Capture  -- EXPORT
+
+-- Rolling history on disk, declared after Sensors( ):
+--   History{ file="/var/lib/powerinsight/history", hours=72, step=1,
+--            sensors={ "CPU1", "MEM1" } }
+-- While streaming, the average, min and max of each sensor over every
+--      step seconds go to a circular file holding the last hours
+--      (default 24, one second steps, the sensors selected by
+--      default).  Other processes may read it while it's written,
+--      see pihist.  A file written with other sensors or sizes is
+--      started over.
+local Hist
+local function History( h )
+  if type(h) ~= "table" or type(h.file) ~= "string" then
+    error( "History: needs a file", 2 )
+  end
+  if h.sensors == nil then
+    h.sensors = { }
+    for _, s in ipairs( S ) do
+      if P.selected( s ) then
+        table.insert( h.sensors, (s.name ~= nil and s.name ~= "") and s.name or s.conn )
+      end
+    end
+  end
+  for _, name in ipairs( h.sensors ) do
+    if byName[name] == nil then
+      error( "History: sensor "..tostring(name).." not found", 2 )
+    end
+  end
+  Hist = h
+end
+P.History = History
+_G.History = P.History  -- EXPORT
+
 
 -- Update sensors with update() methods
-local function doUpdate( )
+-- @lazy -- skip the Vcc and cold junction references, they are
+--      refreshed when a sensor first needs them (see fresh( ))
+local function doUpdate( lazy )
   for i = 1, #Update do
-    Update[i]:update()
+    local s = Update[i]
+    if not (lazy and (s.update == vcc_update or s.update == cj_update)) then
+      refresh( s )
+    end
   end
-  Update.last = P.gettime( )
+  Update.last = clock( )
   if P.verbose() > 0 then
-    io.write( string.format( "# doUpdate( ) at %.6f\n", Update.last ) )
+    io.write( string.format( "# doUpdate( ) at %.6f\n", P.mono2wall( Update.last * 1e9 ) ) )
   end
 end
 P.doUpdate = doUpdate
 
-local function tryUpdate( )
-  if Update.interval and P.gettime( Update.last ) < Update.interval then
-    -- Not time yet...
-    return
+-- Default interval
+Update.interval = 60  -- seconds
+-- Refresh references once per sample epoch, false for only every
+--      Update.interval (and the first time they're needed)
+Update.epoch = true
+-- tryUpdate( ) latency counters, see updateStats( )
+Update.worst, Update.total, Update.calls, Update.refreshed = 0, 0, 0, 0
+
+
+-- Per-sensor sample scheduling
+--
+-- Each sensor may declare its own sample period in the .conf file as
+--      either "period" (seconds) or "rate" (Hz):
+--   Sensors( { conn="J1", name="CPU1", volt="12v", amp="shunt10", rate=1000 },
+--            { conn="T1", name="Tcpu1", temp="typeK", rate=10 },
+--            { conn="Vcc", rate=1 } )
+-- Sensors with an update() method (Vcc, Tja, Tjb, ...) are always
+--      scheduled and default to Update.interval.  Other sensors are
+--      scheduled only when they declare a period.  Their samples are
+--      kept in s.cache (s.cache.t is the time, s.cache[1..3] are the
+--      results of the sensor's first method, see P.methods)
+--
+-- schedule() (called from post_conf.lua) queues the sensors by SPI
+--      bus in Sched.bus[name], each queue kept in deadline order.
+--      runDue() services the earliest deadline across all the buses,
+--      and counts a deadline miss for every period that went by
+--      without a sample.
+Sched = { bus = { }, queues = { }, list = { }, tick = 0 }
+
+-- Reading methods, in the same order libpidev looks for them
+local methods = { "power", "temp", "volt", "amp", "reading" }
+P.methods = methods
+
+-- Name of the bus a sensor's chip selects are on (eg. "spidev2")
+local function busOf( s )
+  local cs = s.acs or s.vcs or s.tcs
+  local spi = type(cs) == "table" and cs.spi
+  if type(spi) == "table" and spi.name then
+    return string.match( spi.name, "(spidev%d+)" ) or spi.name
+  end
+  return "other"
+end
+P.busOf = busOf
+
+-- Read a sensor using its first method and save the results in s.cache
+--      (a sensor object keeps them itself, see bind( ))
+local function sample( s )
+  local o = s.obj
+  if o then return o:sample( ) end
+  if s.power ~= power then sampled( s ) end  -- power( ) does
+  local c = s.cache
+  if c == nil then
+    c = { }
+    s.cache = c
+  end
+  for i = 1, #methods do
+    local m = s[methods[i]]
+    if m ~= nil then
+      c[1], c[2], c[3] = m( s )
+      c.t = clock( )
+      c.m = i
+      return c[1], c[2], c[3]
+    end
+  end
+end
+P.sample = sample
+
+-- Insert s into bus queue q by deadline (queues are short)
+local function enqueue( q, s )
+  local i = #q
+  while i > 0 and q[i].due > s.due do
+    q[i+1] = q[i]
+    i = i - 1
+  end
+  q[i+1] = s
+end
+
+-- (Re)build the schedule from S
+local function schedule( )
+  local now = clock( )
+  Sched.bus = { }
+  Sched.queues = { }
+  Sched.list = { }
+  for k, s in ipairs( S ) do
+    local period = s.period or (s.rate and 1/s.rate)
+    if s.update ~= nil and period == nil then
+      period = Update.interval or 0
+    end
+    if period ~= nil then
+      s.period = period
+      if s.update ~= nil and Update.last then
+        s.due = Update.last + period
+      else
+        s.due = now
+      end
+      s.nsamp, s.nmiss, s.first, s.prev = 0, 0, nil, nil
+      s.bus = busOf( s )
+      local q = Sched.bus[s.bus]
+      if q == nil then
+        q = { name=s.bus }
+        Sched.bus[s.bus] = q
+        table.insert( Sched.queues, q )
+      end
+      enqueue( q, s )
+      table.insert( Sched.list, s )
+    end
+  end
+  return #Sched.list
+end
+P.schedule = schedule
+
+-- Earliest deadline in the bus queues
+-- @refsOnly -- only consider sensors with update() methods, and only
+--      once they are fresh (until then nothing has needed them)
+-- @tick -- skip sensors already serviced in this pass (false for none)
+-- Returns the queue, position in the queue and the sensor
+local function earliest( refsOnly, tick )
+  local bq, bi, bs
+  for _, q in ipairs( Sched.queues ) do
+    for i = 1, #q do
+      local s = q[i]
+      if (not refsOnly or (s.update ~= nil and s.fresh)) and s.tick ~= tick then
+        if bs == nil or s.due < bs.due then
+          bq, bi, bs = q, i, s
+        end
+        break
+      end
+    end
+  end
+  return bq, bi, bs
+end
+
+-- Service scheduled sensors whose deadline has passed, earliest first
+-- @now -- time to compare deadlines against (default: now)
+-- @max -- maximum number of sensors to service (default: all due)
+-- @refsOnly -- only service sensors with update() methods
+-- Returns the number serviced and the next deadline (nil if none)
+local function runDue( now, max, refsOnly )
+  now = now or clock( )
+  Sched.tick = Sched.tick + 1
+  local n = 0
+  while true do
+    local bq, bi, bs = earliest( refsOnly, Sched.tick )
+    if bs == nil or bs.due > now or (max and n >= max) then
+      local q, i, s = earliest( refsOnly, false )
+      return n, s and s.due
+    end
+
+    -- Reschedule before the read, a read that raises must not drop
+    -- the sensor (or a reference) from the schedule for good
+    table.remove( bq, bi )
+    bs.tick = Sched.tick
+    if bs.period > 0 then
+      local due = bs.due + bs.period
+      if due <= now then
+        -- Missed deadlines, skip ahead rather than bunch up samples
+        local missed = math.floor( (now - due) / bs.period ) + 1
+        bs.nmiss = bs.nmiss + missed
+        due = due + missed * bs.period
+      end
+      bs.due = due
+    else
+      bs.due = now
+    end
+    enqueue( bq, bs )
+
+    local ok, err = pcall( bs.update ~= nil and refresh or sample, bs )
+    if not ok then error( err, 0 ) end
+    bs.nsamp = bs.nsamp + 1
+    bs.first = bs.first or now
+    bs.prev = now
+    n = n + 1
+  end
+end
+P.runDue = runDue
+
+-- Samples, deadline misses and achieved rate of a scheduled sensor
+local function schedStats( s )
+  local achieved = 0
+  if s.nsamp and s.nsamp > 1 and s.prev > s.first then
+    achieved = (s.nsamp - 1) / (s.prev - s.first)
+  end
+  return s.nsamp or 0, s.nmiss or 0, achieved
+end
+P.schedStats = schedStats
+
+local function schedReport( out )
+  out = out or io.stdout
+  out:write( "# Sensor     Bus         Rate(Hz) Achieved  Samples   Misses\n" )
+  for _, s in ipairs( Sched.list ) do
+    local nsamp, nmiss, achieved = schedStats( s )
+    out:write( string.format( "# %-10s %-10s %9.3f %8.3f %8d %8d\n",
+        (s.name and s.name ~= "") and s.name or s.conn, s.bus,
+        s.period > 0 and 1/s.period or math.huge, achieved, nsamp, nmiss ) )
+  end
+end
+P.schedReport = schedReport
+
+-- Run the schedule for duration seconds (default: forever)
+--      With pi.gcpolicy( "paced" ) garbage is only collected in the
+--      idle time before each deadline (see pilib_gc.c).  The collector
+--      is back to normal when it returns, or raises a read's error.
+local function runSchedule( duration )
+  local stop = duration and clock( ) + duration
+  P.gcstats( true )
+  P.gcpace( true )
+  local ok, err = pcall( function( )
+    while true do
+      local n, due = runDue( )
+      if due == nil then break end  -- Nothing scheduled
+      if stop then
+        if clock( ) >= stop then break end
+        if due > stop then due = stop end
+      end
+      P.gcidle( due - clock( ) )
+      P.sleep( due - clock( ) )
+    end
+  end )
+  P.gcpace( false )
+  if not ok then error( err, 0 ) end
+  if P.verbose() > 0 then
+    schedReport( io.stderr )
+    P.gcreport( )
+  end
+end
+P.runSchedule = runSchedule
+
+-- The reference reading s brings up to date first (see fresh( )), the
+--      same one obj_ref( ) in pilib_obj.c picks for an object, or nil
+local function refOf( s )
+  if s.update ~= nil then return s end
+  local a = s.amp
+  if a == amp_shunt10 or a == amp_shunt25 or a == amp_shunt50 then
+    return s.vcc
+  end
+  if s.temp == temp_typeK then return s.cj end
+end
+
+-- Whether reading s will refresh its reference: it's stale, or stale
+--      in the new sample epoch the read starts (see sampled( ))
+local function refreshes( s )
+  local r = refOf( s )
+  if r == nil then return false end
+  if not r.fresh then return true end
+  if not Update.epoch then return false end
+  local e = P.epoch( )
+  local o = s.obj
+  local last
+  if o then last = o:epoch( ) else last = s.sampled end
+  return r.epoch ~= e or last == e
+end
+
+-- Refresh at most one stale reference (update() sensor), the one with
+--      the earliest deadline.  Called before every read, with the
+--      sensor read, and left out when the read refreshes a reference
+--      of its own, so a read never pays for more than one reference
+--      conversion.  The time spent here is the latency added to the
+--      read, see updateStats
+local function tryUpdate( s )
+  local now = clock( )
+  local n = 0
+  if s == nil or not refreshes( s ) then
+    n = runDue( now, 1, true )
+  end
+  local took = clock( now )
+  Update.calls = Update.calls + 1
+  Update.total = Update.total + took
+  if took > Update.worst then
+    Update.worst = took
+  end
+  if n > 0 then
+    Update.last = now
+    Update.refreshed = Update.refreshed + n
   end
-  doUpdate( )
 end
 P.tryUpdate = tryUpdate
 
--- Default interval
-Update.interval = 60  -- seconds
+-- Refresh stale references during idle time, until none are due or
+--      budget seconds have been used
+-- Returns the number of references refreshed
+local function idleUpdate( budget )
+  local start = clock( )
+  local n = 0
+  repeat
+    local did = runDue( clock( ), 1, true )
+    n = n + did
+  until did == 0 or clock( start ) >= (budget or 0)
+  if n > 0 then
+    Update.last = clock( )
+    Update.refreshed = Update.refreshed + n
+  end
+  return n
+end
+P.idleUpdate = idleUpdate
+
+-- Age-bounded reads
+--
+-- Every sample taken by sample() is kept in s.cache with its time, so
+--      consumers polling the same sensor at different rates can share
+--      samples instead of each triggering a conversion:
+--   local p, v, a = s:read{ maxage=0.5 }   -- or s:read( 0.5 )
+-- returns the cached sample if it is at most 0.5 seconds old and
+--      otherwise reads the sensor.  Without maxage it always reads.
+local Cache = { hits = 0, misses = 0 }
+
+-- Read a sensor with a maximum age for the result
+-- @s -- sensor
+-- @opt -- maximum age in seconds or a table with a maxage field
+-- Returns the results of the sensor's first method (see methods)
+local function read( s, opt )
+  local maxage = opt
+  if type(opt) == "table" then maxage = opt.maxage end
+  local o = s.obj
+  if o and maxage ~= nil and o:age( ) <= maxage then
+    Cache.hits = Cache.hits + 1
+    return o:last( )
+  end
+  local c = s.cache
+  if c ~= nil and c.t ~= nil and maxage ~= nil and clock( c.t ) <= maxage then
+    Cache.hits = Cache.hits + 1
+    return c[1], c[2], c[3]
+  end
+  Cache.misses = Cache.misses + 1
+  tryUpdate( s )
+  return sample( s )
+end
+P.read = read
+
+-- read() by name for libpidev
+-- Returns the name of the method used and its results, or nil if the
+--      sensor is not found or has no reading methods
+local function readByName( name, maxage )
+  local s = byName[name]
+  if s == nil then return nil end
+  local r1, r2, r3 = read( s, maxage )
+  if s.obj then return s.obj:method( ), r1, r2, r3 end
+  local c = s.cache
+  if c == nil or c.m == nil then return nil end
+  return methods[c.m], r1, r2, r3
+end
+P.readByName = readByName
+
+-- Cache hits and misses of read( )
+local function cacheStats( reset )
+  local hits, misses = Cache.hits, Cache.misses
+  if reset then
+    Cache.hits, Cache.misses = 0, 0
+  end
+  return hits, misses
+end
+P.cacheStats = cacheStats
+
+-- Latency added to reads by tryUpdate( )
+-- @reset -- optional, clear the counters after reading them
+-- Returns worst and mean seconds per call, calls, references refreshed
+local function updateStats( reset )
+  local worst, calls, refreshed = Update.worst, Update.calls, Update.refreshed
+  local mean = 0
+  if calls > 0 then mean = Update.total / calls end
+  if reset then
+    Update.worst, Update.total, Update.calls, Update.refreshed = 0, 0, 0, 0
+  end
+  return worst, mean, calls, refreshed
+end
+P.updateStats = updateStats
+
+
+-- Streaming acquisition plan
+--
+-- compile() translates sensors into the C acquisition plan (see
+--      piacq.h) so pi.stream( ) can sample them without going through
+--      Lua.  Sensors built from the readers, filters, reference and
+--      Types functions above are sampled entirely in C.  Anything else
+--      (user functions, bbwain, everyn_factory, ...) is sampled with
+--      sample( s ) through Lua.
+local Readers = { [ads8344_read]="ads8344", [ads1256_read]="ads1256",
+                  [mcp3008_read]="mcp3008" }
+
+-- Channel descriptor for a cs, mux and reader (XXX_read or factory)
+-- @lazy -- leave the chip to be readied on first use
+local function chanOf( cs, mux, readfn, lazy )
+  local filter, oversample
+  local f = Factories[readfn]
+  if f ~= nil then
+    filter, oversample, readfn = f.filter, f.oversample, f.readfn
+  end
+  if type(cs) ~= "table" or Readers[readfn] == nil then return nil end
+  if not lazy then
+    chipReady( cs )  -- The plan reads it directly (compile( ) readied it)
+  end
+  return { cs=cs, mux=mux, adc=Readers[readfn], filter=filter,
+           oversample=oversample }
+end
+
+-- Descriptor of a sensor, for pi.acq_sensor( ) or pi.sensor_new( ):
+--      its kind, channels, transfer function names and constants.
+--      ref( r ) is what to put in it for a reference sensor r (plan
+--      index or object), lazy is for chanOf( ).  The kind stays "lua"
+--      for anything it doesn't recognize.
+local function describe( s, ref, lazy )
+  local d = { name=(s.name ~= nil and s.name ~= "") and s.name or s.conn,
+              sensor=s, kind="lua" }
+
+  local function volt( )
+    d.vxf, d.v, d.vref = Xfer[s.volt], chanOf( s.vcs, s.mux, s.vraw, lazy ), s.vref
+  end
+  local function amp( )
+    d.axf, d.a = Xfer[s.amp], chanOf( s.acs, s.mux, s.araw, lazy )
+    if s.vcc ~= nil then d.vcc = ref( s.vcc ) end
+  end
+  local function temp( )
+    d.txf, d.vref, d.pullup = Xfer[s.temp], s.vref, s.pullup
+    if s.temp == temp_44004 then
+      d.t = chanOf( s.acs, s.mux, s.araw, lazy )
+    else
+      d.t = chanOf( s.tcs, s.mux, s.traw, lazy )
+    end
+    if s.cj ~= nil then d.cj = ref( s.cj ) end
+  end
+
+  if s.update == vcc_update and s.volt == vcc_volt then
+    d.kind, d.v = "vcc", chanOf( s.vcs, s.mux, s.uraw, lazy )
+  elseif s.update == cj_update and s.temp == cj_temp then
+    d.kind, d.t, d.pullup = "cj", chanOf( s.tcs, s.mux, s.uraw, lazy ), s.pullup
+  elseif s.update ~= nil then
+    d.kind = "lua"
+  elseif s.power ~= nil then
+    if s.power == power then
+      d.kind = "power" ; volt( ) ; amp( )
+    end
+  elseif s.temp ~= nil then
+    d.kind = "temp" ; temp( )
+  elseif s.volt ~= nil then
+    d.kind = "volt" ; volt( )
+  elseif s.amp ~= nil then
+    d.kind = "amp" ; amp( )
+  end
+  return d
+end
+
+-- CIC and FIR ratios of Sensors{ decimate= } (see pilib_decim.c),
+--      decimate=r is a CIC by r/2 and a FIR by 2 for even r (the FIR
+--      alone for 2), a CIC by r and a compensating FIR for odd r, or
+--      decimate={ cic=, fir= } gives both
+local function decimation( s )
+  local dec = s.decimate
+  if dec == nil then return 1, 1 end
+  if type(dec) == "number" then
+    if dec % 1 ~= 0 or dec < 1 then
+      error( "Sensor "..s.conn..": decimate must be a whole number >= 1" )
+    end
+    if dec % 2 == 0 then return dec / 2, 2 end
+    return dec, 1
+  elseif type(dec) == "table" then
+    return dec.cic or 1, dec.fir or 1
+  end
+  error( "Sensor "..s.conn..": decimate must be a number or { cic=, fir= }" )
+end
+
+-- Sensors selected by default, the same as the default App
+local function selected( s )
+  return (s.name ~= nil and s.name ~= "") or not string.find(s.conn, "^[JT]")
+end
+P.selected = selected
+
+-- Compile sensors into the plan
+-- @... -- names of sensors to select (default: see selected( ), "*": all)
+-- Returns the number of sensors selected
+local function compile( ... )
+  local names = { ... }
+  local index = { }  -- sensor -> plan index
+  local emit = { }  -- selected sensors
+
+  local function add( s )
+    if index[s] ~= nil then return index[s] end
+    local cic, fir = decimation( s )
+    local d = describe( s, add )
+    d.emit, d.period, d.cic, d.fir = emit[s], s.period or Update.interval, cic, fir
+    if Update.epoch and (d.kind == "vcc" or d.kind == "cj") then
+      d.period = 0  -- Every scan, once (see pi_acq_refresh( ))
+    end
+    index[s] = P.acq_sensor( d )
+    return index[s]
+  end
+
+  local list = { }
+  if #names == 0 or names[1] == "*" then
+    for _, s in ipairs( S ) do
+      if names[1] == "*" or selected( s ) then table.insert( list, s ) end
+    end
+  else
+    for _, name in ipairs( names ) do
+      local s = byName[name]
+      if s == nil then
+        error( "Sensor "..tostring(name).." not found", 2 )
+      end
+      table.insert( list, s )
+    end
+  end
+
+  ready( list )
+  P.acq_reset( )
+  for _, s in ipairs( list ) do emit[s] = true end
+  for _, s in ipairs( list ) do add( s ) end
+
+  -- Threshold rules of the selected sensors, Rules.plan[index] = rule
+  Rules.plan = { }
+  for _, r in ipairs( Rules ) do
+    local s = byName[r.sensor]
+    if emit[s] then
+      local value = 1
+      if s.power == power then value = Values[r.value] or 1 end
+      local name = r.name or
+        (r.above ~= nil and r.sensor..">"..r.above or r.sensor.."<"..r.below)
+      Rules.plan[P.event_rule{ sensor=index[s], name=name, value=value,
+          above=r.above, below=r.below, clear=r.clear, hold=r.hold }] = r
+    end
+  end
+
+  -- Capture of the selected sensors
+  if Cap ~= nil then
+    local sensors = { }
+    for _, name in ipairs( Cap.sensors ) do
+      if emit[byName[name]] then table.insert( sensors, index[byName[name]] ) end
+    end
+    if #sensors > 0 then
+      P.capture_setup{ sensors=sensors, pre=Cap.pre, post=Cap.post, file=Cap.file,
+                       rule=Cap.on, mark=Cap.mark, gpio=Cap.gpio }
+    end
+  end
+
+  -- History of the selected sensors, in the order of the file
+  if Hist ~= nil then
+    local sensors = { }
+    for i, name in ipairs( Hist.sensors ) do
+      if emit[byName[name]] then sensors[i] = index[byName[name]] end
+    end
+    P.history_setup{ file=Hist.file, names=Hist.sensors, sensors=sensors,
+                     step=Hist.step or 1, hours=Hist.hours or 24 }
+  end
+  return #list
+end
+P.compile = compile
+
+-- Sensor objects
+--
+-- bind( s ) gives a sensor compile( ) would sample in C an object,
+--      s.obj (see pilib_obj.c), sampled by the same C code as the
+--      plan.  sample( ), read( ), readByName( ), power( ) and libpidev
+--      go straight to it instead of walking the readers and transfer
+--      functions above, and it keeps the last sample in place of
+--      s.cache.  The sensor table stays as it is, the object is on top
+--      of it.  Anything else keeps its Lua methods (s.obj is false).
+--      The chips are still readied on first use.  post_conf.lua binds
+--      every sensor in S.
+local function bind( s )
+  if s.obj == nil then
+    s.obj = P.sensor_new( describe( s, bind, true ) ) or false
+  end
+  return s.obj or nil
+end
+P.bind = bind
+
+-- Compile sensors and write the plan to a snapshot file, so later
+--      starts can stream it without running the config file (see
+--      pilib_snap.c, powerInsight --snapshot and --load)
+-- @file -- snapshot to write
+-- @... -- names of sensors to select, as for compile( )
+-- Returns the number of sensors in it
+local function snapshot( file, ... )
+  compile( ... )
+  local n = P.snapshot_save( file )
+  print( "# Snapshot of "..n.." sensors in "..file )
+  return n
+end
+P.snapshot = snapshot
+
+-- Handle threshold events while streaming in the background
+-- @timeout -- seconds to wait for an event (default 0, don't wait)
+-- @fn -- handler, default the rule's call( ev ) or the global
+--      OnEvent( ev ), and without either the event is printed
+-- Returns the number of events handled
+local function dispatch( timeout, fn )
+  local events = P.events( timeout )
+  for _, ev in ipairs( events ) do
+    local r = Rules.plan and Rules.plan[ev.rule] or { }
+    local call = fn or r.call or OnEvent
+    if call ~= nil then
+      call( ev )
+    else
+      io.write( string.format( "# %.6f %s %s %s %.3f\n", P.mono2wall( ev.t ),
+        ev.name, ev.raised and "raised" or "cleared", ev.sensor, ev.value ) )
+    end
+  end
+  return #events
+end
+P.dispatch = dispatch
 
 
 pi = P -- ie. return P
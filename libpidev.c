@@ -20,6 +20,7 @@
 #include <lualib.h>
 #include "pilib.h"
 #include "piglobal.h"
+#include "piacq.h"
 #include "pidev.h"
 
 /* Global variables */
@@ -28,6 +29,12 @@ char *  libexecdir = PILIBDIR_DEFAULT ;
 char *  configfile = PICONFIGFILE_DEFAULT ;
 unsigned int  debug = PIDEBUG_DEFAULT ;
 int  verbose = PIVERBOSE_DEFAULT ;
+int  rtprio = 0 ;
+int  rtlock = 0 ;
+int  rtcpu = -1 ;
+
+/* Snapshot to load instead of the config file (pidev_setup_load) */
+static char *  snapshot = NULL ;
 
 /* For pathnames */
 static char  buffer[1024];
@@ -35,6 +42,9 @@ static char  buffer[1024];
 /* The Lua instance */
 static lua_State *  L = NULL ;
 
+/* Sampling in the background (pidev_start) */
+static int  background = 0 ;
+
 
 /* Helper function for _read and _temp functions */
 int pidev_read_helper( char prefix, int portNumber, reading_t * sample )
@@ -73,6 +83,48 @@ int pidev_setup( char * a, char * l, char * c, unsigned int d, int v )
    return PIERR_SUCCESS ;
 }
 
+/* Set the real-time options for the calling (reading) thread
+ *
+ * fifo_prio > 0 runs it SCHED_FIFO at that priority, mlock locks the
+ *      Lua state and heap in memory once configured, cpu >= 0 pins it
+ *      to that CPU.  pidev_open applies them to the thread calling it.
+ */
+PIEXPORT(pidev_setup_rt)
+int pidev_setup_rt( int fifo_prio, int mlock, int cpu )
+{
+   if( fifo_prio < 0 || fifo_prio > 99 ) { return PIERR_ERROR ; }
+
+   rtprio = fifo_prio ;
+   rtlock = mlock ;
+   rtcpu = cpu ;
+
+   return PIERR_SUCCESS ;
+}
+
+/* Set the garbage collector policy, see pilib_gc.c */
+PIEXPORT(pidev_setup_gc)
+int pidev_setup_gc( int paced, int step )
+{
+   pi_gc_policy( paced != 0, step );
+
+   return PIERR_SUCCESS ;
+}
+
+/* Load a snapshot instead of running the config file
+ *
+ * pidev_open makes the snapshot (powerInsight --snapshot) the plan
+ *      unless the config changed since it was written, reads are then
+ *      served from the plan in C.  Only the sensors in the snapshot can
+ *      be read.
+ */
+PIEXPORT(pidev_setup_load)
+int pidev_setup_load( char * path )
+{
+   snapshot = path ;
+
+   return PIERR_SUCCESS ;
+}
+
 /* Open/init the library */
 PIEXPORT(pidev_open)
 int pidev_open( )
@@ -80,7 +132,7 @@ int pidev_open( )
    int  ret ;
 
    /* Create a Lua instance */
-   L = luaL_newstate( );
+   L = pi_newstate( );  /* Pooled allocator, see pilib_alloc.c */
    if( L == NULL ) {
       fprintf( stderr, "%s: Memory allocation error creating Lua instance.\n", ARGV0 );
       return PIERR_ERROR ;
@@ -103,29 +155,54 @@ int pidev_open( )
       luaPI_doerror( L, ret, buffer );
    }
 
-   /* Now read the config file */
-   ret = luaL_loadfile( L, configfile );
-   if( ret != 0 || (ret = lua_pcall( L, 0, LUA_MULTRET, 0 )) ) {
-      strcpy( buffer, "Processing config file " );
-      strcat( buffer, configfile );
-      luaPI_doerror( L, ret, buffer );
-   }
-   if( (debug & DBG_LUA) && lua_gettop( L ) ) {
-      fprintf( stderr, "Config file returned %d values. Ignored\n", lua_gettop( L ) );
+   /* A snapshot (pidev_setup_load) stands in for the config file */
+   if( snapshot != NULL ) {
+      lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+      lua_getfield( L, -1, "snapshot_load" );
+      lua_remove( L, -2 );
+      lua_pushstring( L, snapshot );
+      if( (ret = lua_pcall( L, 1, 2, 0 )) != 0 ) {
+         luaPI_doerror( L, ret, "Loading the snapshot" );
+      }
+      if( lua_isnil( L, -2 ) && verbose >= 0 ) {
+         fprintf( stderr, "%s: %s: %s, reading %s\n", ARGV0, snapshot,
+               lua_tostring( L, -1 ), configfile );
+      }
+      lua_pop( L, 2 );
    }
-   lua_pop( L, lua_gettop( L ));
 
-   /* Post-configfile initialization with Lua code */
-   strcpy( buffer, libexecdir );
-   strcat( buffer, "/post_conf.lc" );
-   ret = luaL_loadfile( L, buffer );
-   if( ret != 0 || (ret = lua_pcall( L, 0, 0, 0 )) ) {
-      strcpy( buffer, "Load/run " );
-      strcat( buffer, libexecdir );
+   if( ! piplan.snapshot ) {
+      /* Now read the config file */
+      ret = luaL_loadfile( L, configfile );
+      if( ret != 0 || (ret = lua_pcall( L, 0, LUA_MULTRET, 0 )) ) {
+         strcpy( buffer, "Processing config file " );
+         strcat( buffer, configfile );
+         luaPI_doerror( L, ret, buffer );
+      }
+      if( (debug & DBG_LUA) && lua_gettop( L ) ) {
+         fprintf( stderr, "Config file returned %d values. Ignored\n", lua_gettop( L ) );
+      }
+      lua_pop( L, lua_gettop( L ));
+
+      /* Post-configfile initialization with Lua code */
+      strcpy( buffer, libexecdir );
       strcat( buffer, "/post_conf.lc" );
-      luaPI_doerror( L, ret, buffer );
+      ret = luaL_loadfile( L, buffer );
+      if( ret != 0 || (ret = lua_pcall( L, 0, 0, 0 )) ) {
+         strcpy( buffer, "Load/run " );
+         strcat( buffer, libexecdir );
+         strcat( buffer, "/post_conf.lc" );
+         luaPI_doerror( L, ret, buffer );
+      }
    }
 
+   /* Real-time options (pidev_setup_rt), failures are only warnings */
+   pi_rt_lock( L );
+   pi_rt_enter( rtcpu );
+
+   /* Reads are acquisition, the collector runs when paced (pidev_setup_gc) */
+   pi_gc_begin( L );
+
    return PIERR_SUCCESS ;
 }
 
@@ -157,15 +234,120 @@ int pidev_temp( int portNumber, reading_t * sample )
 }
 
 
+/* Plan index of byName[name], or -1 */
+static int pidev_planidx( const char * name )
+{
+   int  idx = -1 ;
+
+   if( piplan.snapshot ) {
+      return pi_snap_find( name );
+   }
+   lua_settop( L, 0 );
+   lua_getfield( L, LUA_GLOBALSINDEX, "byName" );
+   lua_getfield( L, -1, name );
+   if( ! lua_isnil( L, -1 ) ) {
+      idx = pi_acq_find( L, -1 );
+   }
+   lua_settop( L, 0 );
+
+   return idx ;
+}
+
+/* Fill sample from the values val of plan sensor idx */
+static void pidev_plansample( int idx, const double * val, reading_t * sample )
+{
+   switch( piplan.sensor[idx].kind ) {
+   case PIKIND_POWER :
+      sample->watt = val[0] ;
+      sample->volt = val[1] ;
+      sample->amp = val[2] ;
+      break ;
+   case PIKIND_VOLT :
+   case PIKIND_VCC :
+      sample->reading = sample->volt = val[0] ;
+      break ;
+   case PIKIND_AMP :
+      sample->reading = sample->amp = val[0] ;
+      break ;
+   default :
+      sample->reading = val[0] ;
+      break ;
+   }
+}
+
+/* Get a reading sampled in the background (pidev_start), no older
+ *      than max_age seconds
+ */
+static int pidev_read_latest( char * name, double max_age, reading_t * sample )
+{
+   double  val[3] ;
+   int64_t  t ;
+   int  idx ;
+   int  n ;
+
+   sample->reading = sample->volt = sample->amp = NAN ;
+
+   idx = pidev_planidx( name );
+   if( idx < 0 ) {
+      if( debug & DBG_PIDEV ) {
+         fprintf( stderr, "DBG: read_byname: '%s' not sampled in the background\n", name );
+      }
+      return PIERR_NOTFOUND ;
+   }
+   n = stream_latest( idx, val, &t );
+   if( n <= 0 || (monotime_ns( ) - t) * 1e-9 > max_age ) {
+      return PIERR_NOSAMPLE ;
+   }
+   pidev_plansample( idx, val, sample );
+
+   return PIERR_SUCCESS ;
+}
+
+/* Get a reading of a loaded snapshot (pidev_setup_load), sampled in C */
+static int pidev_read_plan( char * name, reading_t * sample )
+{
+   double  val[3] ;
+   int  idx ;
+
+   sample->reading = sample->volt = sample->amp = NAN ;
+
+   idx = pi_snap_find( name );
+   if( idx < 0 ) {
+      if( debug & DBG_PIDEV ) {
+         fprintf( stderr, "DBG: read_byname: '%s' not in the snapshot\n", name );
+      }
+      return PIERR_NOTFOUND ;
+   }
+   if( pi_snap_read( L, idx, val ) < 0 ) {
+      return PIERR_NOSAMPLE ;
+   }
+   pidev_plansample( idx, val, sample );
+
+   return PIERR_SUCCESS ;
+}
+
+/* Number at stack index idx, or NAN */
+static double pidev_tonumber( int idx )
+{
+   return lua_isnumber( L, idx ) ? lua_tonumber( L, idx ) : NAN ;
+}
+
 /* Get a reading by name
  *
  * This looks up the name, and calls the "power", "volt", "temp", "amp"
  *      or "reading" method on the sensor.  They are checked in that order
- *      and whichever is found first is called.
+ *      and whichever is found first is called.  A sensor with a sensor
+ *      object (pi.bind) is sampled by the object instead.
+ *
+ * While sampling in the background (pidev_start) the latest sample
+ *      is returned instead, the hardware belongs to the background.
+ *      A loaded snapshot (pidev_setup_load) samples the plan in C.
  */
 PIEXPORT(pidev_read_byname)
 int pidev_read_byname( char * name, reading_t * sample )
 {
+   int  kind ;
+
    if( sample == NULL ) { return PIERR_NOSAMPLE ; }
 
    if( debug & DBG_PIDEV ) {
@@ -173,20 +355,16 @@ int pidev_read_byname( char * name, reading_t * sample )
       fflush( stderr );
    }
 
+   if( background ) {
+      return pidev_read_latest( name, INFINITY, sample );
+   }
+   if( piplan.snapshot ) {
+      return pidev_read_plan( name, sample );
+   }
+
    /* Clean the stack */
    lua_settop( L, 0 );
 
-   /* pi.tryUpdate( )  globals */
-   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
-   lua_getfield( L, -1, "tryUpdate" );
-   if( debug & DBG_PIDEV ) { fprintf( stderr, "DBG: Calling tryUpdate ..." ); }
-   lua_pcall( L, 0, 0, 0 );
-   if( debug & DBG_PIDEV ) {
-      fprintf( stderr, " Done\n" );
-      fflush( stderr );
-   }
-   lua_pop( L, 1 ); /* pi */
-
    /* The name index */
    lua_getfield( L, LUA_GLOBALSINDEX, "byName" );
 
@@ -205,6 +383,51 @@ int pidev_read_byname( char * name, reading_t * sample )
          );
    }
 
+   /* pi.tryUpdate( s ), unless reading s refreshes a reference itself */
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "tryUpdate" );
+   lua_pushvalue( L, -3 );
+   if( debug & DBG_PIDEV ) { fprintf( stderr, "DBG: Calling tryUpdate ..." ); }
+   lua_pcall( L, 1, 0, 0 );
+   if( debug & DBG_PIDEV ) {
+      fprintf( stderr, " Done\n" );
+      fflush( stderr );
+   }
+   lua_settop( L, 2 );  /* byName, s */
+
+   /* A sensor object (pi.bind) samples in C: p, v, a = s.obj:sample( ) */
+   lua_getfield( L, -1, "obj" );
+   kind = pi_obj_kind( L, -1 );
+   if( kind >= 0 ) {
+      lua_getfield( L, -1, "sample" );
+      lua_insert( L, -2 );
+      if( lua_pcall( L, 1, 3, 0 ) != 0 ) {
+         goto failure ;
+      }
+      switch( kind ) {
+      case PIKIND_POWER :
+         sample->watt = pidev_tonumber( -3 );
+         sample->volt = pidev_tonumber( -2 );
+         sample->amp = pidev_tonumber( -1 );
+         break ;
+      case PIKIND_VOLT :
+      case PIKIND_VCC :
+         sample->reading = sample->volt = pidev_tonumber( -3 );
+         sample->amp = NAN ;
+         break ;
+      case PIKIND_AMP :
+         sample->reading = sample->amp = pidev_tonumber( -3 );
+         sample->volt = NAN ;
+         break ;
+      default :
+         sample->temp = pidev_tonumber( -3 );
+         sample->volt = sample->amp = NAN ;
+         break ;
+      }
+      goto success ;
+   }
+   lua_pop( L, 1 );
+
    /* Look for a method to run */
 
    /* power */
@@ -384,6 +607,476 @@ success:
    if( debug & DBG_PIDEV ) {
       fprintf( stderr, "DBG: read_byname returning SUCCESS\n" );
    }
+   pi_gc_idle( L, 0.0 );  /* Only if it's been long without idle time */
+   return PIERR_SUCCESS ;
+}
+
+/* Get a reading by name, no older than max_age seconds
+ *
+ * Returns the sensor's cached sample when it was acquired within
+ *      max_age seconds, otherwise reads the sensor (see pi.read).  This
+ *      lets consumers polling the same sensor at different rates share
+ *      samples.  The sample is filled in the same way as read_byname.
+ *
+ * While sampling in the background the latest sample is returned if
+ *      it is within max_age seconds, PIERR_NOSAMPLE otherwise.
+ */
+PIEXPORT(pidev_read_maxage)
+int pidev_read_maxage( char * name, double max_age, reading_t * sample )
+{
+   const char *  method ;
+
+   if( sample == NULL ) { return PIERR_NOSAMPLE ; }
+
+   if( debug & DBG_PIDEV ) {
+      fprintf( stderr, "DBG: read_maxage( '%s', %g, %p )\n", name, max_age, sample );
+      fflush( stderr );
+   }
+
+   if( background ) {
+      return pidev_read_latest( name, max_age, sample );
+   }
+   /* No cached samples in a snapshot, every read is fresh */
+   if( piplan.snapshot ) {
+      return pidev_read_byname( name, sample );
+   }
+
+   /* method, r1, r2, r3 = pi.readByName( name, max_age ) */
+   lua_settop( L, 0 );
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "readByName" );
+   lua_pushstring( L, name );
+   lua_pushnumber( L, max_age );
+   if( lua_pcall( L, 2, 4, 0 ) != 0 ) {
+      if( debug & DBG_PIDEV ) {
+         fprintf( stderr, "DBG: readByName failed: %s\n", lua_tostring( L, -1 ) );
+      }
+      sample->reading = sample->volt = sample->amp = NAN ;
+      return PIERR_ERROR ;
+   }
+
+   method = lua_tostring( L, -4 );
+   if( method == NULL ) {
+      if( debug & DBG_PIDEV ) {
+         fprintf( stderr, "DBG: read_maxage: '%s' not found\n", name );
+      }
+      sample->reading = sample->volt = sample->amp = NAN ;
+      return PIERR_NOTFOUND ;
+   }
+
+   if( strcmp( method, piMethodNames[PIMN_POWER] ) == 0 ) {
+      sample->watt = pidev_tonumber( -3 );
+      sample->volt = pidev_tonumber( -2 );
+      sample->amp = pidev_tonumber( -1 );
+   } else if( strcmp( method, piMethodNames[PIMN_VOLT] ) == 0 ) {
+      sample->reading = sample->volt = pidev_tonumber( -3 );
+      sample->amp = NAN ;
+   } else if( strcmp( method, piMethodNames[PIMN_AMP] ) == 0 ) {
+      sample->reading = sample->amp = pidev_tonumber( -3 );
+      sample->volt = NAN ;
+   } else {
+      /* temp or reading */
+      sample->reading = pidev_tonumber( -3 );
+      sample->volt = sample->amp = NAN ;
+   }
+   lua_settop( L, 0 );
+
+   return PIERR_SUCCESS ;
+}
+
+/* Refresh stale references in idle time
+ *
+ * Reads refresh at most one stale reference (Vcc, cold junction) each,
+ *      their own if it is stale, or else the one most overdue.
+ *      An application with idle time between reads can call this to
+ *      keep them fresh instead, so the reads don't pay for it.
+ *      Does nothing while sampling in the background (pidev_start).
+ */
+PIEXPORT(pidev_idle)
+int pidev_idle( double budget )
+{
+   double  start = pi_monotonic( );
+   int  n ;
+
+   /* The background refreshes the references itself (see stream_loop) */
+   if( background ) { return 0 ; }
+
+   lua_settop( L, 0 );
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "idleUpdate" );
+   lua_pushnumber( L, budget );
+   if( lua_pcall( L, 1, 1, 0 ) != 0 ) {
+      if( debug & DBG_PIDEV ) {
+         fprintf( stderr, "DBG: idleUpdate failed: %s\n", lua_tostring( L, -1 ) );
+      }
+      return PIERR_ERROR ;
+   }
+   n = lua_tointeger( L, -1 );
+   lua_settop( L, 0 );
+
+   /* Collect garbage in what is left (paced, see pidev_setup_gc) */
+   pi_gc_idle( L, budget - (pi_monotonic( ) - start) );
+
+   return n ;
+}
+
+/* Get the latency added to reads by refreshing references */
+PIEXPORT(pidev_update_stats)
+int pidev_update_stats( update_stats_t * stats, int reset )
+{
+   if( stats == NULL ) { return PIERR_NOSAMPLE ; }
+
+   lua_settop( L, 0 );
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "updateStats" );
+   lua_pushboolean( L, reset );
+   if( lua_pcall( L, 1, 4, 0 ) != 0 ) {
+      if( debug & DBG_PIDEV ) {
+         fprintf( stderr, "DBG: updateStats failed: %s\n", lua_tostring( L, -1 ) );
+      }
+      return PIERR_ERROR ;
+   }
+   stats->worst = lua_tonumber( L, -4 );
+   stats->mean = lua_tonumber( L, -3 );
+   stats->reads = lua_tonumber( L, -2 );
+   stats->refreshed = lua_tonumber( L, -1 );
+   lua_settop( L, 0 );
+
+   return PIERR_SUCCESS ;
+}
+
+/* Get the garbage collection metrics (see pilib_gc.c) */
+PIEXPORT(pidev_gc_stats)
+int pidev_gc_stats( gc_stats_t * stats, int reset )
+{
+   struct pi_gcstats  st ;
+
+   if( stats == NULL ) { return PIERR_NOSAMPLE ; }
+
+   pi_gc_get( &st, reset );
+   stats->cycles = st.cycles ;
+   stats->steps = st.steps ;
+   stats->collections = st.collections ;
+   stats->total = st.total ;
+   stats->mean = st.cycles > 0 ? st.total / st.cycles : 0.0 ;
+   stats->worst = st.worst ;
+
+   return PIERR_SUCCESS ;
+}
+
+/* Get the memory counts of the Lua state (see pilib_alloc.c) */
+PIEXPORT(pidev_memstats)
+int pidev_memstats( memstats_t * stats )
+{
+   struct pi_memstats  st ;
+
+   if( stats == NULL ) { return PIERR_NOSAMPLE ; }
+   if( L == NULL || pi_memstats_get( L, &st ) < 0 ) { return PIERR_ERROR ; }
+
+   stats->inuse = st.inuse ;
+   stats->peak = st.peak ;
+   stats->limit = st.limit ;
+   stats->allocs = st.allocs ;
+   stats->frees = st.frees ;
+   stats->failed = st.failed ;
+   stats->pooled = st.pooled ;
+   stats->idle = st.idle ;
+
+   return PIERR_SUCCESS ;
+}
+
+/* Sample in the background
+ *
+ * Streams every sensor that can be sampled in C (pi.stream_start with
+ *      "*") at rate scans per second.  The samples feed reads and
+ *      phase markers.
+ */
+PIEXPORT(pidev_start)
+int pidev_start( double rate )
+{
+   if( background ) { return PIERR_ERROR ; }
+
+   lua_settop( L, 0 );
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "stream_start" );
+   lua_pushnumber( L, rate );
+   lua_pushstring( L, "*" );
+   if( lua_pcall( L, 2, 1, 0 ) != 0 ) {
+      if( verbose >= 0 ) {
+         fprintf( stderr, "%s: pidev_start: %s\n", ARGV0, lua_tostring( L, -1 ) );
+      }
+      lua_settop( L, 0 );
+      return PIERR_ERROR ;
+   }
+   lua_settop( L, 0 );
+   background = 1 ;
+
+   return PIERR_SUCCESS ;
+}
+
+/* Stop sampling in the background */
+PIEXPORT(pidev_stop)
+int pidev_stop( void )
+{
+   if( ! background ) { return PIERR_SUCCESS ; }
+
+   lua_settop( L, 0 );
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "stream_stop" );
+   lua_pcall( L, 0, 0, 0 );
+   lua_settop( L, 0 );
+   background = 0 ;
+
+   return PIERR_SUCCESS ;
+}
+
+/* Mark the beginning of a phase, from any thread */
+PIEXPORT(pidev_mark_begin)
+int pidev_mark_begin( const char * tag )
+{
+   if( tag == NULL ) { return PIERR_ERROR ; }
+
+   return pi_mark( tag, 1 ) == 0 ? PIERR_SUCCESS : PIERR_ERROR ;
+}
+
+/* Mark the end of the latest phase with the tag, from any thread */
+PIEXPORT(pidev_mark_end)
+int pidev_mark_end( const char * tag )
+{
+   if( tag == NULL ) { return PIERR_ERROR ; }
+
+   return pi_mark( tag, 0 ) == 0 ? PIERR_SUCCESS : PIERR_ERROR ;
+}
+
+/* Get the energy a sensor used during the last phase with the tag */
+PIEXPORT(pidev_phase)
+int pidev_phase( const char * tag, char * name, phase_t * phase )
+{
+   struct pi_phase_stat  st ;
+   double  duration ;
+   int  idx ;
+
+   if( phase == NULL ) { return PIERR_NOSAMPLE ; }
+
+   idx = pidev_planidx( name );
+   if( idx < 0 || pi_mark_result( tag, idx, &st, &duration ) < 0 ) {
+      return PIERR_NOTFOUND ;
+   }
+   phase->energy = st.energy ;
+   phase->avg = st.covered > 0 ? st.energy / st.covered : NAN ;
+   phase->peak = st.n > 0 ? st.peak : NAN ;
+   phase->min = st.n > 0 ? st.min : NAN ;
+   phase->duration = duration ;
+   phase->samples = st.n ;
+
+   return PIERR_SUCCESS ;
+}
+
+/* Public copy of an event */
+static void pidev_event_copy( event_t * event, const struct pi_event * ev )
+{
+   memset( event, 0, sizeof(*event) );
+   memcpy( event->rule, ev->name, sizeof(event->rule) );  /* PIEVT_NAMELEN */
+   strncpy( event->sensor, piplan.sensor[ev->sensor].name, sizeof(event->sensor) -1 );
+   event->raised = ev->raised ;
+   event->time = mono2wall( ev->t );
+   event->duration = (ev->t - ev->start) / 1000000000.0 ;
+   event->value = ev->value ;
+   event->peak = ev->peak ;
+}
+
+/* File descriptor readable while threshold events are pending */
+PIEXPORT(pidev_event_fd)
+int pidev_event_fd( void )
+{
+   int  fd = pi_event_fd( );
+
+   return fd >= 0 ? fd : PIERR_ERROR ;
+}
+
+/* Next threshold event, PIERR_NOTFOUND if none */
+PIEXPORT(pidev_event_next)
+int pidev_event_next( event_t * event )
+{
+   struct pi_event  ev ;
+
+   if( event == NULL ) { return PIERR_NOSAMPLE ; }
+
+   if( pi_event_next( &ev ) < 0 ) {
+      return PIERR_NOTFOUND ;
+   }
+   pidev_event_copy( event, &ev );
+
+   return PIERR_SUCCESS ;
+}
+
+/* The application's callback, see pidev_event_callback */
+static void (* eventfn)( const event_t *, void * ) = NULL ;
+
+static void pidev_event_call( const struct pi_event * ev, void * arg )
+{
+   event_t  event ;
+
+   pidev_event_copy( &event, ev );
+   eventfn( &event, arg );
+}
+
+/* Call fn( event, arg ) from the sampling thread for each event */
+PIEXPORT(pidev_event_callback)
+int pidev_event_callback( void (* fn)( const event_t * event, void * arg ), void * arg )
+{
+   pi_event_callback( NULL, NULL );
+   eventfn = fn ;
+   if( fn != NULL ) {
+      pi_event_callback( pidev_event_call, arg );
+   }
+
+   return PIERR_SUCCESS ;
+}
+
+/* Trigger the capture, from any thread */
+PIEXPORT(pidev_capture)
+int pidev_capture( const char * why )
+{
+   return pi_capture_trigger( why ) == 0 ? PIERR_SUCCESS : PIERR_ERROR ;
+}
+
+/* reading_t from values x[0 .. n-1] */
+static void pidev_reading( reading_t * r, const double * x, int n )
+{
+   r->reading = x[0] ;
+   r->volt = n == 3 ? x[1] : NAN ;
+   r->amp = n == 3 ? x[2] : NAN ;
+}
+
+/* Aggregates of a sensor over the last completed (or current) period */
+PIEXPORT(pidev_rollup)
+int pidev_rollup( char * name, int tier, int current, rollup_t * rollup )
+{
+   struct pi_rollup  r ;
+   double  x[3] = { NAN, NAN, NAN } ;
+   int  i ;
+
+   if( rollup == NULL ) { return PIERR_NOSAMPLE ; }
+
+   if( pi_rollup_get( pidev_planidx( name ), tier, current, &r ) < 0 ) {
+      return PIERR_NOTFOUND ;
+   }
+   rollup->start = r.start ;
+   rollup->duration = r.step ;
+   rollup->samples = r.n ;
+   for( i = 0 ; i < r.nval ; ++i ) {
+      x[i] = r.sum[i] / r.n ;
+   }
+   pidev_reading( &rollup->avg, x, r.nval );
+   pidev_reading( &rollup->min, r.min, r.nval );
+   pidev_reading( &rollup->max, r.max, r.nval );
+   for( i = 0 ; i < r.nval ; ++i ) {
+      x[i] = pi_rollup_sd( &r, i );
+   }
+   pidev_reading( &rollup->sd, x, r.nval );
+
+   return PIERR_SUCCESS ;
+}
+
+/* Statistics of a sensor since the last call */
+PIEXPORT(pidev_stats)
+int pidev_stats( char * name, int keep, stats_t * stats )
+{
+   struct pi_stats  st ;
+
+   if( stats == NULL ) { return PIERR_NOSAMPLE ; }
+
+   if( pi_stats_take( pidev_planidx( name ), !keep, &st ) < 0 ) {
+      return PIERR_NOTFOUND ;
+   }
+   stats->start = st.start ;
+   stats->end = st.end ;
+   stats->samples = st.n ;
+   pidev_reading( &stats->mean, st.mean, st.nval );
+   pidev_reading( &stats->sd, st.sd, st.nval );
+   pidev_reading( &stats->min, st.min, st.nval );
+   pidev_reading( &stats->max, st.max, st.nval );
+   stats->p50 = st.p50 ;
+   stats->p99 = st.p99 ;
+   stats->p999 = st.p999 ;
+
+   return PIERR_SUCCESS ;
+}
+
+/* Record the background samples to a binary file */
+PIEXPORT(pidev_record)
+int pidev_record( const char * path )
+{
+   if( background ) { return PIERR_ERROR ; }
+
+   lua_settop( L, 0 );
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "stream_file" );
+   if( path != NULL ) {
+      lua_pushstring( L, path );
+   } else {
+      lua_pushnil( L );
+   }
+   if( lua_pcall( L, 1, 0, 0 ) != 0 ) {
+      if( verbose >= 0 ) {
+         fprintf( stderr, "%s: pidev_record: %s\n", ARGV0, lua_tostring( L, -1 ) );
+      }
+      lua_settop( L, 0 );
+      return PIERR_ERROR ;
+   }
+   lua_settop( L, 0 );
+
+   return PIERR_SUCCESS ;
+}
+
+/* Open a binary stream file, no need for pidev_open */
+PIEXPORT(pidev_file_open)
+pidev_file_t * pidev_file_open( const char * path )
+{
+   if( path == NULL ) { return NULL ; }
+
+   return pib_open( path );
+}
+
+/* Read the samples between from and to (wall clock sec) next */
+PIEXPORT(pidev_file_seek)
+int pidev_file_seek( pidev_file_t * file, double from, double to )
+{
+   if( file == NULL ) { return PIERR_ERROR ; }
+
+   pib_seek( file, pib_mono( file, from ), pib_mono( file, to ) );
+
+   return PIERR_SUCCESS ;
+}
+
+/* Next sample in the range, PIERR_NOTFOUND past the end */
+PIEXPORT(pidev_file_next)
+int pidev_file_next( pidev_file_t * file, record_t * record )
+{
+   struct pib_sample  s ;
+
+   if( file == NULL ) { return PIERR_ERROR ; }
+   if( record == NULL ) { return PIERR_NOSAMPLE ; }
+
+   if( pib_next( file, &s ) < 0 ) {
+      return PIERR_NOTFOUND ;
+   }
+   memset( record, 0, sizeof(*record) );
+   strncpy( record->sensor, s.name, sizeof(record->sensor) -1 );
+   record->time = pib_wall( file, s.t );
+   record->reading.reading = s.val[0] ;
+   record->reading.volt = s.n == 3 ? s.val[1] : NAN ;
+   record->reading.amp = s.n == 3 ? s.val[2] : NAN ;
+
+   return PIERR_SUCCESS ;
+}
+
+PIEXPORT(pidev_file_close)
+int pidev_file_close( pidev_file_t * file )
+{
+   pib_close( file );
+
    return PIERR_SUCCESS ;
 }
 
@@ -394,6 +1087,8 @@ int pidev_close( void )
    /* FIXME: Not sure what to do here...  How do we shut down
     *   all the open file descriptors and he Lua instance?
     */
+   pidev_stop( );
+   pi_rt_leave( );
    return PIERR_SUCCESS ;
 }
 
@@ -17,6 +17,9 @@ char *  libexecdir = PILIBDIR_DEFAULT ;
 char *  configfile = PICONFIGFILE_DEFAULT ;
 unsigned int  debug = PIDEBUG_DEFAULT ;
 int  verbose = PIVERBOSE_DEFAULT ;
+int  rtprio = 0 ;
+int  rtlock = 0 ;
+int  rtcpu = -1 ;
 
 
 /* Lua library loader/open function */
@@ -0,0 +1,585 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+#ifndef PIACQ_H
+#define PIACQ_H
+
+/* Acquisition plan
+ *
+ * The sensors in S are Lua tables whose methods walk the readers,
+ *    filters and transfer functions in init_final.lua.  That's fine
+ *    for a reading now and then, but too slow and too jittery for a
+ *    continuous stream.  pi.compile( ) (init_final.lua) translates
+ *    the sensors it recognizes into the flat structures below so
+ *    they can be sampled entirely in C.  Anything it doesn't
+ *    recognize is kept as a PIKIND_LUA sensor and sampled through
+ *    pi.sample( s ).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <lua.h>
+
+/* Limits of the plan, all storage is static */
+#define PIACQ_MAXBANKS 8
+#define PIACQ_MAXBITS 16
+#define PIACQ_MAXCS 32
+#define PIACQ_MAXSENSORS 128
+
+/* ADC chip types */
+#define PIADC_ADS8344 1
+#define PIADC_ADS1256 2
+#define PIADC_MCP3008 3
+
+/* Sensor kinds */
+#define PIKIND_LUA 0  /* sampled with pi.sample( s ) */
+#define PIKIND_POWER 1
+#define PIKIND_VOLT 2
+#define PIKIND_AMP 3
+#define PIKIND_TEMP 4
+#define PIKIND_VCC 5  /* Vcc reference (update() sensor) */
+#define PIKIND_CJ 6  /* Cold junction reference (update() sensor) */
+
+/* Transfer functions, see pilib_sensor.c and pilib_temp.c */
+#define PIXF_NONE 0
+#define PIXF_12V 1
+#define PIXF_5V 2
+#define PIXF_3V3 3
+#define PIXF_ACS713_20 4
+#define PIXF_ACS713_30 5
+#define PIXF_ACS723_10 6
+#define PIXF_ACS723_20 7
+#define PIXF_SHUNT10 8
+#define PIXF_SHUNT25 9
+#define PIXF_SHUNT50 10
+#define PIXF_TYPEK 11
+#define PIXF_PTS 12
+#define PIXF_44004 13
+
+/* Bank select GPIOs shared by chip selects on the same SPI device */
+struct pi_bank {
+   int  nbits ;
+   int  fd[PIACQ_MAXBITS] ;
+   int  cur ;  /* Current setting, -1 if unknown */
+   int  ref ;  /* Registry reference to the Lua bank table */
+   unsigned long  gen ;  /* Hardware generation cur was last pulled in */
+} ;
+
+/* A chip select, ie. one ADC chip */
+struct pi_cs {
+   int  adc ;  /* PIADC_XXX */
+   int  fd ;  /* spidev fd */
+   struct pi_bank *  bank ;  /* NULL if no bank select */
+   int  banksel ;  /* Bank to select */
+   int  bus ;  /* spidev bus number (eg. 2 for /dev/spidev2.1) */
+   double  scale ;  /* ADS1256 1/gain */
+   int  cmux ;  /* ADS1256 current MUX setting, -1 if unknown */
+   int  ref ;  /* Registry reference to the Lua cs table */
+   unsigned long  gen ;  /* Hardware generation cmux was last pulled in */
+} ;
+
+/* A channel of a chip select */
+struct pi_chan {
+   struct pi_cs *  cs ;  /* NULL if not used */
+   int  mux ;
+   double  filter ;  /* pi.filter factor, < 0 for none */
+   int  oversample ;  /* ADS8344 conversions per reading, 1 for none */
+   double  last ;  /* Last (filtered) raw reading, NAN if none */
+} ;
+
+struct pi_sensor {
+   char  name[16] ;
+   int  kind ;  /* PIKIND_XXX */
+   int  emit ;  /* Selected for output (not just a reference) */
+   int  vxf, axf, txf ;  /* PIXF_XXX */
+   struct pi_chan  v, a, t ;
+   double  vref ;
+   double  pullup ;
+   int  vcc ;  /* Index of Vcc reference sensor, -1 if none */
+   int  cj ;  /* Index of cold junction reference sensor, -1 if none */
+   double  period ;  /* Reference refresh period (sec) */
+   double  due ;  /* Next reference refresh (sec, CLOCK_MONOTONIC) */
+   double  refv ;  /* Reference value: Vcc volts, or cold junction volts */
+   unsigned long  epoch ;  /* Sample epoch refv was read in, 0 if none */
+   int  bus ;  /* SPI bus of its channels, -1 if mixed or sampled in Lua */
+   int  ref ;  /* Registry reference to the Lua sensor table */
+} ;
+
+struct pi_plan {
+   int  nbanks ;
+   struct pi_bank  bank[PIACQ_MAXBANKS] ;
+   int  ncs ;
+   struct pi_cs  cs[PIACQ_MAXCS] ;
+   int  nsensors ;
+   struct pi_sensor  sensor[PIACQ_MAXSENSORS] ;
+   int  snapshot ;  /* Loaded from a snapshot, no Lua tables behind it */
+} ;
+
+extern struct pi_plan  piplan ;
+
+/* Sample plan sensor idx into val[0..2]
+ * Returns the number of values (1 or 3), or -1 on error
+ *
+ * Sensors on different buses (pi_sensor.bus >= 0) share no state but
+ *    reference values, so they may be sampled from different threads.
+ *    PIKIND_LUA sensors need L and may only be sampled by its thread.
+ */
+int pi_acq_sample( lua_State * L, int idx, double * val );
+
+/* Sample plan sensor idx n times back to back, as fast as its ADC
+ *    allows: val[3*i .. 3*i+2] and t[i] (monotime_ns) of each
+ * Returns the number of values per sample (1 or 3), or -1 on error
+ */
+int pi_acq_burst( lua_State * L, int idx, int n, double * val, int64_t * t );
+
+/* Conversion of compiled sensors from raw ADC codes, for recording
+ *    the codes rather than the values (see pilib_pib.c)
+ *    pi_acq_format -- transfer function and weight of each code
+ *    pi_acq_codes -- codes of the sample just taken, and the reference
+ *       value used to convert them
+ *    pi_acq_convert -- values from raw readings (code * weight)
+ *    pi_acq_xfer -- a transfer function
+ */
+int pi_acq_format( int idx, int * xf, double * lsb );
+int pi_acq_codes( int idx, int32_t * code, double * refv );
+int pi_acq_convert( int kind, const int * xf, const double * raw,
+      double vref, double pullup, double refv, double * val );
+double pi_acq_xfer( int xf, double raw, double vref, double pullup, double refv );
+
+/* Names of the PIKIND_XXX, PIXF_XXX and PIADC_XXX values in the
+ *    descriptors of pi.compile( ), and the index of one (0 if unknown)
+ */
+extern const char * const  piKindNames[] ;
+extern const char * const  piXfNames[] ;
+extern const char * const  piAdcNames[] ;
+int pi_acq_lookup( const char * const * names, const char * name );
+
+/* Plan index of the Lua sensor table at idx, or -1 */
+int pi_acq_find( lua_State * L, int idx );
+
+/* SPI bus all of a compiled sensor's channels are on, or -1 */
+int pi_acq_bus( const struct pi_sensor * s );
+
+/* Latest sample of plan sensor idx while streaming in the background
+ *    (pi.stream_start), see pilib_stream.c
+ */
+int stream_latest( int idx, double * val, int64_t * t );
+
+/* Non-zero while streaming in the background (pi.stream_start) */
+int stream_running( void );
+
+/* Refresh reference sensor idx (PIKIND_VCC or PIKIND_CJ), unless it
+ *    was already in the calling thread's sample epoch
+ */
+int pi_acq_refresh( lua_State * L, int idx );
+
+/* Sample epochs, one scan cycle each (see pilib_acq.c)
+ *    pi_acq_epoch -- the calling thread's epoch
+ *    pi_acq_epoch_next -- start a new one on the calling thread
+ */
+unsigned long pi_acq_epoch( void );
+unsigned long pi_acq_epoch_next( void );
+
+/* Copy bank, mux and filter state from the plan to the Lua
+ *    tables (push) or back (pull), so C and Lua readers can be
+ *    mixed
+ */
+void pi_acq_push( lua_State * L );
+void pi_acq_pull( lua_State * L );
+
+/* Hardware generations (see pilib_acq.c), pi_acq_touch( ) is in
+ *    pilib.h
+ *    pi_acq_generation -- the current one
+ */
+unsigned long pi_acq_generation( void );
+
+/* Plans other than piplan, built and sampled from the Lua thread by
+ *    the same code (the sensor objects', see pilib_obj.c)
+ *    pi_plan_add -- add the sensor described at stack index 1 (see
+ *       pi.acq_sensor( )), PIKIND_LUA if it can't be sampled in C
+ *    pi_plan_sample -- pi_acq_sample( ) of one of its sensors
+ *    pi_plan_pull, pi_plan_push -- pi_acq_pull( ) and pi_acq_push( )
+ *       of just what one of its sensors shares with the Lua readers
+ */
+struct pi_sensor * pi_plan_add( lua_State * L, struct pi_plan * p );
+int pi_plan_sample( lua_State * L, struct pi_plan * p, int idx, double * val );
+void pi_plan_pull( lua_State * L, struct pi_plan * p, int idx );
+void pi_plan_push( lua_State * L, struct pi_plan * p, int idx );
+
+/* Sensor objects (pilib_obj.c), the userdata pi.bind( s ) keeps in
+ *    s.obj
+ *    pi_obj_kind -- PIKIND_XXX of the object at idx, or -1 if it
+ *       isn't one
+ *    pi_obj_flush -- hand the Lua tables the bank and mux settings
+ *       objects changed (see pi_acq_touch( ))
+ */
+int pi_obj_kind( lua_State * L, int idx );
+void pi_obj_flush( lua_State * L );
+
+/* Application phase markers (pilib_mark.c)
+ *    pi_mark -- queue a begin (or end) marker for tag, lock-free
+ *    pi_mark_sample -- attribute a power sample to the phases
+ *    pi_mark_reset -- forget previous samples, a new stream starts
+ *    pi_mark_result -- statistics of the last completed phase of tag
+ *    pi_mark_report -- print the completed phases
+ */
+#define PIMARK_TAGLEN 32
+#define PIMARK_MAXOPEN 16  /* Phases measured at once */
+#define PIMARK_MAXDONE 32  /* Completed phases kept */
+
+struct pi_phase_stat {
+   unsigned long  n ;  /* Samples inside the phase */
+   double  energy ;  /* Joules */
+   double  covered ;  /* Seconds of the phase with samples on both sides */
+   double  peak ;
+   double  min ;
+} ;
+
+struct pi_phase {
+   char  tag[PIMARK_TAGLEN] ;
+   int64_t  begin, end ;  /* monotime_ns */
+   struct pi_phase_stat  stat[PIACQ_MAXSENSORS] ;
+} ;
+
+int pi_mark( const char * tag, int begin );
+void pi_mark_sample( int sensor, int64_t t, double watts );
+void pi_mark_reset( void );
+int pi_mark_result( const char * tag, int sensor, struct pi_phase_stat * stat,
+      double * duration );
+void pi_mark_report( FILE * out );
+
+/* Threshold rules and events (pilib_event.c)
+ *    pi_event_reset -- drop the rules (the plan is being rebuilt)
+ *    pi_event_arm -- start the rules from scratch (a stream starts)
+ *    pi_event_sample -- check the rules of a sensor on a new sample,
+ *       called by the loop sampling the sensor
+ *    pi_event_next -- pop the next event, 0 if one, -1 if none
+ *    pi_event_fd -- eventfd readable while events are pending
+ *    pi_event_callback -- also call fn( ev, arg ) from the sampling
+ *       loop as each event happens (must not block), NULL to stop
+ *    pi_event_report -- print the pending events
+ */
+#define PIEVT_NAMELEN 32
+#define PIEVT_MAXRULES 64
+
+struct pi_event {
+   char  name[PIEVT_NAMELEN] ;  /* Rule name */
+   int  rule ;  /* Rule index */
+   int  sensor ;  /* Plan index */
+   int  raised ;  /* 1 raised, 0 cleared */
+   int64_t  t ;  /* Sample that raised or cleared it (monotime_ns) */
+   int64_t  start ;  /* First sample past the limit (monotime_ns) */
+   double  value ;  /* Value at t */
+   double  peak ;  /* Most extreme value since start */
+} ;
+
+void pi_event_reset( void );
+void pi_event_arm( void );
+void pi_event_sample( int sensor, int64_t t, const double * val, int n );
+int pi_event_next( struct pi_event * ev );
+int pi_event_fd( void );
+void pi_event_callback( void (* fn)( const struct pi_event *, void * ), void * arg );
+void pi_event_report( FILE * out );
+
+/* Pre/post-trigger capture (pilib_capture.c)
+ *    pi_capture_reset -- drop the capture (the plan is being rebuilt)
+ *    pi_capture_arm -- start over with empty rings (a stream starts)
+ *    pi_capture_sample -- keep a sample of a sensor in its ring,
+ *       called by the loop sampling the sensor
+ *    pi_capture_burst -- once triggered, take the post-trigger samples
+ *       of the loop's capture sensors, returns 1 if it did
+ *    pi_capture_poll -- check the external (GPIO) trigger
+ *    pi_capture_trigger -- trigger a capture, from any thread
+ *    pi_capture_rule, pi_capture_mark -- trigger it if the threshold
+ *       rule raised or the marker begun is the one that triggers it
+ *    pi_capture_dump -- write a completed capture to its file
+ */
+#define PICAP_WHYLEN 32
+
+void pi_capture_reset( void );
+void pi_capture_arm( void );
+void pi_capture_sample( int sensor, int64_t t, const double * val, int n );
+int pi_capture_burst( lua_State * L, const int * sensor, int n );
+void pi_capture_poll( void );
+int pi_capture_trigger( const char * why );
+void pi_capture_rule( const char * name );
+void pi_capture_mark( const char * tag );
+void pi_capture_dump( int final );
+
+/* Binary stream files (pilib_pib.c)
+ *
+ * Raw ADC codes of each sensor in blocks of up to PIB_BLOCK samples,
+ *    columns of delta (times delta of delta) zigzag varints, and one
+ *    of the reference value of sensors converted with one, with the
+ *    sensors' conversion in the header and a sparse index of the
+ *    blocks' times in the footer for seeking to a time range.
+ *    pib_create -- start a file for the sensors of the plan
+ *    pib_put -- add a sample, by the writer thread
+ *    pib_finish -- write what's pending and the index, close it
+ *    pib_open -- open a file for reading
+ *    pib_seek -- go to the first block that may hold samples in
+ *       [from, to) (monotime_ns of the file)
+ *    pib_next -- next sample in the range, 0 if one, -1 if done
+ *    pib_wall, pib_mono -- convert the file's times to wall clock
+ *       seconds and back
+ *    pib_wall_ns -- same as pib_wall, in nanoseconds (see wall_format)
+ *    pib_close -- done reading
+ * Samples come back a block at a time, in time order for each
+ *    sensor but not across sensors.
+ */
+#define PIB_BLOCK 256  /* Samples per block */
+#define PIB_GROUP 16  /* Blocks per index entry */
+
+struct pib_writer ;
+struct pib_reader ;
+
+struct pib_sample {
+   int  sensor ;  /* Index in the file */
+   const char *  name ;
+   int64_t  t ;  /* monotime_ns */
+   int  n ;  /* Number of values (1 or 3) */
+   double  val[3] ;
+   int  ncode ;
+   int32_t  code[2] ;  /* Raw ADC codes (milli-units for Lua sensors) */
+   double  refv ;  /* Reference value they were converted with, NAN if none */
+} ;
+
+struct pib_writer * pib_create( const char * path );
+int pib_put( struct pib_writer * w, int sensor, int64_t t, int n,
+      const double * val, const int32_t * code, int ncode, double refv );
+int pib_finish( struct pib_writer * w );
+struct pib_reader * pib_open( const char * path );
+int pib_nsensors( const struct pib_reader * r );
+const char * pib_name( const struct pib_reader * r, int sensor );
+int pib_seek( struct pib_reader * r, int64_t from, int64_t to );
+int pib_next( struct pib_reader * r, struct pib_sample * s );
+double pib_wall( const struct pib_reader * r, int64_t t );
+int64_t pib_wall_ns( const struct pib_reader * r, int64_t t );
+int64_t pib_mono( const struct pib_reader * r, double wall );
+void pib_close( struct pib_reader * r );
+
+/* Rollups (pilib_rollup.c)
+ *    pi_rollup_reset -- forget all periods, a stream starts
+ *    pi_rollup_sample -- add a record to each tier, by the writer
+ *    pi_rollup_get -- copy the last completed (or current) period of
+ *       a tier, from any thread
+ *    pi_rollup_sd -- standard deviation of a value of a period
+ */
+#define PIROLLUP_SEC 0
+#define PIROLLUP_MIN 1
+#define PIROLLUP_HOUR 2
+#define PIROLLUP_TIERS 3
+
+struct pi_rollup {
+   double  start ;  /* Start of the period (wall clock sec) */
+   double  step ;  /* Its length (sec) */
+   unsigned long  n ;  /* Samples */
+   int  nval ;  /* Values per sample (1 or 3) */
+   double  sum[3] ;
+   double  sumsq[3] ;
+   double  min[3] ;
+   double  max[3] ;
+} ;
+
+void pi_rollup_reset( void );
+void pi_rollup_sample( int sensor, int64_t t, const double * val, int n );
+int pi_rollup_get( int sensor, int tier, int current, struct pi_rollup * r );
+double pi_rollup_sd( const struct pi_rollup * r, int i );
+
+/* Streaming statistics (pilib_stats.c)
+ *    pi_stats_reset -- forget all samples, a stream starts
+ *    pi_stats_sample -- add a record, by the writer
+ *    pi_stats_take -- statistics of a sensor since the last reset,
+ *       and optionally reset them, from any thread
+ */
+struct pi_stats {
+   unsigned long  n ;  /* Samples */
+   int  nval ;  /* Values per sample (1 or 3) */
+   double  start ;  /* First and last samples (wall clock sec) */
+   double  end ;
+   double  mean[3] ;
+   double  sd[3] ;
+   double  min[3] ;
+   double  max[3] ;
+   double  p50 ;  /* Quantiles of the first value, within 1% */
+   double  p99 ;
+   double  p999 ;
+} ;
+
+void pi_stats_reset( void );
+void pi_stats_sample( int sensor, int64_t t, const double * val, int n );
+int pi_stats_take( int sensor, int reset, struct pi_stats * st );
+
+/* Spectra (pilib_fft.c)
+ *    pi_fft_plan -- twiddles, bit reversal and window for n points,
+ *       kept until n or the window changes
+ *    pi_fft_power -- add the squared amplitude spectrum of a window
+ *    pi_fft_peaks -- dominant frequencies of a magnitude spectrum
+ */
+#define PIFFT_RECT 0
+#define PIFFT_HANN 1
+#define PIFFT_HAMMING 2
+#define PIFFT_BLACKMAN 3
+
+struct pi_fft {
+   int  n ;  /* Points, a power of 2 */
+   int  bits ;  /* log2( n ) */
+   int  window ;  /* PIFFT_XXX */
+   double *  cosw ;  /* [n/2] twiddles */
+   double *  sinw ;
+   int *  rev ;  /* [n] bit reversed index */
+   double *  win ;  /* [n] window */
+   double  gain ;  /* Sum of the window */
+   double *  re ;  /* [n] work */
+   double *  im ;
+} ;
+
+const struct pi_fft * pi_fft_plan( int n, int window );
+void pi_fft_power( const struct pi_fft * f, const double * x, double * pw );
+int pi_fft_peaks( const double * mag, int nbins, double df, int max,
+      double * freq, double * amp );
+
+/* Decimation (pilib_decim.c)
+ *    pi_decim_plan -- set the CIC and FIR ratios of a plan sensor
+ *    pi_decim_ratio -- samples in per sample out, 1 if not decimated
+ *    pi_decim_get -- the CIC and FIR ratios of a plan sensor
+ *    pi_decim_reset -- empty the filters, a stream starts
+ *    pi_decim_sample -- run a sample through, by its sampling loop
+ */
+#define PIDEC_MAXCIC 64
+#define PIDEC_MAXFIR 8
+
+int pi_decim_plan( int idx, int cic, int fir );
+int pi_decim_ratio( int idx );
+void pi_decim_get( int idx, int * cic, int * fir );
+void pi_decim_reset( void );
+int pi_decim_sample( int idx, double * val, int n );
+
+/* Plan snapshots (pilib_snap.c)
+ *    pi_snap_sum -- checksum of the configuration (the config file,
+ *       init_final.lc and post_conf.lc) a snapshot is valid for
+ *    pi_snap_save -- write the compiled plan, with the checksum
+ *    pi_snap_load -- open the devices and initialize the ADCs of a
+ *       snapshot and make it the plan, without running the config
+ *       file.  Returns 0, 1 if it is stale, 2 if it is for the
+ *       default App and the config file has its own, -1 if not a
+ *       snapshot.
+ *    pi_snap_find -- plan index of a sensor of a loaded snapshot by name
+ *    pi_snap_read -- read a sensor of a loaded snapshot by name, a new
+ *       sample epoch each pass over the sensors
+ */
+#define PISNAP_SUMLEN 17  /* Hex checksum and '\0' */
+#define PISNAP_PATHLEN 64  /* Device paths */
+
+int pi_snap_sum( char * sum );
+int pi_snap_save( lua_State * L, const char * path );
+int pi_snap_load( lua_State * L, const char * path, int app );
+int pi_snap_find( const char * name );
+int pi_snap_read( lua_State * L, int idx, double * val );
+
+/* Lua memory (pilib_alloc.c)
+ *    pi_alloc -- lua_Alloc pooling small blocks by size class
+ *    pi_newstate -- luaL_newstate( ) with pi_alloc
+ *    pi_memstats_get -- its counts, -1 if L doesn't use pi_alloc
+ *    pi_memlimit_set -- cap what the Lua state holds, 0 for no cap.
+ *       Not a bound on process memory, the pool slabs (pooled) are
+ *       kept once carved and aren't counted.
+ */
+#define PIALLOC_CLASSES 8  /* Pooled sizes, 16 to 256 bytes */
+#ifndef PIALLOC_LIMIT
+#define PIALLOC_LIMIT (64*1024*1024)  /* Default cap */
+#endif
+
+struct pi_memstats {
+   size_t  inuse ;  /* Bytes the Lua state holds */
+   size_t  peak ;
+   size_t  limit ;
+   unsigned long  allocs ;  /* Blocks allocated and freed */
+   unsigned long  frees ;
+   unsigned long  failed ;  /* Allocations refused (over the limit) */
+   size_t  pooled ;  /* Bytes of pool slabs, in use or not */
+   size_t  idle ;  /* Bytes free in the pools */
+   unsigned long  slabs[PIALLOC_CLASSES] ;  /* Of each size class */
+} ;
+
+void * pi_alloc( void * ud, void * ptr, size_t osize, size_t nsize );
+lua_State * pi_newstate( void );
+int pi_memstats_get( lua_State * L, struct pi_memstats * st );
+size_t pi_memlimit_set( size_t limit );
+
+/* Garbage collector pacing (pilib_gc.c)
+ *    pi_gc_policy -- paced (1) or Lua's automatic collection (0)
+ *    pi_gc_begin -- acquisition starts, stop the collector if paced
+ *    pi_gc_idle -- bounded steps in budget seconds of idle time
+ *    pi_gc_end -- acquisition ended, restart the collector
+ *    pi_gc_get -- the metrics below, cleared if reset
+ *    pi_gc_report -- print them (if paced)
+ */
+struct pi_gcstats {
+   unsigned long  cycles ;  /* pi_gc_idle( ) calls */
+   unsigned long  steps ;  /* LUA_GCSTEP slices */
+   unsigned long  collections ;  /* Full collections finished */
+   double  total ;  /* Seconds spent collecting */
+   double  worst ;  /* Longest in one cycle (sec) */
+} ;
+
+void pi_gc_policy( int pace, int kb );
+void pi_gc_begin( lua_State * L );
+double pi_gc_idle( lua_State * L, double budget );
+void pi_gc_end( lua_State * L );
+void pi_gc_get( struct pi_gcstats * st, int reset );
+void pi_gc_report( FILE * out );
+
+/* Rolling history file (pilib_hist.c)
+ *    pi_hist_reset -- unmap it (the plan is being rebuilt)
+ *    pi_hist_sample -- add a sample, by the writer thread
+ *    pi_hist_flush -- commit the partial step, the stream ended
+ * Reading, from any process:
+ *    pih_open -- map a history file read-only
+ *    pih_range -- steps between two times (wall clock sec)
+ *    pih_get -- a sensor's slot of a step, -1 if it isn't there
+ *    pih_close -- unmap it
+ */
+#define PIHIST_MAXCHANS 64
+
+struct pih_file ;
+
+struct pih_value {
+   double  t ;  /* Start of the step (wall clock sec) */
+   unsigned  n ;  /* Samples in it, 0 if none */
+   unsigned  nval ;  /* Values (1 or 3) */
+   double  avg[3] ;  /* Averages of the values */
+   double  min, max ;  /* Of the first value */
+} ;
+
+void pi_hist_reset( void );
+void pi_hist_sample( int sensor, int64_t t, const double * val, int n );
+void pi_hist_flush( void );
+struct pih_file * pih_open( const char * path );
+int pih_nchans( const struct pih_file * f );
+const char * pih_name( const struct pih_file * f, int chan );
+int pih_range( const struct pih_file * f, double from, double to,
+      uint64_t * first, uint64_t * last );
+int pih_get( const struct pih_file * f, uint64_t step, int chan, struct pih_value * v );
+void pih_close( struct pih_file * f );
+
+/* Real-time support, see rtprio, rtlock and rtcpu in piglobal.h
+ *    pi_rt_lock -- pre-fault and lock the working set (after config)
+ *    pi_rt_enter -- SCHED_FIFO and pinning to cpu for the calling thread
+ *    pi_rt_leave -- undo pi_rt_enter
+ *    pi_rt_create -- start a thread without the calling thread's
+ *       pi_rt_enter settings
+ */
+int pi_rt_lock( lua_State * L );
+int pi_rt_enter( int cpu );
+void pi_rt_leave( void );
+int pi_rt_create( pthread_t * thread, void * (* fn)( void * ), void * arg );
+
+/* Monotonic time in seconds (CLOCK_MONOTONIC, for deadlines) */
+double pi_monotonic( void );
+
+#endif /* PIACQ_H */
+
+/* ex: set sw=3 sta et : */
@@ -0,0 +1,135 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Read a binary stream file (powerInsight --stream --out file)
+ *
+ * Prints the samples in a time range as the text stream would, from
+ *   the raw ADC codes and the conversions recorded in the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <lua.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+/* Global variables */
+char *  ARGV0 = "pibread" ;
+char *  libexecdir = PILIBDIR_DEFAULT ;
+char *  configfile = PICONFIGFILE_DEFAULT ;
+unsigned int  debug = PIDEBUG_DEFAULT ;
+int  verbose = PIVERBOSE_DEFAULT ;
+int  rtprio = 0 ;
+int  rtlock = 0 ;
+int  rtcpu = -1 ;
+
+static void usage( void )
+{
+   printf(
+"usage: %s [-u] [-v] [-l] [-r] [-s sensor] file [from [to]]\n"
+"where:\n"
+"   -u  print this usage menu\n"
+"   -v  increments verbosity\n"
+"   -l  list the sensors in the file instead of the samples\n"
+"   -r  also print the raw ADC codes of each sample, and the reference\n"
+"         value (Vcc or cold junction volts) they were converted with\n"
+"   -s  only print this sensor\n"
+"   from, to  time range, wall clock seconds or +seconds from the\n"
+"         start of the file (default: all of it)\n"
+         "",
+         ARGV0 );
+   exit( 1 );
+}
+
+/* Wall clock time from an argument, +sec is relative to start */
+static double timearg( const char * arg, double start )
+{
+   char *  end ;
+   double  t = strtod( arg, &end );
+
+   if( end == arg || *end != '\0' ) {
+      fprintf( stderr, "%s: bad time: %s\n", ARGV0, arg );
+      usage( );
+   }
+   return arg[0] == '+' ? start + t : t ;
+}
+
+int main( int argc, char ** argv )
+{
+   struct pib_reader *  r ;
+   struct pib_sample  s ;
+   const char *  only = NULL ;
+   char  when[PIWALL_LEN] ;
+   double  from, to ;
+   int64_t  t0 ;
+   int  list = 0 ;
+   int  raw = 0 ;
+   int  option ;
+   int  i ;
+
+   ARGV0 = argv[0] ;
+   while( -1 != (option = getopt( argc, argv, "uvlrs:" )) ) {
+      switch( option ) {
+      case 'v' : ++verbose ; break ;
+      case 'l' : list = 1 ; break ;
+      case 'r' : raw = 1 ; break ;
+      case 's' : only = optarg ; break ;
+      default : usage( ); break ;
+      }
+   }
+   if( optind >= argc || argc - optind > 3 ) {
+      usage( );
+   }
+
+   r = pib_open( argv[optind] );
+   if( r == NULL ) {
+      fprintf( stderr, "%s: %s: not a readable stream file\n", ARGV0, argv[optind] );
+      return 1 ;
+   }
+
+   if( list ) {
+      for( i = 0 ; i < pib_nsensors( r ) ; ++i ) {
+         printf( "%3d %s\n", i, pib_name( r, i ) );
+      }
+      pib_close( r );
+      return 0 ;
+   }
+
+   /* The first sample, for +sec times */
+   t0 = pib_next( r, &s ) == 0 ? s.t : 0 ;
+   from = optind +1 < argc ? timearg( argv[optind +1], pib_wall( r, t0 ) ) : -HUGE_VAL ;
+   to = optind +2 < argc ? timearg( argv[optind +2], pib_wall( r, t0 ) ) : HUGE_VAL ;
+   pib_seek( r, pib_mono( r, from ), pib_mono( r, to ) );
+
+   while( pib_next( r, &s ) == 0 ) {
+      if( only != NULL && strcmp( only, s.name ) != 0 ) {
+         continue ;
+      }
+      wall_format( when, sizeof(when), pib_wall_ns( r, s.t ) );
+      if( s.n == 3 ) {
+         printf( "%s %-10s %8.3f %7.3f %7.3f", when,
+               s.name, s.val[0], s.val[1], s.val[2] );
+      } else {
+         printf( "%s %-10s %8.3f", when, s.name, s.val[0] );
+      }
+      if( raw ) {
+         for( i = 0 ; i < s.ncode ; ++i ) {
+            printf( " %d", s.code[i] );
+         }
+         if( ! isnan( s.refv ) ) {
+            printf( " %.9f", s.refv );
+         }
+      }
+      putchar( '\n' );
+   }
+
+   pib_close( r );
+   return 0 ;
+}
+
+/* ex: set sw=3 sta et : */
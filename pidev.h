@@ -20,6 +20,94 @@ typedef struct {
     double  amp ;  /* Amperage component */
 } reading_t ;
 
+/* Latency added to reads by refreshing stale references (Vcc, cold
+ *      junctions).  Each read refreshes at most one reference: the
+ *      one the sensor needs, when it is stale or the read starts a
+ *      new pass over the sensors (reading a sensor again does), or
+ *      else the one most overdue.  Only the latter is counted here.
+ */
+typedef struct {
+    double  worst ;  /* Longest time spent refreshing in one read (sec) */
+    double  mean ;  /* Average time per read (sec) */
+    unsigned long  reads ;  /* Reads that checked for stale references */
+    unsigned long  refreshed ;  /* References refreshed */
+} update_stats_t ;
+
+/* Energy attributed to a marked application phase for one sensor */
+typedef struct {
+    double  energy ;  /* Joules */
+    double  avg ;  /* Average power (W) */
+    double  peak ;  /* Highest power sample (W) */
+    double  min ;  /* Lowest power sample (W) */
+    double  duration ;  /* Length of the phase (sec) */
+    unsigned long  samples ;  /* Power samples inside the phase */
+} phase_t ;
+
+/* A threshold rule (Thresholds( ) in the config file) raised or cleared */
+typedef struct {
+    char  rule[32] ;  /* Rule name */
+    char  sensor[16] ;  /* Sensor name */
+    int  raised ;  /* 1 raised, 0 cleared */
+    double  time ;  /* Sample that raised or cleared it (wall clock sec) */
+    double  duration ;  /* Time past the limit until then (sec) */
+    double  value ;  /* Value at time */
+    double  peak ;  /* Most extreme value past the limit */
+} event_t ;
+
+/* Aggregates of a sensor over a period (pidev_rollup) */
+typedef struct {
+    double  start ;  /* Start of the period (wall clock sec) */
+    double  duration ;  /* Its length (sec) */
+    unsigned long  samples ;
+    reading_t  avg, min, max, sd ;  /* sd is the standard deviation */
+} rollup_t ;
+
+#define PIDEV_ROLLUP_SEC  0
+#define PIDEV_ROLLUP_MIN  1
+#define PIDEV_ROLLUP_HOUR  2
+
+/* Statistics of a sensor since they were last read (pidev_stats) */
+typedef struct {
+    double  start, end ;  /* First and last samples (wall clock sec) */
+    unsigned long  samples ;
+    reading_t  mean, sd, min, max ;  /* sd is the standard deviation */
+    double  p50, p99, p999 ;  /* Quantiles of watts, within 1% */
+} stats_t ;
+
+/* Garbage collection with the paced policy (pidev_gc_stats), a cycle
+ *      is a call to pidev_idle or a read
+ */
+typedef struct {
+    unsigned long  cycles ;
+    unsigned long  steps ;  /* Bounded collector steps */
+    unsigned long  collections ;  /* Full collections finished */
+    double  total ;  /* Time spent collecting (sec) */
+    double  mean ;  /* Per cycle (sec) */
+    double  worst ;  /* Longest in one cycle (sec) */
+} gc_stats_t ;
+
+/* Memory of the library's Lua state (pidev_memstats) */
+typedef struct {
+    unsigned long  inuse ;  /* Bytes it holds */
+    unsigned long  peak ;
+    unsigned long  limit ;  /* Cap on inuse, 0 if none (pooled isn't capped) */
+    unsigned long  allocs ;  /* Blocks allocated and freed */
+    unsigned long  frees ;
+    unsigned long  failed ;  /* Allocations refused over the cap */
+    unsigned long  pooled ;  /* Bytes in the size-class pools */
+    unsigned long  idle ;  /* Bytes free in the pools */
+} memstats_t ;
+
+/* A sample read back from a binary stream file */
+typedef struct {
+    char  sensor[16] ;  /* Sensor name */
+    double  time ;  /* Wall clock sec */
+    reading_t  reading ;  /* volt and amp are NAN unless a power sensor */
+} record_t ;
+
+/* A binary stream file open for reading */
+typedef struct pib_reader pidev_file_t ;
+
 /* Change default global parameters.  Call before calling pidev_open */
 int pidev_setup(
         char * ARGV0,  /* printed in error messages */
@@ -29,6 +117,30 @@ int pidev_setup(
         int VERBOSE  /* Increase verbosity */
     );
 
+/* Real-time options for the thread that will call pidev_open and
+ *      read.  fifo_prio > 0 runs it SCHED_FIFO at that priority (needs
+ *      privilege), mlock != 0 pre-faults and locks memory once the
+ *      config is loaded, cpu >= 0 pins it to that CPU.  Call before
+ *      calling pidev_open
+ */
+int pidev_setup_rt( int fifo_prio, int mlock, int cpu );
+
+/* Set the garbage collector policy of the library's Lua state.
+ *      paced != 0 stops automatic collection once the config is
+ *      loaded, garbage is then collected in pidev_idle's budget (and
+ *      a bounded step after a read if there's been no idle time for a
+ *      while).  step is the LUA_GCSTEP size of each slice (0 for the
+ *      smallest).  Call before calling pidev_open
+ */
+int pidev_setup_gc( int paced, int step );
+
+/* Load a snapshot of the config (powerInsight --snapshot) instead of
+ *      running the config file, unless the config changed since it was
+ *      written.  Reads are then served in C, of the sensors in the
+ *      snapshot only.  Call before calling pidev_open
+ */
+int pidev_setup_load( char * path );
+
 /* Call to initialize the library, MUST be called before read, etc. */
 int pidev_open( void );
 
@@ -41,6 +153,113 @@ int pidev_temp( int portNumber, reading_t * sample );
 /* Read a sensor by name */
 int pidev_read_byname( char * name, reading_t * sample );
 
+/* Read a sensor by name, reusing its last sample if it is no more
+ *      than max_age seconds old.  While sampling in the background
+ *      (pidev_start) only the latest sample is used, PIERR_NOSAMPLE
+ *      if it is older
+ */
+int pidev_read_maxage( char * name, double max_age, reading_t * sample );
+
+/* Refresh stale references for up to budget seconds of idle time.
+ *      Returns the number refreshed (>= 0) or an error below, 0
+ *      while sampling in the background (pidev_start)
+ */
+int pidev_idle( double budget );
+
+/* Get the latency added to reads by reference refreshes.  If reset
+ *      is non-zero the counters are cleared after reading
+ */
+int pidev_update_stats( update_stats_t * stats, int reset );
+
+/* Get the time spent collecting garbage with the paced policy
+ *      (pidev_setup_gc).  If reset is non-zero the counters are
+ *      cleared after reading
+ */
+int pidev_gc_stats( gc_stats_t * stats, int reset );
+
+/* Get the memory counts of the Lua state.  allocs - frees growing
+ *      from read to read is a leak
+ */
+int pidev_memstats( memstats_t * stats );
+
+/* Sample in the background at rate scans per second, every sensor
+ *      that can be sampled without Lua (see pi.stream_start).  While
+ *      running, reads return the latest background sample and fail
+ *      with PIERR_NOTFOUND for sensors it doesn't sample
+ */
+int pidev_start( double rate );
+
+/* Stop sampling in the background */
+int pidev_stop( void );
+
+/* Mark the beginning and end of an application phase.  Cheap and
+ *      safe to call from any thread: a timestamp into a lock-free
+ *      queue.  Phases may nest and overlap, the same tag may nest
+ *      (an end matches the latest begin).  Power sampled in the
+ *      background is attributed to every phase it overlaps
+ */
+int pidev_mark_begin( const char * tag );
+int pidev_mark_end( const char * tag );
+
+/* Get the energy used by sensor name during the last completed phase
+ *      with the tag.  PIERR_NOTFOUND if there is none (yet)
+ */
+int pidev_phase( const char * tag, char * name, phase_t * phase );
+
+/* Threshold events while sampling in the background.  The rules are
+ *      checked on every sample, so events are detected one sample
+ *      period after they happen.  Either poll( ) the file descriptor
+ *      from pidev_event_fd and, once readable, call pidev_event_next
+ *      until it returns PIERR_NOTFOUND, or have fn( event, arg )
+ *      called from the sampling thread as each event happens (it
+ *      must return quickly, NULL to stop).  Events are queued either
+ *      way.
+ */
+int pidev_event_fd( void );
+int pidev_event_next( event_t * event );
+int pidev_event_callback( void (* fn)( const event_t * event, void * arg ), void * arg );
+
+/* Trigger the capture set up with Capture{ } in the config file while
+ *      sampling in the background, safe from any thread.  why is
+ *      noted in the file.  PIERR_ERROR if there's none or it is
+ *      still busy with the previous trigger
+ */
+int pidev_capture( const char * why );
+
+/* Get the aggregates of sensor name over the last completed second,
+ *      minute or hour (tier PIDEV_ROLLUP_XXX) of streaming, or the one
+ *      in progress if current is non-zero.  Kept up to date on every
+ *      sample, so this is a copy of one record.  PIERR_NOTFOUND if
+ *      there is none (yet)
+ */
+int pidev_rollup( char * name, int tier, int current, rollup_t * rollup );
+
+/* Get the statistics of sensor name since the last call, the mean,
+ *      standard deviation, min, max and p50/p99/p99.9 watts (value
+ *      of other sensors), kept on every sample while streaming.  They
+ *      start over unless keep is non-zero.  PIERR_NOTFOUND if there
+ *      were no samples
+ */
+int pidev_stats( char * name, int keep, stats_t * stats );
+
+/* Record the background samples (pidev_start) to a binary file of
+ *      raw ADC codes, see pibread.  Call before pidev_start, NULL to
+ *      stop recording from the next start
+ */
+int pidev_record( const char * path );
+
+/* Read a binary stream file, with or without pidev_open.  Seek to a
+ *      time range (wall clock sec) and call pidev_file_next until it
+ *      returns PIERR_NOTFOUND.  Seeking uses the file's index, the
+ *      cost grows with the log of its size.  Samples come a block
+ *      (up to 256 samples of one sensor) at a time, in time order for
+ *      each sensor but not across sensors
+ */
+pidev_file_t * pidev_file_open( const char * path );
+int pidev_file_seek( pidev_file_t * file, double from, double to );
+int pidev_file_next( pidev_file_t * file, record_t * record );
+int pidev_file_close( pidev_file_t * file );
+
 /* Close the library */
 int pidev_close( void );
 
@@ -46,6 +46,15 @@ extern unsigned int  debug ;
 #define PIDEBUG_DEFAULT 0
 #endif
 
+/* Real-time acquisition
+ *    rtprio -- SCHED_FIFO priority for the acquisition loop (0 = don't)
+ *    rtlock -- pre-fault and mlockall the working set (0 = don't)
+ *    rtcpu -- CPU to pin the acquisition loop to (-1 = don't)
+ */
+extern int  rtprio ;
+extern int  rtlock ;
+extern int  rtcpu ;
+
 /* Macro to declare functions for export when creating a shared library.
  *
  * See Makefile for how this gets converted to a list of symbols to
@@ -0,0 +1,130 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Read a rolling history file (History{ } in the config file)
+ *
+ * Prints the steps in a time window, found by binary search, so it
+ *   costs the same on a file of an hour or of three days.  Safe to
+ *   run while powerInsight is writing the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <lua.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+/* Global variables */
+char *  ARGV0 = "pihist" ;
+char *  libexecdir = PILIBDIR_DEFAULT ;
+char *  configfile = PICONFIGFILE_DEFAULT ;
+unsigned int  debug = PIDEBUG_DEFAULT ;
+int  verbose = PIVERBOSE_DEFAULT ;
+int  rtprio = 0 ;
+int  rtlock = 0 ;
+int  rtcpu = -1 ;
+
+static void usage( void )
+{
+   printf(
+"usage: %s [-u] [-l] [-s sensor] file [from [to]]\n"
+"where:\n"
+"   -u  print this usage menu\n"
+"   -l  list the sensors in the file instead of the history\n"
+"   -s  only print this sensor\n"
+"   from, to  time window, wall clock seconds or -seconds before\n"
+"         now (default: all of it)\n"
+"Each line is the start of a step, the sensor, the average values\n"
+"   over the step, the min and max of the first and the samples.\n"
+         "",
+         ARGV0 );
+   exit( 1 );
+}
+
+/* Wall clock time from an argument, -sec is relative to now */
+static double timearg( const char * arg )
+{
+   struct timespec  now ;
+   char *  end ;
+   double  t = strtod( arg, &end );
+
+   if( end == arg || *end != '\0' ) {
+      fprintf( stderr, "%s: bad time: %s\n", ARGV0, arg );
+      usage( );
+   }
+   if( t < 0 ) {
+      clock_gettime( CLOCK_REALTIME, &now );
+      t += now.tv_sec + now.tv_nsec / 1000000000.0 ;
+   }
+   return t ;
+}
+
+int main( int argc, char ** argv )
+{
+   struct pih_file *  f ;
+   struct pih_value  v ;
+   const char *  only = NULL ;
+   uint64_t  first, last, s ;
+   double  from, to ;
+   int  list = 0 ;
+   int  option ;
+   int  c ;
+
+   ARGV0 = argv[0] ;
+   while( -1 != (option = getopt( argc, argv, "+uls:" )) ) {
+      switch( option ) {
+      case 'l' : list = 1 ; break ;
+      case 's' : only = optarg ; break ;
+      default : usage( ); break ;
+      }
+   }
+   if( optind >= argc || argc - optind > 3 ) {
+      usage( );
+   }
+   from = optind +1 < argc ? timearg( argv[optind +1] ) : -HUGE_VAL ;
+   to = optind +2 < argc ? timearg( argv[optind +2] ) : HUGE_VAL ;
+
+   f = pih_open( argv[optind] );
+   if( f == NULL ) {
+      fprintf( stderr, "%s: %s: not a readable history file\n", ARGV0, argv[optind] );
+      return 1 ;
+   }
+
+   if( list ) {
+      for( c = 0 ; c < pih_nchans( f ) ; ++c ) {
+         printf( "%3d %s\n", c, pih_name( f, c ) );
+      }
+      pih_close( f );
+      return 0 ;
+   }
+
+   pih_range( f, from, to, &first, &last );
+   for( s = first ; s < last ; ++s ) {
+      for( c = 0 ; c < pih_nchans( f ) ; ++c ) {
+         if( only != NULL && strcmp( only, pih_name( f, c ) ) != 0 ) {
+            continue ;
+         }
+         if( pih_get( f, s, c, &v ) < 0 || v.n == 0 ) {
+            continue ;  /* Overwritten meanwhile, or no samples */
+         }
+         if( v.nval == 3 ) {
+            printf( "%.3f %-10s %8.3f %7.3f %7.3f", v.t, pih_name( f, c ),
+                  v.avg[0], v.avg[1], v.avg[2] );
+         } else {
+            printf( "%.3f %-10s %8.3f", v.t, pih_name( f, c ), v.avg[0] );
+         }
+         printf( "  %8.3f %8.3f %u\n", v.min, v.max, v.n );
+      }
+   }
+
+   pih_close( f );
+   return 0 ;
+}
+
+/* ex: set sw=3 sta et : */
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <errno.h>
@@ -41,6 +42,8 @@ luaL_Reg pi_funcs[] = {
          {"i2c_read",    pi_i2c_read},
          {"i2c_write",   pi_i2c_write},
          {"ads1256_init", pi_ads1256_init},
+         {"ads1256_start", pi_ads1256_start},
+         {"ads1256_finish", pi_ads1256_finish},
          {"ads1256_wait4DRDY", pi_ads1256_wait4DRDY},
          {"ads1256_getraw", pi_ads1256_getraw},
          {"ads1256_setmux", pi_ads1256_setmux},
@@ -49,9 +52,12 @@ luaL_Reg pi_funcs[] = {
 /*       {"ads8344_init", pi_ads8344_init}, *** Declared in init_final.lua */
          {"ads8344_mkmsg", pi_ads8344_mkmsg},
          {"ads8344_getraw", pi_ads8344_getraw},
+         {"ads8344_oversample", pi_ads8344_oversample},
+         {"ads8344_sample", pi_ads8344_sample},
 /*       {"mcp3008_init", pi_mcp3008_init}, *** Declared in init_final.lua */
          {"mcp3008_mkmsg", pi_mcp3008_mkmsg},
          {"mcp3008_getraw", pi_mcp3008_getraw},
+         {"mcp3008_sample", pi_mcp3008_sample},
          {"sc620_init",  pi_sc620_init},
          {"setbank",     pi_setbank},
          {"sens_5v",     pi_sens_5v},
@@ -73,12 +79,46 @@ luaL_Reg pi_funcs[] = {
          {"setled_temp", pi_setled_temp},
          {"setled_main", pi_setled_main},
          {"gettime",     pi_gettime},
+         {"monotime",    pi_monotime},
+         {"mono2wall",   pi_mono2wall},
+         {"sleep",       pi_sleep},
          {"filter",      pi_filter},
          {"verbose",     pi_verbose},
          {"debug",       pi_debug},
          {"Sensors",     pi_Sensors},
          {"addSensors",  pi_addSensors},
          {"addConnectors", pi_addConnectors},
+         {"acq_reset",   pi_acq_reset},
+         {"acq_sensor",  pi_acq_sensor},
+         {"epoch",       pi_epoch},
+         {"sensor_new",  pi_sensor_new},
+         {"stream",      pi_stream},
+         {"stream_bench", pi_stream_bench},
+         {"stream_start", pi_stream_start},
+         {"stream_stop", pi_stream_stop},
+         {"stream_file", pi_stream_file},
+         {"mark_begin",  pi_mark_begin},
+         {"mark_end",    pi_mark_end},
+         {"phases",      pi_phases},
+         {"event_rule",  pi_event_rule},
+         {"events",      pi_events},
+         {"capture_setup", pi_capture_setup},
+         {"capture",     pi_capture},
+         {"captures",    pi_captures},
+         {"history_setup", pi_history_setup},
+         {"rollup",      pi_rollup},
+         {"stats",       pi_stats},
+         {"memstats",    pi_memstats},
+         {"memlimit",    pi_memlimit},
+         {"gcpolicy",    pi_gcpolicy},
+         {"gcidle",      pi_gcidle},
+         {"gcpace",      pi_gcpace},
+         {"gcstats",     pi_gcstats},
+         {"gcreport",    pi_gcreport},
+         {"spectrum",    pi_spectrum},
+         {"spectrum_report", pi_spectrum_report},
+         {"snapshot_save", pi_snapshot_save},
+         {"snapshot_load", pi_snapshot_load},
          {NULL, NULL},
          };
 
@@ -151,7 +191,7 @@ int pi_register( lua_State *L )
    /* dostring "init" for initialization from lua */
    ret = luaL_loadstring(L,
 /**** BEGIN LUA CODE ****/
-"pi.version = 'v0.3'\n"
+"pi.version = 'v0.4'\n"
 /**** END LUA CODE ****/
       );
    if( ret != 0 || (ret = lua_pcall(L, 0, 0, 0)) ) {
@@ -206,6 +246,9 @@ void luaPI_doerror( lua_State * L, int ret, const char * attempt )
  *      struct timeval with micro-second resolution without loss of
  *      precision.  32 bits for seconds and 20 bits for microseconds
  *      and 53 effective bits in a double mantissa
+ *
+ * This is wall clock time and steps when the clock is adjusted (NTP),
+ *      use pi.monotime( ) for intervals, deadlines and rates
  */
 int pi_gettime(lua_State * L)
 {
@@ -220,6 +263,167 @@ int pi_gettime(lua_State * L)
    return 1 ;
 }
 
+/* CLOCK_MONOTONIC_RAW is never slewed or stepped, so intervals are
+ *      exact counts of the oscillator.  Fall back to CLOCK_MONOTONIC
+ *      where it isn't supported.
+ */
+static clockid_t  monoclock = CLOCK_MONOTONIC_RAW ;
+
+/* monotime_ns( ) -- Monotonic nanoseconds (arbitrary origin) */
+int64_t monotime_ns( void )
+{
+   struct timespec  now ;
+
+   if( clock_gettime( monoclock, &now ) < 0 ) {
+      monoclock = CLOCK_MONOTONIC ;
+      clock_gettime( monoclock, &now );
+   }
+   return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec ;
+}
+
+/* Monotonic to wall clock mapping, for exporting timestamps.  Both
+ *      clocks are read back to back and the wall clock reading is
+ *      paired with the middle of the tightest of a few monotonic
+ *      brackets.  The two clocks drift apart (NTP slews the wall
+ *      clock, not the raw one), so the mapping is refreshed when it is
+ *      more than a second old.  The stream writer, pidev_event_copy
+ *      and the Lua thread all use it, so the pair is behind a seqlock
+ *      (odd while being written, as in stream_latest): readers retry
+ *      a torn copy, and only the thread that wins the odd count
+ *      writes a new mapping.
+ */
+static unsigned long  map_seq ;
+static int64_t  map_mono ;
+static int64_t  map_wall ;
+
+static void timemap_sync( void )
+{
+   struct timespec  wall ;
+   int64_t  before, after, best = -1 ;
+   int64_t  mono = 0, wns = 0 ;
+   unsigned long  seq ;
+   int  i ;
+
+   for( i = 0 ; i < 3 ; ++i ) {
+      before = monotime_ns( );
+      clock_gettime( CLOCK_REALTIME, &wall );
+      after = monotime_ns( );
+      if( best < 0 || after - before < best ) {
+         best = after - before ;
+         mono = before + (after - before) / 2 ;
+         wns = (int64_t) wall.tv_sec * 1000000000 + wall.tv_nsec ;
+      }
+   }
+
+   /* Another thread is already writing one, use that */
+   seq = __atomic_load_n( &map_seq, __ATOMIC_RELAXED );
+   if( (seq & 1) || ! __atomic_compare_exchange_n( &map_seq, &seq, seq +1,
+         0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) {
+      return ;
+   }
+   __atomic_thread_fence( __ATOMIC_RELEASE );
+   map_mono = mono ;
+   map_wall = wns ;
+   __atomic_store_n( &map_seq, seq +2, __ATOMIC_RELEASE );
+}
+
+/* mono2wall_ns( ns ) -- Wall clock nanoseconds for a monotime_ns( ) time */
+int64_t mono2wall_ns( int64_t ns )
+{
+   int64_t  mono, wall, now ;
+   unsigned long  seq ;
+
+   for( ;; ) {
+      do {
+         seq = __atomic_load_n( &map_seq, __ATOMIC_ACQUIRE );
+         mono = map_mono ;
+         wall = map_wall ;
+         __atomic_thread_fence( __ATOMIC_ACQUIRE );
+      } while( (seq & 1) || seq != __atomic_load_n( &map_seq, __ATOMIC_RELAXED ) );
+
+      /* After the copy, so a mapping just written by another thread
+       *      is never in the future
+       */
+      now = monotime_ns( );
+      if( seq != 0 && now - mono <= 1000000000 && now >= mono ) {
+         return wall + (ns - mono) ;
+      }
+      timemap_sync( );
+   }
+}
+
+/* mono2wall( ns ) -- Wall clock seconds for a monotime_ns( ) time */
+double mono2wall( int64_t ns )
+{
+   return mono2wall_ns( ns ) / 1000000000.0 ;
+}
+
+/* wall_format( buf, size, wall ) -- "seconds.nanoseconds" of wall
+ *    clock nanoseconds, all nine digits exact (a double of seconds
+ *    only holds about seven now)
+ * -----
+ * @ret -- buf
+ */
+char * wall_format( char * buf, size_t size, int64_t wall )
+{
+   snprintf( buf, size, "%lld.%09lld", (long long)(wall / 1000000000),
+         (long long)(wall % 1000000000) );
+   return buf ;
+}
+
+/* pi_monotime( [start] ) -- Monotonic time in nanoseconds
+ * @start -- starting nanoseconds to subtract (default 0)
+ * -----
+ * @ns -- CLOCK_MONOTONIC_RAW nanoseconds, or the delta to start
+ *
+ * The origin is arbitrary (usually boot), use pi.mono2wall( ) to
+ *      export a time.  A double holds nanoseconds exactly for the
+ *      first 104 days of uptime and to within a few after that.
+ */
+int pi_monotime(lua_State * L)
+{
+   lua_Number  start ;
+
+   start = luaL_optnumber( L, 1, 0.0 );
+
+   lua_pushnumber( L, (lua_Number) monotime_ns( ) - start );
+   return 1 ;
+}
+
+/* pi_mono2wall( ns ) -- Wall clock time of a monotonic time
+ * @ns -- nanoseconds from pi.monotime( )
+ * -----
+ * @seconds -- wall clock seconds, as pi.gettime( ) would have been
+ */
+int pi_mono2wall(lua_State * L)
+{
+   lua_Number  ns ;
+
+   ns = luaL_checknumber( L, 1 );
+
+   lua_pushnumber( L, mono2wall( (int64_t) ns ) );
+   return 1 ;
+}
+
+/* pi_sleep( seconds ) -- Sleep for a (fractional) number of seconds
+ * @seconds -- time to sleep, returns immediately if <= 0
+ */
+int pi_sleep(lua_State * L)
+{
+   lua_Number  seconds ;
+   struct timespec  req ;
+
+   seconds = luaL_checknumber( L, 1 );
+   if( seconds > 0.0 ) {
+      req.tv_sec = (time_t) seconds ;
+      req.tv_nsec = (seconds - req.tv_sec) * 1000000000.0 ;
+      while( nanosleep( &req, &req ) == -1 && errno == EINTR )
+         ;  /* Interrupted, sleep the remainder */
+   }
+
+   return 0 ;
+}
+
 /* pi_filter( last, factor, new )
  * @last -- Previous value
  * @factor -- Filter factor 0 = faster, 1 = slower
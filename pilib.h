@@ -9,6 +9,7 @@
  *   to SPI hardware and Power Insight carriers
  */
 
+#include <stdint.h>
 #include <lua.h>
 
 /* Library methods */
@@ -22,6 +23,8 @@ int pi_i2c_device(lua_State * L);
 int pi_i2c_read(lua_State * L);
 int pi_i2c_write(lua_State * L);
 int pi_ads1256_init(lua_State * L);
+int pi_ads1256_start(lua_State * L);
+int pi_ads1256_finish(lua_State * L);
 int pi_ads1256_wait4DRDY(lua_State * L);
 int pi_ads1256_getraw(lua_State * L);
 int pi_ads1256_setmux(lua_State * L);
@@ -30,9 +33,12 @@ int pi_ads1256_rxbuf2raw(lua_State *L);
 /* int pi_ads8344_init(lua_State * L); *** Declared in init_final.lua */
 int pi_ads8344_mkmsg(lua_State * L);
 int pi_ads8344_getraw(lua_State * L);
+int pi_ads8344_oversample(lua_State * L);
+int pi_ads8344_sample(lua_State * L);
 /* int pi_mcp3008_init(lua_State * L); *** Declared in init_final.lua */
 int pi_mcp3008_mkmsg(lua_State * L);
 int pi_mcp3008_getraw(lua_State * L);
+int pi_mcp3008_sample(lua_State * L);
 int pi_sc620_init(lua_State * L);
 int pi_setbank(lua_State * L);
 int pi_sens_5v(lua_State * L);
@@ -54,12 +60,88 @@ int pi_temp2rt_44004(lua_State * L);
 int pi_setled_temp(lua_State * L);
 int pi_setled_main(lua_State * L);
 int pi_gettime(lua_State * L);
+int pi_monotime(lua_State * L);
+int pi_mono2wall(lua_State * L);
+int pi_sleep(lua_State * L);
 int pi_filter(lua_State * L);
 int pi_verbose(lua_State * L);
 int pi_debug(lua_State * L);
 int pi_addConnectors(lua_State * L);
 int pi_addSensors(lua_State * L);
 int pi_Sensors(lua_State * L);
+int pi_acq_reset(lua_State * L);
+int pi_acq_sensor(lua_State * L);
+int pi_epoch(lua_State * L);
+int pi_sensor_new(lua_State * L);
+int pi_stream(lua_State * L);
+int pi_stream_bench(lua_State * L);
+int pi_stream_start(lua_State * L);
+int pi_stream_stop(lua_State * L);
+int pi_stream_file(lua_State * L);
+int pi_mark_begin(lua_State * L);
+int pi_mark_end(lua_State * L);
+int pi_phases(lua_State * L);
+int pi_event_rule(lua_State * L);
+int pi_events(lua_State * L);
+int pi_capture_setup(lua_State * L);
+int pi_capture(lua_State * L);
+int pi_captures(lua_State * L);
+int pi_history_setup(lua_State * L);
+int pi_rollup(lua_State * L);
+int pi_stats(lua_State * L);
+int pi_memstats(lua_State * L);
+int pi_memlimit(lua_State * L);
+int pi_gcpolicy(lua_State * L);
+int pi_gcidle(lua_State * L);
+int pi_gcpace(lua_State * L);
+int pi_gcstats(lua_State * L);
+int pi_gcreport(lua_State * L);
+int pi_spectrum(lua_State * L);
+int pi_spectrum_report(lua_State * L);
+int pi_snapshot_save(lua_State * L);
+int pi_snapshot_load(lua_State * L);
+
+/* C implementations behind some of the above, used directly by
+ *    the acquisition engine (pilib_acq.c) without going through Lua
+ */
+int bank_select( const int * fds, int nbits, int * cur, int bank );
+struct spi_ioc_transfer ;
+int spi_transfer( int fd, int n, struct spi_ioc_transfer * msgs );
+extern __thread int64_t  spi_stamp ;
+int64_t monotime_ns( void );
+double mono2wall( int64_t ns );
+int64_t mono2wall_ns( int64_t ns );
+#define PIWALL_LEN 24  /* Room for wall_format( ) */
+char * wall_format( char * buf, size_t size, int64_t wall );
+int ads8344_sample( int fd, int mux, double * reading );
+#define ADS8344_BURST 32  /* Conversions per ads8344_burst( ) */
+int ads8344_burst( int fd, int n, const int * mux, double * reading );
+#define ADS8344_OVERSAMPLE 256  /* Most conversions per ads8344_oversample( ) */
+int ads8344_oversample( int fd, int mux, int k, double * reading );
+int64_t ads1256_start( int fd, int rate, int gain );
+int ads1256_finish( int fd, int rate, int64_t start, double * ofc, double * fsc );
+int ads1256_setup( int fd, int rate, int gain, double * ofc, double * fsc );
+int ads1256_sample( int fd, int * cmux, int mux, double scale, double * reading );
+int mcp3008_sample( int fd, int mux, double * reading );
+double sens_5v( double reading, double vref );
+double sens_12v( double reading, double vref );
+double sens_3v3( double reading, double vref );
+double sens_acs713_20( double reading );
+double sens_acs713_30( double reading );
+double sens_acs723_10( double reading );
+double sens_acs723_20( double reading );
+double sens_shunt10( double reading, double vcc );
+double sens_shunt25( double reading, double vcc );
+double sens_shunt50( double reading, double vcc );
+double volt2temp_K( double volts );
+double temp2volt_K( double temp );
+double rt2temp_PTS( double reading, double pullup );
+double rt2temp_44004( double reading );
+
+/* The Lua bindings of the functions above that use the hardware call
+ *    this first, sensor objects share it (see pilib_acq.c)
+ */
+void pi_acq_touch( lua_State * L );
 
 /* List of method names for getting readings */
 extern const char * const  piMethodNames[] ;
@@ -0,0 +1,1117 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * The acquisition plan...
+ *   Sensors compiled by pi.compile( ) (see init_final.lua and piacq.h)
+ *   and sampled without going through Lua
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+/* The plan */
+struct pi_plan  piplan ;
+
+/* Names used by pi.compile( ), in PIKIND_XXX and PIXF_XXX order */
+const char * const  piKindNames[] = {
+      "lua", "power", "volt", "amp", "temp", "vcc", "cj", NULL
+   };
+const char * const  piXfNames[] = {
+      "", "12v", "5v", "3v3",
+      "acs713_20", "acs713_30", "acs723_10", "acs723_20",
+      "shunt10", "shunt25", "shunt50",
+      "typeK", "PTS", "Rt44004", NULL
+   };
+const char * const  piAdcNames[] = {
+      "", "ads8344", "ads1256", "mcp3008", NULL
+   };
+
+/* pi_acq_lookup( names, name ) -- Index of name in names, or 0 if
+ *    not found
+ */
+int pi_acq_lookup( const char * const * names, const char * name )
+{
+   int  idx ;
+
+   if( name == NULL ) {
+      return 0 ;
+   }
+   for( idx = 0 ; names[idx] != NULL ; ++idx ) {
+      if( strcmp( names[idx], name ) == 0 ) {
+         return idx ;
+      }
+   }
+   return 0 ;
+}
+
+/* Monotonic time in seconds, for deadlines.  This is CLOCK_MONOTONIC,
+ *    not monotime_ns( )'s raw clock, because it is the clock
+ *    clock_nanosleep( ) sleeps on
+ */
+double pi_monotonic( void )
+{
+   struct timespec  now ;
+
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return now.tv_sec + now.tv_nsec / 1000000000.0 ;
+}
+
+/* Reference values are written by the thread sampling the reference
+ *    and may be read by threads sampling other buses
+ */
+static double get_refv( const struct pi_plan * p, int idx )
+{
+   double  v ;
+
+   __atomic_load( &p->sensor[idx].refv, &v, __ATOMIC_RELAXED );
+   return v ;
+}
+
+static void set_refv( struct pi_sensor * s, double v )
+{
+   __atomic_store( &s->refv, &v, __ATOMIC_RELAXED );
+}
+
+/* Sample epochs...
+ *   A scan cycle is an epoch, and a reference is read at most once in
+ *   one, the first time the scan needs it, so every sensor of the scan
+ *   converts with the same value.  Each stream loop starts an epoch per
+ *   scan, references first (see pilib_stream.c).  Objects and Lua
+ *   sensors start one when a sensor already sampled in the current
+ *   epoch is sampled again (see pilib_obj.c and sample( ) in
+ *   init_final.lua), which is when polling went around.  Epoch numbers
+ *   are unique across threads, 0 is never one.
+ */
+static unsigned long  epochs ;  /* Last one started, by any thread */
+static __thread unsigned long  epoch ;  /* This thread's */
+
+/* pi_acq_epoch( ) -- The calling thread's sample epoch */
+unsigned long pi_acq_epoch( void )
+{
+   if( epoch == 0 ) {
+      epoch = __atomic_add_fetch( &epochs, 1, __ATOMIC_RELAXED );
+   }
+   return epoch ;
+}
+
+/* pi_acq_epoch_next( ) -- Start a new sample epoch on the calling thread */
+unsigned long pi_acq_epoch_next( void )
+{
+   epoch = __atomic_add_fetch( &epochs, 1, __ATOMIC_RELAXED );
+   return epoch ;
+}
+
+/* pi_epoch( [next] ) -- Sample epoch (see above)
+ * @next -- true to start a new one
+ * -----
+ * @epoch -- the current epoch, a number
+ */
+int pi_epoch(lua_State * L)
+{
+   lua_pushnumber( L, lua_toboolean( L, 1 ) ? pi_acq_epoch_next( ) : pi_acq_epoch( ) );
+   return 1 ;
+}
+
+/* Hardware generations...
+ *   Sensor objects keep the bank selected, the ADS1256 mux and filter
+ *   state of their channels in objplan, and only hand them to the Lua
+ *   tables when something else is about to use the hardware (see
+ *   pilib_obj.c).  The Lua functions that touch the hardware, and
+ *   piplan when its state goes to or comes from the Lua tables, call
+ *   pi_acq_touch( ), which does that and starts a new generation: an
+ *   object picks the state up again only if it was last picked up in
+ *   an older one.
+ */
+static unsigned long  generation = 1 ;
+
+/* pi_acq_touch( L ) -- The Lua readers are about to use the hardware */
+void pi_acq_touch( lua_State * L )
+{
+   pi_obj_flush( L );
+   ++generation ;
+}
+
+/* pi_acq_generation( ) -- The current hardware generation */
+unsigned long pi_acq_generation( void )
+{
+   return generation ;
+}
+
+/* SPI bus all of a compiled sensor's channels are on, or -1 */
+int pi_acq_bus( const struct pi_sensor * s )
+{
+   const struct pi_chan *  c[3] = { &s->v, &s->a, &s->t } ;
+   int  bus = -1 ;
+   int  i ;
+
+   if( s->kind == PIKIND_LUA ) {
+      return -1 ;
+   }
+   for( i = 0 ; i < 3 ; ++i ) {
+      if( c[i]->cs == NULL ) {
+         continue ;
+      }
+      if( c[i]->cs->bus < 0 || (bus >= 0 && c[i]->cs->bus != bus) ) {
+         return -1 ;
+      }
+      bus = c[i]->cs->bus ;
+   }
+   return bus ;
+}
+
+/* Is the Lua value at idx the one in the registry as ref? */
+static int sameref( lua_State * L, int idx, int ref )
+{
+   int  eq ;
+
+   lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+   eq = lua_rawequal( L, -1, idx );
+   lua_pop( L, 1 );
+   return eq ;
+}
+
+/* Bank object of plan p from the Lua bank table at idx (see bank_new) */
+static struct pi_bank * acq_bank( lua_State * L, struct pi_plan * p, int idx )
+{
+   struct pi_bank *  b ;
+   int  i ;
+
+   for( i = 0 ; i < p->nbanks ; ++i ) {
+      if( sameref( L, idx, p->bank[i].ref ) ) {
+         return p->bank + i ;
+      }
+   }
+
+   if( p->nbanks >= PIACQ_MAXBANKS ) {
+      luaL_error( L, "acq_sensor: too many banks (%d)", PIACQ_MAXBANKS );
+   }
+   b = p->bank + p->nbanks ;
+   b->nbits = lua_objlen( L, idx );
+   if( b->nbits < 1 || b->nbits > PIACQ_MAXBITS ) {
+      luaL_error( L, "acq_sensor: invalid number of bank bits (%d)", b->nbits );
+   }
+   for( i = 0 ; i < b->nbits ; ++i ) {
+      lua_rawgeti( L, idx, i +1 );
+      if( lua_type( L, -1 ) != LUA_TNUMBER ) {
+         luaL_error( L, "acq_sensor: bank bit not an fd" );
+      }
+      b->fd[i] = lua_tointeger( L, -1 );
+      lua_pop( L, 1 );
+   }
+   lua_getfield( L, idx, "cur" );
+   b->cur = lua_isnumber( L, -1 ) ? lua_tointeger( L, -1 ) : -1 ;
+   lua_pop( L, 1 );
+   lua_pushvalue( L, idx );
+   b->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+   ++p->nbanks ;
+   return b ;
+}
+
+/* Chip select object of plan p from the Lua cs table at idx */
+static struct pi_cs * acq_cs( lua_State * L, struct pi_plan * p, int idx, int adc )
+{
+   struct pi_cs *  cs ;
+   const char *  name ;
+   int  spi ;
+   int  i ;
+
+   for( i = 0 ; i < p->ncs ; ++i ) {
+      if( sameref( L, idx, p->cs[i].ref ) ) {
+         return p->cs[i].adc == adc ? p->cs + i : NULL ;
+      }
+   }
+
+   lua_getfield( L, idx, "spi" );
+   spi = lua_gettop( L );
+   if( lua_type( L, spi ) != LUA_TTABLE ) {
+      lua_pop( L, 1 );
+      return NULL ;
+   }
+
+   if( p->ncs >= PIACQ_MAXCS ) {
+      luaL_error( L, "acq_sensor: too many chip selects (%d)", PIACQ_MAXCS );
+   }
+   cs = p->cs + p->ncs ;
+   memset( cs, 0, sizeof(*cs) );
+   cs->adc = adc ;
+
+   lua_getfield( L, spi, "fd" );
+   if( lua_type( L, -1 ) != LUA_TNUMBER ) {
+      lua_pop( L, 2 );
+      return NULL ;
+   }
+   cs->fd = lua_tointeger( L, -1 );
+   lua_pop( L, 1 );
+
+   lua_getfield( L, spi, "name" );
+   name = lua_tostring( L, -1 );
+   if( name == NULL || (name = strstr( name, "spidev" )) == NULL || sscanf( name, "spidev%d", &cs->bus ) != 1 ) {
+      cs->bus = -1 ;
+   }
+   lua_pop( L, 1 );
+
+   lua_getfield( L, spi, "bank" );
+   if( lua_type( L, -1 ) == LUA_TTABLE ) {
+      cs->bank = acq_bank( L, p, lua_gettop( L ) );
+      lua_getfield( L, idx, "bank" );
+      cs->banksel = lua_tointeger( L, -1 );
+      lua_pop( L, 1 );
+   }
+   lua_pop( L, 2 );  /* bank, spi */
+
+   lua_getfield( L, idx, "scale" );
+   cs->scale = lua_isnumber( L, -1 ) ? lua_tonumber( L, -1 ) : 1.0 ;
+   lua_getfield( L, idx, "cmux" );
+   cs->cmux = lua_isnumber( L, -1 ) ? lua_tointeger( L, -1 ) : -1 ;
+   lua_pop( L, 2 );
+
+   lua_pushvalue( L, idx );
+   cs->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+   ++p->ncs ;
+   return cs ;
+}
+
+/* Channel from field "name" of the descriptor at idx:
+ *    { cs=<cs table>, mux=<number>, adc=<string>, filter=<number or nil> }
+ * Returns 0 if usable, -1 if not (c->cs is NULL)
+ */
+static int acq_chan( lua_State * L, struct pi_plan * p, int idx, const char * name, struct pi_chan * c )
+{
+   int  d ;
+   int  adc ;
+
+   c->cs = NULL ;
+   c->filter = -1.0 ;
+   c->oversample = 1 ;
+   c->last = NAN ;
+
+   lua_getfield( L, idx, name );
+   d = lua_gettop( L );
+   if( lua_type( L, d ) != LUA_TTABLE ) {
+      lua_pop( L, 1 );
+      return -1 ;
+   }
+
+   lua_getfield( L, d, "adc" );
+   adc = pi_acq_lookup( piAdcNames, lua_tostring( L, -1 ) );
+   lua_getfield( L, d, "mux" );
+   c->mux = lua_tointeger( L, -1 );
+   lua_getfield( L, d, "filter" );
+   if( lua_isnumber( L, -1 ) ) {
+      c->filter = lua_tonumber( L, -1 );
+   }
+   lua_getfield( L, d, "oversample" );
+   if( adc == PIADC_ADS8344 && lua_isnumber( L, -1 ) ) {
+      c->oversample = lua_tointeger( L, -1 );
+   }
+   lua_getfield( L, d, "cs" );
+   if( adc != 0 && lua_type( L, -1 ) == LUA_TTABLE ) {
+      c->cs = acq_cs( L, p, lua_gettop( L ), adc );
+   }
+   if( c->cs != NULL ) {
+      /* Pick up the last reading (cache or filter state) */
+      lua_rawgeti( L, -1, c->mux );
+      if( lua_isnumber( L, -1 ) ) {
+         c->last = lua_tonumber( L, -1 );
+      }
+      lua_pop( L, 1 );
+   }
+   lua_pop( L, 6 );  /* desc, adc, mux, filter, oversample, cs */
+
+   return c->cs != NULL ? 0 : -1 ;
+}
+
+/* Index of a reference sensor of kind from field "name" of the
+ *    descriptor at idx, or -1
+ */
+static int acq_refidx( lua_State * L, const struct pi_plan * p, int idx, const char * name, int kind )
+{
+   int  ref = -1 ;
+
+   lua_getfield( L, idx, name );
+   if( lua_isnumber( L, -1 ) ) {
+      ref = lua_tointeger( L, -1 );
+      if( ref < 0 || ref >= p->nsensors || p->sensor[ref].kind != kind ) {
+         ref = -1 ;
+      }
+   }
+   lua_pop( L, 1 );
+   return ref ;
+}
+
+/* pi_acq_reset( ) -- Empty the acquisition plan
+ */
+int pi_acq_reset(lua_State * L)
+{
+   int  i ;
+
+   for( i = 0 ; i < piplan.nbanks ; ++i ) {
+      luaL_unref( L, LUA_REGISTRYINDEX, piplan.bank[i].ref );
+   }
+   for( i = 0 ; i < piplan.ncs ; ++i ) {
+      luaL_unref( L, LUA_REGISTRYINDEX, piplan.cs[i].ref );
+   }
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      luaL_unref( L, LUA_REGISTRYINDEX, piplan.sensor[i].ref );
+   }
+   memset( &piplan, 0, sizeof(piplan) );
+   pi_acq_touch( L );  /* The new plan reads the Lua tables */
+   pi_event_reset( );
+   pi_capture_reset( );
+   pi_hist_reset( );
+
+   return 0 ;
+}
+
+/* pi_plan_add( L, p ) -- Add the sensor described by the descriptor
+ *    at stack index 1 (see pi_acq_sensor( )) to plan p, as PIKIND_LUA
+ *    if it can't be sampled in C.  Neither keeps the sensor table nor
+ *    sets up decimation, those are for piplan.
+ */
+struct pi_sensor * pi_plan_add( lua_State * L, struct pi_plan * p )
+{
+   struct pi_sensor *  s ;
+   int  ok ;
+
+   if( p->nsensors >= PIACQ_MAXSENSORS ) {
+      luaL_error( L, "acq_sensor: too many sensors (%d)", PIACQ_MAXSENSORS );
+   }
+   s = p->sensor + p->nsensors ;
+   memset( s, 0, sizeof(*s) );
+
+   lua_getfield( L, 1, "name" );
+   strncpy( s->name, luaL_optstring( L, -1, "?" ), sizeof(s->name) -1 );
+   lua_getfield( L, 1, "kind" );
+   s->kind = pi_acq_lookup( piKindNames, lua_tostring( L, -1 ) );
+   lua_getfield( L, 1, "emit" );
+   s->emit = lua_toboolean( L, -1 );
+   lua_getfield( L, 1, "vxf" );
+   s->vxf = pi_acq_lookup( piXfNames, lua_tostring( L, -1 ) );
+   lua_getfield( L, 1, "axf" );
+   s->axf = pi_acq_lookup( piXfNames, lua_tostring( L, -1 ) );
+   lua_getfield( L, 1, "txf" );
+   s->txf = pi_acq_lookup( piXfNames, lua_tostring( L, -1 ) );
+   lua_getfield( L, 1, "vref" );
+   s->vref = lua_isnumber( L, -1 ) ? lua_tonumber( L, -1 ) : 1.0 ;
+   lua_getfield( L, 1, "pullup" );
+   s->pullup = lua_isnumber( L, -1 ) ? lua_tonumber( L, -1 ) : NAN ;
+   lua_getfield( L, 1, "period" );
+   s->period = lua_isnumber( L, -1 ) ? lua_tonumber( L, -1 ) : 0.0 ;
+   lua_pop( L, 9 );
+
+   s->vcc = acq_refidx( L, p, 1, "vcc", PIKIND_VCC );
+   s->cj = acq_refidx( L, p, 1, "cj", PIKIND_CJ );
+   s->refv = NAN ;
+   s->epoch = 0 ;
+   s->ref = LUA_NOREF ;
+
+   /* Compile what we can, everything else goes through Lua */
+   ok = 1 ;
+   if( s->kind == PIKIND_POWER || s->kind == PIKIND_VOLT || s->kind == PIKIND_VCC ) {
+      ok = ok && acq_chan( L, p, 1, "v", &s->v ) == 0 ;
+      if( s->kind != PIKIND_VCC ) {
+         ok = ok && s->vxf >= PIXF_12V && s->vxf <= PIXF_3V3 ;
+      }
+   }
+   if( s->kind == PIKIND_POWER || s->kind == PIKIND_AMP ) {
+      ok = ok && acq_chan( L, p, 1, "a", &s->a ) == 0 ;
+      ok = ok && s->axf >= PIXF_ACS713_20 && s->axf <= PIXF_SHUNT50 ;
+      if( s->axf >= PIXF_SHUNT10 && s->axf <= PIXF_SHUNT50 ) {
+         ok = ok && s->vcc >= 0 ;
+      }
+   }
+   if( s->kind == PIKIND_TEMP || s->kind == PIKIND_CJ ) {
+      ok = ok && acq_chan( L, p, 1, "t", &s->t ) == 0 ;
+      if( s->kind == PIKIND_CJ ) {
+         ok = ok && ! isnan( s->pullup );
+      } else if( s->txf == PIXF_TYPEK ) {
+         ok = ok && s->cj >= 0 ;
+      } else if( s->txf == PIXF_PTS ) {
+         ok = ok && ! isnan( s->pullup );
+      } else {
+         ok = ok && s->txf == PIXF_44004 ;
+      }
+   }
+   if( ! ok ) {
+      s->kind = PIKIND_LUA ;
+   }
+   s->bus = pi_acq_bus( s );
+
+   ++p->nsensors ;
+   return s ;
+}
+
+/* pi_acq_sensor( desc ) -- Add a sensor to the acquisition plan
+ * @desc -- table describing the sensor (built by pi.compile)
+ *      name -- name for output
+ *      sensor -- the sensor table (for PIKIND_LUA and state sync)
+ *      kind -- "power", "volt", "amp", "temp", "vcc", "cj" or "lua"
+ *      emit -- true if selected for output
+ *      vxf, axf, txf -- transfer function names (Types)
+ *      v, a, t -- channels { cs=, mux=, adc=, filter= }
+ *      vref, pullup, period -- numbers
+ *      vcc, cj -- plan index of the reference sensor
+ *      cic, fir -- decimation ratios (see pilib_decim.c), default 1
+ * -----
+ * @index -- plan index of the sensor
+ * @kind -- kind actually used ("lua" if it could not be compiled)
+ */
+int pi_acq_sensor(lua_State * L)
+{
+   struct pi_sensor *  s ;
+   int  idx ;
+
+   luaL_checktype( L, 1, LUA_TTABLE );
+   lua_getfield( L, 1, "sensor" );
+   if( lua_type( L, -1 ) != LUA_TTABLE ) {
+      return luaL_argerror( L, 1, "missing table field 'sensor'" );
+   }
+   s = pi_plan_add( L, &piplan );
+   idx = s - piplan.sensor ;
+   s->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+   if( s->kind == PIKIND_LUA && verbose > 0 ) {
+      fprintf( stderr, "%s: acq_sensor: sampling %s through Lua\n", ARGV0, s->name );
+   }
+
+   lua_getfield( L, 1, "cic" );
+   lua_getfield( L, 1, "fir" );
+   if( pi_decim_plan( idx, luaL_optint( L, -2, 1 ), luaL_optint( L, -1, 1 ) ) < 0 ) {
+      return luaL_error( L, "acq_sensor: %s: can't decimate by cic=%d fir=%d",
+            s->name, luaL_optint( L, -2, 1 ), luaL_optint( L, -1, 1 ) );
+   }
+   lua_pop( L, 2 );
+
+   lua_pushinteger( L, idx );
+   lua_pushstring( L, piKindNames[s->kind] );
+   return 2 ;
+}
+
+/* Plan index of the Lua sensor table at idx, or -1 */
+int pi_acq_find( lua_State * L, int idx )
+{
+   int  i ;
+
+   if( idx < 0 && idx > LUA_REGISTRYINDEX ) {
+      idx = lua_gettop( L ) + idx + 1 ;  /* sameref pushes */
+   }
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      if( sameref( L, idx, piplan.sensor[i].ref ) ) {
+         return i ;
+      }
+   }
+   return -1 ;
+}
+
+/* Apply a channel's filter to a new raw reading */
+static void chan_filter( struct pi_chan * c, double * raw )
+{
+   /* Same as pi.filter( last, filter, raw ) */
+   if( c->filter >= 0.0 && ! isnan( c->last ) ) {
+      *raw += (c->last - *raw) * c->filter ;
+   }
+   c->last = *raw ;
+}
+
+/* Read a channel, applying its filter */
+static int chan_read( struct pi_chan * c, double * raw )
+{
+   struct pi_cs *  cs = c->cs ;
+   int  ret ;
+
+   if( cs->bank != NULL ) {
+      if( bank_select( cs->bank->fd, cs->bank->nbits, &cs->bank->cur, cs->banksel ) < 0 ) {
+         return -1 ;
+      }
+   }
+
+   switch( cs->adc ) {
+   case PIADC_ADS8344 :
+      if( c->oversample > 1 ) {
+         ret = ads8344_oversample( cs->fd, c->mux, c->oversample, raw );
+      } else {
+         ret = ads8344_sample( cs->fd, c->mux, raw );
+      }
+      break ;
+   case PIADC_ADS1256 :
+      ret = ads1256_sample( cs->fd, &cs->cmux, c->mux, cs->scale, raw );
+      break ;
+   case PIADC_MCP3008 :
+      ret = mcp3008_sample( cs->fd, c->mux, raw );
+      break ;
+   default :
+      errno = EINVAL ;
+      ret = -1 ;
+      break ;
+   }
+   if( ret < 0 ) {
+      return ret ;
+   }
+
+   chan_filter( c, raw );
+   return 0 ;
+}
+
+/* pi_acq_xfer( xf, raw, vref, pullup, refv ) -- Transfer function
+ * @xf -- PIXF_XXX
+ * @raw -- raw reading (0 to 1, ADS1256 volts / gain)
+ * @vref, @pullup -- of the sensor
+ * @refv -- Vcc for shunts, cold junction volts for type K
+ * -----
+ * @ret -- the value, NAN if xf is unknown
+ */
+double pi_acq_xfer( int xf, double raw, double vref, double pullup, double refv )
+{
+   switch( xf ) {
+   case PIXF_12V : return sens_12v( raw, vref );
+   case PIXF_5V : return sens_5v( raw, vref );
+   case PIXF_3V3 : return sens_3v3( raw, vref );
+   case PIXF_ACS713_20 : return sens_acs713_20( raw );
+   case PIXF_ACS713_30 : return sens_acs713_30( raw );
+   case PIXF_ACS723_10 : return sens_acs723_10( raw );
+   case PIXF_ACS723_20 : return sens_acs723_20( raw );
+   case PIXF_SHUNT10 : return sens_shunt10( raw, refv );
+   case PIXF_SHUNT25 : return sens_shunt25( raw, refv );
+   case PIXF_SHUNT50 : return sens_shunt50( raw, refv );
+   case PIXF_TYPEK : return volt2temp_K( raw * vref + refv );
+   case PIXF_PTS : return rt2temp_PTS( raw, pullup );
+   case PIXF_44004 : return rt2temp_44004( raw );
+   }
+   return NAN ;
+}
+
+/* Reference value transfer function xf of sensor s of plan p needs,
+ *    or NAN
+ */
+static double xfer_refv( const struct pi_plan * p, int xf, const struct pi_sensor * s )
+{
+   if( xf >= PIXF_SHUNT10 && xf <= PIXF_SHUNT50 ) {
+      return get_refv( p, s->vcc );
+   }
+   if( xf == PIXF_TYPEK ) {
+      return get_refv( p, s->cj );
+   }
+   return NAN ;
+}
+
+/* Apply transfer function xf to raw reading of sensor s of plan p */
+static double xfer( const struct pi_plan * p, int xf, double raw, const struct pi_sensor * s )
+{
+   return pi_acq_xfer( xf, raw, s->vref, s->pullup, xfer_refv( p, xf, s ) );
+}
+
+/* Sample a PIKIND_LUA sensor with pi.sample( s ) */
+static int acq_lua( lua_State * L, struct pi_sensor * s, double * val )
+{
+   int  n ;
+   int  i ;
+
+   pi_acq_push( L );
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "sample" );
+   lua_rawgeti( L, LUA_REGISTRYINDEX, s->ref );
+   if( lua_pcall( L, 1, 3, 0 ) != 0 ) {
+      if( verbose >= 0 ) {
+         fprintf( stderr, "%s: sampling %s: %s\n", ARGV0, s->name, lua_tostring( L, -1 ) );
+      }
+      lua_pop( L, 2 );
+      pi_acq_pull( L );
+      return -1 ;
+   }
+
+   n = lua_isnil( L, -2 ) && lua_isnil( L, -1 ) ? 1 : 3 ;
+   for( i = 0 ; i < 3 ; ++i ) {
+      val[i] = lua_isnumber( L, i -3 ) ? lua_tonumber( L, i -3 ) : NAN ;
+   }
+   lua_pop( L, 4 );
+   pi_acq_pull( L );
+
+   return n ;
+}
+
+/* Refresh a reference sensor of plan p, once per sample epoch */
+static int plan_refresh( struct pi_plan * p, int idx )
+{
+   struct pi_sensor *  s = p->sensor + idx ;
+   double  raw ;
+
+   if( s->epoch == pi_acq_epoch( ) ) {
+      return 0 ;
+   }
+   switch( s->kind ) {
+   case PIKIND_VCC :
+      if( chan_read( &s->v, &raw ) < 0 ) {
+         return -1 ;
+      }
+      set_refv( s, 4.096 / raw );
+      break ;
+   case PIKIND_CJ :
+      if( chan_read( &s->t, &raw ) < 0 ) {
+         return -1 ;
+      }
+      set_refv( s, temp2volt_K( rt2temp_PTS( raw, s->pullup ) ) );
+      break ;
+   }
+   s->epoch = pi_acq_epoch( );
+   return 0 ;
+}
+
+int pi_acq_refresh( lua_State * L, int idx )
+{
+   return plan_refresh( &piplan, idx );
+}
+
+/* Sample sensor idx of plan p, PIKIND_LUA ones only in piplan */
+int pi_plan_sample( lua_State * L, struct pi_plan * p, int idx, double * val )
+{
+   struct pi_sensor *  s = p->sensor + idx ;
+   double  raw ;
+
+   switch( s->kind ) {
+   case PIKIND_POWER :
+      if( chan_read( &s->v, &raw ) < 0 ) {
+         return -1 ;
+      }
+      val[1] = xfer( p, s->vxf, raw, s );
+      if( chan_read( &s->a, &raw ) < 0 ) {
+         return -1 ;
+      }
+      val[2] = xfer( p, s->axf, raw, s );
+      val[0] = val[1] * val[2] ;
+      return 3 ;
+   case PIKIND_VOLT :
+      if( chan_read( &s->v, &raw ) < 0 ) {
+         return -1 ;
+      }
+      val[0] = xfer( p, s->vxf, raw, s );
+      return 1 ;
+   case PIKIND_AMP :
+      if( chan_read( &s->a, &raw ) < 0 ) {
+         return -1 ;
+      }
+      val[0] = xfer( p, s->axf, raw, s );
+      return 1 ;
+   case PIKIND_TEMP :
+      if( chan_read( &s->t, &raw ) < 0 ) {
+         return -1 ;
+      }
+      val[0] = xfer( p, s->txf, raw, s );
+      return 1 ;
+   case PIKIND_VCC :
+      if( plan_refresh( p, idx ) < 0 ) {
+         return -1 ;
+      }
+      val[0] = s->refv ;
+      return 1 ;
+   case PIKIND_CJ :
+      if( plan_refresh( p, idx ) < 0 ) {
+         return -1 ;
+      }
+      val[0] = rt2temp_PTS( s->t.last, s->pullup );
+      return 1 ;
+   }
+   return acq_lua( L, s, val );
+}
+
+/* Sample a sensor of the plan */
+int pi_acq_sample( lua_State * L, int idx, double * val )
+{
+   return pi_plan_sample( L, &piplan, idx, val );
+}
+
+/* Channels (and their transfer functions) of a compiled sensor, in
+ *    the order of its values: volt and amp, or the one it has.
+ *    Returns how many, 0 for PIKIND_LUA.
+ */
+static int sensor_chans( struct pi_sensor * s, struct pi_chan ** c, int * xf )
+{
+   int  nc = 0 ;
+
+   if( s->kind == PIKIND_POWER || s->kind == PIKIND_VOLT || s->kind == PIKIND_VCC ) {
+      c[nc] = &s->v ;
+      xf[nc++] = s->kind == PIKIND_VCC ? PIXF_NONE : s->vxf ;
+   }
+   if( s->kind == PIKIND_POWER || s->kind == PIKIND_AMP ) {
+      c[nc] = &s->a ;
+      xf[nc++] = s->axf ;
+   }
+   if( s->kind == PIKIND_TEMP || s->kind == PIKIND_CJ ) {
+      c[nc] = &s->t ;
+      xf[nc++] = s->kind == PIKIND_CJ ? PIXF_NONE : s->txf ;
+   }
+   return nc ;
+}
+
+/* Raw reading of one ADC code of a channel's chip */
+static double chan_lsb( const struct pi_chan * c )
+{
+   switch( c->cs->adc ) {
+   case PIADC_ADS8344 : return 1.0 / 65536.0 / c->oversample ;
+   case PIADC_ADS1256 : return c->cs->scale / 0x400000 ;
+   case PIADC_MCP3008 : return 1.0 / 0x3ff ;
+   }
+   return 1.0 ;
+}
+
+/* pi_acq_format( idx, xf, lsb ) -- How to convert codes of a sensor
+ * @idx -- plan index
+ * @xf -- filled with the transfer function of each code
+ * @lsb -- filled with the raw reading of one count of each code
+ * -----
+ * @ret -- number of codes per sample (see pi_acq_codes), 0 for
+ *    PIKIND_LUA sensors
+ */
+int pi_acq_format( int idx, int * xf, double * lsb )
+{
+   struct pi_chan *  c[2] ;
+   int  nc ;
+   int  i ;
+
+   nc = sensor_chans( piplan.sensor + idx, c, xf );
+   for( i = 0 ; i < nc ; ++i ) {
+      lsb[i] = chan_lsb( c[i] );
+   }
+   return nc ;
+}
+
+/* pi_acq_codes( idx, code, refv ) -- ADC codes of the sample just taken
+ * @idx -- plan index, of a sensor just sampled by the calling thread
+ * @code -- filled with the code of each channel (see pi_acq_format)
+ * @refv -- filled with the reference value its conversion used
+ * -----
+ * @ret -- number of codes, 0 for PIKIND_LUA sensors
+ *
+ * Codes of filtered channels are the filtered reading, rounded.
+ */
+int pi_acq_codes( int idx, int32_t * code, double * refv )
+{
+   struct pi_sensor *  s = piplan.sensor + idx ;
+   struct pi_chan *  c[2] ;
+   int  xf[2] ;
+   int  nc ;
+   int  i ;
+
+   nc = sensor_chans( s, c, xf );
+   for( i = 0 ; i < nc ; ++i ) {
+      code[i] = lrint( c[i]->last / chan_lsb( c[i] ) );
+   }
+   *refv = nc > 0 ? xfer_refv( &piplan, xf[nc -1], s ) : NAN ;
+   return nc ;
+}
+
+/* pi_acq_convert( kind, xf, raw, vref, pullup, refv, val ) -- Values
+ *    of a sensor from its raw readings, as pi_acq_sample( ) would
+ * @kind -- PIKIND_XXX
+ * @xf, @raw -- transfer function and raw reading of each channel
+ * @vref, @pullup, @refv -- see pi_acq_xfer( )
+ * @val -- filled with the values
+ * -----
+ * @ret -- number of values (1 or 3), -1 if kind is PIKIND_LUA
+ */
+int pi_acq_convert( int kind, const int * xf, const double * raw,
+      double vref, double pullup, double refv, double * val )
+{
+   switch( kind ) {
+   case PIKIND_POWER :
+      val[1] = pi_acq_xfer( xf[0], raw[0], vref, pullup, refv );
+      val[2] = pi_acq_xfer( xf[1], raw[1], vref, pullup, refv );
+      val[0] = val[1] * val[2] ;
+      return 3 ;
+   case PIKIND_VOLT :
+   case PIKIND_AMP :
+   case PIKIND_TEMP :
+      val[0] = pi_acq_xfer( xf[0], raw[0], vref, pullup, refv );
+      return 1 ;
+   case PIKIND_VCC :
+      val[0] = 4.096 / raw[0] ;
+      return 1 ;
+   case PIKIND_CJ :
+      val[0] = rt2temp_PTS( raw[0], pullup );
+      return 1 ;
+   }
+   return -1 ;
+}
+
+/* Sample a sensor n times back to back
+ * @val -- 3 values per sample (val[3*i] ...)
+ * @t -- time of each sample (monotime_ns)
+ * Returns the number of values of each sample (1 or 3), or -1 on error
+ *
+ * Sensors whose channels are all on one ADS8344 are read in bursts of
+ *    ADS8344_BURST conversions per SPI message (ads8344_burst), with
+ *    the bank selected once.  Times within a burst are interpolated.
+ *    Anything else is sampled n times, for an ADS1256 channel that
+ *    is at the chip's data rate as its MUX stays put, and for an
+ *    oversampled ADS8344 channel one SPI message per sample.
+ */
+int pi_acq_burst( lua_State * L, int idx, int n, double * val, int64_t * t )
+{
+   struct pi_sensor *  s = piplan.sensor + idx ;
+   struct pi_chan *  c[2] ;
+   int  xf[2] ;
+   int  mux[ADS8344_BURST] ;
+   double  raw[ADS8344_BURST] ;
+   double  *  v ;
+   int64_t  before ;
+   int  nc ;
+   int  per, m, i, j, k ;
+
+   nc = sensor_chans( s, c, xf );
+   if( nc == 0 || s->kind == PIKIND_VCC || s->kind == PIKIND_CJ || c[0]->cs->adc != PIADC_ADS8344 || (nc == 2 && c[1]->cs != c[0]->cs)
+         || c[0]->oversample > 1 || (nc == 2 && c[1]->oversample > 1) ) {
+      for( m = 0, i = 0 ; i < n ; ++i ) {
+         spi_stamp = 0 ;
+         m = pi_acq_sample( L, idx, val + 3*i );
+         if( m < 0 ) {
+            return -1 ;
+         }
+         t[i] = spi_stamp != 0 ? spi_stamp : monotime_ns( );
+      }
+      return m ;
+   }
+
+   if( c[0]->cs->bank != NULL ) {
+      struct pi_bank *  b = c[0]->cs->bank ;
+      if( bank_select( b->fd, b->nbits, &b->cur, c[0]->cs->banksel ) < 0 ) {
+         return -1 ;
+      }
+   }
+   per = ADS8344_BURST / nc ;
+   for( i = 0 ; i < n ; i += k ) {
+      k = n - i < per ? n - i : per ;
+      for( j = 0 ; j < k * nc ; ++j ) {
+         mux[j] = c[j % nc]->mux ;
+      }
+      before = monotime_ns( );
+      if( ads8344_burst( c[0]->cs->fd, k * nc, mux, raw ) < 0 ) {
+         return -1 ;
+      }
+      for( j = 0 ; j < k ; ++j ) {
+         t[i+j] = before + (spi_stamp - before) * (j +1) / k ;
+         v = val + 3 * (i+j) ;
+         for( m = 0 ; m < nc ; ++m ) {
+            chan_filter( c[m], raw + j * nc + m );
+            v[m+1] = xfer( &piplan, xf[m], raw[j * nc + m], s );
+         }
+         v[0] = nc == 2 ? v[1] * v[2] : v[1] ;
+      }
+   }
+   return nc == 2 ? 3 : 1 ;
+}
+
+/* Save a channel's last reading in its Lua cs table, cs[mux] */
+static void chan_push( lua_State * L, struct pi_chan * c )
+{
+   if( c->cs != NULL && ! isnan( c->last ) ) {
+      lua_rawgeti( L, LUA_REGISTRYINDEX, c->cs->ref );
+      lua_pushnumber( L, c->last );
+      lua_rawseti( L, -2, c->mux );
+      lua_pop( L, 1 );
+   }
+}
+
+static void chan_pull( lua_State * L, struct pi_chan * c )
+{
+   if( c->cs != NULL ) {
+      lua_rawgeti( L, LUA_REGISTRYINDEX, c->cs->ref );
+      lua_rawgeti( L, -1, c->mux );
+      if( lua_isnumber( L, -1 ) ) {
+         c->last = lua_tonumber( L, -1 );
+      }
+      lua_pop( L, 2 );
+   }
+}
+
+/* Save a bank's setting in its Lua bank table, bank.cur */
+static void bank_push( lua_State * L, struct pi_bank * b )
+{
+   lua_rawgeti( L, LUA_REGISTRYINDEX, b->ref );
+   if( b->cur >= 0 ) {
+      lua_pushinteger( L, b->cur );
+   } else {
+      lua_pushnil( L );
+   }
+   lua_setfield( L, -2, "cur" );
+   lua_pop( L, 1 );
+}
+
+static void bank_pull( lua_State * L, struct pi_bank * b )
+{
+   lua_rawgeti( L, LUA_REGISTRYINDEX, b->ref );
+   lua_getfield( L, -1, "cur" );
+   b->cur = lua_isnumber( L, -1 ) ? lua_tointeger( L, -1 ) : -1 ;
+   lua_pop( L, 2 );
+}
+
+/* Save an ADS1256's MUX setting in its Lua cs table, cs.cmux */
+static void cmux_push( lua_State * L, struct pi_cs * cs )
+{
+   if( cs->adc == PIADC_ADS1256 ) {
+      lua_rawgeti( L, LUA_REGISTRYINDEX, cs->ref );
+      if( cs->cmux >= 0 ) {
+         lua_pushinteger( L, cs->cmux );
+      } else {
+         lua_pushnil( L );
+      }
+      lua_setfield( L, -2, "cmux" );
+      lua_pop( L, 1 );
+   }
+}
+
+static void cmux_pull( lua_State * L, struct pi_cs * cs )
+{
+   if( cs->adc == PIADC_ADS1256 ) {
+      lua_rawgeti( L, LUA_REGISTRYINDEX, cs->ref );
+      lua_getfield( L, -1, "cmux" );
+      cs->cmux = lua_isnumber( L, -1 ) ? lua_tointeger( L, -1 ) : -1 ;
+      lua_pop( L, 2 );
+   }
+}
+
+void pi_acq_push( lua_State * L )
+{
+   struct pi_sensor *  s ;
+   int  i ;
+
+   if( piplan.snapshot ) {
+      return ;  /* No Lua tables to keep in step */
+   }
+   pi_acq_touch( L );
+   for( i = 0 ; i < piplan.nbanks ; ++i ) {
+      bank_push( L, piplan.bank + i );
+   }
+   for( i = 0 ; i < piplan.ncs ; ++i ) {
+      cmux_push( L, piplan.cs + i );
+   }
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      s = piplan.sensor + i ;
+      chan_push( L, &s->v );
+      chan_push( L, &s->a );
+      chan_push( L, &s->t );
+      if( s->kind == PIKIND_CJ && ! isnan( s->refv ) ) {
+         lua_rawgeti( L, LUA_REGISTRYINDEX, s->ref );
+         lua_pushnumber( L, s->refv );
+         lua_setfield( L, -2, "cjtv" );
+         lua_pop( L, 1 );
+      }
+      if( (s->kind == PIKIND_VCC || s->kind == PIKIND_CJ) && s->epoch == pi_acq_epoch( ) ) {
+         /* Read in this epoch already, fresh( ) needn't read it again */
+         lua_rawgeti( L, LUA_REGISTRYINDEX, s->ref );
+         lua_pushnumber( L, s->epoch );
+         lua_setfield( L, -2, "epoch" );
+         lua_pushboolean( L, 1 );
+         lua_setfield( L, -2, "fresh" );
+         lua_pop( L, 1 );
+      }
+   }
+}
+
+void pi_acq_pull( lua_State * L )
+{
+   struct pi_sensor *  s ;
+   int  i ;
+
+   if( piplan.snapshot ) {
+      return ;
+   }
+   pi_acq_touch( L );
+   for( i = 0 ; i < piplan.nbanks ; ++i ) {
+      bank_pull( L, piplan.bank + i );
+   }
+   for( i = 0 ; i < piplan.ncs ; ++i ) {
+      cmux_pull( L, piplan.cs + i );
+   }
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      s = piplan.sensor + i ;
+      chan_pull( L, &s->v );
+      chan_pull( L, &s->a );
+      chan_pull( L, &s->t );
+      if( s->kind == PIKIND_VCC ) {
+         s->refv = 4.096 / s->v.last ;
+      } else if( s->kind == PIKIND_CJ ) {
+         lua_rawgeti( L, LUA_REGISTRYINDEX, s->ref );
+         lua_getfield( L, -1, "cjtv" );
+         if( lua_isnumber( L, -1 ) ) {
+            s->refv = lua_tonumber( L, -1 );
+         }
+         lua_pop( L, 2 );
+      }
+   }
+}
+
+/* pi_plan_pull( L, p, idx ) -- Pick up the state sensor idx of plan
+ *    p shares with the Lua readers before sampling it: the bank
+ *    selected and ADS1256 mux of its chips, the filter state of its
+ *    channels, and for a reference the reading in its cs[mux].  A bank
+ *    or chip already picked up in the current hardware generation is
+ *    left alone, only p changed it since (see pi_acq_touch( )).
+ */
+void pi_plan_pull( lua_State * L, struct pi_plan * p, int idx )
+{
+   struct pi_sensor *  s = p->sensor + idx ;
+   struct pi_chan *  c[3] = { &s->v, &s->a, &s->t } ;
+   int  ref = s->kind == PIKIND_VCC || s->kind == PIKIND_CJ ;
+   struct pi_cs *  cs ;
+   int  i ;
+
+   for( i = 0 ; i < 3 ; ++i ) {
+      cs = c[i]->cs ;
+      if( cs == NULL ) {
+         continue ;
+      }
+      if( cs->bank != NULL && cs->bank->gen != generation ) {
+         bank_pull( L, cs->bank );
+         cs->bank->gen = generation ;
+      }
+      if( cs->gen != generation ) {
+         cmux_pull( L, cs );
+         cs->gen = generation ;
+      }
+      if( ref || c[i]->filter >= 0.0 ) {
+         chan_pull( L, c[i] );
+      }
+   }
+   if( s->kind == PIKIND_VCC ) {
+      set_refv( s, 4.096 / s->v.last );  /* vcc_volt( ) */
+   } else if( s->kind == PIKIND_CJ ) {
+      set_refv( s, temp2volt_K( rt2temp_PTS( s->t.last, s->pullup ) ) );  /* cj_update( ) */
+   }
+}
+
+/* pi_plan_push( L, p, idx ) -- Hand the state back after sampling */
+void pi_plan_push( lua_State * L, struct pi_plan * p, int idx )
+{
+   struct pi_sensor *  s = p->sensor + idx ;
+   struct pi_chan *  c[3] = { &s->v, &s->a, &s->t } ;
+   int  i ;
+
+   for( i = 0 ; i < 3 ; ++i ) {
+      if( c[i]->cs == NULL ) {
+         continue ;
+      }
+      if( c[i]->cs->bank != NULL ) {
+         bank_push( L, c[i]->cs->bank );
+      }
+      cmux_push( L, c[i]->cs );
+      if( c[i]->filter >= 0.0 ) {
+         chan_push( L, c[i] );
+      }
+   }
+}
+
+/* ex: set sw=3 sta et : */
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <linux/types.h>
@@ -175,8 +176,7 @@ static int  gain2reg( int gain )
  */
 static int wait4DRDY( int fd, double timeout )
 {
-   struct timeval  start ;
-   struct timeval  now ;
+   int64_t  start = 0 ;
    unsigned long  loops ;
    unsigned long  maxloops ;
    struct spi_ioc_transfer  msgs[2] ;
@@ -184,7 +184,7 @@ static int wait4DRDY( int fd, double timeout )
    int  ret ;
 
    if( debug & DBG_WAIT ) {
-      gettimeofday( &start, NULL );
+      start = monotime_ns( );
    }
 
    /* 100usec per loop is an estimate based on debug measurements */
@@ -203,16 +203,15 @@ static int wait4DRDY( int fd, double timeout )
    loops = 0 ;
    do {
       ++loops ;
-      ret = ioctl( fd, SPI_IOC_MESSAGE(2), msgs );
+      ret = spi_transfer( fd, 2, msgs );
       if( ret == -1 ) {
          return -1 ;
       }
    } while( bufs[4] & 1 && loops < maxloops );
 
    if( debug & DBG_WAIT ) {
-      gettimeofday( &now, NULL );
-      fprintf( stderr, "DBG: wait4DRDY(%d) took: %.6f sec, %lu loops, DRDY = %d\n",
-            fd, now.tv_sec-start.tv_sec + (now.tv_usec-start.tv_usec)/1000000.0,
+      fprintf( stderr, "DBG: wait4DRDY(%d) took: %.9f sec, %lu loops, DRDY = %d\n",
+            fd, (monotime_ns( ) - start) / 1000000000.0,
             loops,
             !(bufs[4] & 1)
          );
@@ -246,32 +245,23 @@ int pi_ads1256_wait4DRDY(lua_State * L)
    return 1 ;
 }
 
-/* pi_ads1256_init( fd, [rate], [gain] ) -- Initialize ADS1256
+/* ads1256_start( fd, rate, gain ) -- Configure an ADS1256 and start
+ *    its SELFCAL, without waiting for it (see ads1256_finish)
  * @fd -- spidev device connected to ads1256.  Assumes bank already selected
- * @rate -- conversion rate to select (default: 2000)
- * @gain -- gain setting (default: 16)
+ * @rate -- conversion rate to select
+ * @gain -- gain setting
  * -----
- * @ofc -- SELFCAL calculated ofc (on 0-1 scale)
- * @fsc -- SELFCAL calculated fsc (~1)
+ * @ret -- when SELFCAL started (monotime_ns), or -1 with errno set
+ *
+ * Chips calibrate on their own once commanded, so several can be
+ *    started (selecting each one's bank) and then finished together.
  */
-int pi_ads1256_init(lua_State * L)
+int64_t ads1256_start( int fd, int rate, int gain )
 {
-   int  fd ;
-   int  rate ;
-   int  gain ;
    const struct ads1256_rate *  rateinfo ;
    int  gainreg ;
-   struct timeval  start ;
-   struct timeval  now ;
    struct spi_ioc_transfer  msgs[2] ;
    __u8  bufs[12] ;
-   lua_Number  ofc ;
-   lua_Number  fsc ;
-   int  ret ;
-
-   fd = luaL_checkint( L, 1 );
-   rate = luaL_optint( L, 2, 2000 );
-   gain = luaL_optint( L, 3, 16 );
 
    rateinfo = getrateinfo( rate );
    gainreg = gain2reg( gain );
@@ -292,31 +282,52 @@ int pi_ads1256_init(lua_State * L)
    msgs[1].tx_buf = (__u64) bufs +8 ;
    msgs[1].len = 1 ;
    bufs[8] = 0xf0 ;  /* SELFCAL */
-   if( rateinfo->selfcal < 65500 ) {
-      msgs[1].delay_usecs = rateinfo->selfcal * 4 / 5 ;
-   } else {
-      msgs[1].delay_usecs = 65500 ;
+
+   if( spi_transfer( fd, 2, msgs ) < 0 ) {
+      return -1 ;
    }
+   return spi_stamp ;
+}
 
-   if( debug & DBG_SPI ) {
-      gettimeofday( &start, NULL );
-   };
-   ret = ioctl( fd, SPI_IOC_MESSAGE(2), msgs );
-   if( ret < 0 ) {
-      return luaL_error( L, "ioctl(%d,2,...) to initialize: %s", fd, strerror(errno) );
+/* ads1256_finish( fd, rate, start, ofc, fsc ) -- Wait for the SELFCAL
+ *    begun by ads1256_start( ) and restart conversions
+ * @fd -- spidev device connected to ads1256.  Assumes bank already selected
+ * @rate -- conversion rate given to ads1256_start( )
+ * @start -- what ads1256_start( ) returned
+ * @ofc, @fsc -- set to the SELFCAL calculated ofc (on 0-1 scale) and fsc (~1)
+ * -----
+ * @ret -- 0, or -1 with errno set (ETIMEDOUT if the device is not
+ *    ready after SELFCAL)
+ */
+int ads1256_finish( int fd, int rate, int64_t start, double * ofc, double * fsc )
+{
+   const struct ads1256_rate *  rateinfo ;
+   struct spi_ioc_transfer  msgs[2] ;
+   __u8  bufs[12] ;
+   int64_t  left ;
+   int  ret ;
+
+   rateinfo = getrateinfo( rate );
+
+   /* Don't poll until it is nearly done */
+   left = start + rateinfo->selfcal * 800LL - monotime_ns( );
+   if( left > 0 ) {
+      struct timespec  ts = { left / 1000000000, left % 1000000000 } ;
+      while( nanosleep( &ts, &ts ) < 0 && errno == EINTR )
+         ;
    }
 
    ret = wait4DRDY( fd, rateinfo->selfcal * (1.2 / 1000000.0) );
    if( ret < 0 ) {
-      return luaL_error( L, "ioctl(%d,...) wait for DRDY: %s", fd, strerror(errno));
+      return -1 ;
    } else if( ! ret ) {
-      return luaL_error( L, "Device NOT ready after SELFCAL (timeout %f)", rateinfo->selfcal * (1.2/1000000.0) );
+      errno = ETIMEDOUT ;
+      return -1 ;
    }
 
    if( debug & DBG_SPI ) {
-      gettimeofday( &now, NULL );
-      fprintf( stderr, "DBG: Init w/SELFCAL took: %.6f sec\n",
-            now.tv_sec-start.tv_sec + (now.tv_usec-start.tv_usec)/1000000.0
+      fprintf( stderr, "DBG: Init w/SELFCAL took: %.9f sec\n",
+            (monotime_ns( ) - start) / 1000000000.0
          );
    }
 
@@ -331,9 +342,9 @@ int pi_ads1256_init(lua_State * L)
    msgs[1].len = 1 ;
    bufs[4] = 0x00 ;  /* WAKEUP */
 
-   ret = ioctl( fd, SPI_IOC_MESSAGE(2), msgs );
+   ret = spi_transfer( fd, 2, msgs );
    if( ret < 0 ) {
-      return luaL_error( L, "ioctl(%d,2,...) to SYNC/WAKE: %s", fd, strerror(errno) );
+      return -1 ;
    }
 
    /* Get ofc, fsc */
@@ -347,9 +358,9 @@ int pi_ads1256_init(lua_State * L)
    msgs[1].rx_buf = (__u64) bufs +4 ;
    msgs[1].len = 6 ;
 
-   ret = ioctl( fd, SPI_IOC_MESSAGE(2), msgs );
+   ret = spi_transfer( fd, 2, msgs );
    if( ret < 0 ) {
-      return luaL_error( L, "ioctl(%d,2,...) RREG [OFC, FSC]: %s", fd, strerror(errno) );
+      return -1 ;
    }
 
    if( verbose > 1 ) {
@@ -361,8 +372,100 @@ int pi_ads1256_init(lua_State * L)
       );
    }
 
-   ofc = (double)(((signed char)bufs[6]<<16) | (bufs[5]<<8) | (bufs[4])) / rateinfo->alpha ;
-   fsc = (double)(             (bufs[9]<<16) | (bufs[8]<<8) | (bufs[7])) / rateinfo->fsc ;
+   *ofc = (double)(((signed char)bufs[6]<<16) | (bufs[5]<<8) | (bufs[4])) / rateinfo->alpha ;
+   *fsc = (double)(             (bufs[9]<<16) | (bufs[8]<<8) | (bufs[7])) / rateinfo->fsc ;
+   return 0 ;
+}
+
+/* ads1256_setup( fd, rate, gain, ofc, fsc ) -- Initialize ADS1256,
+ *    ads1256_start( ) and ads1256_finish( ) back to back
+ */
+int ads1256_setup( int fd, int rate, int gain, double * ofc, double * fsc )
+{
+   int64_t  start ;
+
+   start = ads1256_start( fd, rate, gain );
+   if( start < 0 ) {
+      return -1 ;
+   }
+   return ads1256_finish( fd, rate, start, ofc, fsc );
+}
+
+/* Error of ads1256_setup( ) or ads1256_finish( ) */
+static int init_error( lua_State * L, int fd )
+{
+   if( errno == ETIMEDOUT ) {
+      return luaL_error( L, "Device NOT ready after SELFCAL" );
+   }
+   return luaL_error( L, "ioctl(%d,...) to initialize: %s", fd, strerror(errno) );
+}
+
+/* pi_ads1256_init( fd, [rate], [gain] ) -- Initialize ADS1256
+ * @fd -- spidev device connected to ads1256.  Assumes bank already selected
+ * @rate -- conversion rate to select (default: 2000)
+ * @gain -- gain setting (default: 16)
+ * -----
+ * @ofc -- SELFCAL calculated ofc (on 0-1 scale)
+ * @fsc -- SELFCAL calculated fsc (~1)
+ */
+int pi_ads1256_init(lua_State * L)
+{
+   int  fd ;
+   double  ofc ;
+   double  fsc ;
+
+   fd = luaL_checkint( L, 1 );
+   if( ads1256_setup( fd, luaL_optint( L, 2, 2000 ), luaL_optint( L, 3, 16 ), &ofc, &fsc ) < 0 ) {
+      return init_error( L, fd );
+   }
+
+   lua_pushnumber( L, ofc );
+   lua_pushnumber( L, fsc );
+   return 2 ;
+}
+
+/* pi_ads1256_start( fd, [rate], [gain] ) -- Start initializing ADS1256,
+ *    finish it with pi.ads1256_finish( )
+ * @fd -- spidev device connected to ads1256.  Assumes bank already selected
+ * @rate -- conversion rate to select (default: 2000)
+ * @gain -- gain setting (default: 16)
+ * -----
+ * @start -- when SELFCAL started, for pi.ads1256_finish( )
+ */
+int pi_ads1256_start(lua_State * L)
+{
+   int  fd ;
+   int64_t  start ;
+
+   fd = luaL_checkint( L, 1 );
+   start = ads1256_start( fd, luaL_optint( L, 2, 2000 ), luaL_optint( L, 3, 16 ) );
+   if( start < 0 ) {
+      return luaL_error( L, "ioctl(%d,2,...) to initialize: %s", fd, strerror(errno) );
+   }
+
+   lua_pushnumber( L, start );
+   return 1 ;
+}
+
+/* pi_ads1256_finish( fd, rate, start ) -- Wait for ADS1256 SELFCAL
+ * @fd -- spidev device connected to ads1256.  Assumes bank already selected
+ * @rate -- conversion rate given to pi.ads1256_start( ) (default: 2000)
+ * @start -- what pi.ads1256_start( ) returned
+ * -----
+ * @ofc -- SELFCAL calculated ofc (on 0-1 scale)
+ * @fsc -- SELFCAL calculated fsc (~1)
+ */
+int pi_ads1256_finish(lua_State * L)
+{
+   int  fd ;
+   double  ofc ;
+   double  fsc ;
+
+   fd = luaL_checkint( L, 1 );
+   if( ads1256_finish( fd, luaL_optint( L, 2, 2000 ), (int64_t)luaL_checknumber( L, 3 ),
+            &ofc, &fsc ) < 0 ) {
+      return init_error( L, fd );
+   }
 
    lua_pushnumber( L, ofc );
    lua_pushnumber( L, fsc );
@@ -391,6 +494,7 @@ int pi_ads1256_getraw(lua_State * L)
    fd = luaL_checkint( L, 1 );
    scale = luaL_optnumber( L, 2, 1.0 );
    timeout = luaL_optnumber( L, 3, 0.100 );
+   pi_acq_touch( L );
 
    ret = wait4DRDY( fd, timeout );
    if( ret < 0 ) {
@@ -408,7 +512,7 @@ int pi_ads1256_getraw(lua_State * L)
    msgs[1].rx_buf = (__u64) bufs +4 ;
    msgs[1].len = 3 ;
 
-   ret = ioctl( fd, SPI_IOC_MESSAGE(2), msgs );
+   ret = spi_transfer( fd, 2, msgs );
    if( ret < 0 ) {
       return luaL_error( L, "ioctl(%d,2,...) RDATA: %s", fd, strerror(errno) );
    }
@@ -446,6 +550,7 @@ int pi_ads1256_setmux(lua_State * L)
          delay = 0.065 ;
       }
    }
+   pi_acq_touch( L );
 
    /* Write MUX register, then (re)start the conversion */
    memset( msgs, 0, sizeof(msgs) );
@@ -466,7 +571,7 @@ int pi_ads1256_setmux(lua_State * L)
    bufs[8] = 0x00 ;  /* WAKEUP */
    msgs[2].delay_usecs = delay * 1000000 ;
 
-   ret = ioctl( fd, SPI_IOC_MESSAGE(3), msgs );
+   ret = spi_transfer( fd, 3, msgs );
    if( ret < 0 ) {
       return luaL_error( L, "ioctl(%d,2,...) WREG MUX/SYNC/WAKEUP: %s", fd, strerror(errno) );
    }
@@ -519,6 +624,7 @@ int pi_ads1256_getraw_setmuxC(lua_State * L)
    scale = luaL_optnumber( L, 2, 1.0 );
    mux = luaL_checkint( L, 3 );
    timeout = 0.100 ;
+   pi_acq_touch( L );
 
    /* Wait for DRDY */
    ret = wait4DRDY( fd, timeout );
@@ -554,7 +660,7 @@ int pi_ads1256_getraw_setmuxC(lua_State * L)
    msgs[4].rx_buf = (__u64) bufs +8 ;
    msgs[4].len = 3 ;
 
-   ret = ioctl( fd, SPI_IOC_MESSAGE(5), msgs );
+   ret = spi_transfer( fd, 5, msgs );
    if( ret < 0 ) {
       return luaL_error( L, "ioctl(%d,2,...) WREG MUX/SYNC/WAKEUP/RDATA: %s", fd, strerror(errno) );
    }
@@ -564,5 +670,71 @@ int pi_ads1256_getraw_setmuxC(lua_State * L)
    lua_pushnumber( L, reading );
    return 1 ;
 }
+/* ads1256_sample( fd, cmux, mux, scale, reading ) -- Read a channel from C
+ * @fd -- spidev device connected to ads1256.  Assumes bank already selected
+ * @cmux -- the chip's current MUX setting, updated when it changes
+ * @mux -- MUX value for the channel to read
+ * @scale -- scale factor for reading (eg. 1/gain)
+ * @reading -- "raw" reading with scale applied
+ * -----
+ * @ret -- 0 on success, or -1 and sets errno (ETIMEDOUT if not ready)
+ *
+ * NOTE: Same as ads1256_read( cs, mux ) in init_final.lua
+ */
+int ads1256_sample( int fd, int * cmux, int mux, double scale, double * reading )
+{
+   struct spi_ioc_transfer  msgs[3] ;
+   __u8  bufs[12] ;
+   int  ret ;
+
+   if( *cmux != mux ) {
+      /* Write MUX register, then (re)start the conversion */
+      memset( msgs, 0, sizeof(msgs) );
+      msgs[0].tx_buf = (__u64) bufs +0 ;
+      msgs[0].len = 3 ;
+      bufs[0] = 0x51 ;  /* WREG Write register 1 (MUX) */
+      bufs[1] = 0x00 ;  /* +0 more */
+      bufs[2] = mux ;
+      msgs[0].delay_usecs = 1 ;  /* T11(WREG), 4 clocks at 8MHz */
+
+      msgs[1].tx_buf = (__u64) bufs +4 ;
+      msgs[1].len = 1 ;
+      bufs[4] = 0xfc ;  /* SYNC */
+      msgs[1].delay_usecs = 4 ;  /* T11(SYNC), 24 clocks @ 8MHz */
+
+      msgs[2].tx_buf = (__u64) bufs +8 ;
+      msgs[2].len = 1 ;
+      bufs[8] = 0x00 ;  /* WAKEUP */
+
+      if( spi_transfer( fd, 3, msgs ) < 0 ) {
+         return -1 ;
+      }
+      *cmux = mux ;
+   }
+
+   ret = wait4DRDY( fd, 0.100 );
+   if( ret < 0 ) {
+      return -1 ;
+   } else if( !ret ) {
+      errno = ETIMEDOUT ;
+      return -1 ;
+   }
+
+   /* Get reading */
+   memset( msgs, 0, sizeof(msgs) );
+   msgs[0].tx_buf = (__u64) bufs +0 ;
+   msgs[0].len = 1 ;
+   bufs[0] = 0x01 ;  /* RDATA */
+   msgs[0].delay_usecs = 8 ;  /* T6: 50 clock periods at 8 MHz */
+   msgs[1].rx_buf = (__u64) bufs +4 ;
+   msgs[1].len = 3 ;
+
+   if( spi_transfer( fd, 2, msgs ) < 0 ) {
+      return -1 ;
+   }
+
+   *reading = scale * (((signed char)bufs[4]<<16)|(bufs[5]<<8)|(bufs[6])) / 0x400000 ;
+   return 0 ;
+}
 
 /* ex: set sw=3 sta et : */
@@ -12,8 +12,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 #include <linux/types.h>
+#include <linux/spi/spidev.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -197,5 +199,178 @@ int pi_ads8344_getraw(lua_State * L)
    return narg - msgstart +1 ;
 }
 
+/* See pilib_spi.c, same warning on 32-bit platforms */
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+
+/* ads8344_sample( fd, mux, reading ) -- Read a channel from C
+ * @fd -- spidev device connected to ads8344.  Assumes bank already selected
+ * @mux -- channel to read
+ * @reading -- "raw" reading [0,1), the same as mkmsg( mux ) and getraw
+ * -----
+ * @ret -- 0 on success, or -1 and sets errno
+ */
+int ads8344_sample( int fd, int mux, double * reading )
+{
+   struct spi_ioc_transfer  msg ;
+   __u8  bufs[8] ;
+
+   memset( &msg, 0, sizeof(msg) );
+   msg.tx_buf = (__u64) bufs +0 ;
+   msg.rx_buf = (__u64) bufs +4 ;
+   msg.len = 4 ;
+   bufs[0] = chan_map[mux&7] >> 1 ;  /* Default shift, stretched acquisition */
+   bufs[1] = chan_map[mux&7] << 7 ;
+   bufs[2] = 0 ;
+   bufs[3] = 0 ;
+
+   if( spi_transfer( fd, 1, &msg ) < 0 ) {
+      return -1 ;
+   }
+
+   *reading = ((((bufs[5]<<16)|(bufs[6]<<8)|bufs[7])>>6)&0xffff) / 65536.0 ;
+   return 0 ;
+}
+
+/* ads8344_burst( fd, n, mux, reading ) -- Back to back conversions
+ * @fd -- spidev device connected to ads8344.  Assumes bank already selected
+ * @n -- number of conversions (up to ADS8344_BURST)
+ * @mux -- channel of each conversion
+ * @reading -- filled with the n "raw" readings, as ads8344_sample
+ * -----
+ * @ret -- 0 on success, or -1 and sets errno
+ *
+ * All n conversions are queued in a single SPI_IOC_MESSAGE, the chip
+ *    select toggling between them, so they run at the rate of the SPI
+ *    clock instead of one system call each.  spi_stamp is when the
+ *    last one was read.
+ */
+int ads8344_burst( int fd, int n, const int * mux, double * reading )
+{
+   struct spi_ioc_transfer  msgs[ADS8344_BURST] ;
+   __u8  bufs[ADS8344_BURST][8] ;
+   int  i ;
+
+   if( n < 1 || n > ADS8344_BURST ) {
+      errno = EINVAL ;
+      return -1 ;
+   }
+
+   memset( msgs, 0, n * sizeof(msgs[0]) );
+   for( i = 0 ; i < n ; ++i ) {
+      msgs[i].tx_buf = (__u64) bufs[i] +0 ;
+      msgs[i].rx_buf = (__u64) bufs[i] +4 ;
+      msgs[i].len = 4 ;
+      msgs[i].cs_change = i < n -1 ;  /* New conversion, new start bit */
+      bufs[i][0] = chan_map[mux[i]&7] >> 1 ;  /* Same as ads8344_sample */
+      bufs[i][1] = chan_map[mux[i]&7] << 7 ;
+      bufs[i][2] = 0 ;
+      bufs[i][3] = 0 ;
+   }
+
+   if( spi_transfer( fd, n, msgs ) < 0 ) {
+      return -1 ;
+   }
+
+   for( i = 0 ; i < n ; ++i ) {
+      reading[i] = ((((bufs[i][5]<<16)|(bufs[i][6]<<8)|bufs[i][7])>>6)&0xffff) / 65536.0 ;
+   }
+   return 0 ;
+}
+
+/* ads8344_oversample( fd, mux, k, reading ) -- Oversampled conversion
+ * @fd -- spidev device connected to ads8344.  Assumes bank already selected
+ * @mux -- channel to read
+ * @k -- conversions, a power of 2 up to ADS8344_OVERSAMPLE
+ * @reading -- "raw" reading [0,1) with log2( k ) / 2 more bits than
+ *      ads8344_sample, in steps of 1 / (65536 * k)
+ * -----
+ * @ret -- 0 on success, or -1 and sets errno
+ *
+ * The k conversions of one channel go in a single SPI_IOC_MESSAGE,
+ *    as ads8344_burst, and the codes are summed.  The sum is kept
+ *    whole rather than shifted back to 16 bits, so the noise averaged
+ *    out shows up as the extra bits.
+ */
+int ads8344_oversample( int fd, int mux, int k, double * reading )
+{
+   struct spi_ioc_transfer  msgs[ADS8344_OVERSAMPLE] ;
+   __u8  bufs[ADS8344_OVERSAMPLE][8] ;
+   unsigned long  sum ;
+   int  i ;
+
+   if( k < 1 || k > ADS8344_OVERSAMPLE || (k & (k -1)) != 0 ) {
+      errno = EINVAL ;
+      return -1 ;
+   }
+
+   memset( msgs, 0, k * sizeof(msgs[0]) );
+   for( i = 0 ; i < k ; ++i ) {
+      msgs[i].tx_buf = (__u64) bufs[i] +0 ;
+      msgs[i].rx_buf = (__u64) bufs[i] +4 ;
+      msgs[i].len = 4 ;
+      msgs[i].cs_change = i < k -1 ;
+      bufs[i][0] = chan_map[mux&7] >> 1 ;
+      bufs[i][1] = chan_map[mux&7] << 7 ;
+      bufs[i][2] = 0 ;
+      bufs[i][3] = 0 ;
+   }
+
+   if( spi_transfer( fd, k, msgs ) < 0 ) {
+      return -1 ;
+   }
+
+   for( sum = 0, i = 0 ; i < k ; ++i ) {
+      sum += (((bufs[i][5]<<16)|(bufs[i][6]<<8)|bufs[i][7])>>6)&0xffff ;
+   }
+   *reading = sum / (65536.0 * k) ;
+   return 0 ;
+}
+
+/* pi_ads8344_oversample( fd, mux, k ) -- Oversampled reading
+ * @fd -- spidev file descriptor, bank already selected
+ * @mux -- channel to read
+ * @k -- conversions, a power of 2 up to 256
+ * -----
+ * @reading -- "raw" reading [0,1), the average of the k conversions
+ */
+int pi_ads8344_oversample(lua_State * L)
+{
+   int  fd = luaL_checkint( L, 1 );
+   int  mux = luaL_checkint( L, 2 );
+   int  k = luaL_checkint( L, 3 );
+   double  reading ;
+
+   luaL_argcheck( L, mux >= 0 && mux <= 7, 2, "invalid mux value [0,7]" );
+   luaL_argcheck( L, k >= 1 && k <= ADS8344_OVERSAMPLE && (k & (k -1)) == 0, 3,
+         "must be a power of 2 up to 256" );
+   pi_acq_touch( L );
+   if( ads8344_oversample( fd, mux, k, &reading ) < 0 ) {
+      return luaL_error( L, "ads8344_oversample: %s", strerror( errno ) );
+   }
+   lua_pushnumber( L, reading );
+   return 1 ;
+}
+
+/* pi_ads8344_sample( fd, mux ) -- Read a channel
+ * @fd -- spidev device connected to ads8344.  Assumes bank already selected
+ * @mux -- channel to read
+ * -----
+ * @reading -- "raw" reading [0,1), as getraw( spi_message( mkmsg( mux ) ) )
+ *    but without a message table or rx_buf string for every read
+ */
+int pi_ads8344_sample(lua_State * L)
+{
+   int  fd = luaL_checkint( L, 1 );
+   int  mux = luaL_checkint( L, 2 );
+   double  reading ;
+
+   luaL_argcheck( L, mux >= 0 && mux <= 7, 2, "invalid mux value [0,7]" );
+   pi_acq_touch( L );
+   if( ads8344_sample( fd, mux, &reading ) < 0 ) {
+      return luaL_error( L, "ads8344_sample: %s", strerror( errno ) );
+   }
+   lua_pushnumber( L, reading );
+   return 1 ;
+}
 
 /* ex: set sw=3 sta et : */
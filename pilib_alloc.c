@@ -0,0 +1,272 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Lua memory...
+ *   The Lua state of powerInsight and libpidev allocates through
+ *   pi_alloc rather than realloc( ).  Blocks up to PIALLOC_SMALL bytes
+ *   (the tables, strings and closures made on every read) come from
+ *   size-class pools carved out of PIALLOC_SLAB slabs and go back to
+ *   their pool when freed, so they never reach glibc malloc and can't
+ *   fragment its heap.  Larger blocks are malloc( )ed.  The total the
+ *   state holds is capped (PIALLOC_LIMIT, pi.memlimit( )); past it an
+ *   allocation fails and Lua raises a memory error.  The cap is on the
+ *   blocks Lua holds, not on the process: slabs stay with their pool
+ *   once carved, so pooled can stay above the cap after a burst of
+ *   small blocks is freed.  The counts are in pi.memstats( ) and
+ *   pidev_memstats( ).
+ *
+ * Only the thread running the Lua state allocates, there's no locking.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PIALLOC_SMALL 256  /* Largest pooled block */
+#define PIALLOC_SLAB (16*1024)  /* Pools grow by this much */
+#define PIALLOC_ALIGN 16
+
+/* Size classes, and the class of each 16 bytes up to PIALLOC_SMALL */
+static const size_t  classSize[PIALLOC_CLASSES] = {
+      16, 32, 48, 64, 96, 128, 192, 256
+   } ;
+static const unsigned char  sizeClass[PIALLOC_SMALL / PIALLOC_ALIGN] = {
+      0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+   } ;
+
+/* A free pooled block */
+struct pi_block {
+   struct pi_block *  next ;
+} ;
+
+static struct pi_block *  pool[PIALLOC_CLASSES] ;  /* Free lists */
+static struct pi_memstats  stats = { .limit = PIALLOC_LIMIT } ;
+
+#define CLASS( n ) (sizeClass[((n) -1) / PIALLOC_ALIGN])
+
+/* A block of class c, carving a new slab if its pool is empty */
+static void * pool_get( int c )
+{
+   struct pi_block *  b = pool[c] ;
+   char *  slab ;
+   size_t  n ;
+
+   if( b == NULL ) {
+      slab = malloc( PIALLOC_SLAB );
+      if( slab == NULL ) {
+         return NULL ;
+      }
+      for( n = 0 ; n + classSize[c] <= PIALLOC_SLAB ; n += classSize[c] ) {
+         b = (struct pi_block *)(slab + n) ;
+         b->next = pool[c] ;
+         pool[c] = b ;
+      }
+      stats.pooled += PIALLOC_SLAB ;
+      stats.idle += n ;
+      ++stats.slabs[c] ;
+   }
+   pool[c] = b->next ;
+   stats.idle -= classSize[c] ;
+   return b ;
+}
+
+/* Return a block of class c to its pool */
+static void pool_put( int c, void * p )
+{
+   struct pi_block *  b = p ;
+
+   b->next = pool[c] ;
+   pool[c] = b ;
+   stats.idle += classSize[c] ;
+}
+
+/* pi_alloc( ud, ptr, osize, nsize ) -- lua_Alloc of the Lua state
+ *    (see lua_newstate( ))
+ */
+void * pi_alloc( void * ud, void * ptr, size_t osize, size_t nsize )
+{
+   void *  p ;
+
+   (void)ud ;
+   if( ptr == NULL ) {
+      osize = 0 ;
+   }
+
+   if( nsize == 0 ) {
+      if( ptr != NULL ) {
+         if( osize <= PIALLOC_SMALL ) {
+            pool_put( CLASS( osize ), ptr );
+         } else {
+            free( ptr );
+         }
+         stats.inuse -= osize ;
+         ++stats.frees ;
+      }
+      return NULL ;
+   }
+
+   /* Only growing can fail, Lua counts on shrinking to work (below) */
+   if( nsize > osize && stats.limit && stats.inuse - osize + nsize > stats.limit ) {
+      ++stats.failed ;
+      return NULL ;
+   }
+
+   if( nsize <= PIALLOC_SMALL ) {
+      if( ptr != NULL && osize <= PIALLOC_SMALL && CLASS( osize ) == CLASS( nsize ) ) {
+         p = ptr ;  /* Still fits its block */
+      } else if( (p = pool_get( CLASS( nsize ) )) != NULL && ptr != NULL ) {
+         memcpy( p, ptr, osize < nsize ? osize : nsize );
+         if( osize <= PIALLOC_SMALL ) {
+            pool_put( CLASS( osize ), ptr );
+         } else {
+            free( ptr );
+         }
+      }
+   } else if( ptr != NULL && osize > PIALLOC_SMALL ) {
+      p = realloc( ptr, nsize );
+   } else if( (p = malloc( nsize )) != NULL && ptr != NULL ) {
+      memcpy( p, ptr, osize );
+      pool_put( CLASS( osize ), ptr );
+   }
+
+   if( p == NULL && nsize < osize ) {
+      p = ptr ;  /* No smaller block to move to, it still fits the old one */
+   }
+   if( p == NULL ) {
+      ++stats.failed ;
+      return NULL ;
+   }
+   if( ptr == NULL ) {
+      ++stats.allocs ;
+   }
+   stats.inuse += nsize - osize ;
+   if( stats.inuse > stats.peak ) {
+      stats.peak = stats.inuse ;
+   }
+   return p ;
+}
+
+/* Error outside of lua_pcall( ), as luaL_newstate( ) would have it */
+static int panic( lua_State * L )
+{
+   fprintf( stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+         lua_tostring( L, -1 ) );
+   return 0 ;
+}
+
+/* pi_newstate( ) -- luaL_newstate( ), allocating with pi_alloc( )
+ * -----
+ * @ret -- the Lua state, or NULL
+ */
+lua_State * pi_newstate( void )
+{
+   lua_State *  L ;
+
+   L = lua_newstate( pi_alloc, NULL );
+   if( L != NULL ) {
+      lua_atpanic( L, panic );
+   }
+   return L ;
+}
+
+/* pi_memstats_get( L, st ) -- Copy the counts
+ * -----
+ * @ret -- 0, or -1 if the Lua state doesn't use pi_alloc( )
+ */
+int pi_memstats_get( lua_State * L, struct pi_memstats * st )
+{
+   void *  ud ;
+
+   if( lua_getallocf( L, &ud ) != pi_alloc ) {
+      return -1 ;
+   }
+   *st = stats ;
+   return 0 ;
+}
+
+/* pi_memlimit_set( limit ) -- Cap the bytes the Lua state holds, 0
+ *    for none (default: PIALLOC_LIMIT).  Pool slabs aren't counted,
+ *    it doesn't bound what the process takes from malloc( ).
+ * -----
+ * @ret -- the previous cap
+ */
+size_t pi_memlimit_set( size_t limit )
+{
+   size_t  old = stats.limit ;
+
+   stats.limit = limit ;
+   return old ;
+}
+
+/* pi_memstats( ) -- Memory of the Lua state
+ * -----
+ * @stats -- { inuse=, peak=, limit=, allocs=, frees=, failed=,
+ *    pooled=, idle=, slabs={ [size]=n } } in bytes and counts, idle
+ *    is the part of pooled that is free.  nil if the state doesn't
+ *    allocate with pi_alloc (Lua loaded the library)
+ */
+int pi_memstats(lua_State * L)
+{
+   struct pi_memstats  st ;
+   int  c ;
+
+   if( pi_memstats_get( L, &st ) < 0 ) {
+      lua_pushnil( L );
+      return 1 ;
+   }
+
+   lua_newtable( L );
+   lua_pushnumber( L, st.inuse );
+   lua_setfield( L, -2, "inuse" );
+   lua_pushnumber( L, st.peak );
+   lua_setfield( L, -2, "peak" );
+   lua_pushnumber( L, st.limit );
+   lua_setfield( L, -2, "limit" );
+   lua_pushnumber( L, st.allocs );
+   lua_setfield( L, -2, "allocs" );
+   lua_pushnumber( L, st.frees );
+   lua_setfield( L, -2, "frees" );
+   lua_pushnumber( L, st.failed );
+   lua_setfield( L, -2, "failed" );
+   lua_pushnumber( L, st.pooled );
+   lua_setfield( L, -2, "pooled" );
+   lua_pushnumber( L, st.idle );
+   lua_setfield( L, -2, "idle" );
+   lua_newtable( L );
+   for( c = 0 ; c < PIALLOC_CLASSES ; ++c ) {
+      lua_pushnumber( L, st.slabs[c] );
+      lua_rawseti( L, -2, classSize[c] );
+   }
+   lua_setfield( L, -2, "slabs" );
+
+   return 1 ;
+}
+
+/* pi_memlimit( [bytes] ) -- Cap the memory of the Lua state
+ * @bytes -- new cap, 0 for none (default: leave it)
+ * -----
+ * @limit -- the cap before
+ */
+int pi_memlimit(lua_State * L)
+{
+   void *  ud ;
+   size_t  old = stats.limit ;
+
+   if( lua_getallocf( L, &ud ) == pi_alloc && ! lua_isnoneornil( L, 1 ) ) {
+      old = pi_memlimit_set( (size_t)luaL_checknumber( L, 1 ) );
+   }
+   lua_pushnumber( L, old );
+   return 1 ;
+}
+
+/* ex: set sw=3 sta et : */
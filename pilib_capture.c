@@ -0,0 +1,464 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Pre/post-trigger capture...
+ *   While streaming, the samples of the capture sensors are kept in
+ *   a ring per sensor.  On a trigger (a threshold rule raised, an
+ *   application marker, an external GPIO or an explicit call) each
+ *   sampling loop takes the post-trigger samples of its capture
+ *   sensors back to back, as fast as the ADC goes, and the writer
+ *   thread dumps the window around the trigger to a file.  The rings
+ *   are allocated when the capture is set up, not while streaming.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PICAP_MAXCHANS 8  /* Capture sensors */
+#define PICAP_MAXSAMPLES 1000000  /* pre + post per sensor */
+#define PICAP_CHUNK 64  /* Post-trigger samples per pi_acq_burst( ) */
+
+/* Capture states */
+#define PICAP_IDLE 0  /* Not set up, or not streaming */
+#define PICAP_ARMED 1  /* Filling the pre-trigger rings */
+#define PICAP_TRIGGERING 2  /* A trigger is filling in why */
+#define PICAP_TRIGGERED 3  /* Loops are taking the post-trigger samples */
+#define PICAP_FULL 4  /* Waiting for the writer to dump it */
+
+struct pi_capchan {
+   int  sensor ;  /* Plan index */
+   int  n ;  /* Values per sample */
+   unsigned long  head ;  /* Samples kept */
+   unsigned long  trig ;  /* head when the loop saw the trigger */
+   int  seen ;  /* Trigger seen */
+   int  done ;  /* All the post-trigger samples taken */
+   int64_t *  t ;  /* [size] monotime_ns */
+   double *  val ;  /* [3 * size] */
+} ;
+
+static struct {
+   int  state ;  /* PICAP_XXX */
+   int  nchans ;
+   struct pi_capchan  chan[PICAP_MAXCHANS] ;
+   int  capof[PIACQ_MAXSENSORS] ;  /* Capture sensor of a plan sensor +1 */
+   unsigned long  pre, post, size ;
+   int  remaining ;  /* Sensors still taking post-trigger samples */
+   int64_t  t ;  /* When it was triggered */
+   char  why[PICAP_WHYLEN] ;  /* What triggered it */
+   char  rule[PIEVT_NAMELEN] ;  /* Rule that triggers it, "*" any */
+   char  mark[PIMARK_TAGLEN] ;  /* Marker tag that triggers it */
+   int  gpio ;  /* GPIO value file that triggers it, -1 if none */
+   int  level ;  /* Last GPIO level */
+   char  file[256] ;  /* File name, %d is the capture number */
+   unsigned long  count ;  /* Captures written */
+   char  last[256 + 24] ;  /* Last file written, file and a number */
+} cap = { .gpio = -1 } ;
+
+/* pi_capture_reset( ) -- Drop the capture and free its rings */
+void pi_capture_reset( void )
+{
+   int  i ;
+
+   for( i = 0 ; i < cap.nchans ; ++i ) {
+      free( cap.chan[i].t );
+      free( cap.chan[i].val );
+   }
+   if( cap.gpio >= 0 ) {
+      close( cap.gpio );
+   }
+   memset( &cap, 0, sizeof(cap) );
+   cap.gpio = -1 ;
+}
+
+/* pi_capture_arm( ) -- Empty the rings and wait for a trigger */
+void pi_capture_arm( void )
+{
+   int  i ;
+
+   for( i = 0 ; i < cap.nchans ; ++i ) {
+      cap.chan[i].head = 0 ;
+      cap.chan[i].seen = 0 ;
+      cap.chan[i].done = 0 ;
+   }
+   cap.level = 1 ;  /* Wait for a rising edge */
+   __atomic_store_n( &cap.state, cap.nchans > 0 ? PICAP_ARMED : PICAP_IDLE,
+         __ATOMIC_RELEASE );
+}
+
+/* pi_capture_trigger( why ) -- Trigger the capture, from any thread
+ * -----
+ * @ret -- 0 if triggered, -1 if not armed (not set up, not streaming,
+ *      or busy with a previous trigger)
+ */
+int pi_capture_trigger( const char * why )
+{
+   int  armed = PICAP_ARMED ;
+
+   if( ! __atomic_compare_exchange_n( &cap.state, &armed, PICAP_TRIGGERING, 0,
+         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) {
+      return -1 ;
+   }
+   cap.t = monotime_ns( );
+   strncpy( cap.why, why != NULL ? why : "trigger", PICAP_WHYLEN -1 );
+   cap.why[PICAP_WHYLEN -1] = '\0' ;
+   cap.remaining = cap.nchans ;
+   __atomic_store_n( &cap.state, PICAP_TRIGGERED, __ATOMIC_RELEASE );
+   return 0 ;
+}
+
+/* pi_capture_rule( name ) -- Trigger if threshold rule name triggers it */
+void pi_capture_rule( const char * name )
+{
+   if( __atomic_load_n( &cap.state, __ATOMIC_RELAXED ) == PICAP_ARMED
+         && cap.rule[0] != '\0'
+         && (strcmp( cap.rule, "*" ) == 0 || strcmp( cap.rule, name ) == 0) ) {
+      pi_capture_trigger( name );
+   }
+}
+
+/* pi_capture_mark( tag ) -- Trigger if a marker with tag triggers it */
+void pi_capture_mark( const char * tag )
+{
+   if( __atomic_load_n( &cap.state, __ATOMIC_RELAXED ) == PICAP_ARMED
+         && cap.mark[0] != '\0' && strcmp( cap.mark, tag ) == 0 ) {
+      pi_capture_trigger( tag );
+   }
+}
+
+/* pi_capture_poll( ) -- Trigger on a rising edge of the GPIO
+ *
+ * Called once per scan by one of the sampling loops.
+ */
+void pi_capture_poll( void )
+{
+   char  buf[2] ;
+   int  level ;
+
+   if( cap.gpio < 0 || pread( cap.gpio, buf, sizeof(buf), 0 ) < 1 ) {
+      return ;
+   }
+   level = buf[0] == '1' ;
+   if( level && ! cap.level ) {
+      pi_capture_trigger( "gpio" );
+   }
+   cap.level = level ;
+}
+
+/* Capture sensor c has all it will get, the last one completes it */
+static void capture_done( struct pi_capchan * c )
+{
+   c->done = 1 ;
+   if( __atomic_sub_fetch( &cap.remaining, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+      __atomic_store_n( &cap.state, PICAP_FULL, __ATOMIC_RELEASE );
+   }
+}
+
+/* Keep a sample in the ring of capture sensor c */
+static void capture_put( struct pi_capchan * c, int state, int64_t t, const double * val, int n )
+{
+   unsigned long  i ;
+
+   if( state == PICAP_TRIGGERED ) {
+      if( c->done ) {
+         return ;
+      }
+      if( ! c->seen ) {
+         c->seen = 1 ;
+         c->trig = c->head ;
+      }
+   }
+
+   i = c->head % cap.size ;
+   c->t[i] = t ;
+   memcpy( c->val + 3 * i, val, n * sizeof(double) );
+   c->n = n ;
+   ++c->head ;
+
+   if( state == PICAP_TRIGGERED && c->head - c->trig >= cap.post ) {
+      capture_done( c );
+   }
+}
+
+/* pi_capture_sample( sensor, t, val, n ) -- Keep a sample
+ *
+ * Called by the loop sampling the sensor, right after each sample.
+ *    Only that loop writes the sensor's ring.
+ */
+void pi_capture_sample( int sensor, int64_t t, const double * val, int n )
+{
+   int  state ;
+
+   if( cap.capof[sensor] == 0 ) {
+      return ;
+   }
+   state = __atomic_load_n( &cap.state, __ATOMIC_ACQUIRE );
+   if( state == PICAP_ARMED || state == PICAP_TRIGGERED ) {
+      capture_put( cap.chan + cap.capof[sensor] -1, state, t, val, n );
+   }
+}
+
+/* pi_capture_burst( L, sensor, n ) -- Take the post-trigger samples
+ * @sensor -- the n sensors of the calling loop
+ * -----
+ * @ret -- 1 if it took samples (the loop's schedule slipped), else 0
+ *
+ * The loop's capture sensors are sampled back to back, PICAP_CHUNK
+ *    samples each in turn, until they all have their post-trigger
+ *    samples.  Its other sensors wait.
+ */
+int pi_capture_burst( lua_State * L, const int * sensor, int n )
+{
+   double  val[3 * PICAP_CHUNK] ;
+   int64_t  t[PICAP_CHUNK] ;
+   struct pi_capchan *  c ;
+   unsigned long  left ;
+   int  busy = 1 ;
+   int  took = 0 ;
+   int  i, k, m, got ;
+
+   if( __atomic_load_n( &cap.state, __ATOMIC_ACQUIRE ) != PICAP_TRIGGERED ) {
+      return 0 ;
+   }
+   while( busy ) {
+      busy = 0 ;
+      for( i = 0 ; i < n ; ++i ) {
+         if( cap.capof[sensor[i]] == 0 ) {
+            continue ;
+         }
+         c = cap.chan + cap.capof[sensor[i]] -1 ;
+         if( c->done ) {
+            continue ;
+         }
+         left = c->seen ? cap.post - (c->head - c->trig) : cap.post ;
+         got = left < PICAP_CHUNK ? left : PICAP_CHUNK ;
+         m = pi_acq_burst( L, sensor[i], got, val, t );
+         if( m < 0 ) {
+            /* Give up on it, keep what there is */
+            if( ! c->seen ) {
+               c->seen = 1 ;
+               c->trig = c->head ;
+            }
+            capture_done( c );
+            continue ;
+         }
+         for( k = 0 ; k < got ; ++k ) {
+            capture_put( c, PICAP_TRIGGERED, t[k], val + 3 * k, m );
+         }
+         busy = busy || ! c->done ;
+         took = 1 ;
+      }
+   }
+   return took ;
+}
+
+/* Write capture sensor c's window around the trigger */
+static void capture_write( FILE * out, const struct pi_capchan * c )
+{
+   unsigned long  from, to, i ;
+   const double *  v ;
+
+   to = c->seen ? c->trig + cap.post : c->head ;
+   if( to > c->head ) {
+      to = c->head ;
+   }
+   from = c->seen && c->trig > cap.pre ? c->trig - cap.pre : 0 ;
+   if( c->head > cap.size && from < c->head - cap.size ) {
+      from = c->head - cap.size ;
+   }
+
+   for( i = from ; i < to ; ++i ) {
+      v = c->val + 3 * (i % cap.size) ;
+      if( c->n == 3 ) {
+         fprintf( out, "%-10s %13.9f %8.3f %7.3f %7.3f\n", piplan.sensor[c->sensor].name,
+               (c->t[i % cap.size] - cap.t) / 1000000000.0, v[0], v[1], v[2] );
+      } else {
+         fprintf( out, "%-10s %13.9f %8.3f\n", piplan.sensor[c->sensor].name,
+               (c->t[i % cap.size] - cap.t) / 1000000000.0, v[0] );
+      }
+   }
+}
+
+/* Name of capture n: cap.file with its first %d replaced by n, or
+ *    with -n added if it has none.  cap.file comes from the config,
+ *    it's never a format.
+ */
+static void capture_name( char * buf, size_t size, unsigned long n )
+{
+   const char *  d = strstr( cap.file, "%d" );
+
+   if( d == NULL ) {
+      snprintf( buf, size, "%s-%lu", cap.file, n );
+   } else {
+      snprintf( buf, size, "%.*s%lu%s", (int)(d - cap.file), cap.file, n, d +2 );
+   }
+}
+
+/* pi_capture_dump( final ) -- Write out a completed capture, and re-arm
+ * @final -- the loops are done, write a capture cut short by the end
+ *      of the stream with what it has and disarm
+ *
+ * Called by the stream writer when it's idle, and once at the end.
+ */
+void pi_capture_dump( int final )
+{
+   FILE *  out ;
+   char  when[PIWALL_LEN] ;
+   int  state ;
+   int  i ;
+
+   if( final ) {
+      /* Disarm, waiting out a trigger in progress */
+      do {
+         state = __atomic_load_n( &cap.state, __ATOMIC_ACQUIRE );
+      } while( state == PICAP_TRIGGERING || ! __atomic_compare_exchange_n( &cap.state,
+            &state, PICAP_IDLE, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) );
+      if( state != PICAP_FULL && state != PICAP_TRIGGERED ) {
+         return ;
+      }
+   } else if( __atomic_load_n( &cap.state, __ATOMIC_ACQUIRE ) != PICAP_FULL ) {
+      return ;
+   }
+
+   ++cap.count ;
+   capture_name( cap.last, sizeof(cap.last), cap.count );
+   out = fopen( cap.last, "w" );
+   if( out == NULL ) {
+      if( verbose >= 0 ) {
+         fprintf( stderr, "%s: capture: can't write %s\n", ARGV0, cap.last );
+      }
+   } else {
+      fprintf( out, "# Capture %lu: %s at %s\n", cap.count, cap.why,
+            wall_format( when, sizeof(when), mono2wall_ns( cap.t ) ) );
+      fprintf( out, "# %lu samples before and %lu after the trigger\n", cap.pre, cap.post );
+      fprintf( out, "# sensor    seconds from trigger, value [volt amp]\n" );
+      for( i = 0 ; i < cap.nchans ; ++i ) {
+         capture_write( out, cap.chan + i );
+      }
+      fclose( out );
+      if( verbose > 0 ) {
+         fprintf( stderr, "# Capture %lu (%s) written to %s\n", cap.count, cap.why, cap.last );
+      }
+   }
+
+   if( ! final ) {
+      pi_capture_arm( );
+   }
+}
+
+/* pi_capture_setup( desc ) -- Set up the capture (built by pi.compile)
+ * @desc -- table describing the capture
+ *      sensors -- list of plan indexes of the sensors captured
+ *      pre, post -- samples kept before and taken after the trigger
+ *      file -- name of the files written, the first %d is replaced
+ *              by the capture number (-number is added without one)
+ *      rule -- name of the threshold rule that triggers it, "*" any
+ *      mark -- tag of the markers (pi.mark_begin) that trigger it
+ *      gpio -- GPIO value file (/sys/class/gpio/gpioN/value) that
+ *              triggers it going high
+ */
+int pi_capture_setup(lua_State * L)
+{
+   struct pi_capchan *  c ;
+   const char *  gpio ;
+   int  idx ;
+
+   luaL_checktype( L, 1, LUA_TTABLE );
+   pi_capture_reset( );
+
+   lua_getfield( L, 1, "pre" );
+   cap.pre = luaL_optint( L, -1, 1000 );
+   lua_getfield( L, 1, "post" );
+   cap.post = luaL_optint( L, -1, 1000 );
+   luaL_argcheck( L, cap.pre + cap.post > 0 && cap.post > 0
+         && cap.pre + cap.post <= PICAP_MAXSAMPLES, 1, "bad pre or post" );
+   cap.size = cap.pre + cap.post ;
+   lua_getfield( L, 1, "file" );
+   strncpy( cap.file, luaL_optstring( L, -1, "pi-capture-%d.txt" ), sizeof(cap.file) -1 );
+   lua_getfield( L, 1, "rule" );
+   strncpy( cap.rule, luaL_optstring( L, -1, "" ), PIEVT_NAMELEN -1 );
+   lua_getfield( L, 1, "mark" );
+   strncpy( cap.mark, luaL_optstring( L, -1, "" ), PIMARK_TAGLEN -1 );
+   lua_getfield( L, 1, "gpio" );
+   gpio = lua_tostring( L, -1 );
+   if( gpio != NULL ) {
+      cap.gpio = open( gpio, O_RDONLY );
+      if( cap.gpio < 0 ) {
+         return luaL_error( L, "capture: can't open %s", gpio );
+      }
+   }
+   lua_pop( L, 6 );
+
+   lua_getfield( L, 1, "sensors" );
+   luaL_argcheck( L, lua_istable( L, -1 ), 1, "missing table field 'sensors'" );
+   while( 1 ) {
+      lua_rawgeti( L, -1, cap.nchans +1 );
+      if( lua_isnil( L, -1 ) ) {
+         lua_pop( L, 1 );
+         break ;
+      }
+      idx = lua_tointeger( L, -1 );
+      lua_pop( L, 1 );
+      if( cap.nchans >= PICAP_MAXCHANS ) {
+         return luaL_error( L, "capture: too many sensors (%d)", PICAP_MAXCHANS );
+      }
+      luaL_argcheck( L, idx >= 0 && idx < piplan.nsensors, 1, "no such sensor" );
+      if( piplan.sensor[idx].kind == PIKIND_LUA ) {
+         return luaL_error( L, "capture: %s is sampled through Lua, it can't be captured",
+               piplan.sensor[idx].name );
+      }
+      c = cap.chan + cap.nchans ;
+      c->sensor = idx ;
+      c->t = malloc( cap.size * sizeof(*c->t) );
+      c->val = malloc( 3 * cap.size * sizeof(*c->val) );
+      ++cap.nchans ;
+      if( c->t == NULL || c->val == NULL ) {
+         return luaL_error( L, "capture: out of memory" );
+      }
+      cap.capof[idx] = cap.nchans ;
+   }
+   lua_pop( L, 1 );
+
+   return 0 ;
+}
+
+/* pi_capture( [why] ) -- Trigger the capture
+ * @why -- noted in the file (default "trigger")
+ * -----
+ * @ok -- false if not armed
+ */
+int pi_capture(lua_State * L)
+{
+   lua_pushboolean( L, pi_capture_trigger( luaL_optstring( L, 1, "trigger" ) ) == 0 );
+   return 1 ;
+}
+
+/* pi_captures( ) -- Captures written
+ * -----
+ * @count -- number of captures written
+ * @file -- the last file written, nil if none
+ */
+int pi_captures(lua_State * L)
+{
+   lua_pushnumber( L, cap.count );
+   if( cap.count > 0 ) {
+      lua_pushstring( L, cap.last );
+   } else {
+      lua_pushnil( L );
+   }
+   return 2 ;
+}
+
+/* ex: set sw=3 sta et : */
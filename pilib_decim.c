@@ -0,0 +1,259 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Decimation...
+ *   A sensor streamed faster than its consumers need can be decimated
+ *   (Sensors{ decimate= }) by a CIC filter and a FIR filter that
+ *   makes up for the CIC droop, rather than dropping samples and
+ *   letting everything above the new Nyquist alias into the rest.
+ *   Each value of the sensor (watt, volt and amp of power sensors)
+ *   has its own filters.  The sampling loop runs them on every sample
+ *   and only hands the outputs to the writer (history, rollups,
+ *   latest samples, the stream and its file), threshold rules and
+ *   captures still see every sample.
+ *
+ * The CIC is 3 stages in 64-bit fixed point, wrapping around as CIC
+ *   integrators do.  The FIR coefficients are designed when the plan
+ *   is compiled, one table per pair of ratios, so sampling only
+ *   multiplies and adds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <lua.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PIDEC_STAGES 3  /* CIC order */
+#define PIDEC_SCALE 1048576.0  /* CIC fixed point, 2^20 per unit */
+#define PIDEC_LIMIT 1e6  /* Inputs are clipped to +/- this */
+#define PIDEC_TAPS 31  /* FIR length (odd, linear phase) */
+#define PIDEC_GRID 512  /* Frequency points of the FIR design */
+#define PIDEC_MAXFIRS 8  /* Distinct FIR designs */
+
+/* A FIR design for a CIC and FIR ratio */
+struct pi_fir {
+   int  cic, fir ;
+   double  h[PIDEC_TAPS] ;
+} ;
+
+/* Filters of one value of a sensor */
+struct pi_decval {
+   uint64_t  integ[PIDEC_STAGES] ;
+   uint64_t  comb[PIDEC_STAGES] ;  /* Previous input of each comb */
+   double  line[PIDEC_TAPS] ;  /* FIR delay line, at the CIC rate */
+   double  last ;  /* Last input, held over NAN */
+} ;
+
+/* A decimated sensor, only touched by the loop sampling it */
+struct pi_decim {
+   int  cic, fir ;  /* Ratios, 1 and 1 if not decimated */
+   const struct pi_fir *  f ;
+   double  gain ;  /* Of the CIC, with PIDEC_SCALE */
+   int  cphase, fphase ;  /* Inputs into the current CIC, FIR output */
+   int  pos ;  /* Next slot of the delay lines */
+   int  fill ;  /* CIC outputs so far, until the filters are full */
+   struct pi_decval  v[3] ;
+} ;
+
+static struct pi_fir  firs[PIDEC_MAXFIRS] ;
+static int  nfirs ;
+static struct pi_decim  decim[PIACQ_MAXSENSORS] ;
+
+/* Magnitude of the CIC response at f cycles per CIC output sample */
+static double cic_gain( int r, double f )
+{
+   double  g ;
+
+   if( f == 0 || r == 1 ) {
+      return 1.0 ;
+   }
+   g = sin( M_PI * f ) / (r * sin( M_PI * f / r )) ;
+   return pow( fabs( g ), PIDEC_STAGES );
+}
+
+/* Design the FIR: lowpass at the output Nyquist (0.5 / fir of the CIC
+ *    rate), flat to 80% of it after undoing the CIC droop, tapering to
+ *    0 at it.  Frequency sampling of that response, Hamming windowed.
+ */
+static void fir_design( struct pi_fir * d )
+{
+   double  fc = 0.5 / d->fir ;
+   double  fp = 0.8 * fc ;
+   double  want, f, sum ;
+   int  m = PIDEC_TAPS / 2 ;
+   int  i, j ;
+
+   for( i = 0 ; i < PIDEC_TAPS ; ++i ) {
+      d->h[i] = 0 ;
+   }
+   for( j = 0 ; j < PIDEC_GRID ; ++j ) {
+      f = (j + 0.5) * 0.5 / PIDEC_GRID ;
+      if( f >= fc ) {
+         break ;
+      }
+      want = 1.0 / cic_gain( d->cic, f );
+      if( f > fp ) {
+         want *= (fc - f) / (fc - fp) ;
+      }
+      for( i = 0 ; i < PIDEC_TAPS ; ++i ) {
+         d->h[i] += want * cos( 2 * M_PI * f * (i - m) );
+      }
+   }
+   for( sum = 0, i = 0 ; i < PIDEC_TAPS ; ++i ) {
+      d->h[i] *= 0.54 - 0.46 * cos( 2 * M_PI * i / (PIDEC_TAPS -1) );
+      sum += d->h[i] ;
+   }
+   for( i = 0 ; i < PIDEC_TAPS ; ++i ) {
+      d->h[i] /= sum ;  /* Unity gain at DC */
+   }
+}
+
+/* pi_decim_plan( idx, cic, fir ) -- Set the decimation of a sensor
+ * @idx -- plan index
+ * @cic -- CIC ratio, 1 to PIDEC_MAXCIC
+ * @fir -- FIR ratio after it, 1 to PIDEC_MAXFIR
+ * -----
+ * @ret -- 0, or -1 if the ratios are out of range or there are too
+ *    many different ones
+ */
+int pi_decim_plan( int idx, int cic, int fir )
+{
+   struct pi_decim *  d = decim + idx ;
+   int  i ;
+
+   memset( d, 0, sizeof(*d) );
+   d->cic = d->fir = 1 ;
+   if( cic < 1 || cic > PIDEC_MAXCIC || fir < 1 || fir > PIDEC_MAXFIR ) {
+      return -1 ;
+   }
+   if( cic == 1 && fir == 1 ) {
+      return 0 ;
+   }
+
+   for( i = 0 ; i < nfirs ; ++i ) {
+      if( firs[i].cic == cic && firs[i].fir == fir ) {
+         break ;
+      }
+   }
+   if( i == nfirs ) {
+      if( nfirs >= PIDEC_MAXFIRS ) {
+         return -1 ;
+      }
+      firs[i].cic = cic ;
+      firs[i].fir = fir ;
+      fir_design( firs + i );
+      ++nfirs ;
+   }
+   d->cic = cic ;
+   d->fir = fir ;
+   d->f = firs + i ;
+   d->gain = PIDEC_SCALE * pow( cic, PIDEC_STAGES );
+   return 0 ;
+}
+
+/* pi_decim_ratio( idx ) -- Samples in per sample out of a sensor */
+int pi_decim_ratio( int idx )
+{
+   return decim[idx].cic * decim[idx].fir ;
+}
+
+/* pi_decim_get( idx, cic, fir ) -- CIC and FIR ratios of a sensor */
+void pi_decim_get( int idx, int * cic, int * fir )
+{
+   *cic = decim[idx].cic ;
+   *fir = decim[idx].fir ;
+}
+
+/* pi_decim_reset( ) -- Empty the filters, a new stream starts */
+void pi_decim_reset( void )
+{
+   struct pi_decim *  d ;
+   int  i ;
+
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      d = decim + i ;
+      d->cphase = d->fphase = d->pos = d->fill = 0 ;
+      memset( d->v, 0, sizeof(d->v) );
+   }
+}
+
+/* pi_decim_sample( idx, val, n ) -- Run a sample through the filters
+ *    of a sensor, by the loop sampling it
+ * @val -- its n values, replaced by the output if there is one
+ * -----
+ * @ret -- 1 if val is an output, 0 if the sample was taken in
+ *
+ * Nothing comes out until the filters have filled, about
+ *    (PIDEC_STAGES + PIDEC_TAPS) * cic samples after a reset.
+ */
+int pi_decim_sample( int idx, double * val, int n )
+{
+   struct pi_decim *  d = decim + idx ;
+   struct pi_decval *  v ;
+   uint64_t  y, prev ;
+   double  x, out ;
+   int  i, k, p ;
+
+   if( d->f == NULL ) {
+      return 1 ;
+   }
+
+   /* CIC integrators at the input rate */
+   for( i = 0 ; i < n ; ++i ) {
+      v = d->v + i ;
+      x = isnan( val[i] ) ? v->last : val[i] ;
+      v->last = x ;
+      x = x > PIDEC_LIMIT ? PIDEC_LIMIT : x < -PIDEC_LIMIT ? -PIDEC_LIMIT : x ;
+      v->integ[0] += (uint64_t)llrint( x * PIDEC_SCALE );
+      for( k = 1 ; k < PIDEC_STAGES ; ++k ) {
+         v->integ[k] += v->integ[k-1] ;
+      }
+   }
+   if( ++d->cphase < d->cic ) {
+      return 0 ;
+   }
+   d->cphase = 0 ;
+
+   /* Combs at the CIC rate, into the FIR delay lines */
+   for( i = 0 ; i < n ; ++i ) {
+      v = d->v + i ;
+      y = v->integ[PIDEC_STAGES -1] ;
+      for( k = 0 ; k < PIDEC_STAGES ; ++k ) {
+         prev = v->comb[k] ;
+         v->comb[k] = y ;
+         y -= prev ;
+      }
+      v->line[d->pos] = (int64_t)y / d->gain ;
+   }
+   d->pos = (d->pos +1) % PIDEC_TAPS ;
+   if( d->fill < PIDEC_STAGES + PIDEC_TAPS ) {
+      ++d->fill ;  /* Still the start-up transient */
+      return 0 ;
+   }
+   if( ++d->fphase < d->fir ) {
+      return 0 ;
+   }
+   d->fphase = 0 ;
+
+   /* FIR output, newest sample first */
+   for( i = 0 ; i < n ; ++i ) {
+      v = d->v + i ;
+      out = 0 ;
+      for( k = 0, p = d->pos ; k < PIDEC_TAPS ; ++k ) {
+         p = p > 0 ? p -1 : PIDEC_TAPS -1 ;
+         out += d->f->h[k] * v->line[p] ;
+      }
+      val[i] = out ;
+   }
+   return 1 ;
+}
+
+/* ex: set sw=3 sta et : */
@@ -0,0 +1,421 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Threshold rules and events...
+ *   Rules from the .conf file (see Thresholds( ) in init_final.lua)
+ *   are checked by the sampling loop on every sample of their sensor,
+ *   so an event is raised one sample period after the limit is
+ *   crossed however seldom the application looks.  Events are
+ *   queued for the application, which is woken through an eventfd.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+/* Rule states */
+#define PIRULE_IDLE 0
+#define PIRULE_PENDING 1  /* Past the limit, not for long enough yet */
+#define PIRULE_RAISED 2  /* Event raised, waiting to get back past clear */
+
+struct pi_rule {
+   char  name[PIEVT_NAMELEN] ;
+   int  sensor ;  /* Plan index */
+   int  value ;  /* Index of the sample value checked (0 .. 2) */
+   int  below ;  /* Raised below the limit instead of above */
+   double  limit ;
+   double  clear ;  /* Cleared back past this (hysteresis) */
+   int64_t  hold ;  /* Time past the limit before raising (nsec) */
+   int  next ;  /* Next rule of the same sensor, -1 if none */
+   /* Belongs to the loop sampling the sensor */
+   int  state ;  /* PIRULE_XXX */
+   int64_t  since ;  /* First sample past the limit */
+   double  peak ;  /* Most extreme value since */
+} ;
+
+static struct pi_rule  rules[PIEVT_MAXRULES] ;
+static int  nrules ;
+static int  first[PIACQ_MAXSENSORS] ;  /* First rule of each sensor +1, 0 if none */
+
+/* The event queue.  Pushed by the sampling loops (one per bus, see
+ *    pilib_stream.c), popped by the application.  Same scheme as the
+ *    marker queue in pilib_mark.c: pushing never blocks, events are
+ *    dropped and counted when it is full.  Every event pushed is also
+ *    added to the eventfd, so applications can poll( ) for them.
+ */
+#define PIEVT_QUEUE 256  /* Power of 2 */
+struct pi_evslot {
+   unsigned long  seq ;
+   struct pi_event  ev ;
+} ;
+
+static struct {
+   unsigned long  head ;
+   unsigned long  tail ;
+   unsigned long  dropped ;
+   struct pi_evslot  slot[PIEVT_QUEUE] ;
+} evq ;
+
+static int  evfd = -1 ;
+static pthread_once_t  evonce = PTHREAD_ONCE_INIT ;
+static pthread_mutex_t  evlock = PTHREAD_MUTEX_INITIALIZER ;  /* Consumers */
+
+/* Called from the sampling loops as events happen, see pi_event_callback */
+static void (* evcall)( const struct pi_event *, void * ) = NULL ;
+static void *  evarg = NULL ;
+
+static void evq_init( void )
+{
+   unsigned long  i ;
+
+   for( i = 0 ; i < PIEVT_QUEUE ; ++i ) {
+      evq.slot[i].seq = i ;
+   }
+   evfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+   if( evfd < 0 && verbose >= 0 ) {
+      fprintf( stderr, "%s: eventfd: %s\n", ARGV0, strerror( errno ) );
+   }
+}
+
+static void evq_push( const struct pi_event * ev )
+{
+   struct pi_evslot *  s ;
+   unsigned long  pos ;
+   uint64_t  one = 1 ;
+   long  diff ;
+
+   pos = __atomic_load_n( &evq.head, __ATOMIC_RELAXED );
+   while( 1 ) {
+      s = evq.slot + (pos & (PIEVT_QUEUE-1)) ;
+      diff = (long) __atomic_load_n( &s->seq, __ATOMIC_ACQUIRE ) - (long) pos ;
+      if( diff == 0 ) {
+         if( __atomic_compare_exchange_n( &evq.head, &pos, pos +1, 1,
+               __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+            break ;
+         }
+      } else if( diff < 0 ) {
+         __atomic_add_fetch( &evq.dropped, 1, __ATOMIC_RELAXED );
+         return ;
+      } else {
+         pos = __atomic_load_n( &evq.head, __ATOMIC_RELAXED );
+      }
+   }
+
+   s->ev = *ev ;
+   __atomic_store_n( &s->seq, pos +1, __ATOMIC_RELEASE );
+   if( evfd >= 0 && write( evfd, &one, sizeof(one) ) < 0 ) {
+      /* Counter full, it is readable anyway */
+   }
+}
+
+static int evq_pop( struct pi_event * out )
+{
+   struct pi_evslot *  s = evq.slot + (evq.tail & (PIEVT_QUEUE-1)) ;
+
+   if( __atomic_load_n( &s->seq, __ATOMIC_ACQUIRE ) != evq.tail +1 ) {
+      return -1 ;
+   }
+   *out = s->ev ;
+   __atomic_store_n( &s->seq, evq.tail + PIEVT_QUEUE, __ATOMIC_RELEASE );
+   ++evq.tail ;
+   return 0 ;
+}
+
+/* pi_event_reset( ) -- Drop every rule, the plan is being rebuilt */
+void pi_event_reset( void )
+{
+   nrules = 0 ;
+   memset( first, 0, sizeof(first) );
+}
+
+/* pi_event_arm( ) -- Start every rule from scratch, a new stream starts */
+void pi_event_arm( void )
+{
+   int  i ;
+
+   pthread_once( &evonce, evq_init );
+   for( i = 0 ; i < nrules ; ++i ) {
+      rules[i].state = PIRULE_IDLE ;
+   }
+}
+
+static void rule_event( struct pi_rule * r, int raised, int64_t t, double v )
+{
+   struct pi_event  ev ;
+   void (* call)( const struct pi_event *, void * ) ;
+
+   memcpy( ev.name, r->name, PIEVT_NAMELEN );
+   ev.rule = r - rules ;
+   ev.sensor = r->sensor ;
+   ev.raised = raised ;
+   ev.t = t ;
+   ev.start = r->since ;
+   ev.value = v ;
+   ev.peak = r->peak ;
+
+   pthread_once( &evonce, evq_init );
+   call = __atomic_load_n( &evcall, __ATOMIC_ACQUIRE );
+   if( call != NULL ) {
+      call( &ev, evarg );
+   }
+   evq_push( &ev );
+   if( raised ) {
+      pi_capture_rule( r->name );
+   }
+}
+
+/* pi_event_sample( sensor, t, val, n ) -- Check the rules of a sensor
+ * @sensor -- plan index
+ * @t -- time of the sample (monotime_ns)
+ * @val -- the n values of the sample
+ *
+ * Called by the loop sampling the sensor, right after each sample.
+ *    A rule is raised once its value has been past the limit for
+ *    hold, and cleared when it gets back past clear.
+ */
+void pi_event_sample( int sensor, int64_t t, const double * val, int n )
+{
+   struct pi_rule *  r ;
+   double  v ;
+   int  over, back ;
+   int  i ;
+
+   for( i = first[sensor] -1 ; i >= 0 ; i = r->next ) {
+      r = rules + i ;
+      if( r->value >= n || isnan( val[r->value] ) ) {
+         continue ;
+      }
+      v = val[r->value] ;
+      over = r->below ? v < r->limit : v > r->limit ;
+      back = r->below ? v >= r->clear : v <= r->clear ;
+
+      switch( r->state ) {
+      case PIRULE_IDLE :
+         if( ! over ) {
+            break ;
+         }
+         r->state = PIRULE_PENDING ;
+         r->since = t ;
+         r->peak = v ;
+         /* fallthrough */
+      case PIRULE_PENDING :
+         if( ! over ) {
+            r->state = PIRULE_IDLE ;
+            break ;
+         }
+         if( r->below ? v < r->peak : v > r->peak ) {
+            r->peak = v ;
+         }
+         if( t - r->since >= r->hold ) {
+            r->state = PIRULE_RAISED ;
+            rule_event( r, 1, t, v );
+         }
+         break ;
+      case PIRULE_RAISED :
+         if( r->below ? v < r->peak : v > r->peak ) {
+            r->peak = v ;
+         }
+         if( back ) {
+            r->state = PIRULE_IDLE ;
+            rule_event( r, 0, t, v );
+         }
+         break ;
+      }
+   }
+}
+
+/* pi_event_next( ev ) -- Pop the next event
+ * -----
+ * @ret -- 0 if ev was filled, -1 if there are no events
+ *
+ * The eventfd is cleared before saying there are none, so a poll( )
+ *    on it afterwards wakes up for the next one.
+ */
+int pi_event_next( struct pi_event * ev )
+{
+   uint64_t  count ;
+   int  ret ;
+
+   pthread_once( &evonce, evq_init );
+   pthread_mutex_lock( &evlock );
+   ret = evq_pop( ev );
+   if( ret < 0 && evfd >= 0 && read( evfd, &count, sizeof(count) ) > 0 ) {
+      /* Pushed since the pop? */
+      ret = evq_pop( ev );
+   }
+   pthread_mutex_unlock( &evlock );
+
+   return ret ;
+}
+
+/* pi_event_fd( ) -- Readable while events are pending */
+int pi_event_fd( void )
+{
+   pthread_once( &evonce, evq_init );
+   return evfd ;
+}
+
+/* pi_event_callback( fn, arg ) -- Call fn( ev, arg ) for every event
+ *
+ * fn is called from the sampling loop the moment the event happens,
+ *    before it is queued, so it must be quick and must not block.
+ *    NULL to stop.
+ */
+void pi_event_callback( void (* fn)( const struct pi_event *, void * ), void * arg )
+{
+   __atomic_store_n( &evcall, NULL, __ATOMIC_RELEASE );
+   evarg = arg ;
+   __atomic_store_n( &evcall, fn, __ATOMIC_RELEASE );
+}
+
+/* pi_event_report( out ) -- Print pending events, one line each */
+void pi_event_report( FILE * out )
+{
+   struct pi_event  ev ;
+   char  when[PIWALL_LEN] ;
+
+   while( pi_event_next( &ev ) == 0 ) {
+      fprintf( out, "# %s %s %-7s %-10s %8.3f peak %8.3f after %.6f sec\n",
+            wall_format( when, sizeof(when), mono2wall_ns( ev.t ) ), ev.name, ev.raised ? "raised" : "cleared",
+            piplan.sensor[ev.sensor].name, ev.value, ev.peak,
+            (ev.t - ev.start) / 1000000000.0 );
+   }
+   if( evq.dropped && verbose >= 0 ) {
+      fprintf( out, "# Events: %lu dropped (queue full)\n", evq.dropped );
+      evq.dropped = 0 ;
+   }
+}
+
+/* pi_event_rule( desc ) -- Add a threshold rule to the plan
+ * @desc -- table describing the rule (built by pi.compile)
+ *      sensor -- plan index of the sensor
+ *      name -- name of the rule, for events
+ *      value -- index of the sample value checked (default 1)
+ *      above, below -- the limit, one or the other
+ *      clear -- cleared back past this (default: the limit)
+ *      hold -- seconds past the limit before raising (default 0)
+ * -----
+ * @index -- rule index
+ */
+int pi_event_rule(lua_State * L)
+{
+   struct pi_rule *  r ;
+   int  i ;
+
+   luaL_checktype( L, 1, LUA_TTABLE );
+   if( nrules >= PIEVT_MAXRULES ) {
+      return luaL_error( L, "event_rule: too many rules (%d)", PIEVT_MAXRULES );
+   }
+   r = rules + nrules ;
+   memset( r, 0, sizeof(*r) );
+
+   lua_getfield( L, 1, "sensor" );
+   r->sensor = luaL_checkint( L, -1 );
+   luaL_argcheck( L, r->sensor >= 0 && r->sensor < piplan.nsensors, 1, "no such sensor" );
+   lua_getfield( L, 1, "name" );
+   strncpy( r->name, luaL_optstring( L, -1, piplan.sensor[r->sensor].name ), PIEVT_NAMELEN -1 );
+   lua_getfield( L, 1, "value" );
+   r->value = luaL_optint( L, -1, 1 ) -1 ;
+   luaL_argcheck( L, r->value >= 0 && r->value < 3, 1, "value must be 1 to 3" );
+   lua_getfield( L, 1, "above" );
+   lua_getfield( L, 1, "below" );
+   if( lua_isnumber( L, -2 ) ) {
+      r->limit = lua_tonumber( L, -2 );
+   } else if( lua_isnumber( L, -1 ) ) {
+      r->limit = lua_tonumber( L, -1 );
+      r->below = 1 ;
+   } else {
+      return luaL_argerror( L, 1, "needs a number 'above' or 'below'" );
+   }
+   lua_getfield( L, 1, "clear" );
+   r->clear = luaL_optnumber( L, -1, r->limit );
+   if( r->below ? r->clear < r->limit : r->clear > r->limit ) {
+      return luaL_argerror( L, 1, "'clear' is on the wrong side of the limit" );
+   }
+   lua_getfield( L, 1, "hold" );
+   r->hold = (int64_t)(luaL_optnumber( L, -1, 0.0 ) * 1000000000.0) ;
+   lua_pop( L, 7 );
+
+   /* Chain it to its sensor, in order */
+   r->next = -1 ;
+   if( first[r->sensor] == 0 ) {
+      first[r->sensor] = nrules +1 ;
+   } else {
+      for( i = first[r->sensor] -1 ; rules[i].next >= 0 ; i = rules[i].next )
+         ;
+      rules[i].next = nrules ;
+   }
+
+   lua_pushinteger( L, nrules++ );
+   return 1 ;
+}
+
+/* pi_events( [timeout] ) -- Pending events, oldest first
+ * @timeout -- seconds to wait for one if there are none (default 0)
+ * -----
+ * @events -- list of { name=, rule=index, sensor=name, raised=bool,
+ *      t=ns, start=ns, value=, peak= }.  t is the sample that raised or
+ *      cleared the event, start the first one past the limit.
+ */
+int pi_events(lua_State * L)
+{
+   lua_Number  timeout = luaL_optnumber( L, 1, 0.0 );
+   struct pi_event  ev ;
+   struct pollfd  pfd ;
+   int  k = 0 ;
+
+   lua_newtable( L );
+   while( 1 ) {
+      if( pi_event_next( &ev ) < 0 ) {
+         if( k > 0 || timeout <= 0 ) {
+            break ;
+         }
+         /* None yet, wait once */
+         pfd.fd = pi_event_fd( );
+         pfd.events = POLLIN ;
+         if( pfd.fd < 0 || poll( &pfd, 1, (int)(timeout * 1000) ) <= 0 ) {
+            break ;
+         }
+         timeout = 0 ;
+         continue ;
+      }
+      lua_createtable( L, 0, 8 );
+      lua_pushstring( L, ev.name );
+      lua_setfield( L, -2, "name" );
+      lua_pushinteger( L, ev.rule );
+      lua_setfield( L, -2, "rule" );
+      lua_pushstring( L, piplan.sensor[ev.sensor].name );
+      lua_setfield( L, -2, "sensor" );
+      lua_pushboolean( L, ev.raised );
+      lua_setfield( L, -2, "raised" );
+      lua_pushnumber( L, ev.t );
+      lua_setfield( L, -2, "t" );
+      lua_pushnumber( L, ev.start );
+      lua_setfield( L, -2, "start" );
+      lua_pushnumber( L, ev.value );
+      lua_setfield( L, -2, "value" );
+      lua_pushnumber( L, ev.peak );
+      lua_setfield( L, -2, "peak" );
+      lua_rawseti( L, -2, ++k );
+   }
+
+   return 1 ;
+}
+
+/* ex: set sw=3 sta et : */
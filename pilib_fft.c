@@ -0,0 +1,428 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Spectra...
+ *   A window of n samples of a sensor is taken back to back (see
+ *   pi_acq_burst) and run through a radix-2 FFT, giving its magnitude
+ *   spectrum and dominant frequencies: VRM ripple or load oscillation
+ *   in the current channels.  The plan (twiddles, bit reversal and
+ *   window) and the buffers are kept from one window to the next and
+ *   only rebuilt when n or the window changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PIFFT_MINSIZE 8
+#define PIFFT_MAXSIZE 65536
+#define PIFFT_MAXPEAKS 32
+
+static const char * const  windowNames[] = { "rect", "hann", "hamming", "blackman", NULL } ;
+
+/* The plan, reused while n and window stay the same */
+static struct pi_fft  plan ;
+
+/* Buffers of spectrum( ), grown as needed */
+static struct {
+   int  size ;
+   double *  val ;  /* [3 * size] pi_acq_burst( ) samples */
+   int64_t *  t ;  /* [size] */
+   double *  u ;  /* [size] the value analyzed, as sampled */
+   double *  x ;  /* [size] same, on a uniform grid */
+   double *  mag ;  /* [size/2 +1] */
+} buf ;
+
+/* pi_fft_plan( n, window ) -- The plan for n points, n a power of 2
+ * @window -- PIFFT_RECT, PIFFT_HANN, PIFFT_HAMMING or PIFFT_BLACKMAN
+ * -----
+ * @ret -- the plan, NULL if out of memory
+ */
+const struct pi_fft * pi_fft_plan( int n, int window )
+{
+   double  a ;
+   int  i, b ;
+
+   if( plan.n != n ) {
+      free( plan.cosw );
+      free( plan.sinw );
+      free( plan.rev );
+      free( plan.win );
+      free( plan.re );
+      free( plan.im );
+      memset( &plan, 0, sizeof(plan) );
+      plan.cosw = malloc( n / 2 * sizeof(*plan.cosw) );
+      plan.sinw = malloc( n / 2 * sizeof(*plan.sinw) );
+      plan.rev = malloc( n * sizeof(*plan.rev) );
+      plan.win = malloc( n * sizeof(*plan.win) );
+      plan.re = malloc( n * sizeof(*plan.re) );
+      plan.im = malloc( n * sizeof(*plan.im) );
+      if( plan.cosw == NULL || plan.sinw == NULL || plan.rev == NULL ||
+            plan.win == NULL || plan.re == NULL || plan.im == NULL ) {
+         return NULL ;
+      }
+
+      for( plan.bits = 0 ; (1 << plan.bits) < n ; ++plan.bits ) ;
+      for( i = 0 ; i < n / 2 ; ++i ) {
+         plan.cosw[i] = cos( 2 * M_PI * i / n );
+         plan.sinw[i] = -sin( 2 * M_PI * i / n );
+      }
+      for( i = 0 ; i < n ; ++i ) {
+         plan.rev[i] = 0 ;
+         for( b = 0 ; b < plan.bits ; ++b ) {
+            plan.rev[i] |= ((i >> b) & 1) << (plan.bits -1 - b) ;
+         }
+      }
+      plan.n = n ;
+      plan.window = -1 ;
+   }
+
+   /* Periodic windows (over n, not n-1), for spectral analysis */
+   if( plan.window != window ) {
+      plan.gain = 0 ;
+      for( i = 0 ; i < n ; ++i ) {
+         a = 2 * M_PI * i / n ;
+         switch( window ) {
+         case PIFFT_HANN : plan.win[i] = 0.5 - 0.5 * cos( a ); break ;
+         case PIFFT_HAMMING : plan.win[i] = 0.54 - 0.46 * cos( a ); break ;
+         case PIFFT_BLACKMAN : plan.win[i] = 0.42 - 0.5 * cos( a ) + 0.08 * cos( 2 * a ); break ;
+         default : plan.win[i] = 1.0 ; break ;
+         }
+         plan.gain += plan.win[i] ;
+      }
+      plan.window = window ;
+   }
+
+   return &plan ;
+}
+
+/* pi_fft_power( f, x, pw ) -- Add the squared amplitude spectrum of
+ *    x[0 .. n-1] to pw[0 .. n/2], windowed and scaled so a sine of
+ *    amplitude A in a bin gives A*A
+ */
+void pi_fft_power( const struct pi_fft * f, const double * x, double * pw )
+{
+   double *  re = f->re ;
+   double *  im = f->im ;
+   double  tr, ti, a ;
+   int  n = f->n ;
+   int  half, step, i, j, k ;
+
+   for( i = 0 ; i < n ; ++i ) {
+      re[f->rev[i]] = x[i] * f->win[i] ;
+      im[f->rev[i]] = 0.0 ;
+   }
+   for( half = 1, step = n / 2 ; half < n ; half *= 2, step /= 2 ) {
+      for( i = 0 ; i < n ; i += 2 * half ) {
+         for( j = 0, k = 0 ; j < half ; ++j, k += step ) {
+            tr = re[i+j+half] * f->cosw[k] - im[i+j+half] * f->sinw[k] ;
+            ti = re[i+j+half] * f->sinw[k] + im[i+j+half] * f->cosw[k] ;
+            re[i+j+half] = re[i+j] - tr ;
+            im[i+j+half] = im[i+j] - ti ;
+            re[i+j] += tr ;
+            im[i+j] += ti ;
+         }
+      }
+   }
+
+   /* Single-sided: bins 1 .. n/2-1 also have the negative frequencies */
+   for( i = 0 ; i <= n / 2 ; ++i ) {
+      a = (i == 0 || i == n / 2 ? 1.0 : 2.0) / f->gain ;
+      pw[i] += a * a * (re[i] * re[i] + im[i] * im[i]) ;
+   }
+}
+
+/* pi_fft_peaks( mag, nbins, df, max, freq, amp ) -- Dominant frequencies
+ * @mag -- magnitude spectrum, mag[0] (DC) is not a peak
+ * @df -- frequency step of the bins (Hz)
+ * @max -- peaks wanted
+ * @freq, @amp -- filled with the peaks, largest first.  The frequency
+ *    is interpolated between bins (parabola through the 3 bins)
+ * -----
+ * @ret -- number of peaks found
+ */
+int pi_fft_peaks( const double * mag, int nbins, double df, int max,
+      double * freq, double * amp )
+{
+   double  d, den ;
+   int  npeaks = 0 ;
+   int  i, j ;
+
+   for( i = 1 ; i < nbins -1 ; ++i ) {
+      if( mag[i] <= mag[i-1] || mag[i] < mag[i+1] ) {
+         continue ;
+      }
+      for( j = npeaks ; j > 0 && amp[j-1] < mag[i] ; --j ) {
+         if( j < max ) {
+            freq[j] = freq[j-1] ;
+            amp[j] = amp[j-1] ;
+         }
+      }
+      if( j < max ) {
+         den = mag[i-1] - 2 * mag[i] + mag[i+1] ;
+         d = den != 0 ? 0.5 * (mag[i-1] - mag[i+1]) / den : 0.0 ;
+         freq[j] = (i + d) * df ;
+         amp[j] = mag[i] ;
+         if( npeaks < max ) {
+            ++npeaks ;
+         }
+      }
+   }
+   return npeaks ;
+}
+
+/* Interpolate u[0 .. n-1] sampled at t onto n evenly spaced points
+ *    from t[0] to t[n-1] in x.  Within an ADS8344 burst conversions
+ *    are evenly spaced, between bursts there is the gap of a new SPI
+ *    message, which the FFT would see as a line at the burst rate.
+ */
+static void resample( const int64_t * t, const double * u, double * x, int n )
+{
+   double  step = (double)(t[n-1] - t[0]) / (n -1) ;
+   double  at ;
+   int  i, j ;
+
+   x[0] = u[0] ;
+   for( i = 1, j = 0 ; i < n ; ++i ) {
+      at = t[0] + i * step ;
+      while( j < n -2 && t[j+1] < at ) {
+         ++j ;
+      }
+      x[i] = t[j+1] > t[j] ?
+            u[j] + (u[j+1] - u[j]) * (at - t[j]) / (t[j+1] - t[j]) : u[j+1] ;
+   }
+}
+
+/* Take average windows of n samples of plan sensor idx and leave the
+ *    magnitude spectrum of its current (the value of other sensors) in
+ *    buf.mag.  Each window is resampled to its average rate (see
+ *    resample( )).
+ */
+static int spectrum( lua_State * L, int idx, int n, int window, int average,
+      double * rate, double * mean )
+{
+   struct pi_sensor *  s = piplan.sensor + idx ;
+   const struct pi_fft *  f ;
+   int64_t  span = 0 ;
+   double  sum = 0 ;
+   double  m ;
+   int  nval, v ;
+   int  w, i ;
+
+   if( buf.size < n ) {
+      free( buf.val );
+      free( buf.t );
+      free( buf.u );
+      free( buf.x );
+      free( buf.mag );
+      buf.val = malloc( 3 * n * sizeof(*buf.val) );
+      buf.t = malloc( n * sizeof(*buf.t) );
+      buf.u = malloc( n * sizeof(*buf.u) );
+      buf.x = malloc( n * sizeof(*buf.x) );
+      buf.mag = malloc( (n / 2 +1) * sizeof(*buf.mag) );
+      buf.size = buf.val && buf.t && buf.u && buf.x && buf.mag ? n : 0 ;
+      if( buf.size == 0 ) {
+         return luaL_error( L, "spectrum: out of memory" );
+      }
+   }
+   f = pi_fft_plan( n, window );
+   if( f == NULL ) {
+      return luaL_error( L, "spectrum: out of memory" );
+   }
+
+   if( s->vcc >= 0 ) {
+      pi_acq_refresh( L, s->vcc );
+   }
+   if( s->cj >= 0 ) {
+      pi_acq_refresh( L, s->cj );
+   }
+
+   memset( buf.mag, 0, (n / 2 +1) * sizeof(*buf.mag) );
+   for( w = 0 ; w < average ; ++w ) {
+      nval = pi_acq_burst( L, idx, n, buf.val, buf.t );
+      if( nval < 0 ) {
+         return luaL_error( L, "spectrum: sampling %s failed", s->name );
+      }
+      v = nval == 3 ? 2 : 0 ;  /* Amps of a power sensor */
+      for( i = 0 ; i < n ; ++i ) {
+         buf.u[i] = buf.val[3*i + v] ;
+      }
+      resample( buf.t, buf.u, buf.x, n );
+      for( m = 0, i = 0 ; i < n ; ++i ) {
+         m += buf.x[i] ;
+      }
+      m /= n ;
+      for( i = 0 ; i < n ; ++i ) {
+         buf.x[i] -= m ;
+      }
+      pi_fft_power( f, buf.x, buf.mag );
+      sum += m ;
+      span += buf.t[n-1] - buf.t[0] ;
+   }
+   for( i = 0 ; i <= n / 2 ; ++i ) {
+      buf.mag[i] = sqrt( buf.mag[i] / average );
+   }
+   pi_acq_push( L );
+
+   *rate = span > 0 ? 1e9 * (n -1) * average / span : 0.0 ;
+   *mean = sum / average ;
+   return 0 ;
+}
+
+/* pi.compile( name ... ) the sensors from argument first, returns the
+ *    number selected
+ */
+static int spectrum_compile( lua_State * L, int first )
+{
+   int  nargs = lua_gettop( L );
+   int  nsel ;
+   int  i ;
+
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "compile" );
+   for( i = first ; i <= nargs ; ++i ) {
+      lua_pushvalue( L, i );
+   }
+   lua_call( L, nargs >= first ? nargs - first +1 : 0, 1 );
+   nsel = lua_tointeger( L, -1 );
+   lua_settop( L, nargs );
+   return nsel ;
+}
+
+static int check_size( lua_State * L, int arg )
+{
+   int  n = luaL_checkint( L, arg );
+
+   luaL_argcheck( L, n >= PIFFT_MINSIZE && n <= PIFFT_MAXSIZE && (n & (n -1)) == 0,
+         arg, "size must be a power of 2 from 8 to 65536" );
+   return n ;
+}
+
+/* pi_spectrum( name, n, [window], [average], [peaks] ) -- Spectrum of
+ *    a sensor's current (the value of sensors other than power)
+ * @n -- samples per window, a power of 2
+ * @window -- "hann" (default), "hamming", "blackman" or "rect"
+ * @average -- windows taken and averaged (default 1)
+ * @peaks -- dominant frequencies wanted (default 5)
+ * -----
+ * @spectrum -- { rate=, df=, mean=, mag={ }, peaks={ { freq=, mag= } } }
+ *    with the amplitude of bins 0 Hz, df Hz ... rate/2 in mag[1] ...
+ *    mag[n/2+1], DC removed (it is mean), and the peaks largest first
+ */
+int pi_spectrum(lua_State * L)
+{
+   const char *  name = luaL_checkstring( L, 1 );
+   int  n = check_size( L, 2 );
+   int  window = luaL_checkoption( L, 3, "hann", windowNames );
+   int  average = luaL_optint( L, 4, 1 );
+   int  npeaks = luaL_optint( L, 5, 5 );
+   double  freq[PIFFT_MAXPEAKS], amp[PIFFT_MAXPEAKS] ;
+   double  rate, mean ;
+   int  idx ;
+   int  i ;
+
+   luaL_argcheck( L, average >= 1, 4, "average must be >= 1" );
+   luaL_argcheck( L, npeaks >= 0 && npeaks <= PIFFT_MAXPEAKS, 5, "at most 32 peaks" );
+   if( stream_running( ) ) {
+      return luaL_error( L, "spectrum: streaming in the background" );
+   }
+
+   lua_settop( L, 1 );
+   spectrum_compile( L, 1 );
+   for( idx = 0 ; idx < piplan.nsensors ; ++idx ) {
+      if( strcmp( piplan.sensor[idx].name, name ) == 0 ) {
+         break ;
+      }
+   }
+   if( idx >= piplan.nsensors ) {
+      return luaL_error( L, "spectrum: sensor %s not found", name );
+   }
+   spectrum( L, idx, n, window, average, &rate, &mean );
+
+   lua_newtable( L );
+   lua_pushnumber( L, rate );
+   lua_setfield( L, -2, "rate" );
+   lua_pushnumber( L, rate / n );
+   lua_setfield( L, -2, "df" );
+   lua_pushnumber( L, mean );
+   lua_setfield( L, -2, "mean" );
+   lua_createtable( L, n / 2 +1, 0 );
+   for( i = 0 ; i <= n / 2 ; ++i ) {
+      lua_pushnumber( L, buf.mag[i] );
+      lua_rawseti( L, -2, i +1 );
+   }
+   lua_setfield( L, -2, "mag" );
+   npeaks = pi_fft_peaks( buf.mag, n / 2 +1, rate / n, npeaks, freq, amp );
+   lua_createtable( L, npeaks, 0 );
+   for( i = 0 ; i < npeaks ; ++i ) {
+      lua_createtable( L, 0, 2 );
+      lua_pushnumber( L, freq[i] );
+      lua_setfield( L, -2, "freq" );
+      lua_pushnumber( L, amp[i] );
+      lua_setfield( L, -2, "mag" );
+      lua_rawseti( L, -2, i +1 );
+   }
+   lua_setfield( L, -2, "peaks" );
+
+   return 1 ;
+}
+
+/* pi_spectrum_report( n, [window], [average], [name ...] ) -- Print
+ *    the dominant frequencies of each sensor (powerInsight --spectrum),
+ *    and with -v every bin
+ * @name -- sensors (default: same as App)
+ */
+int pi_spectrum_report(lua_State * L)
+{
+   int  n = check_size( L, 1 );
+   int  window = luaL_checkoption( L, 2, "hann", windowNames );
+   int  average = luaL_optint( L, 3, 1 );
+   double  freq[5], amp[5] ;
+   double  rate, mean ;
+   int  npeaks ;
+   int  idx ;
+   int  i ;
+
+   luaL_argcheck( L, average >= 1, 3, "average must be >= 1" );
+   if( stream_running( ) ) {
+      return luaL_error( L, "spectrum: streaming in the background" );
+   }
+   if( spectrum_compile( L, 4 ) < 1 ) {
+      return luaL_error( L, "spectrum: no sensors selected" );
+   }
+
+   for( idx = 0 ; idx < piplan.nsensors ; ++idx ) {
+      if( ! piplan.sensor[idx].emit ) {
+         continue ;
+      }
+      spectrum( L, idx, n, window, average, &rate, &mean );
+      printf( "# %s: %d samples at %.1f/sec, %.3f Hz bins, %s x%d, mean %.4f\n",
+            piplan.sensor[idx].name, n, rate, rate / n, windowNames[window],
+            average, mean );
+      npeaks = pi_fft_peaks( buf.mag, n / 2 +1, rate / n, 5, freq, amp );
+      for( i = 0 ; i < npeaks ; ++i ) {
+         printf( "#   peak %d  %10.2f Hz  %10.6f\n", i +1, freq[i], amp[i] );
+      }
+      if( verbose >= 1 ) {
+         for( i = 0 ; i <= n / 2 ; ++i ) {
+            printf( "%s %.3f %.6f\n", piplan.sensor[idx].name, i * rate / n, buf.mag[i] );
+         }
+      }
+   }
+   fflush( stdout );
+
+   return 0 ;
+}
+
+/* ex: set sw=3 sta et : */
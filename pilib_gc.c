@@ -0,0 +1,229 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Garbage collector pacing...
+ *   Lua's incremental collector runs whenever allocations cross its
+ *   threshold, which can be in the middle of a scan, between the volt
+ *   and amp conversions of a power sensor.  With the "paced" policy
+ *   (pi.gcpolicy( ), pidev_setup_gc( )) automatic collection is
+ *   stopped while acquiring (pi_gc_begin) and the sampling loops run
+ *   bounded LUA_GCSTEP slices in the idle time before their next
+ *   deadline (pi_gc_idle).  A step is only started when the worst
+ *   step so far still fits, so it doesn't make the scan late.  When a
+ *   loop has no idle time and the state has grown PIGC_SLACK since
+ *   its last full collection, it takes a step anyway.
+ *
+ * Only the thread running the Lua state calls these.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PIGC_SLACK 1024  /* KB of growth that forces a step */
+
+static const char * const  policyNames[] = { "auto", "paced", NULL } ;
+
+static int  paced ;  /* Policy, 0 auto, 1 paced */
+static int  stepkb ;  /* LUA_GCSTEP argument, 0 for one basic step */
+static int  stopped ;  /* Collector stopped by pi_gc_begin( ) */
+static int  basekb ;  /* Size after the last full collection */
+static int  incycle ;  /* A collection is under way */
+static double  worststep ;  /* Longest step (sec) */
+static struct pi_gcstats  stats ;
+
+/* pi_gc_policy( pace, kb ) -- Pace the collector (1) or leave it to
+ *    Lua (0, the default), kb as LUA_GCSTEP's argument for each step
+ */
+void pi_gc_policy( int pace, int kb )
+{
+   paced = pace ;
+   stepkb = kb > 0 ? kb : 0 ;
+}
+
+/* pi_gc_begin( L ) -- Acquisition starts, stop automatic collection
+ *    if paced
+ */
+void pi_gc_begin( lua_State * L )
+{
+   if( paced && ! stopped ) {
+      lua_gc( L, LUA_GCSTOP, 0 );
+      basekb = lua_gc( L, LUA_GCCOUNT, 0 );
+      incycle = 0 ;
+      stopped = 1 ;
+   }
+}
+
+/* pi_gc_end( L ) -- Acquisition ended, back to automatic collection */
+void pi_gc_end( lua_State * L )
+{
+   if( stopped ) {
+      lua_gc( L, LUA_GCRESTART, 0 );
+      stopped = 0 ;
+   }
+}
+
+/* pi_gc_idle( L, budget ) -- Collect for up to budget seconds of idle
+ *    time, if paced and acquiring
+ * -----
+ * @ret -- seconds spent collecting
+ */
+double pi_gc_idle( lua_State * L, double budget )
+{
+   double  start, end, t, took ;
+   int  steps = 0 ;
+   int  finished = 0 ;
+   int  kb ;
+
+   if( ! stopped ) {
+      return 0.0 ;
+   }
+
+   start = t = pi_monotonic( );
+   end = start + budget ;
+   kb = lua_gc( L, LUA_GCCOUNT, 0 );
+
+   /* A collection starts once the state grew by half since the last
+    *    one (Lua's default pause is to double), and there's nothing
+    *    more to do once it finishes
+    */
+   if( ! incycle && kb - basekb < basekb / 2 ) {
+      finished = 1 ;
+   }
+   while( ! finished && (t + worststep < end
+         || (steps == 0 && kb - basekb > PIGC_SLACK)) ) {
+      ++steps ;
+      incycle = 1 ;
+      if( lua_gc( L, LUA_GCSTEP, stepkb ) ) {
+         ++stats.collections ;
+         basekb = lua_gc( L, LUA_GCCOUNT, 0 );
+         incycle = 0 ;
+         finished = 1 ;
+      }
+      took = pi_monotonic( ) - t ;
+      t += took ;
+      if( took > worststep ) {
+         worststep = took ;
+      }
+   }
+   if( steps > 0 ) {
+      /* In Lua 5.1 a step restarts the collector */
+      lua_gc( L, LUA_GCSTOP, 0 );
+   }
+
+   took = t - start ;
+   ++stats.cycles ;
+   stats.steps += steps ;
+   stats.total += took ;
+   if( took > stats.worst ) {
+      stats.worst = took ;
+   }
+   return took ;
+}
+
+/* pi_gc_get( st, reset ) -- Copy the GC metrics, and clear them */
+void pi_gc_get( struct pi_gcstats * st, int reset )
+{
+   *st = stats ;
+   if( reset ) {
+      memset( &stats, 0, sizeof(stats) );
+   }
+}
+
+/* pi_gc_report( out ) -- One line of GC metrics, if paced */
+void pi_gc_report( FILE * out )
+{
+   if( ! paced || stats.cycles == 0 ) {
+      return ;
+   }
+   fprintf( out, "# GC: %lu cycles, %lu steps, %lu collections, %.6f sec,"
+         " %.1fus per cycle, worst %.1fus\n",
+         stats.cycles, stats.steps, stats.collections, stats.total,
+         stats.total / stats.cycles * 1e6, stats.worst * 1e6 );
+}
+
+/* pi_gcpolicy( [policy], [kb] ) -- Garbage collector policy
+ * @policy -- "auto" (Lua's) or "paced" (see above), default: leave it
+ * @kb -- LUA_GCSTEP argument for each step (default: 0, one basic step)
+ * -----
+ * @policy -- the policy before
+ */
+int pi_gcpolicy(lua_State * L)
+{
+   int  was = paced ;
+
+   if( ! lua_isnoneornil( L, 1 ) ) {
+      pi_gc_policy( luaL_checkoption( L, 1, NULL, policyNames ), luaL_optint( L, 2, 0 ) );
+   }
+   lua_pushstring( L, policyNames[was] );
+   return 1 ;
+}
+
+/* pi_gcidle( [budget] ) -- pi_gc_idle( ) for loops in Lua
+ * @budget -- idle seconds until the next deadline (default: 0)
+ * -----
+ * @took -- seconds spent collecting
+ */
+int pi_gcidle(lua_State * L)
+{
+   lua_pushnumber( L, pi_gc_idle( L, luaL_optnumber( L, 1, 0.0 ) ) );
+   return 1 ;
+}
+
+/* pi_gcpace( on ) -- pi_gc_begin( ) (true) or pi_gc_end( ) (false) */
+int pi_gcpace(lua_State * L)
+{
+   if( lua_toboolean( L, 1 ) ) {
+      pi_gc_begin( L );
+   } else {
+      pi_gc_end( L );
+   }
+   return 0 ;
+}
+
+/* pi_gcstats( [reset] ) -- GC metrics of the paced policy
+ * @reset -- true to clear them after reading
+ * -----
+ * @stats -- { cycles=, steps=, collections=, total=, mean=, worst= },
+ *    times in seconds, mean and worst per idle cycle
+ */
+int pi_gcstats(lua_State * L)
+{
+   struct pi_gcstats  st ;
+
+   pi_gc_get( &st, lua_toboolean( L, 1 ) );
+   lua_newtable( L );
+   lua_pushnumber( L, st.cycles );
+   lua_setfield( L, -2, "cycles" );
+   lua_pushnumber( L, st.steps );
+   lua_setfield( L, -2, "steps" );
+   lua_pushnumber( L, st.collections );
+   lua_setfield( L, -2, "collections" );
+   lua_pushnumber( L, st.total );
+   lua_setfield( L, -2, "total" );
+   lua_pushnumber( L, st.cycles > 0 ? st.total / st.cycles : 0.0 );
+   lua_setfield( L, -2, "mean" );
+   lua_pushnumber( L, st.worst );
+   lua_setfield( L, -2, "worst" );
+   return 1 ;
+}
+
+/* pi_gcreport( ) -- pi_gc_report( ) to stderr */
+int pi_gcreport(lua_State * L)
+{
+   (void)L ;
+   pi_gc_report( stderr );
+   return 0 ;
+}
+
+/* ex: set sw=3 sta et : */
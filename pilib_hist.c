@@ -0,0 +1,430 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Rolling history...
+ *   The average, min and max of each history sensor over every step
+ *   go to a fixed size file, mapped shared, with a ring of slots per
+ *   sensor and a head counting the steps ever committed.  Step s of
+ *   sensor c is slot s % nslots of c's ring.  The writer thread fills
+ *   in the slots of a step, each under its own sequence number (odd
+ *   while written, 2s+2 once done), then advances head.  Readers map
+ *   the file too and take a slot only if its sequence number is the
+ *   one expected before and after copying it, so they never see a
+ *   torn slot, and a crash loses at most the step being accumulated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PIH_MAGIC "PIH1"
+
+struct pih_header {
+   char  magic[4] ;  /* PIH_MAGIC, written last */
+   uint32_t  nchans ;
+   uint64_t  nslots ;  /* Per sensor */
+   double  step ;  /* sec */
+   uint64_t  head ;  /* Steps committed since the file was made */
+   char  name[PIHIST_MAXCHANS][16] ;
+} ;
+
+struct pih_slot {
+   uint64_t  seq ;  /* 2s+2 once step s is in, odd while being written */
+   double  t ;  /* Start of the step (wall clock sec) */
+   uint32_t  n ;  /* Samples in the step, 0 if none */
+   uint32_t  nval ;  /* Values per sample (1 or 3) */
+   double  avg[3] ;
+   double  min, max ;  /* Of the first value */
+} ;
+
+/* A mapped history file */
+struct pih_file {
+   int  fd ;
+   size_t  len ;
+   struct pih_header *  h ;
+   struct pih_slot *  slot ;
+} ;
+
+/* Slots start on a 64 byte boundary after the header */
+#define PIH_SLOTS ((sizeof(struct pih_header) + 63) & ~(size_t)63)
+
+static size_t pih_len( uint32_t nchans, uint64_t nslots )
+{
+   return PIH_SLOTS + nchans * nslots * sizeof(struct pih_slot) ;
+}
+
+static struct pih_slot * pih_slot( const struct pih_file * f, int chan, uint64_t step )
+{
+   return f->slot + chan * f->h->nslots + step % f->h->nslots ;
+}
+
+/* Map a file of len bytes, writable or not */
+static int pih_map( struct pih_file * f, size_t len, int writable )
+{
+   void *  p ;
+
+   p = mmap( NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, f->fd, 0 );
+   if( p == MAP_FAILED ) {
+      return -1 ;
+   }
+   f->len = len ;
+   f->h = p ;
+   f->slot = (struct pih_slot *)((char *) p + PIH_SLOTS) ;
+   return 0 ;
+}
+
+/* The history being written, by the stream writer thread */
+static struct {
+   struct pih_file  f ;  /* f.h is NULL if none */
+   int  chan[PIACQ_MAXSENSORS] ;  /* History channel +1 of plan sensors */
+   double  cur ;  /* Step being accumulated (wall clock sec), NAN if none */
+   struct {
+      unsigned long  n ;
+      int  nval ;
+      double  sum[3] ;
+      double  min, max ;
+   } acc[PIHIST_MAXCHANS] ;
+} hist = { { -1 } } ;
+
+/* pi_hist_reset( ) -- Unmap the history (the plan is being rebuilt) */
+void pi_hist_reset( void )
+{
+   if( hist.f.h != NULL ) {
+      msync( hist.f.h, hist.f.len, MS_ASYNC );
+      munmap( hist.f.h, hist.f.len );
+      hist.f.h = NULL ;
+   }
+   if( hist.f.fd >= 0 ) {
+      close( hist.f.fd );
+      hist.f.fd = -1 ;
+   }
+   memset( hist.chan, 0, sizeof(hist.chan) );
+}
+
+/* Commit the step being accumulated, start the next */
+static void hist_commit( void )
+{
+   struct pih_header *  h = hist.f.h ;
+   struct pih_slot *  p ;
+   uint64_t  s = h->head ;
+   int  c, i ;
+
+   for( c = 0 ; c < (int) h->nchans ; ++c ) {
+      p = pih_slot( &hist.f, c, s );
+      __atomic_store_n( &p->seq, 2 * s +1, __ATOMIC_RELAXED );
+      __atomic_thread_fence( __ATOMIC_RELEASE );
+      p->t = hist.cur ;
+      p->n = hist.acc[c].n ;
+      p->nval = hist.acc[c].nval ;
+      for( i = 0 ; i < 3 ; ++i ) {
+         p->avg[i] = p->n > 0 ? hist.acc[c].sum[i] / p->n : NAN ;
+      }
+      p->min = p->n > 0 ? hist.acc[c].min : NAN ;
+      p->max = p->n > 0 ? hist.acc[c].max : NAN ;
+      __atomic_store_n( &p->seq, 2 * s +2, __ATOMIC_RELEASE );
+   }
+   __atomic_store_n( &h->head, s +1, __ATOMIC_RELEASE );
+   memset( hist.acc, 0, sizeof(hist.acc) );
+}
+
+/* pi_hist_sample( sensor, t, val, n ) -- Add a sample to the history
+ *    Called by the writer thread in time order (mostly)
+ */
+void pi_hist_sample( int sensor, int64_t t, const double * val, int n )
+{
+   double  start ;
+   int  c = hist.chan[sensor] -1 ;
+   int  i ;
+
+   if( c < 0 || hist.f.h == NULL ) {
+      return ;
+   }
+   start = floor( mono2wall( t ) / hist.f.h->step ) * hist.f.h->step ;
+   if( isnan( hist.cur ) || start > hist.cur ) {
+      if( ! isnan( hist.cur ) ) {
+         hist_commit( );
+      }
+      hist.cur = start ;
+   }
+
+   if( hist.acc[c].n == 0 || val[0] < hist.acc[c].min ) {
+      hist.acc[c].min = val[0] ;
+   }
+   if( hist.acc[c].n == 0 || val[0] > hist.acc[c].max ) {
+      hist.acc[c].max = val[0] ;
+   }
+   for( i = 0 ; i < n ; ++i ) {
+      hist.acc[c].sum[i] += val[i] ;
+   }
+   hist.acc[c].nval = n ;
+   ++hist.acc[c].n ;
+}
+
+/* pi_hist_flush( ) -- Commit the partial step, a stream ended */
+void pi_hist_flush( void )
+{
+   if( hist.f.h == NULL || isnan( hist.cur ) ) {
+      return ;
+   }
+   hist_commit( );
+   hist.cur = NAN ;
+   msync( hist.f.h, hist.f.len, MS_ASYNC );
+}
+
+/* Does the mapped header describe this history? */
+static int hist_same( const struct pih_header * h, uint32_t nchans, uint64_t nslots,
+      double step, char (* name)[16] )
+{
+   return memcmp( h->magic, PIH_MAGIC, sizeof(h->magic) ) == 0
+         && h->nchans == nchans && h->nslots == nslots && h->step == step
+         && memcmp( h->name, name, sizeof(h->name) ) == 0 ;
+}
+
+/* pi_history_setup( desc ) -- Map the history file
+ * @desc -- table built by pi.compile( ) from History{ }
+ *      file -- path of the history
+ *      names -- names of the history sensors, in the file's order
+ *      sensors -- plan index of each, nil if not streamed
+ *      step -- seconds per slot
+ *      hours -- how far back it goes
+ * -----
+ * A file made for other sensors, step or hours is started over, else
+ *    it carries on from where it was.
+ */
+int pi_history_setup(lua_State * L)
+{
+   char  name[PIHIST_MAXCHANS][16] ;
+   const char *  file ;
+   const char *  p ;
+   struct stat  st ;
+   uint64_t  nslots ;
+   uint32_t  nchans ;
+   double  step, hours ;
+   size_t  len ;
+   int  idx ;
+   int  i ;
+
+   luaL_checktype( L, 1, LUA_TTABLE );
+   pi_hist_reset( );
+   hist.cur = NAN ;
+
+   lua_getfield( L, 1, "file" );
+   file = luaL_checkstring( L, -1 );
+   lua_getfield( L, 1, "step" );
+   step = luaL_optnumber( L, -1, 1.0 );
+   lua_getfield( L, 1, "hours" );
+   hours = luaL_optnumber( L, -1, 24.0 );
+   if( step <= 0 || hours <= 0 ) {
+      return luaL_error( L, "history_setup: step and hours must be > 0" );
+   }
+   nslots = (uint64_t) ceil( hours * 3600 / step );
+
+   memset( name, 0, sizeof(name) );
+   lua_getfield( L, 1, "names" );
+   luaL_checktype( L, -1, LUA_TTABLE );
+   nchans = lua_objlen( L, -1 );
+   if( nchans < 1 || nchans > PIHIST_MAXCHANS ) {
+      return luaL_error( L, "history_setup: 1 to %d sensors", PIHIST_MAXCHANS );
+   }
+   lua_getfield( L, 1, "sensors" );
+   for( i = 0 ; i < (int) nchans ; ++i ) {
+      lua_rawgeti( L, -2, i +1 );
+      p = lua_tostring( L, -1 );
+      strncpy( name[i], p != NULL ? p : "?", sizeof(name[i]) -1 );
+      lua_rawgeti( L, -2, i +1 );
+      if( lua_isnumber( L, -1 ) ) {
+         idx = lua_tointeger( L, -1 );
+         if( idx >= 0 && idx < piplan.nsensors ) {
+            hist.chan[idx] = i +1 ;
+         }
+      }
+      lua_pop( L, 2 );
+   }
+
+   len = pih_len( nchans, nslots );
+   hist.f.fd = open( file, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+   if( hist.f.fd < 0 || fstat( hist.f.fd, &st ) < 0 ) {
+      i = errno ;
+      pi_hist_reset( );
+      return luaL_error( L, "history_setup: %s: %s", file, strerror( i ) );
+   }
+   if( (size_t) st.st_size == len && pih_map( &hist.f, len, 1 ) == 0
+         && hist_same( hist.f.h, nchans, nslots, step, name ) ) {
+      return 0 ;  /* Carry on */
+   }
+
+   /* Start over */
+   if( hist.f.h != NULL ) {
+      munmap( hist.f.h, hist.f.len );
+      hist.f.h = NULL ;
+   }
+   if( verbose >= 0 && st.st_size > 0 ) {
+      fprintf( stderr, "%s: history: %s was for other sensors or sizes, starting over\n",
+            ARGV0, file );
+   }
+   if( ftruncate( hist.f.fd, 0 ) < 0 || ftruncate( hist.f.fd, len ) < 0
+         || pih_map( &hist.f, len, 1 ) < 0 ) {
+      i = errno ;
+      pi_hist_reset( );
+      return luaL_error( L, "history_setup: %s: %s", file, strerror( i ) );
+   }
+   hist.f.h->nchans = nchans ;
+   hist.f.h->nslots = nslots ;
+   hist.f.h->step = step ;
+   hist.f.h->head = 0 ;
+   memcpy( hist.f.h->name, name, sizeof(name) );
+   __atomic_thread_fence( __ATOMIC_RELEASE );
+   memcpy( hist.f.h->magic, PIH_MAGIC, sizeof(hist.f.h->magic) );
+   msync( hist.f.h, PIH_SLOTS, MS_SYNC );
+
+   return 0 ;
+}
+
+/* pih_open( path ) -- Map a history file for reading
+ * -----
+ * @ret -- the file, or NULL (errno set)
+ */
+struct pih_file * pih_open( const char * path )
+{
+   struct pih_file *  f ;
+   struct stat  st ;
+   struct pih_header  h ;
+
+   f = calloc( 1, sizeof(*f) );
+   if( f == NULL ) {
+      return NULL ;
+   }
+   f->fd = open( path, O_RDONLY | O_CLOEXEC );
+   if( f->fd < 0 || fstat( f->fd, &st ) < 0 || (size_t) st.st_size < sizeof(h)
+         || pread( f->fd, &h, sizeof(h), 0 ) != sizeof(h) ) {
+      goto fail ;
+   }
+   if( memcmp( h.magic, PIH_MAGIC, sizeof(h.magic) ) != 0 || h.nchans > PIHIST_MAXCHANS
+         || h.nslots == 0 || (size_t) st.st_size != pih_len( h.nchans, h.nslots ) ) {
+      errno = EINVAL ;
+      goto fail ;
+   }
+   if( pih_map( f, st.st_size, 0 ) < 0 ) {
+      goto fail ;
+   }
+   return f ;
+
+fail :
+   pih_close( f );
+   return NULL ;
+}
+
+void pih_close( struct pih_file * f )
+{
+   if( f == NULL ) {
+      return ;
+   }
+   if( f->h != NULL ) {
+      munmap( f->h, f->len );
+   }
+   if( f->fd >= 0 ) {
+      close( f->fd );
+   }
+   free( f );
+}
+
+int pih_nchans( const struct pih_file * f )
+{
+   return f->h->nchans ;
+}
+
+const char * pih_name( const struct pih_file * f, int chan )
+{
+   return chan >= 0 && chan < (int) f->h->nchans ? f->h->name[chan] : NULL ;
+}
+
+/* pih_get( f, step, chan, v ) -- Copy a slot
+ * @step -- absolute step number (see pih_range)
+ * -----
+ * @ret -- 0, or -1 if the step isn't there (not yet written, being
+ *    written, or overwritten)
+ */
+int pih_get( const struct pih_file * f, uint64_t step, int chan, struct pih_value * v )
+{
+   const struct pih_slot *  p = pih_slot( f, chan, step );
+   uint64_t  seq ;
+
+   seq = __atomic_load_n( &p->seq, __ATOMIC_ACQUIRE );
+   if( seq != 2 * step +2 ) {
+      return -1 ;
+   }
+   v->t = p->t ;
+   v->n = p->n ;
+   v->nval = p->nval ;
+   memcpy( v->avg, p->avg, sizeof(v->avg) );
+   v->min = p->min ;
+   v->max = p->max ;
+   __atomic_thread_fence( __ATOMIC_ACQUIRE );
+   return __atomic_load_n( &p->seq, __ATOMIC_RELAXED ) == seq ? 0 : -1 ;
+}
+
+/* Start of a step, -HUGE_VAL if it's gone */
+static double pih_time( const struct pih_file * f, uint64_t step )
+{
+   struct pih_value  v ;
+
+   return pih_get( f, step, 0, &v ) == 0 ? v.t : -HUGE_VAL ;
+}
+
+/* pih_range( f, from, to, first, last ) -- Steps in a time range
+ * @from, @to -- wall clock sec
+ * @first, @last -- filled with the steps in [from, to)
+ * -----
+ * @ret -- the number of steps, 0 if none
+ *
+ * Binary searches of the steps in the file, which are in time order.
+ *    The oldest may be overwritten while searching, it is then taken
+ *    to be before the range.
+ */
+int pih_range( const struct pih_file * f, double from, double to,
+      uint64_t * first, uint64_t * last )
+{
+   uint64_t  head = __atomic_load_n( &f->h->head, __ATOMIC_ACQUIRE );
+   uint64_t  lo, hi, mid, begin ;
+
+   begin = head > f->h->nslots ? head - f->h->nslots : 0 ;
+
+   for( lo = begin, hi = head ; lo < hi ; ) {
+      mid = lo + (hi - lo) / 2 ;
+      if( pih_time( f, mid ) < from ) {
+         lo = mid +1 ;
+      } else {
+         hi = mid ;
+      }
+   }
+   *first = lo ;
+   for( hi = head ; lo < hi ; ) {
+      mid = lo + (hi - lo) / 2 ;
+      if( pih_time( f, mid ) < to ) {
+         lo = mid +1 ;
+      } else {
+         hi = mid ;
+      }
+   }
+   *last = lo ;
+   return *last - *first ;
+}
+
+/* ex: set sw=3 sta et : */
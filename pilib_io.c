@@ -105,26 +105,19 @@ int pi_read(lua_State * L)
 {
    int  fd ;
    int  len ;
-   char *  buf ;
-   size_t  ret ;
+   char  buf[4096] ;
+   ssize_t  ret ;
 
 
    fd = luaL_checkint( L, 1 );
    len = luaL_optint( L, 2, 16 );
-   luaL_argcheck( L, len > 0 && len <= 4096, 2, "invalid length [1-4096]" );
+   luaL_argcheck( L, len > 0 && len <= sizeof(buf), 2, "invalid length [1-4096]" );
 
-   buf = malloc( len );
-   if( buf == NULL ) {
-      return luaL_error( L, "read buffer allocation failed" );
-   }
    ret = read( fd, buf, len );
    if( ret < 0 ) {
-      int  save_errno = errno ;
-      free( buf );
-      return luaL_error( L, "read failed: %s", strerror(save_errno) );
+      return luaL_error( L, "read failed: %s", strerror(errno) );
    }
-   lua_pushlstring( L, buf, len );
-   free( buf );
+   lua_pushlstring( L, buf, ret );
    return 1 ;
 }
 
@@ -0,0 +1,454 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Application phase markers...
+ *   Applications mark the beginning and end of tagged phases and the
+ *   power samples of the stream (pilib_stream.c) are attributed to
+ *   the phases they overlap: energy, average, peak and minimum power
+ *   per sensor per phase
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+/* The marker queue.  Any number of application threads push markers,
+ *    only the consumer (the stream writer, or whoever asks for the
+ *    results) pops them.  Each slot has a sequence number that says
+ *    whose turn it is: pushers claim a slot by advancing head with a
+ *    compare and swap, fill it, and publish it by bumping its
+ *    sequence, so pushing is a timestamp, a few atomics and a copy.
+ *    When the queue is full markers are dropped and counted.
+ */
+#define PIMARK_QUEUE 1024  /* Power of 2 */
+struct pi_marker {
+   unsigned long  seq ;
+   int64_t  t ;
+   int  begin ;
+   char  tag[PIMARK_TAGLEN] ;
+} ;
+
+static struct {
+   unsigned long  head ;
+   unsigned long  tail ;
+   unsigned long  dropped ;
+   struct pi_marker  slot[PIMARK_QUEUE] ;
+} markq ;
+
+static pthread_once_t  markonce = PTHREAD_ONCE_INIT ;
+
+static void markq_init( void )
+{
+   unsigned long  i ;
+
+   for( i = 0 ; i < PIMARK_QUEUE ; ++i ) {
+      markq.slot[i].seq = i ;
+   }
+}
+
+/* pi_mark( tag, begin ) -- Queue a marker stamped now (monotime_ns)
+ * -----
+ * @ret -- 0 if queued, -1 if the queue was full (dropped)
+ */
+int pi_mark( const char * tag, int begin )
+{
+   struct pi_marker *  m ;
+   int64_t  t = monotime_ns( );
+   unsigned long  pos ;
+   long  diff ;
+
+   pthread_once( &markonce, markq_init );
+   if( begin ) {
+      pi_capture_mark( tag );
+   }
+
+   pos = __atomic_load_n( &markq.head, __ATOMIC_RELAXED );
+   while( 1 ) {
+      m = markq.slot + (pos & (PIMARK_QUEUE-1)) ;
+      diff = (long) __atomic_load_n( &m->seq, __ATOMIC_ACQUIRE ) - (long) pos ;
+      if( diff == 0 ) {
+         if( __atomic_compare_exchange_n( &markq.head, &pos, pos +1, 1,
+               __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+            break ;
+         }
+      } else if( diff < 0 ) {
+         __atomic_add_fetch( &markq.dropped, 1, __ATOMIC_RELAXED );
+         return -1 ;
+      } else {
+         pos = __atomic_load_n( &markq.head, __ATOMIC_RELAXED );
+      }
+   }
+
+   m->t = t ;
+   m->begin = begin ;
+   strncpy( m->tag, tag, PIMARK_TAGLEN -1 );
+   m->tag[PIMARK_TAGLEN -1] = '\0' ;
+   __atomic_store_n( &m->seq, pos +1, __ATOMIC_RELEASE );
+   return 0 ;
+}
+
+static int markq_pop( struct pi_marker * out )
+{
+   struct pi_marker *  m = markq.slot + (markq.tail & (PIMARK_QUEUE-1)) ;
+
+   if( __atomic_load_n( &m->seq, __ATOMIC_ACQUIRE ) != markq.tail +1 ) {
+      return -1 ;
+   }
+   *out = *m ;
+   __atomic_store_n( &m->seq, markq.tail + PIMARK_QUEUE, __ATOMIC_RELEASE );
+   ++markq.tail ;
+   return 0 ;
+}
+
+/* Phases being measured, and the last ones completed.  All of this
+ *    belongs to the consumer and is protected by marklock, which is
+ *    never taken by pi_mark( ).
+ */
+#define PIPHASE_FREE 0
+#define PIPHASE_OPEN 1  /* Begun, not ended */
+#define PIPHASE_CLOSING 2  /* Ended, waiting for samples past the end */
+
+static struct pi_phase  active[PIMARK_MAXOPEN] ;
+static int  activestate[PIMARK_MAXOPEN] ;
+static struct pi_phase  done[PIMARK_MAXDONE] ;
+static unsigned long  ndone ;  /* Total completed, done[ndone % MAXDONE] is next */
+static unsigned long  lost ;  /* Begins with no free slot, ends with no begin */
+
+/* Last power sample of each plan sensor, 0 time if none */
+static int64_t  prevt[PIACQ_MAXSENSORS] ;
+static double  prevp[PIACQ_MAXSENSORS] ;
+
+static pthread_mutex_t  marklock = PTHREAD_MUTEX_INITIALIZER ;
+
+static void phase_begin( const struct pi_marker * m )
+{
+   struct pi_phase *  p ;
+   int  i ;
+
+   for( i = 0 ; i < PIMARK_MAXOPEN && activestate[i] != PIPHASE_FREE ; ++i )
+      ;
+   if( i == PIMARK_MAXOPEN ) {
+      ++lost ;
+      return ;
+   }
+   p = active + i ;
+   memset( p, 0, sizeof(*p) );
+   memcpy( p->tag, m->tag, PIMARK_TAGLEN );
+   p->begin = m->t ;
+   p->end = INT64_MAX ;
+   for( i = 0 ; i < PIACQ_MAXSENSORS ; ++i ) {
+      p->stat[i].peak = -HUGE_VAL ;
+      p->stat[i].min = HUGE_VAL ;
+   }
+   activestate[p - active] = PIPHASE_OPEN ;
+}
+
+/* End the most recently begun open phase with the tag, so the same
+ *    tag may nest
+ */
+static void phase_end( const struct pi_marker * m )
+{
+   int  best = -1 ;
+   int  i ;
+
+   for( i = 0 ; i < PIMARK_MAXOPEN ; ++i ) {
+      if( activestate[i] == PIPHASE_OPEN && strcmp( active[i].tag, m->tag ) == 0
+            && (best < 0 || active[i].begin > active[best].begin) ) {
+         best = i ;
+      }
+   }
+   if( best < 0 ) {
+      ++lost ;
+      return ;
+   }
+   active[best].end = m->t ;
+   activestate[best] = PIPHASE_CLOSING ;
+}
+
+/* Move closing phases that no sensor can add to anymore to done */
+static void phase_retire( int force )
+{
+   int  i, k ;
+
+   for( i = 0 ; i < PIMARK_MAXOPEN ; ++i ) {
+      if( activestate[i] != PIPHASE_CLOSING ) {
+         continue ;
+      }
+      for( k = 0 ; k < piplan.nsensors && ! force ; ++k ) {
+         if( prevt[k] != 0 && prevt[k] < active[i].end ) {
+            break ;
+         }
+      }
+      if( force || k == piplan.nsensors ) {
+         done[ndone % PIMARK_MAXDONE] = active[i] ;
+         ++ndone ;
+         activestate[i] = PIPHASE_FREE ;
+      }
+   }
+}
+
+static void markers_drain( void )
+{
+   struct pi_marker  m ;
+
+   pthread_once( &markonce, markq_init );
+   while( markq_pop( &m ) == 0 ) {
+      if( m.begin ) {
+         phase_begin( &m );
+      } else {
+         phase_end( &m );
+      }
+   }
+}
+
+/* pi_mark_sample( sensor, t, watts ) -- Attribute a power sample
+ * @sensor -- plan index
+ * @t -- time of the sample (monotime_ns)
+ * @watts -- power
+ *
+ * Called by the consumer of the stream for every power sample, in
+ *    time order per sensor.  Power is taken to be linear between
+ *    samples and the segment from the previous sample is integrated
+ *    over its overlap with every phase, so nested and overlapping
+ *    phases each get their share.  Peak and minimum are over the
+ *    samples inside the phase.
+ */
+void pi_mark_sample( int sensor, int64_t t, double watts )
+{
+   struct pi_phase_stat *  st ;
+   int64_t  t1, a, b ;
+   double  p1, slope, pa, pb ;
+   int  i ;
+
+   pthread_mutex_lock( &marklock );
+   markers_drain( );
+
+   t1 = prevt[sensor] ;
+   p1 = prevp[sensor] ;
+   slope = t1 != 0 && t > t1 ? (watts - p1) / (t - t1) : 0 ;
+   for( i = 0 ; i < PIMARK_MAXOPEN ; ++i ) {
+      if( activestate[i] == PIPHASE_FREE ) {
+         continue ;
+      }
+      st = active[i].stat + sensor ;
+      if( t1 != 0 && t > t1 ) {
+         a = t1 > active[i].begin ? t1 : active[i].begin ;
+         b = t < active[i].end ? t : active[i].end ;
+         if( b > a ) {
+            pa = p1 + slope * (a - t1) ;
+            pb = p1 + slope * (b - t1) ;
+            st->energy += (pa + pb) / 2 * ((b - a) / 1000000000.0) ;
+            st->covered += (b - a) / 1000000000.0 ;
+         }
+      }
+      if( t >= active[i].begin && t <= active[i].end ) {
+         ++st->n ;
+         if( watts > st->peak ) {
+            st->peak = watts ;
+         }
+         if( watts < st->min ) {
+            st->min = watts ;
+         }
+      }
+   }
+   prevt[sensor] = t ;
+   prevp[sensor] = watts ;
+
+   phase_retire( 0 );
+   pthread_mutex_unlock( &marklock );
+}
+
+/* pi_mark_reset( ) -- Forget previous samples (a new stream starts)
+ *
+ * Phases still open stay open, phases waiting on samples from the
+ *    old stream are completed with what they have.
+ */
+void pi_mark_reset( void )
+{
+   pthread_mutex_lock( &marklock );
+   markers_drain( );
+   phase_retire( 1 );
+   memset( prevt, 0, sizeof(prevt) );
+   pthread_mutex_unlock( &marklock );
+}
+
+/* Completed phase n (0 = most recent) with tag (NULL for any) */
+static const struct pi_phase * phase_done( const char * tag, unsigned long n )
+{
+   unsigned long  i ;
+   const struct pi_phase *  p ;
+
+   for( i = ndone ; i > 0 && ndone - i < PIMARK_MAXDONE ; --i ) {
+      p = done + (i -1) % PIMARK_MAXDONE ;
+      if( tag == NULL || strcmp( p->tag, tag ) == 0 ) {
+         if( n-- == 0 ) {
+            return p ;
+         }
+      }
+   }
+   return NULL ;
+}
+
+/* pi_mark_result( tag, sensor, stat, duration ) -- Last completed phase
+ * @tag -- phase tag
+ * @sensor -- plan index
+ * @stat -- copy of the sensor's statistics for the phase
+ * @duration -- length of the phase (sec)
+ * -----
+ * @ret -- 0 if found, -1 if no completed phase has the tag
+ */
+int pi_mark_result( const char * tag, int sensor, struct pi_phase_stat * stat,
+      double * duration )
+{
+   const struct pi_phase *  p ;
+
+   pthread_mutex_lock( &marklock );
+   markers_drain( );
+   phase_retire( 0 );
+   p = phase_done( tag, 0 );
+   if( p != NULL ) {
+      *stat = p->stat[sensor] ;
+      *duration = (p->end - p->begin) / 1000000000.0 ;
+   }
+   pthread_mutex_unlock( &marklock );
+
+   return p != NULL ? 0 : -1 ;
+}
+
+/* pi_mark_report( out ) -- Print the completed phases */
+void pi_mark_report( FILE * out )
+{
+   const struct pi_phase *  p ;
+   const struct pi_phase_stat *  st ;
+   unsigned long  n ;
+   int  i ;
+
+   pthread_mutex_lock( &marklock );
+   markers_drain( );
+   phase_retire( 0 );
+   if( ndone > 0 ) {
+      fprintf( out, "# Phase            Sensor      Seconds    Joules  Avg(W) Peak(W)  Min(W)\n" );
+   }
+   for( n = ndone < PIMARK_MAXDONE ? ndone : PIMARK_MAXDONE ; n > 0 ; --n ) {
+      p = phase_done( NULL, n -1 );
+      for( i = 0 ; i < piplan.nsensors ; ++i ) {
+         st = p->stat + i ;
+         if( st->covered <= 0 ) {
+            continue ;
+         }
+         fprintf( out, "# %-16s %-10s %8.3f %9.3f %7.3f %7.3f %7.3f\n",
+               p->tag, piplan.sensor[i].name, (p->end - p->begin) / 1000000000.0,
+               st->energy, st->energy / st->covered, st->peak, st->min );
+      }
+   }
+   if( (lost || markq.dropped) && verbose >= 0 ) {
+      fprintf( out, "# Markers: %lu dropped (queue full), %lu unmatched or over %d open\n",
+            markq.dropped, lost, PIMARK_MAXOPEN );
+   }
+   pthread_mutex_unlock( &marklock );
+}
+
+/* pi_mark_begin( tag ) -- Mark the beginning of a phase
+ * @tag -- phase name (up to 31 characters)
+ * -----
+ * @ok -- false if the marker was dropped
+ */
+int pi_mark_begin(lua_State * L)
+{
+   lua_pushboolean( L, pi_mark( luaL_checkstring( L, 1 ), 1 ) == 0 );
+   return 1 ;
+}
+
+/* pi_mark_end( tag ) -- Mark the end of the latest phase with the tag
+ * @tag -- phase name
+ * -----
+ * @ok -- false if the marker was dropped
+ */
+int pi_mark_end(lua_State * L)
+{
+   lua_pushboolean( L, pi_mark( luaL_checkstring( L, 1 ), 0 ) == 0 );
+   return 1 ;
+}
+
+/* pi_phases( [tag] ) -- Completed phases, oldest first
+ * @tag -- only phases with this tag (default: all)
+ * -----
+ * @phases -- list of { tag=, begin=ns, end=ns, sensors={ [name]=
+ *      { energy=J, avg=W, peak=W, min=W, samples=n } } } for the
+ *      sensors that were sampled during the phase
+ */
+int pi_phases(lua_State * L)
+{
+   /* Copied out under the lock, so a Lua error building the tables
+    *    (out of memory) can't leave it held.  Only the thread running
+    *    the Lua state calls this.
+    */
+   static struct pi_phase  copy[PIMARK_MAXDONE] ;
+   const char *  tag = luaL_optstring( L, 1, NULL );
+   const struct pi_phase *  p ;
+   const struct pi_phase_stat *  st ;
+   unsigned long  n ;
+   int  ncopy = 0 ;
+   int  k ;
+   int  i ;
+
+   pthread_mutex_lock( &marklock );
+   markers_drain( );
+   phase_retire( 0 );
+   for( n = PIMARK_MAXDONE ; n > 0 ; --n ) {
+      p = phase_done( tag, n -1 );
+      if( p != NULL ) {
+         copy[ncopy++] = *p ;
+      }
+   }
+   pthread_mutex_unlock( &marklock );
+
+   lua_newtable( L );
+   for( k = 0 ; k < ncopy ; ++k ) {
+      p = copy + k ;
+      lua_newtable( L );
+      lua_pushstring( L, p->tag );
+      lua_setfield( L, -2, "tag" );
+      lua_pushnumber( L, p->begin );
+      lua_setfield( L, -2, "begin" );
+      lua_pushnumber( L, p->end );
+      lua_setfield( L, -2, "end" );
+      lua_newtable( L );
+      for( i = 0 ; i < piplan.nsensors ; ++i ) {
+         st = p->stat + i ;
+         if( st->covered <= 0 ) {
+            continue ;
+         }
+         lua_newtable( L );
+         lua_pushnumber( L, st->energy );
+         lua_setfield( L, -2, "energy" );
+         lua_pushnumber( L, st->energy / st->covered );
+         lua_setfield( L, -2, "avg" );
+         lua_pushnumber( L, st->peak );
+         lua_setfield( L, -2, "peak" );
+         lua_pushnumber( L, st->min );
+         lua_setfield( L, -2, "min" );
+         lua_pushnumber( L, st->n );
+         lua_setfield( L, -2, "samples" );
+         lua_setfield( L, -2, piplan.sensor[i].name );
+      }
+      lua_setfield( L, -2, "sensors" );
+      lua_rawseti( L, -2, k +1 );
+   }
+
+   return 1 ;
+}
+
+/* ex: set sw=3 sta et : */
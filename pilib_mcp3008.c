@@ -12,8 +12,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 #include <linux/types.h>
+#include <linux/spi/spidev.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -171,5 +173,57 @@ int pi_mcp3008_getraw(lua_State * L)
    return narg - msgstart +1 ;
 }
 
+/* See pilib_spi.c, same warning on 32-bit platforms */
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+
+/* mcp3008_sample( fd, mux, reading ) -- Read a channel from C
+ * @fd -- spidev device connected to mcp3008
+ * @mux -- channel to read
+ * @reading -- "raw" reading [0,1], the same as mkmsg( mux ) and getraw
+ * -----
+ * @ret -- 0 on success, or -1 and sets errno
+ */
+int mcp3008_sample( int fd, int mux, double * reading )
+{
+   struct spi_ioc_transfer  msg ;
+   __u8  bufs[8] ;
+
+   memset( &msg, 0, sizeof(msg) );
+   msg.tx_buf = (__u64) bufs +0 ;
+   msg.rx_buf = (__u64) bufs +4 ;
+   msg.len = 3 ;
+   bufs[0] = chan_map[mux&7] >> 1 ;  /* Default shift */
+   bufs[1] = chan_map[mux&7] << 7 ;
+   bufs[2] = 0 ;
+
+   if( spi_transfer( fd, 1, &msg ) < 0 ) {
+      return -1 ;
+   }
+
+   *reading = ((((bufs[4]<<16)|(bufs[5]<<8)|bufs[6])>>6)&0x3ff) / (double)0x3ff ;
+   return 0 ;
+}
+
+/* pi_mcp3008_sample( fd, mux ) -- Read a channel
+ * @fd -- spidev device connected to mcp3008
+ * @mux -- channel to read
+ * -----
+ * @reading -- "raw" reading [0,1], as getraw( spi_message( mkmsg( mux ) ) )
+ *    but without a message table or rx_buf string for every read
+ */
+int pi_mcp3008_sample(lua_State * L)
+{
+   int  fd = luaL_checkint( L, 1 );
+   int  mux = luaL_checkint( L, 2 );
+   double  reading ;
+
+   luaL_argcheck( L, mux >= 0 && mux <= 7, 2, "invalid mux value [0,7]" );
+   pi_acq_touch( L );
+   if( mcp3008_sample( fd, mux, &reading ) < 0 ) {
+      return luaL_error( L, "mcp3008_sample: %s", strerror( errno ) );
+   }
+   lua_pushnumber( L, reading );
+   return 1 ;
+}
 
 /* ex: set sw=3 sta et : */
@@ -0,0 +1,407 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Sensor objects...
+ *   The connectors and sensors in S are Lua tables, and s:power( )
+ *   walks s.vraw, s.vcs, s.mux, s.vref, s.acs and the Vcc reference
+ *   through hash and metatable lookups for every sample.  pi.bind( s )
+ *   (init_final.lua) adds each sensor pi.compile( ) recognizes to a
+ *   plan of its own, objplan, with pi_plan_add( ) and the same
+ *   descriptor, and gives it a userdata, s.obj, with its index there
+ *   and its last sample (in place of the s.cache table).  sample( s ),
+ *   read( s ), power( s ) and libpidev go straight to the object,
+ *   which is sampled by pi_plan_sample( ) as streams are.  objplan
+ *   isn't piplan as pi.compile( ) rebuilds that one for every stream.
+ *
+ * Objects own what they share with the Lua readers and piplan while
+ *   nothing else uses the hardware: the bank selected (bank.cur), the
+ *   ADS1256 mux (cs.cmux), and filter state and reference readings
+ *   (cs[mux]).  An object picks them up from the Lua tables with
+ *   pi_plan_pull( ) only if something else touched the hardware since
+ *   it last did (see pi_acq_touch( ) in pilib_acq.c), and hands the
+ *   settings it changed back with pi_plan_push( ) only when something
+ *   else is about to (pi_obj_flush( )).  Filter state goes back after
+ *   each sample, a Lua filter reads cs[mux] before it touches the
+ *   hardware.  Whether a chip (cs.init) or a reference (s.fresh,
+ *   s.epoch) is ready stays in the Lua tables.
+ *
+ * Sampling an object that was already sampled in the current sample
+ *   epoch starts a new one (see pilib_acq.c).  A reference is brought
+ *   up to date with pi.fresh( s ) the first time it is needed in an
+ *   epoch, and keeps that reading for the rest of it, so the power
+ *   sensors of a scan go to Lua for their Vcc once, not once each.
+ *
+ * Objects don't hold on to the sensor tables: a reference's is only in
+ *   a weak table, for pi.fresh( s ), so s.obj doesn't keep s alive.
+ *   Their slots in objplan aren't reused, there is one per sensor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PIOBJ_META "pi.sensor"  /* Registry name of the metatable */
+#define PIOBJ_REFS "pi.sensor.refs"  /* and of the reference tables */
+
+/* The sensors of the objects of the Lua state */
+static struct pi_plan  objplan ;
+
+/* Hardware generation each sensor last picked up the Lua tables' state
+ *    in, and the sensors sampled since the settings were last handed
+ *    back (owed[], each once)
+ */
+static unsigned long  pulled[PIACQ_MAXSENSORS] ;
+static int  owed[PIACQ_MAXSENSORS] ;
+static char  isowed[PIACQ_MAXSENSORS] ;
+static int  nowed ;
+
+struct pi_obj {
+   int  idx ;  /* In objplan */
+   int  ready ;  /* The init( ) of its chips is done */
+   unsigned long  epoch ;  /* Sample epoch it was last sampled in */
+   int  nval ;  /* Last sample: number of values (0 if none), them, */
+   double  val[3] ;
+   double  t ;  /* and when (pi.clock( ) seconds) */
+} ;
+
+/* pi.chipReady( cs ) of the chips whose init( ) hasn't run yet */
+static void obj_ready( lua_State * L, const struct pi_sensor * s )
+{
+   const struct pi_chan *  c[3] = { &s->v, &s->a, &s->t } ;
+   int  i ;
+
+   for( i = 0 ; i < 3 ; ++i ) {
+      if( c[i]->cs == NULL ) {
+         continue ;
+      }
+      lua_rawgeti( L, LUA_REGISTRYINDEX, c[i]->cs->ref );
+      lua_getfield( L, -1, "init" );
+      if( ! lua_isnil( L, -1 ) ) {
+         lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+         lua_getfield( L, -1, "chipReady" );
+         lua_pushvalue( L, -4 );
+         lua_call( L, 1, 0 );
+         lua_pop( L, 1 );
+      }
+      lua_pop( L, 2 );
+   }
+}
+
+/* Index of the reference a sensor's transfer functions need (itself
+ *    for a reference), or -1
+ */
+static int obj_ref( const struct pi_sensor * s, int idx )
+{
+   switch( s->kind ) {
+   case PIKIND_POWER :
+   case PIKIND_AMP :
+      return s->axf >= PIXF_SHUNT10 && s->axf <= PIXF_SHUNT50 ? s->vcc : -1 ;
+   case PIKIND_TEMP :
+      return s->txf == PIXF_TYPEK ? s->cj : -1 ;
+   case PIKIND_VCC :
+   case PIKIND_CJ :
+      return idx ;
+   }
+   return -1 ;
+}
+
+/* Pick up the state sensor idx shares with the Lua readers, unless
+ *    nothing else touched the hardware since it last did
+ */
+static void obj_pull( lua_State * L, int idx )
+{
+   unsigned long  g = pi_acq_generation( );
+
+   if( pulled[idx] != g ) {
+      pi_plan_pull( L, &objplan, idx );
+      pulled[idx] = g ;
+   }
+}
+
+/* Sensor idx was sampled, hand its filter state back now and its
+ *    bank and mux settings when something else needs them
+ */
+static void obj_owe( lua_State * L, int idx )
+{
+   const struct pi_sensor *  s = objplan.sensor + idx ;
+   const struct pi_chan *  c[3] = { &s->v, &s->a, &s->t } ;
+   int  i ;
+
+   for( i = 0 ; i < 3 ; ++i ) {
+      if( c[i]->cs != NULL && c[i]->filter >= 0.0 ) {
+         pi_plan_push( L, &objplan, idx );
+         return ;
+      }
+   }
+   if( ! isowed[idx] ) {
+      isowed[idx] = 1 ;
+      owed[nowed++] = idx ;
+   }
+}
+
+/* pi_obj_flush( L ) -- Hand the bank and mux settings sensor objects
+ *    changed to the Lua tables
+ */
+void pi_obj_flush( lua_State * L )
+{
+   int  i ;
+
+   if( nowed == 0 ) {
+      return ;
+   }
+   /* Made by a Lua state that is closed, L has none of its tables */
+   lua_getfield( L, LUA_REGISTRYINDEX, PIOBJ_REFS );
+   if( lua_isnil( L, -1 ) ) {
+      nowed = 0 ;
+   }
+   lua_pop( L, 1 );
+
+   for( i = 0 ; i < nowed ; ++i ) {
+      pi_plan_push( L, &objplan, owed[i] );
+      isowed[owed[i]] = 0 ;
+   }
+   nowed = 0 ;
+}
+
+/* Bring reference idx up to date, once per sample epoch: pi.fresh( s )
+ *    refreshes it if it's due (see fresh( ) in init_final.lua), and the
+ *    reading it saved in cs[mux] is the reference value
+ */
+static void ref_fresh( lua_State * L, int idx )
+{
+   struct pi_sensor *  r = objplan.sensor + idx ;
+   unsigned long  e = pi_acq_epoch( );
+
+   if( r->epoch == e ) {
+      return ;
+   }
+   lua_getfield( L, LUA_REGISTRYINDEX, PIOBJ_REFS );
+   lua_rawgeti( L, -1, idx );
+   if( lua_istable( L, -1 ) ) {
+      lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+      lua_getfield( L, -1, "fresh" );
+      lua_pushvalue( L, -3 );
+      lua_call( L, 1, 0 );
+      lua_pop( L, 1 );
+   }
+   lua_pop( L, 2 );
+   obj_pull( L, idx );
+   r->epoch = e ;
+}
+
+/* Method libpidev and readByName( ) report each kind's values as */
+static const char * const  kindMethods[] = {
+      [PIKIND_POWER] = "power",
+      [PIKIND_VOLT] = "volt",
+      [PIKIND_AMP] = "amp",
+      [PIKIND_TEMP] = "temp",
+      [PIKIND_VCC] = "volt",
+      [PIKIND_CJ] = "temp",
+   } ;
+
+/* The object at idx, or NULL if it isn't one */
+static struct pi_obj * obj_get( lua_State * L, int idx )
+{
+   struct pi_obj *  o = lua_touserdata( L, idx );
+
+   if( o == NULL || ! lua_getmetatable( L, idx ) ) {
+      return NULL ;
+   }
+   luaL_getmetatable( L, PIOBJ_META );
+   if( ! lua_rawequal( L, -1, -2 ) ) {
+      o = NULL ;
+   }
+   lua_pop( L, 2 );
+   return o ;
+}
+
+/* pi_obj_kind( L, idx ) -- PIKIND_XXX of the sensor object at idx, or
+ *    -1 if it isn't one
+ */
+int pi_obj_kind( lua_State * L, int idx )
+{
+   struct pi_obj *  o = obj_get( L, idx );
+
+   return o != NULL ? objplan.sensor[o->idx].kind : -1 ;
+}
+
+/* o:sample( ) -- Sample the sensor, and keep it as its last sample
+ * -----
+ * @... -- watts, volts and amps of a power sensor, or its value
+ */
+static int obj_sample(lua_State * L)
+{
+   struct pi_obj *  o = luaL_checkudata( L, 1, PIOBJ_META );
+   struct pi_sensor *  s = objplan.sensor + o->idx ;
+   double  val[3] ;
+   int  ref ;
+   int  n ;
+   int  i ;
+
+   /* Sampled again in this epoch, polling went around */
+   if( o->epoch == pi_acq_epoch( ) ) {
+      pi_acq_epoch_next( );
+   }
+   o->epoch = pi_acq_epoch( );
+
+   if( ! o->ready ) {
+      obj_ready( L, s );
+      o->ready = 1 ;
+   }
+   ref = obj_ref( s, o->idx );
+   if( ref >= 0 ) {
+      ref_fresh( L, ref );
+   }
+   if( ref != o->idx ) {
+      obj_pull( L, o->idx );  /* ref_fresh( ) did a reference's */
+   }
+   n = pi_plan_sample( L, &objplan, o->idx, val );
+   obj_owe( L, o->idx );
+   if( n < 0 ) {
+      return luaL_error( L, "sensor %s: %s", s->name, strerror( errno ) );
+   }
+   for( i = 0 ; i < n ; ++i ) {
+      o->val[i] = val[i] ;
+      lua_pushnumber( L, val[i] );
+   }
+   o->nval = n ;
+   o->t = monotime_ns( ) * 1e-9 ;
+   return n ;
+}
+
+/* o:last( ) -- The last sample (nothing if none) */
+static int obj_last(lua_State * L)
+{
+   struct pi_obj *  o = luaL_checkudata( L, 1, PIOBJ_META );
+   int  i ;
+
+   for( i = 0 ; i < o->nval ; ++i ) {
+      lua_pushnumber( L, o->val[i] );
+   }
+   return o->nval ;
+}
+
+/* o:age( ) -- Seconds since the last sample, math.huge if none */
+static int obj_age(lua_State * L)
+{
+   struct pi_obj *  o = luaL_checkudata( L, 1, PIOBJ_META );
+
+   lua_pushnumber( L, o->nval > 0 ? monotime_ns( ) * 1e-9 - o->t : HUGE_VAL );
+   return 1 ;
+}
+
+/* o:epoch( ) -- Sample epoch of the last sample, 0 if none */
+static int obj_epoch(lua_State * L)
+{
+   struct pi_obj *  o = luaL_checkudata( L, 1, PIOBJ_META );
+
+   lua_pushnumber( L, o->epoch );
+   return 1 ;
+}
+
+/* o:method( ) -- Name of the method the values are the results of */
+static int obj_method(lua_State * L)
+{
+   struct pi_obj *  o = luaL_checkudata( L, 1, PIOBJ_META );
+
+   lua_pushstring( L, kindMethods[objplan.sensor[o->idx].kind] );
+   return 1 ;
+}
+
+static const luaL_Reg  objMethods[] = {
+      {"sample",      obj_sample},
+      {"last",        obj_last},
+      {"age",         obj_age},
+      {"epoch",       obj_epoch},
+      {"method",      obj_method},
+      {NULL, NULL},
+   } ;
+
+/* pi_sensor_new( desc ) -- A sensor object
+ * @desc -- descriptor of the sensor, as for pi.acq_sensor( ) but for
+ *      vcc, cj -- the reference's object
+ * -----
+ * @obj -- the object, or nil if the sensor can't be one (kind "lua",
+ *      a reader, transfer function or reference it doesn't know)
+ */
+int pi_sensor_new(lua_State * L)
+{
+   static const char * const  refNames[] = { "vcc", "cj" } ;
+   struct pi_sensor *  s ;
+   struct pi_obj *  o ;
+   struct pi_obj *  r ;
+   int  i ;
+
+   luaL_checktype( L, 1, LUA_TTABLE );
+   lua_settop( L, 1 );
+   if( luaL_newmetatable( L, PIOBJ_META ) ) {
+      lua_newtable( L );
+      luaL_register( L, NULL, objMethods );
+      lua_setfield( L, -2, "__index" );
+
+      /* The first object of this Lua state, any in objplan were made
+       *    by one that is closed
+       */
+      memset( &objplan, 0, sizeof(objplan) );
+      memset( pulled, 0, sizeof(pulled) );
+      memset( isowed, 0, sizeof(isowed) );
+      nowed = 0 ;
+      lua_newtable( L );
+      lua_newtable( L );
+      lua_pushliteral( L, "v" );
+      lua_setfield( L, -2, "__mode" );
+      lua_setmetatable( L, -2 );
+      lua_setfield( L, LUA_REGISTRYINDEX, PIOBJ_REFS );
+   }
+   lua_pop( L, 1 );
+   if( objplan.nsensors >= PIACQ_MAXSENSORS ) {
+      lua_pushnil( L );
+      return 1 ;
+   }
+
+   /* References by their index in objplan */
+   for( i = 0 ; i < 2 ; ++i ) {
+      lua_getfield( L, 1, refNames[i] );
+      r = obj_get( L, -1 );
+      lua_pop( L, 1 );
+      if( r != NULL ) {
+         lua_pushinteger( L, r->idx );
+         lua_setfield( L, 1, refNames[i] );
+      }
+   }
+
+   s = pi_plan_add( L, &objplan );
+   if( s->kind == PIKIND_LUA ) {
+      --objplan.nsensors ;
+      lua_pushnil( L );
+      return 1 ;
+   }
+
+   o = lua_newuserdata( L, sizeof(*o) );
+   memset( o, 0, sizeof(*o) );
+   o->idx = s - objplan.sensor ;
+   luaL_getmetatable( L, PIOBJ_META );
+   lua_setmetatable( L, -2 );
+
+   if( s->kind == PIKIND_VCC || s->kind == PIKIND_CJ ) {
+      lua_getfield( L, LUA_REGISTRYINDEX, PIOBJ_REFS );
+      lua_getfield( L, 1, "sensor" );
+      lua_rawseti( L, -2, o->idx );
+      lua_pop( L, 1 );
+   }
+   return 1 ;
+}
+
+/* ex: set sw=3 sta et : */
@@ -0,0 +1,794 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Binary stream files...
+ *   The raw ADC codes of the streamed sensors, with what it takes to
+ *   convert them in the header, so a file is a fraction of the text
+ *   stream and can be converted again later.  Each sensor's samples
+ *   are collected in blocks of up to PIB_BLOCK, a column of times and
+ *   a column per code, each a zigzag varint of the delta from the
+ *   previous one (delta of delta for the times, which on a steady
+ *   rate is mostly 1 byte).  Sensors converted with a reference value
+ *   (Vcc for shunts, the cold junction for type K) have a column of
+ *   it too, in fixed point, so a reference that changes every scan
+ *   costs a byte or two per sample.  Every PIB_GROUP blocks gets an index
+ *   entry in the footer, so a time range is found with a binary
+ *   search rather than reading the file.
+ *
+ * Layout, native byte order:
+ *   struct pib_header, struct pib_chan for each sensor of the plan
+ *   struct pib_block, time column, code columns, reference column
+ *      ... repeated
+ *   struct pib_index ... , struct pib_footer  (when finished)
+ * A file that wasn't finished (the writer was killed) has no footer,
+ *   pib_open( ) rebuilds the index from the block headers then.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/types.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PIB_MAGIC "PIB2"
+#define PIB_BMAGIC "PIBK"
+#define PIB_XMAGIC "PIBX"
+#define PIB_VARMAX 10  /* Bytes in the longest varint */
+
+struct pib_header {
+   char  magic[4] ;  /* PIB_MAGIC */
+   uint32_t  nsensors ;
+   int64_t  t0 ;  /* Created (monotime_ns) */
+   double  wall0 ;  /* Same, wall clock seconds */
+   uint32_t  block ;  /* PIB_BLOCK */
+   uint32_t  group ;  /* PIB_GROUP */
+} ;
+
+/* How to convert the codes of a sensor */
+struct pib_chan {
+   char  name[16] ;
+   int32_t  kind ;  /* PIKIND_XXX */
+   int32_t  ncode ;  /* Codes per sample, 0 for PIKIND_LUA */
+   int32_t  xf[2] ;  /* PIXF_XXX of each code */
+   double  lsb[2] ;  /* Raw reading = code * lsb */
+   double  vref ;
+   double  pullup ;
+   double  reflsb ;  /* Reference value = code * reflsb, 0 if none */
+} ;
+
+struct pib_block {
+   char  magic[4] ;  /* PIB_BMAGIC */
+   uint16_t  sensor ;
+   uint16_t  count ;  /* Samples */
+   uint16_t  n ;  /* Values per sample (1 or 3) */
+   uint16_t  ncode ;  /* Codes per sample */
+   uint32_t  nbytes[4] ;  /* Time column, code columns, reference column */
+   int64_t  tfirst, tlast ;  /* monotime_ns */
+} ;
+
+/* Blocks are written in the order they fill, so tlast only grows
+ *    until the last blocks of each sensor are flushed at the end,
+ *    while tfirst may go back by up to a block.  tmax lets a seek
+ *    skip what ends before the range, tmin stops a read at what
+ *    starts after it.
+ */
+struct pib_index {
+   int64_t  offset ;  /* First block of the group */
+   int64_t  tmax ;  /* Latest tlast of this and all earlier groups */
+   int64_t  tmin ;  /* Earliest tfirst of this and all later groups */
+} ;
+
+struct pib_footer {
+   int64_t  index ;  /* Offset of the index, also the end of the blocks */
+   uint32_t  nindex ;
+   char  magic[4] ;  /* PIB_XMAGIC */
+} ;
+
+/* The index as it is built, by the writer or pib_open( ) */
+struct pib_idx {
+   int  n ;
+   int  max ;
+   unsigned long  nblocks ;
+   int64_t  tmax ;
+   struct pib_index *  x ;
+} ;
+
+/* A block being filled */
+struct pib_pend {
+   int  count ;
+   int  n ;
+   int  ncode ;
+   int64_t  tfirst ;
+   int64_t  tprev ;
+   int64_t  dprev ;
+   int32_t  cprev[3] ;  /* Codes, reference */
+   uint32_t  nbytes[4] ;
+   uint8_t  col[4][PIB_BLOCK * PIB_VARMAX] ;
+} ;
+
+struct pib_writer {
+   FILE *  f ;
+   int  nsensors ;
+   int64_t  off ;  /* Of the next block */
+   struct pib_idx  idx ;
+   double  reflsb[PIACQ_MAXSENSORS] ;  /* Of each sensor's reference column */
+   struct pib_pend *  pend[PIACQ_MAXSENSORS] ;  /* Allocated on first sample */
+} ;
+
+struct pib_reader {
+   FILE *  f ;
+   struct pib_header  hdr ;
+   struct pib_chan *  chan ;
+   struct pib_idx  idx ;
+   int64_t  end ;  /* Past the last block */
+   int64_t  from, to ;  /* The range */
+   int64_t  off ;  /* Of the next block */
+   int  group ;  /* Index entry of the next block */
+   int  ingroup ;  /* Blocks into it */
+   struct pib_block  blk ;  /* Block being read */
+   int  pos ;  /* Next sample in it */
+   int64_t  t[PIB_BLOCK] ;
+   int32_t  code[3][PIB_BLOCK] ;  /* Codes, reference */
+   uint8_t  buf[4 * PIB_BLOCK * PIB_VARMAX] ;
+} ;
+
+static uint64_t zigzag( int64_t v )
+{
+   return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63) ;
+}
+
+static int64_t unzigzag( uint64_t u )
+{
+   return (int64_t)(u >> 1) ^ -(int64_t)(u & 1) ;
+}
+
+/* Append v as a zigzag varint, returns its length */
+static int put_varint( uint8_t * p, int64_t v )
+{
+   uint64_t  u = zigzag( v );
+   int  len = 0 ;
+
+   while( u >= 0x80 ) {
+      p[len++] = (u & 0x7f) | 0x80 ;
+      u >>= 7 ;
+   }
+   p[len++] = u ;
+   return len ;
+}
+
+/* Next zigzag varint, returns past it or NULL if it runs past end */
+static const uint8_t * get_varint( const uint8_t * p, const uint8_t * end, int64_t * v )
+{
+   uint64_t  u = 0 ;
+   int  shift ;
+
+   for( shift = 0 ; p < end && shift < 64 ; shift += 7 ) {
+      u |= (uint64_t)(*p & 0x7f) << shift ;
+      if( ! (*p++ & 0x80) ) {
+         *v = unzigzag( u );
+         return p ;
+      }
+   }
+   return NULL ;
+}
+
+/* Account for a block at off in the index */
+static int idx_add( struct pib_idx * idx, int64_t off, int64_t tfirst, int64_t tlast )
+{
+   struct pib_index *  x ;
+
+   if( idx->nblocks % PIB_GROUP == 0 ) {
+      if( idx->n == idx->max ) {
+         x = realloc( idx->x, (idx->max ? 2 * idx->max : 64) * sizeof(*x) );
+         if( x == NULL ) {
+            return -1 ;
+         }
+         idx->x = x ;
+         idx->max = idx->max ? 2 * idx->max : 64 ;
+      }
+      x = idx->x + idx->n++ ;
+      x->offset = off ;
+      x->tmin = tfirst ;
+   } else {
+      x = idx->x + idx->n -1 ;
+      if( tfirst < x->tmin ) {
+         x->tmin = tfirst ;
+      }
+   }
+   if( idx->nblocks == 0 || tlast > idx->tmax ) {
+      idx->tmax = tlast ;
+   }
+   x->tmax = idx->tmax ;
+   ++idx->nblocks ;
+   return 0 ;
+}
+
+/* All blocks are in, tmin of each group becomes that of the rest */
+static void idx_finish( struct pib_idx * idx )
+{
+   int  i ;
+
+   for( i = idx->n -2 ; i >= 0 ; --i ) {
+      if( idx->x[i+1].tmin < idx->x[i].tmin ) {
+         idx->x[i].tmin = idx->x[i+1].tmin ;
+      }
+   }
+}
+
+/* Lua sensors are recorded in milli-units */
+static int32_t milli( double v )
+{
+   return isnan( v ) || fabs( v ) > 2.0e6 ? INT32_MIN : (int32_t) lrint( v * 1000.0 );
+}
+
+/* Weight of a reference code, by the transfer functions of a sensor's
+ *    codes: Vcc in microvolts, cold junction volts in nanovolts, well
+ *    below what one count of their ADC changes them by.  0 if it
+ *    needs no reference.
+ */
+static double ref_lsb( int ncode, const int * xf )
+{
+   int  i ;
+
+   for( i = 0 ; i < ncode ; ++i ) {
+      if( xf[i] >= PIXF_SHUNT10 && xf[i] <= PIXF_SHUNT50 ) {
+         return 1.0e-6 ;
+      }
+      if( xf[i] == PIXF_TYPEK ) {
+         return 1.0e-9 ;
+      }
+   }
+   return 0.0 ;
+}
+
+static int32_t ref_code( double refv, double lsb )
+{
+   return isnan( refv ) || fabs( refv / lsb ) > 2.0e9 ? INT32_MIN : (int32_t) lrint( refv / lsb );
+}
+
+/* Bytes of a block after its header */
+static int64_t block_len( const struct pib_block * b )
+{
+   return (int64_t) b->nbytes[0] + b->nbytes[1] + b->nbytes[2] + b->nbytes[3] ;
+}
+
+/* Write the pending block of a sensor */
+static int block_flush( struct pib_writer * w, int sensor )
+{
+   struct pib_pend *  p = w->pend[sensor] ;
+   struct pib_block  b ;
+   int  i ;
+
+   if( p == NULL || p->count == 0 ) {
+      return 0 ;
+   }
+   memset( &b, 0, sizeof(b) );
+   memcpy( b.magic, PIB_BMAGIC, sizeof(b.magic) );
+   b.sensor = sensor ;
+   b.count = p->count ;
+   b.n = p->n ;
+   b.ncode = p->ncode ;
+   memcpy( b.nbytes, p->nbytes, sizeof(b.nbytes) );
+   b.tfirst = p->tfirst ;
+   b.tlast = p->tprev ;
+
+   if( fwrite( &b, sizeof(b), 1, w->f ) != 1 ) {
+      return -1 ;
+   }
+   for( i = 0 ; i < 4 ; ++i ) {
+      if( p->nbytes[i] > 0 && fwrite( p->col[i], 1, p->nbytes[i], w->f ) != p->nbytes[i] ) {
+         return -1 ;
+      }
+   }
+   if( idx_add( &w->idx, w->off, b.tfirst, b.tlast ) < 0 ) {
+      return -1 ;
+   }
+   w->off += sizeof(b) + block_len( &b );
+
+   p->count = 0 ;
+   memset( p->nbytes, 0, sizeof(p->nbytes) );
+   return 0 ;
+}
+
+/* pib_create( path ) -- Start a binary stream file
+ * @path -- file to (over)write
+ * -----
+ * @ret -- the writer, or NULL (errno set)
+ *
+ * Describes every sensor of the plan, so call it once the plan is
+ *    compiled.
+ */
+struct pib_writer * pib_create( const char * path )
+{
+   struct pib_writer *  w ;
+   struct pib_header  h ;
+   struct pib_chan  c ;
+   struct pi_sensor *  s ;
+   int  xf[2] ;
+   int  i, k ;
+
+   w = calloc( 1, sizeof(*w) );
+   if( w == NULL ) {
+      return NULL ;
+   }
+   w->f = fopen( path, "w" );
+   if( w->f == NULL ) {
+      free( w );
+      return NULL ;
+   }
+   w->nsensors = piplan.nsensors ;
+
+   memset( &h, 0, sizeof(h) );
+   memcpy( h.magic, PIB_MAGIC, sizeof(h.magic) );
+   h.nsensors = w->nsensors ;
+   h.t0 = monotime_ns( );
+   h.wall0 = mono2wall( h.t0 );
+   h.block = PIB_BLOCK ;
+   h.group = PIB_GROUP ;
+   if( fwrite( &h, sizeof(h), 1, w->f ) != 1 ) {
+      goto fail ;
+   }
+
+   for( i = 0 ; i < w->nsensors ; ++i ) {
+      s = piplan.sensor + i ;
+      memset( &c, 0, sizeof(c) );
+      memcpy( c.name, s->name, sizeof(c.name) );
+      c.kind = s->kind ;
+      /* Decimated sensors are values, not ADC codes */
+      c.ncode = pi_decim_ratio( i ) == 1 ? pi_acq_format( i, xf, c.lsb ) : 0 ;
+      for( k = 0 ; k < c.ncode ; ++k ) {
+         c.xf[k] = xf[k] ;
+      }
+      c.vref = s->vref ;
+      c.pullup = s->pullup ;
+      c.reflsb = w->reflsb[i] = ref_lsb( c.ncode, xf );
+      if( fwrite( &c, sizeof(c), 1, w->f ) != 1 ) {
+         goto fail ;
+      }
+   }
+   w->off = sizeof(h) + w->nsensors * sizeof(c) ;
+   return w ;
+
+fail :
+   fclose( w->f );
+   free( w );
+   return NULL ;
+}
+
+/* pib_put( w, sensor, t, n, val, code, ncode, refv ) -- Add a sample
+ * @sensor -- plan index
+ * @t -- time of the sample (monotime_ns)
+ * @n, @val -- its values (only used for PIKIND_LUA sensors)
+ * @code, @ncode -- its ADC codes (see pi_acq_codes), 0 for Lua sensors
+ * @refv -- reference value used to convert them
+ * -----
+ * @ret -- 0, or -1 if it couldn't be written
+ *
+ * A block is written once full.
+ */
+int pib_put( struct pib_writer * w, int sensor, int64_t t, int n,
+      const double * val, const int32_t * code, int ncode, double refv )
+{
+   struct pib_pend *  p ;
+   int32_t  lcode[2] ;
+   int32_t  rcode ;
+   int64_t  d ;
+   int  i ;
+
+   if( sensor < 0 || sensor >= w->nsensors ) {
+      return -1 ;
+   }
+   p = w->pend[sensor] ;
+   if( p == NULL ) {
+      p = w->pend[sensor] = calloc( 1, sizeof(*p) );
+      if( p == NULL ) {
+         return -1 ;
+      }
+   }
+   if( ncode == 0 ) {
+      ncode = n == 3 ? 2 : 1 ;
+      for( i = 0 ; i < ncode ; ++i ) {
+         lcode[i] = milli( val[n == 3 ? i +1 : 0] );
+      }
+      code = lcode ;
+   }
+
+   if( p->count > 0 && (p->count == PIB_BLOCK || p->n != n || p->ncode != ncode) ) {
+      if( block_flush( w, sensor ) < 0 ) {
+         return -1 ;
+      }
+   }
+   if( p->count == 0 ) {
+      p->n = n ;
+      p->ncode = ncode ;
+      p->tfirst = p->tprev = t ;
+      p->dprev = 0 ;
+      p->cprev[0] = p->cprev[1] = p->cprev[2] = 0 ;
+   } else {
+      d = t - p->tprev ;
+      p->nbytes[0] += put_varint( p->col[0] + p->nbytes[0], d - p->dprev );
+      p->tprev = t ;
+      p->dprev = d ;
+   }
+   for( i = 0 ; i < ncode ; ++i ) {
+      p->nbytes[i+1] += put_varint( p->col[i+1] + p->nbytes[i+1], (int64_t)code[i] - p->cprev[i] );
+      p->cprev[i] = code[i] ;
+   }
+   if( w->reflsb[sensor] != 0.0 ) {
+      rcode = ref_code( refv, w->reflsb[sensor] );
+      p->nbytes[3] += put_varint( p->col[3] + p->nbytes[3], (int64_t)rcode - p->cprev[2] );
+      p->cprev[2] = rcode ;
+   }
+   ++p->count ;
+   return 0 ;
+}
+
+/* pib_finish( w ) -- Write the pending blocks and the index, close
+ * -----
+ * @ret -- 0, or -1 if something couldn't be written
+ */
+int pib_finish( struct pib_writer * w )
+{
+   struct pib_footer  f ;
+   int  ret = 0 ;
+   int  i ;
+
+   for( i = 0 ; i < w->nsensors ; ++i ) {
+      if( block_flush( w, i ) < 0 ) {
+         ret = -1 ;
+      }
+      free( w->pend[i] );
+   }
+   idx_finish( &w->idx );
+
+   memset( &f, 0, sizeof(f) );
+   f.index = w->off ;
+   f.nindex = w->idx.n ;
+   memcpy( f.magic, PIB_XMAGIC, sizeof(f.magic) );
+   if( ret == 0 && (fwrite( w->idx.x, sizeof(*w->idx.x), w->idx.n, w->f ) != w->idx.n
+         || fwrite( &f, sizeof(f), 1, w->f ) != 1) ) {
+      ret = -1 ;
+   }
+   if( fclose( w->f ) != 0 ) {
+      ret = -1 ;
+   }
+   free( w->idx.x );
+   free( w );
+   return ret ;
+}
+
+/* Is the block header b (at off in a file of size) believable? */
+static int block_valid( const struct pib_reader * r, const struct pib_block * b,
+      int64_t off, int64_t size )
+{
+   int64_t  len = sizeof(*b) ;
+   int  i ;
+
+   if( memcmp( b->magic, PIB_BMAGIC, sizeof(b->magic) ) != 0
+         || b->sensor >= r->hdr.nsensors || b->count < 1 || b->count > PIB_BLOCK
+         || b->ncode < 1 || b->ncode > 2 || (b->n != 1 && b->n != 3) || b->tlast < b->tfirst
+         || (r->chan[b->sensor].ncode != 0 && b->ncode != r->chan[b->sensor].ncode) ) {
+      return 0 ;
+   }
+   for( i = 0 ; i < 4 ; ++i ) {
+      if( b->nbytes[i] > PIB_BLOCK * PIB_VARMAX ) {
+         return 0 ;
+      }
+      len += b->nbytes[i] ;
+   }
+   return off + len <= size ;
+}
+
+/* No footer, index the blocks from the start (start) until the
+ *    first one that's incomplete
+ */
+static int pib_scan( struct pib_reader * r, int64_t start, int64_t size )
+{
+   struct pib_block  b ;
+   int64_t  off = start ;
+
+   while( fseeko( r->f, off, SEEK_SET ) == 0 && fread( &b, sizeof(b), 1, r->f ) == 1
+         && block_valid( r, &b, off, size ) ) {
+      if( idx_add( &r->idx, off, b.tfirst, b.tlast ) < 0 ) {
+         return -1 ;
+      }
+      off += sizeof(b) + block_len( &b );
+   }
+   idx_finish( &r->idx );
+   r->end = off ;
+   return 0 ;
+}
+
+/* pib_open( path ) -- Open a binary stream file for reading
+ * -----
+ * @ret -- the reader, positioned at the start, or NULL
+ */
+struct pib_reader * pib_open( const char * path )
+{
+   struct pib_reader *  r ;
+   struct pib_footer  f ;
+   int64_t  start, size ;
+
+   r = calloc( 1, sizeof(*r) );
+   if( r == NULL ) {
+      return NULL ;
+   }
+   r->f = fopen( path, "r" );
+   if( r->f == NULL ) {
+      free( r );
+      return NULL ;
+   }
+   if( fread( &r->hdr, sizeof(r->hdr), 1, r->f ) != 1
+         || memcmp( r->hdr.magic, PIB_MAGIC, sizeof(r->hdr.magic) ) != 0
+         || r->hdr.block != PIB_BLOCK || r->hdr.nsensors > 0xffff ) {
+      goto fail ;
+   }
+   r->chan = calloc( r->hdr.nsensors +1, sizeof(*r->chan) );
+   if( r->chan == NULL
+         || fread( r->chan, sizeof(*r->chan), r->hdr.nsensors, r->f ) != r->hdr.nsensors ) {
+      goto fail ;
+   }
+   start = ftello( r->f );
+   if( fseeko( r->f, 0, SEEK_END ) != 0 || (size = ftello( r->f )) < start ) {
+      goto fail ;
+   }
+
+   if( size >= start + (int64_t) sizeof(f)
+         && fseeko( r->f, size - sizeof(f), SEEK_SET ) == 0
+         && fread( &f, sizeof(f), 1, r->f ) == 1
+         && memcmp( f.magic, PIB_XMAGIC, sizeof(f.magic) ) == 0
+         && f.index >= start
+         && f.index + (int64_t)(f.nindex * sizeof(struct pib_index) + sizeof(f)) == size ) {
+      r->idx.x = malloc( (f.nindex +1) * sizeof(*r->idx.x) );
+      if( r->idx.x == NULL || fseeko( r->f, f.index, SEEK_SET ) != 0
+            || fread( r->idx.x, sizeof(*r->idx.x), f.nindex, r->f ) != f.nindex ) {
+         goto fail ;
+      }
+      r->idx.n = r->idx.max = f.nindex ;
+      r->end = f.index ;
+   } else {
+      if( verbose > 0 ) {
+         fprintf( stderr, "%s: %s: not finished, indexing the blocks\n", ARGV0, path );
+      }
+      if( pib_scan( r, start, size ) < 0 ) {
+         goto fail ;
+      }
+   }
+
+   pib_seek( r, INT64_MIN, INT64_MAX );
+   return r ;
+
+fail :
+   pib_close( r );
+   return NULL ;
+}
+
+void pib_close( struct pib_reader * r )
+{
+   if( r == NULL ) {
+      return ;
+   }
+   if( r->f != NULL ) {
+      fclose( r->f );
+   }
+   free( r->chan );
+   free( r->idx.x );
+   free( r );
+}
+
+int pib_nsensors( const struct pib_reader * r )
+{
+   return r->hdr.nsensors ;
+}
+
+const char * pib_name( const struct pib_reader * r, int sensor )
+{
+   return sensor >= 0 && sensor < (int) r->hdr.nsensors ? r->chan[sensor].name : NULL ;
+}
+
+double pib_wall( const struct pib_reader * r, int64_t t )
+{
+   return r->hdr.wall0 + (t - r->hdr.t0) / 1000000000.0 ;
+}
+
+/* Wall clock nanoseconds, exact relative to the file's start (wall0
+ *    itself is a double)
+ */
+int64_t pib_wall_ns( const struct pib_reader * r, int64_t t )
+{
+   double  sec = floor( r->hdr.wall0 );
+
+   return (int64_t) sec * 1000000000 + llround( (r->hdr.wall0 - sec) * 1e9 ) + (t - r->hdr.t0) ;
+}
+
+int64_t pib_mono( const struct pib_reader * r, double wall )
+{
+   double  ns = (wall - r->hdr.wall0) * 1e9 + r->hdr.t0 ;
+
+   if( ! (ns > -9.2e18) ) {
+      return INT64_MIN ;
+   }
+   return ns < 9.2e18 ? (int64_t) llround( ns ) : INT64_MAX ;
+}
+
+/* pib_seek( r, from, to ) -- Read samples in [from, to) next
+ * -----
+ * @ret -- 0
+ *
+ * Binary search of the index for the first group with a block that
+ *    ends at or after from, everything before it ends earlier.
+ */
+int pib_seek( struct pib_reader * r, int64_t from, int64_t to )
+{
+   int  lo = 0 ;
+   int  hi = r->idx.n ;
+   int  mid ;
+
+   while( lo < hi ) {
+      mid = lo + (hi - lo) / 2 ;
+      if( r->idx.x[mid].tmax < from ) {
+         lo = mid +1 ;
+      } else {
+         hi = mid ;
+      }
+   }
+   r->from = from ;
+   r->to = to ;
+   r->group = lo ;
+   r->ingroup = 0 ;
+   r->off = lo < r->idx.n ? r->idx.x[lo].offset : r->end ;
+   r->blk.count = 0 ;
+   r->pos = 0 ;
+   return 0 ;
+}
+
+/* Decode a column of count deltas into col */
+static int column_decode( const uint8_t * p, const uint8_t * end, int count, int32_t * col )
+{
+   int64_t  v, c ;
+   int  i ;
+
+   for( c = 0, i = 0 ; i < count ; ++i ) {
+      if( (p = get_varint( p, end, &v )) == NULL ) {
+         return -1 ;
+      }
+      c += v ;
+      col[i] = c ;
+   }
+   return 0 ;
+}
+
+/* Decode the columns of the block in r->blk from r->buf, the codes
+ *    of the reference in r->code[2] (INT32_MIN if it has none)
+ */
+static int block_decode( struct pib_reader * r )
+{
+   const struct pib_block *  b = &r->blk ;
+   const uint8_t *  p = r->buf ;
+   const uint8_t *  end = p + b->nbytes[0] ;
+   int64_t  v, d ;
+   int  i, k ;
+
+   r->t[0] = b->tfirst ;
+   for( d = 0, i = 1 ; i < b->count ; ++i ) {
+      if( (p = get_varint( p, end, &v )) == NULL ) {
+         return -1 ;
+      }
+      d += v ;
+      r->t[i] = r->t[i-1] + d ;
+   }
+   for( k = 0 ; k < b->ncode ; ++k ) {
+      p = end ;
+      end = p + b->nbytes[k+1] ;
+      if( column_decode( p, end, b->count, r->code[k] ) < 0 ) {
+         return -1 ;
+      }
+   }
+   if( b->nbytes[3] == 0 ) {
+      for( i = 0 ; i < b->count ; ++i ) {
+         r->code[2][i] = INT32_MIN ;
+      }
+      return 0 ;
+   }
+   p = r->buf + b->nbytes[0] + b->nbytes[1] + b->nbytes[2] ;
+   return column_decode( p, p + b->nbytes[3], b->count, r->code[2] );
+}
+
+/* Read the next block that may hold samples in the range
+ * Returns 0, or -1 if there are no more
+ */
+static int block_next( struct pib_reader * r )
+{
+   struct pib_block *  b = &r->blk ;
+   size_t  len ;
+
+   while( 1 ) {
+      b->count = 0 ;
+      r->pos = 0 ;
+      if( r->off >= r->end || r->group >= r->idx.n || r->idx.x[r->group].tmin >= r->to ) {
+         return -1 ;
+      }
+      if( fseeko( r->f, r->off, SEEK_SET ) != 0 || fread( b, sizeof(*b), 1, r->f ) != 1
+            || ! block_valid( r, b, r->off, r->end ) ) {
+         b->count = 0 ;
+         return -1 ;
+      }
+      len = block_len( b );
+      r->off += sizeof(*b) + len ;
+      if( ++r->ingroup == PIB_GROUP ) {
+         ++r->group ;
+         r->ingroup = 0 ;
+      }
+      if( b->tlast < r->from || b->tfirst >= r->to ) {
+         continue ;  /* Nothing in range, don't bother decoding */
+      }
+      if( fread( r->buf, 1, len, r->f ) != len || block_decode( r ) < 0 ) {
+         b->count = 0 ;
+         return -1 ;
+      }
+      return 0 ;
+   }
+}
+
+/* pib_next( r, s ) -- Next sample in the range
+ * -----
+ * @ret -- 0 with s filled in, or -1 if there are no more
+ */
+int pib_next( struct pib_reader * r, struct pib_sample * s )
+{
+   const struct pib_chan *  ch ;
+   double  raw[2] ;
+   int  xf[2] ;
+   int  i, k ;
+
+   while( 1 ) {
+      while( r->pos < r->blk.count ) {
+         i = r->pos++ ;
+         if( r->t[i] < r->from || r->t[i] >= r->to ) {
+            continue ;
+         }
+         ch = r->chan + r->blk.sensor ;
+         s->sensor = r->blk.sensor ;
+         s->name = ch->name ;
+         s->t = r->t[i] ;
+         s->ncode = r->blk.ncode ;
+         s->refv = r->code[2][i] == INT32_MIN ? NAN : r->code[2][i] * ch->reflsb ;
+         for( k = 0 ; k < s->ncode ; ++k ) {
+            s->code[k] = r->code[k][i] ;
+            raw[k] = s->code[k] == INT32_MIN ? NAN : s->code[k] / 1000.0 ;
+         }
+         if( ch->ncode == 0 ) {
+            /* Lua sensor, the values in milli-units */
+            s->n = r->blk.n ;
+            if( s->n == 3 ) {
+               s->val[1] = raw[0] ;
+               s->val[2] = raw[1] ;
+               s->val[0] = raw[0] * raw[1] ;
+            } else {
+               s->val[0] = raw[0] ;
+            }
+         } else {
+            for( k = 0 ; k < s->ncode ; ++k ) {
+               raw[k] = s->code[k] * ch->lsb[k] ;
+               xf[k] = ch->xf[k] ;
+            }
+            s->n = pi_acq_convert( ch->kind, xf, raw, ch->vref, ch->pullup,
+                  s->refv, s->val );
+         }
+         return 0 ;
+      }
+      if( block_next( r ) < 0 ) {
+         return -1 ;
+      }
+   }
+}
+
+/* ex: set sw=3 sta et : */
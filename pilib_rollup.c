@@ -0,0 +1,200 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Rollups...
+ *   Count, sum, sum of squares, min and max of each value of each
+ *   streamed sensor over 1 second, 1 minute and 1 hour periods on
+ *   wall clock boundaries, kept up to date by the stream writer on
+ *   every record.  Each tier keeps the period in progress and the
+ *   last completed one, so "average CPU1 watts over the last hour"
+ *   is a copy of one record.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+static const double  tierStep[PIROLLUP_TIERS] = { 1.0, 60.0, 3600.0 } ;
+static const char * const  tierNames[] = { "1s", "1m", "1h", NULL } ;
+
+/* A sensor's tier, written by the writer thread only.  seq is odd
+ *    while it is being updated (see latest_put in pilib_stream.c).
+ */
+struct pi_tier {
+   unsigned long  seq ;
+   struct pi_rollup  cur ;  /* Period in progress */
+   struct pi_rollup  done ;  /* Last completed, n = 0 if none yet */
+} ;
+
+static struct pi_tier  tiers[PIACQ_MAXSENSORS][PIROLLUP_TIERS] ;
+
+/* pi_rollup_reset( ) -- Forget all periods, a new stream starts */
+void pi_rollup_reset( void )
+{
+   memset( tiers, 0, sizeof(tiers) );
+}
+
+/* pi_rollup_sample( sensor, t, val, n ) -- Add a sample to every tier
+ *    of a sensor, by the writer thread
+ */
+void pi_rollup_sample( int sensor, int64_t t, const double * val, int n )
+{
+   struct pi_tier *  tr ;
+   struct pi_rollup *  r ;
+   double  wall = mono2wall( t );
+   double  start ;
+   int  k, i ;
+
+   for( k = 0 ; k < PIROLLUP_TIERS ; ++k ) {
+      tr = tiers[sensor] + k ;
+      r = &tr->cur ;
+      start = floor( wall / tierStep[k] ) * tierStep[k] ;
+
+      __atomic_store_n( &tr->seq, tr->seq +1, __ATOMIC_RELAXED );
+      __atomic_thread_fence( __ATOMIC_RELEASE );
+      if( r->n > 0 && start > r->start ) {
+         tr->done = *r ;
+         r->n = 0 ;
+      }
+      if( r->n == 0 ) {
+         r->start = start ;
+         r->step = tierStep[k] ;
+         r->nval = n ;
+         for( i = 0 ; i < 3 ; ++i ) {
+            r->sum[i] = r->sumsq[i] = 0 ;
+            r->min[i] = r->max[i] = i < n ? val[i] : NAN ;
+         }
+      }
+      ++r->n ;
+      for( i = 0 ; i < n ; ++i ) {
+         r->sum[i] += val[i] ;
+         r->sumsq[i] += val[i] * val[i] ;
+         if( val[i] < r->min[i] ) {
+            r->min[i] = val[i] ;
+         }
+         if( val[i] > r->max[i] ) {
+            r->max[i] = val[i] ;
+         }
+      }
+      __atomic_store_n( &tr->seq, tr->seq +1, __ATOMIC_RELEASE );
+   }
+}
+
+/* pi_rollup_get( sensor, tier, current, r ) -- Copy a rollup
+ * @tier -- PIROLLUP_SEC, PIROLLUP_MIN or PIROLLUP_HOUR
+ * @current -- the period in progress rather than the last completed
+ * -----
+ * @ret -- 0, or -1 if there is none (r->n is 0)
+ */
+int pi_rollup_get( int sensor, int tier, int current, struct pi_rollup * r )
+{
+   struct pi_tier *  tr ;
+   unsigned long  seq ;
+
+   if( sensor < 0 || sensor >= piplan.nsensors || tier < 0 || tier >= PIROLLUP_TIERS ) {
+      return -1 ;
+   }
+   tr = tiers[sensor] + tier ;
+   do {
+      seq = __atomic_load_n( &tr->seq, __ATOMIC_ACQUIRE );
+      *r = current ? tr->cur : tr->done ;
+      __atomic_thread_fence( __ATOMIC_ACQUIRE );
+   } while( (seq & 1) || seq != __atomic_load_n( &tr->seq, __ATOMIC_RELAXED ) );
+
+   return r->n > 0 ? 0 : -1 ;
+}
+
+/* Standard deviation of value i of a rollup */
+double pi_rollup_sd( const struct pi_rollup * r, int i )
+{
+   double  mean, var ;
+
+   if( r->n < 2 ) {
+      return 0.0 ;
+   }
+   mean = r->sum[i] / r->n ;
+   var = (r->sumsq[i] - r->n * mean * mean) / (r->n -1) ;
+   return var > 0 ? sqrt( var ) : 0.0 ;
+}
+
+/* Push { v1, v2, v3 } from x[0 .. n-1] */
+static void push_values( lua_State * L, const double * x, int n )
+{
+   int  i ;
+
+   lua_createtable( L, n, 0 );
+   for( i = 0 ; i < n ; ++i ) {
+      lua_pushnumber( L, x[i] );
+      lua_rawseti( L, -2, i +1 );
+   }
+}
+
+/* pi_rollup( name, [tier], [current] ) -- Aggregates of a sensor
+ * @name -- sensor streamed by pi.stream( ) or pi.stream_start( )
+ * @tier -- "1s", "1m" (default) or "1h"
+ * @current -- true for the period in progress, else the last completed
+ * -----
+ * @rollup -- { start=, step=, n=, avg={ }, min={ }, max={ }, sd={ },
+ *    sum={ }, sumsq={ } } with a value each for watt, volt and amp of
+ *    power sensors, one for others, or nil if there is none
+ */
+int pi_rollup(lua_State * L)
+{
+   const char *  name = luaL_checkstring( L, 1 );
+   int  tier = luaL_checkoption( L, 2, "1m", tierNames );
+   struct pi_rollup  r ;
+   double  x[3] ;
+   int  idx ;
+   int  i ;
+
+   for( idx = 0 ; idx < piplan.nsensors ; ++idx ) {
+      if( strcmp( piplan.sensor[idx].name, name ) == 0 ) {
+         break ;
+      }
+   }
+   if( pi_rollup_get( idx, tier, lua_toboolean( L, 3 ), &r ) < 0 ) {
+      lua_pushnil( L );
+      return 1 ;
+   }
+
+   lua_newtable( L );
+   lua_pushnumber( L, r.start );
+   lua_setfield( L, -2, "start" );
+   lua_pushnumber( L, r.step );
+   lua_setfield( L, -2, "step" );
+   lua_pushnumber( L, r.n );
+   lua_setfield( L, -2, "n" );
+   for( i = 0 ; i < r.nval ; ++i ) {
+      x[i] = r.sum[i] / r.n ;
+   }
+   push_values( L, x, r.nval );
+   lua_setfield( L, -2, "avg" );
+   for( i = 0 ; i < r.nval ; ++i ) {
+      x[i] = pi_rollup_sd( &r, i );
+   }
+   push_values( L, x, r.nval );
+   lua_setfield( L, -2, "sd" );
+   push_values( L, r.min, r.nval );
+   lua_setfield( L, -2, "min" );
+   push_values( L, r.max, r.nval );
+   lua_setfield( L, -2, "max" );
+   push_values( L, r.sum, r.nval );
+   lua_setfield( L, -2, "sum" );
+   push_values( L, r.sumsq, r.nval );
+   lua_setfield( L, -2, "sumsq" );
+
+   return 1 ;
+}
+
+/* ex: set sw=3 sta et : */
@@ -0,0 +1,213 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Real-time support...
+ *   Locking the working set in memory, SCHED_FIFO and CPU pinning
+ *   for the acquisition loop.  See rtprio, rtlock and rtcpu in
+ *   piglobal.h
+ */
+
+#define _GNU_SOURCE  /* CPU_SET, pthread_setaffinity_np */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+/* Stack and heap to pre-fault beyond what's already in use */
+#define PIRT_STACK (64*1024)
+#define PIRT_HEAP (1024*1024)
+
+/* What pi_rt_enter changed, per thread, for pi_rt_leave */
+struct pi_rtsave {
+   int  depth ;  /* pi_rt_enter( )s not left yet */
+   int  changed ;  /* 1 = affinity, 2 = scheduling */
+   int  policy ;
+   struct sched_param  param ;
+   cpu_set_t  cpus ;
+} ;
+static __thread struct pi_rtsave  save ;
+
+/* Touch a stack region so it's faulted in before we lock */
+static void prefault_stack( void )
+{
+   volatile char  stack[PIRT_STACK] ;
+   size_t  i ;
+
+   for( i = 0 ; i < sizeof(stack) ; i += 1024 ) {
+      stack[i] = 0 ;
+   }
+}
+
+/* pi_rt_lock( L ) -- Pre-fault and lock the working set (rtlock)
+ * @L -- Lua state, collected first so the heap is as small as it gets
+ * -----
+ * @ret -- 0 on success (or not requested), -1 and sets errno
+ *
+ * Call once the configuration is loaded (after post_conf.lc) so the
+ *    Lua state is part of what's locked.  Freed heap is kept rather
+ *    than returned to the system, so later allocations reuse locked
+ *    pages instead of faulting new ones.
+ */
+int pi_rt_lock( lua_State * L )
+{
+   char *  heap ;
+   size_t  i ;
+
+   if( ! rtlock ) {
+      return 0 ;
+   }
+
+   if( L != NULL ) {
+      lua_gc( L, LUA_GCCOLLECT, 0 );
+   }
+
+   /* Keep freed memory in the heap, and the heap out of mmap */
+   mallopt( M_TRIM_THRESHOLD, -1 );
+   mallopt( M_MMAP_MAX, 0 );
+
+   if( mlockall( MCL_CURRENT | MCL_FUTURE ) < 0 ) {
+      fprintf( stderr, "%s: WARNING: mlockall: %s\n", ARGV0, strerror( errno ) );
+      return -1 ;
+   }
+
+   /* Grow (and fault in) heap and stack headroom while locked */
+   heap = malloc( PIRT_HEAP );
+   if( heap != NULL ) {
+      for( i = 0 ; i < PIRT_HEAP ; i += 1024 ) {
+         heap[i] = 0 ;
+      }
+      free( heap );
+   }
+   prefault_stack( );
+
+   if( verbose > 0 ) {
+      fprintf( stderr, "%s: Working set locked in memory\n", ARGV0 );
+   }
+   return 0 ;
+}
+
+/* pi_rt_enter( cpu ) -- Make the calling thread a real-time loop
+ * @cpu -- CPU to pin to, -1 for none (usually rtcpu)
+ * -----
+ * @ret -- 0 on success (or not requested), -1 if any part failed
+ *
+ * Applies rtprio (SCHED_FIFO) and cpu (affinity) to the calling
+ *    thread only, so threads it has already created, or creates with
+ *    pi_rt_create( ) (eg. the stream writer), keep running under the
+ *    normal scheduler.  Failures are
+ *    warnings, the loop still runs, just not real-time.
+ *
+ * Calls nest (libpidev's pidev_open( ), then a stream on the same
+ *    thread): only the outermost saves what it changes, and only the
+ *    pi_rt_leave( ) matching it restores it.
+ */
+int pi_rt_enter( int cpu )
+{
+   struct sched_param  param ;
+   cpu_set_t  cpus ;
+   int  ret = 0 ;
+   int  outer = save.depth++ == 0 ;
+   int  err ;
+
+   if( outer ) {
+      save.changed = 0 ;
+   }
+
+   if( cpu >= 0 ) {
+      if( ! (save.changed & 1) ) {
+         pthread_getaffinity_np( pthread_self( ), sizeof(save.cpus), &save.cpus );
+      }
+      CPU_ZERO( &cpus );
+      CPU_SET( cpu, &cpus );
+      err = pthread_setaffinity_np( pthread_self( ), sizeof(cpus), &cpus );
+      if( err != 0 ) {
+         fprintf( stderr, "%s: WARNING: pinning to CPU %d: %s\n", ARGV0, cpu, strerror( err ) );
+         ret = -1 ;
+      } else {
+         save.changed |= 1 ;
+      }
+   }
+
+   if( rtprio > 0 ) {
+      if( ! (save.changed & 2) ) {
+         pthread_getschedparam( pthread_self( ), &save.policy, &save.param );
+      }
+      memset( &param, 0, sizeof(param) );
+      param.sched_priority = rtprio ;
+      err = pthread_setschedparam( pthread_self( ), SCHED_FIFO, &param );
+      if( err != 0 ) {
+         fprintf( stderr, "%s: WARNING: SCHED_FIFO priority %d: %s\n", ARGV0, rtprio, strerror( err ) );
+         ret = -1 ;
+      } else {
+         save.changed |= 2 ;
+      }
+   }
+
+   if( verbose > 0 && outer && save.changed ) {
+      fprintf( stderr, "%s: Real-time loop: priority %d, CPU %d\n", ARGV0,
+            save.changed & 2 ? rtprio : 0, save.changed & 1 ? cpu : -1 );
+   }
+   return ret ;
+}
+
+/* pi_rt_leave( ) -- Restore what pi_rt_enter changed, once every
+ *    pi_rt_enter( ) is left
+ */
+void pi_rt_leave( void )
+{
+   if( save.depth > 0 && --save.depth > 0 ) {
+      return ;
+   }
+   if( save.changed & 2 ) {
+      pthread_setschedparam( pthread_self( ), save.policy, &save.param );
+   }
+   if( save.changed & 1 ) {
+      pthread_setaffinity_np( pthread_self( ), sizeof(save.cpus), &save.cpus );
+   }
+   save.changed = 0 ;
+}
+
+/* pi_rt_create( thread, fn, arg ) -- pthread_create( ) a thread that
+ *    isn't real-time: it gets the scheduling and CPUs the calling
+ *    thread had before pi_rt_enter( ), not its SCHED_FIFO and pinning
+ * -----
+ * @ret -- 0 or an error number, as pthread_create( )
+ */
+int pi_rt_create( pthread_t * thread, void * (* fn)( void * ), void * arg )
+{
+   pthread_attr_t  attr ;
+   int  ret ;
+
+   if( save.changed == 0 ) {
+      return pthread_create( thread, NULL, fn, arg );
+   }
+
+   pthread_attr_init( &attr );
+   if( save.changed & 2 ) {
+      pthread_attr_setinheritsched( &attr, PTHREAD_EXPLICIT_SCHED );
+      pthread_attr_setschedpolicy( &attr, save.policy );
+      pthread_attr_setschedparam( &attr, &save.param );
+   }
+   if( save.changed & 1 ) {
+      pthread_attr_setaffinity_np( &attr, sizeof(save.cpus), &save.cpus );
+   }
+   ret = pthread_create( thread, &attr, fn, arg );
+   pthread_attr_destroy( &attr );
+   return ret ;
+}
+
+/* ex: set sw=3 sta et : */
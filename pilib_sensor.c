@@ -27,6 +27,11 @@
  * @reading -- "raw" reading in range [0,1)
  * @vref -- optional reference voltage -- default 4.096
  */
+double sens_5v( double reading, double vref )
+{
+   return reading * vref * (414.0/249) ;
+}
+
 int pi_sens_5v(lua_State * L)
 {
    lua_Number  reading ;
@@ -35,7 +40,7 @@ int pi_sens_5v(lua_State * L)
    reading = luaL_checknumber( L, 1 );
    vref = luaL_optnumber( L, 2, 4.096 );
 
-   lua_pushnumber( L, reading * vref * (414.0/249) );
+   lua_pushnumber( L, sens_5v( reading, vref ) );
    return 1;
 }
 
@@ -43,6 +48,11 @@ int pi_sens_5v(lua_State * L)
  * @reading -- "raw" reading in range [0,1)
  * @vref -- optional reference voltage -- default 4.096
  */
+double sens_12v( double reading, double vref )
+{
+   return reading * vref * (535.0/133) ;
+}
+
 int pi_sens_12v(lua_State * L)
 {
    lua_Number  reading ;
@@ -51,7 +61,7 @@ int pi_sens_12v(lua_State * L)
    reading = luaL_checknumber( L, 1 );
    vref = luaL_optnumber( L, 2, 4.096 );
 
-   lua_pushnumber( L, reading * vref * (535.0/133) );
+   lua_pushnumber( L, sens_12v( reading, vref ) );
    return 1;
 }
 
@@ -59,6 +69,11 @@ int pi_sens_12v(lua_State * L)
  * @reading -- "raw" reading in range [0,1)
  * @vref -- optional reference voltage -- default 4.096
  */
+double sens_3v3( double reading, double vref )
+{
+   return reading * vref * (121.0/110) ;
+}
+
 int pi_sens_3v3(lua_State * L)
 {
    lua_Number  reading ;
@@ -67,7 +82,7 @@ int pi_sens_3v3(lua_State * L)
    reading = luaL_checknumber( L, 1 );
    vref = luaL_optnumber( L, 2, 4.096 );
 
-   lua_pushnumber( L, reading * vref * (121.0/110) );
+   lua_pushnumber( L, sens_3v3( reading, vref ) );
    return 1;
 }
 
@@ -75,6 +90,14 @@ int pi_sens_3v3(lua_State * L)
  * @reading -- "raw" reading in range [0,1)
  * @vref -- optional reference voltage -- default 5.00 (not used)
  */
+double sens_acs713_20( double reading )
+{
+   /* We can hardcode the gain as 185mV/A at 5.0V VCC because the
+    *   gain is ratiometric to VCC and the reading is a ratio of VCC
+    */
+   return (reading - 0.1) * (5.0/0.185) ;
+}
+
 int pi_sens_acs713_20(lua_State * L)
 {
    lua_Number  reading ;
@@ -83,10 +106,7 @@ int pi_sens_acs713_20(lua_State * L)
    reading = luaL_checknumber( L, 1 );
 //   vref = luaL_optnumber( L, 2, 5.0 );
 
-   /* We can hardcode the gain as 185mV/A at 5.0V VCC because the
-    *   gain is ratiometric to VCC and the reading is a ratio of VCC
-    */
-   lua_pushnumber( L, (reading - 0.1) * (5.0/0.185) );
+   lua_pushnumber( L, sens_acs713_20( reading ) );
    return 1;
 }
 
@@ -94,6 +114,14 @@ int pi_sens_acs713_20(lua_State * L)
  * @reading -- "raw" reading in range [0,1)
  * @vref -- optional reference voltage -- default 5.00 (not used)
  */
+double sens_acs713_30( double reading )
+{
+   /* We can hardcode the gain as 133mV/A at 5.0V VCC because the
+    *   gain is ratiometric to VCC and the reading is a ratio of VCC
+    */
+   return (reading - 0.1) * (5.0/0.133) ;
+}
+
 int pi_sens_acs713_30(lua_State * L)
 {
    lua_Number  reading ;
@@ -102,10 +130,7 @@ int pi_sens_acs713_30(lua_State * L)
    reading = luaL_checknumber( L, 1 );
 //   vref = luaL_optnumber( L, 2, 5.0 );
 
-   /* We can hardcode the gain as 133mV/A at 5.0V VCC because the
-    *   gain is ratiometric to VCC and the reading is a ratio of VCC
-    */
-   lua_pushnumber( L, (reading - 0.1) * (5.0/0.133) );
+   lua_pushnumber( L, sens_acs713_30( reading ) );
    return 1;
 }
 
@@ -113,6 +138,14 @@ int pi_sens_acs713_30(lua_State * L)
  * @reading -- "raw" reading in range [0,1)
  * @vref -- optional reference voltage -- default 5.00 (not used)
  */
+double sens_acs723_10( double reading )
+{
+   /* We can hardcode the gain as 400mV/A at 5.0V VCC because the
+    *   gain is ratiometric to VCC and the reading is a ratio of VCC
+    */
+   return (reading - 0.1) * (5.0/0.400) ;
+}
+
 int pi_sens_acs723_10(lua_State * L)
 {
    lua_Number  reading ;
@@ -121,10 +154,7 @@ int pi_sens_acs723_10(lua_State * L)
    reading = luaL_checknumber( L, 1 );
 //   vref = luaL_optnumber( L, 2, 5.0 );
 
-   /* We can hardcode the gain as 400mV/A at 5.0V VCC because the
-    *   gain is ratiometric to VCC and the reading is a ratio of VCC
-    */
-   lua_pushnumber( L, (reading - 0.1) * (5.0/0.400) );
+   lua_pushnumber( L, sens_acs723_10( reading ) );
    return 1;
 }
 
@@ -132,6 +162,14 @@ int pi_sens_acs723_10(lua_State * L)
  * @reading -- "raw" reading in range [0,1)
  * @vref -- optional reference voltage -- default 5.00 (not used)
  */
+double sens_acs723_20( double reading )
+{
+   /* We can hardcode the gain as 200mV/A at 5.0V VCC because the
+    *   gain is ratiometric to VCC and the reading is a ratio of VCC
+    */
+   return (reading - 0.1) * (5.0/0.200) ;
+}
+
 int pi_sens_acs723_20(lua_State * L)
 {
    lua_Number  reading ;
@@ -140,10 +178,7 @@ int pi_sens_acs723_20(lua_State * L)
    reading = luaL_checknumber( L, 1 );
 //   vref = luaL_optnumber( L, 2, 5.0 );
 
-   /* We can hardcode the gain as 200mV/A at 5.0V VCC because the
-    *   gain is ratiometric to VCC and the reading is a ratio of VCC
-    */
-   lua_pushnumber( L, (reading - 0.1) * (5.0/0.200) );
+   lua_pushnumber( L, sens_acs723_20( reading ) );
    return 1;
 }
 
@@ -189,6 +224,11 @@ int pi_sens_acs723_20(lua_State * L)
  * @reading -- "raw" reading in range [0,1)
  * @vcc -- recommended reference voltage -- default 5.00
  */
+double sens_shunt10( double reading, double vcc )
+{
+   return (reading-(4600.2/95157))*vcc*(95157/(0.010*1421461.8)) ;
+}
+
 int pi_sens_shunt10(lua_State * L)
 {
    lua_Number  reading ;
@@ -197,7 +237,7 @@ int pi_sens_shunt10(lua_State * L)
    reading = luaL_checknumber( L, 1 );
    vcc = luaL_optnumber( L, 2, 5.0 );
 
-   lua_pushnumber( L, (reading-(4600.2/95157))*vcc*(95157/(0.010*1421461.8)) );
+   lua_pushnumber( L, sens_shunt10( reading, vcc ) );
    return 1;
 }
 
@@ -205,6 +245,11 @@ int pi_sens_shunt10(lua_State * L)
  * @reading -- "raw" reading in range [0,1)
  * @vcc -- recommended reference voltage -- default 5.00
  */
+double sens_shunt25( double reading, double vcc )
+{
+   return (reading-(4600.2/95157))*vcc*(95157/(0.025*1421461.8)) ;
+}
+
 int pi_sens_shunt25(lua_State * L)
 {
    lua_Number  reading ;
@@ -213,7 +258,7 @@ int pi_sens_shunt25(lua_State * L)
    reading = luaL_checknumber( L, 1 );
    vcc = luaL_optnumber( L, 2, 5.0 );
 
-   lua_pushnumber( L, (reading-(4600.2/95157))*vcc*(95157/(0.025*1421461.8)) );
+   lua_pushnumber( L, sens_shunt25( reading, vcc ) );
    return 1;
 }
 
@@ -221,6 +266,11 @@ int pi_sens_shunt25(lua_State * L)
  * @reading -- "raw" reading in range [0,1)
  * @vcc -- recommended reference voltage -- default 5.00
  */
+double sens_shunt50( double reading, double vcc )
+{
+   return (reading-(4600.2/95157))*vcc*(95157/(0.050*1421461.8)) ;
+}
+
 int pi_sens_shunt50(lua_State * L)
 {
    lua_Number  reading ;
@@ -229,7 +279,7 @@ int pi_sens_shunt50(lua_State * L)
    reading = luaL_checknumber( L, 1 );
    vcc = luaL_optnumber( L, 2, 5.0 );
 
-   lua_pushnumber( L, (reading-(4600.2/95157))*vcc*(95157/(0.050*1421461.8)) );
+   lua_pushnumber( L, sens_shunt50( reading, vcc ) );
    return 1;
 }
 
@@ -0,0 +1,649 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Plan snapshots...
+ *   The config file (MainCarrier( ), setHeader( ), Sensors( ) ...)
+ *   builds the sensors in Lua, opening and initializing the hardware
+ *   as it goes, and pi.compile( ) flattens them into the plan.  A
+ *   snapshot is that plan written out: device paths of the banks and
+ *   chip selects, SPI mode and speed and ADC setup, and each sensor's
+ *   channels, transfer functions, filters, references and
+ *   decimation.  Loading it opens and initializes the same devices in
+ *   C and streams, or reads the sensors by name (the default App,
+ *   libpidev reads), without running the config file at all.
+ *
+ * The snapshot carries a checksum of the config file, init_final.lc
+ *   and post_conf.lc, so it is stale as soon as any of them changes.
+ *   Sensors sampled through Lua can't be in a snapshot, and Thresholds,
+ *   Capture and History are not part of it.  Nor is a config file's own
+ *   App, a snapshot of one is stale for running the App.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PISNAP_MAGIC "PISNAP1\n"
+
+/* The file: a header, the banks, chip selects and sensors */
+struct pis_header {
+   char  magic[8] ;
+   uint32_t  layout ;  /* sizeof of the records, a different build */
+   char  sum[PISNAP_SUMLEN] ;
+   int32_t  nbanks, ncs, nsensors ;
+   int32_t  app ;  /* The config file has its own App */
+} ;
+
+struct pis_bank {
+   int32_t  nbits ;
+   char  path[PIACQ_MAXBITS][PISNAP_PATHLEN] ;
+} ;
+
+struct pis_cs {
+   char  path[PISNAP_PATHLEN] ;  /* spidev */
+   int32_t  adc ;  /* PIADC_XXX */
+   int32_t  bank ;  /* Index, -1 if no bank select */
+   int32_t  banksel ;
+   uint32_t  mode ;  /* SPI mode */
+   uint32_t  speed ;  /* SPI max speed (Hz), 0 to leave it */
+   int32_t  rate ;  /* ADS1256 conversion rate */
+   double  scale ;  /* ADS1256 1/gain */
+} ;
+
+struct pis_chan {
+   int32_t  cs ;  /* Index, -1 if not used */
+   int32_t  mux ;
+   int32_t  oversample ;
+   double  filter ;
+} ;
+
+struct pis_sensor {
+   char  name[16] ;
+   int32_t  kind, emit ;
+   int32_t  vxf, axf, txf ;
+   int32_t  vcc, cj ;
+   int32_t  cic, fir ;
+   double  vref, pullup, period ;
+   struct pis_chan  v, a, t ;
+} ;
+
+#define PISNAP_LAYOUT (sizeof(struct pis_header) + sizeof(struct pis_bank) + sizeof(struct pis_cs) + sizeof(struct pis_sensor))
+
+/* Sensors selected when the snapshot was taken */
+static int  snapemit[PIACQ_MAXSENSORS] ;
+
+/* Epoch each sensor was last read by name in (pi_snap_read) */
+static unsigned long  snapepoch[PIACQ_MAXSENSORS] ;
+
+/* FNV-1a of a file into h, returns -1 if it can't be read */
+static int sum_file( const char * path, uint64_t * h )
+{
+   unsigned char  buf[4096] ;
+   size_t  n, i ;
+   FILE *  f ;
+
+   f = fopen( path, "r" );
+   if( f == NULL ) {
+      return -1 ;
+   }
+   while( (n = fread( buf, 1, sizeof(buf), f )) > 0 ) {
+      for( i = 0 ; i < n ; ++i ) {
+         *h = (*h ^ buf[i]) * 0x100000001b3ULL ;
+      }
+   }
+   fclose( f );
+   return 0 ;
+}
+
+/* pi_snap_sum( sum ) -- Checksum of the configuration
+ * @sum -- PISNAP_SUMLEN characters for it
+ * -----
+ * @ret -- 0, or -1 if the config file can't be read
+ */
+int pi_snap_sum( char * sum )
+{
+   static const char * const  libs[] = { "/init_final.lc", "/post_conf.lc", NULL } ;
+   char  path[1024] ;
+   uint64_t  h = 0xcbf29ce484222325ULL ;
+   int  i ;
+
+   if( sum_file( configfile, &h ) < 0 ) {
+      return -1 ;
+   }
+   for( i = 0 ; libs[i] != NULL ; ++i ) {
+      snprintf( path, sizeof(path), "%s%s", libexecdir, libs[i] );
+      sum_file( path, &h );  /* Missing is a change as well */
+   }
+   snprintf( sum, PISNAP_SUMLEN, "%016llx", (unsigned long long)h );
+   return 0 ;
+}
+
+/* Copy the string at the top of the stack to path and pop it */
+static void pop_path( lua_State * L, char * path, const char * what )
+{
+   const char *  p = lua_tostring( L, -1 );
+
+   if( p == NULL || strlen( p ) >= PISNAP_PATHLEN ) {
+      luaL_error( L, "snapshot: no usable device name for %s", what );
+   }
+   strcpy( path, p );
+   lua_pop( L, 1 );
+}
+
+static void save_chan( const struct pi_chan * c, struct pis_chan * d )
+{
+   d->cs = c->cs != NULL ? c->cs - piplan.cs : -1 ;
+   d->mux = c->mux ;
+   d->oversample = c->oversample ;
+   d->filter = c->filter ;
+}
+
+/* pi_snap_save( L, path ) -- Write the plan (compiled from the config
+ *    file, the devices come from its Lua tables) to a snapshot
+ * -----
+ * @ret -- 0, or -1 with errno set if the file can't be written.
+ *    Raises an error if the plan can't be a snapshot.
+ */
+int pi_snap_save( lua_State * L, const char * path )
+{
+   struct pis_header  h ;
+   struct pis_bank  b ;
+   struct pis_cs  c ;
+   struct pis_sensor  d ;
+   const struct pi_cs *  cs ;
+   const struct pi_sensor *  s ;
+   __u8  mode ;
+   __u32  speed ;
+   FILE *  f ;
+   int  i, k ;
+
+   if( piplan.snapshot ) {
+      return luaL_error( L, "snapshot: the plan is already a snapshot" );
+   }
+   memset( &h, 0, sizeof(h) );
+   memcpy( h.magic, PISNAP_MAGIC, sizeof(h.magic) );
+   h.layout = PISNAP_LAYOUT ;
+   if( pi_snap_sum( h.sum ) < 0 ) {
+      return luaL_error( L, "snapshot: can't read %s: %s", configfile, strerror( errno ) );
+   }
+   h.nbanks = piplan.nbanks ;
+   h.ncs = piplan.ncs ;
+   h.nsensors = piplan.nsensors ;
+   lua_getfield( L, LUA_GLOBALSINDEX, "App" );
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "defaultApp" );
+   h.app = ! lua_isnil( L, -3 ) && ! lua_rawequal( L, -3, -1 );
+   lua_pop( L, 3 );
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      if( piplan.sensor[i].kind == PIKIND_LUA ) {
+         return luaL_error( L, "snapshot: %s is sampled through Lua", piplan.sensor[i].name );
+      }
+   }
+
+   f = fopen( path, "w" );
+   if( f == NULL ) {
+      return -1 ;
+   }
+   fwrite( &h, sizeof(h), 1, f );
+
+   for( i = 0 ; i < piplan.nbanks ; ++i ) {
+      memset( &b, 0, sizeof(b) );
+      b.nbits = piplan.bank[i].nbits ;
+      lua_rawgeti( L, LUA_REGISTRYINDEX, piplan.bank[i].ref );
+      lua_getfield( L, -1, "name" );
+      if( lua_type( L, -1 ) != LUA_TTABLE ) {
+         fclose( f );
+         return luaL_error( L, "snapshot: bank %d has no device names", i );
+      }
+      for( k = 0 ; k < b.nbits ; ++k ) {
+         lua_rawgeti( L, -1, k +1 );
+         pop_path( L, b.path[k], "a bank" );
+      }
+      lua_pop( L, 2 );
+      fwrite( &b, sizeof(b), 1, f );
+   }
+
+   for( i = 0 ; i < piplan.ncs ; ++i ) {
+      cs = piplan.cs + i ;
+      memset( &c, 0, sizeof(c) );
+      c.adc = cs->adc ;
+      c.bank = cs->bank != NULL ? cs->bank - piplan.bank : -1 ;
+      c.banksel = cs->banksel ;
+      c.scale = cs->scale ;
+      lua_rawgeti( L, LUA_REGISTRYINDEX, cs->ref );
+      lua_getfield( L, -1, "rate" );
+      c.rate = luaL_optint( L, -1, 2000 );
+      lua_getfield( L, -2, "spi" );
+      lua_getfield( L, -1, "name" );
+      pop_path( L, c.path, "a chip select" );
+      lua_pop( L, 3 );
+
+      /* As the config file left them */
+      mode = 0 ;
+      speed = 0 ;
+      ioctl( cs->fd, SPI_IOC_RD_MODE, &mode );
+      ioctl( cs->fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed );
+      c.mode = mode ;
+      c.speed = speed ;
+      fwrite( &c, sizeof(c), 1, f );
+   }
+
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      s = piplan.sensor + i ;
+      memset( &d, 0, sizeof(d) );
+      strncpy( d.name, s->name, sizeof(d.name) -1 );
+      d.kind = s->kind ;
+      d.emit = s->emit ;
+      d.vxf = s->vxf ;
+      d.axf = s->axf ;
+      d.txf = s->txf ;
+      d.vcc = s->vcc ;
+      d.cj = s->cj ;
+      pi_decim_get( i, &k, &d.fir );
+      d.cic = k ;
+      d.vref = s->vref ;
+      d.pullup = s->pullup ;
+      d.period = s->period ;
+      save_chan( &s->v, &d.v );
+      save_chan( &s->a, &d.a );
+      save_chan( &s->t, &d.t );
+      fwrite( &d, sizeof(d), 1, f );
+   }
+
+   if( ferror( f ) ) {
+      fclose( f );
+      return -1 ;
+   }
+   return fclose( f );
+}
+
+static void load_chan( const struct pis_chan * d, struct pi_chan * c )
+{
+   c->cs = d->cs >= 0 ? piplan.cs + d->cs : NULL ;
+   c->mux = d->mux ;
+   c->oversample = d->oversample ;
+   c->filter = d->filter ;
+   c->last = NAN ;
+}
+
+/* Open a device for the plan, an error if it can't be */
+static int open_dev( lua_State * L, const char * path )
+{
+   int  fd ;
+
+   fd = open( path, O_RDWR );
+   if( fd < 0 ) {
+      luaL_error( L, "snapshot: error opening '%s': %s", path, strerror( errno ) );
+   }
+   return fd ;
+}
+
+/* Set up a chip select the way the config file did */
+static int init_cs( struct pi_cs * cs, const struct pis_cs * c )
+{
+   __u8  mode = c->mode ;
+   __u32  speed = c->speed ;
+   double  raw, ofc, fsc ;
+   int  ret ;
+
+   if( ioctl( cs->fd, SPI_IOC_WR_MODE, &mode ) < 0 ||
+         (speed > 0 && ioctl( cs->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed ) < 0) ) {
+      return -1 ;
+   }
+   if( cs->bank != NULL &&
+         bank_select( cs->bank->fd, cs->bank->nbits, &cs->bank->cur, cs->banksel ) < 0 ) {
+      return -1 ;
+   }
+
+   switch( cs->adc ) {
+   case PIADC_ADS8344 :
+      ret = ads8344_sample( cs->fd, 0, &raw );  /* Selects its clock */
+      break ;
+   case PIADC_ADS1256 :
+      ret = ads1256_setup( cs->fd, c->rate, (int)lrint( 1.0 / cs->scale ), &ofc, &fsc );
+      cs->cmux = -1 ;
+      break ;
+   case PIADC_MCP3008 :
+      ret = mcp3008_sample( cs->fd, 0, &raw );
+      break ;
+   default :
+      errno = EINVAL ;
+      ret = -1 ;
+      break ;
+   }
+   return ret ;
+}
+
+/* pi_snap_load( L, path, app ) -- Make a snapshot the plan, to run
+ *    the default App if app is non-zero
+ * -----
+ * @ret -- 0, 1 if the configuration changed since it was taken, 2 if
+ *    app and the config file has its own App (the plan is left alone
+ *    either way), or -1 with errno set if it can't be read (EINVAL: not
+ *    a snapshot of this build).  Raises an error if the devices can't
+ *    be set up.
+ */
+int pi_snap_load( lua_State * L, const char * path, int app )
+{
+   static struct pis_bank  b[PIACQ_MAXBANKS] ;
+   static struct pis_cs  c[PIACQ_MAXCS] ;
+   static struct pis_sensor  d[PIACQ_MAXSENSORS] ;
+   struct pis_header  h ;
+   char  sum[PISNAP_SUMLEN] ;
+   struct pi_sensor *  s ;
+   struct pi_cs *  cs ;
+   FILE *  f ;
+   int  ok ;
+   int  i, k ;
+
+   f = fopen( path, "r" );
+   if( f == NULL ) {
+      return -1 ;
+   }
+   ok = fread( &h, sizeof(h), 1, f ) == 1 &&
+         memcmp( h.magic, PISNAP_MAGIC, sizeof(h.magic) ) == 0 && h.layout == PISNAP_LAYOUT &&
+         h.nbanks >= 0 && h.nbanks <= PIACQ_MAXBANKS && h.ncs >= 0 && h.ncs <= PIACQ_MAXCS &&
+         h.nsensors >= 0 && h.nsensors <= PIACQ_MAXSENSORS &&
+         fread( b, sizeof(b[0]), h.nbanks, f ) == (size_t)h.nbanks &&
+         fread( c, sizeof(c[0]), h.ncs, f ) == (size_t)h.ncs &&
+         fread( d, sizeof(d[0]), h.nsensors, f ) == (size_t)h.nsensors ;
+   fclose( f );
+   for( i = 0 ; ok && i < h.nbanks ; ++i ) {
+      ok = b[i].nbits >= 1 && b[i].nbits <= PIACQ_MAXBITS ;
+   }
+   for( i = 0 ; ok && i < h.ncs ; ++i ) {
+      ok = c[i].bank < h.nbanks ;
+   }
+   for( i = 0 ; ok && i < h.nsensors ; ++i ) {
+      ok = d[i].kind > PIKIND_LUA && d[i].kind <= PIKIND_CJ && d[i].vcc < i && d[i].cj < i &&
+            d[i].v.cs < h.ncs && d[i].a.cs < h.ncs && d[i].t.cs < h.ncs ;
+   }
+   if( ! ok ) {
+      errno = EINVAL ;
+      return -1 ;
+   }
+   h.sum[PISNAP_SUMLEN -1] = '\0' ;
+   if( pi_snap_sum( sum ) < 0 || strcmp( sum, h.sum ) != 0 ) {
+      return 1 ;
+   }
+   if( app && h.app ) {
+      return 2 ;
+   }
+
+   pi_acq_reset( L );
+
+   for( i = 0 ; i < h.nbanks ; ++i ) {
+      piplan.bank[i].nbits = b[i].nbits ;
+      piplan.bank[i].cur = -1 ;
+      piplan.bank[i].ref = LUA_NOREF ;
+      for( k = 0 ; k < b[i].nbits ; ++k ) {
+         b[i].path[k][PISNAP_PATHLEN -1] = '\0' ;
+         piplan.bank[i].fd[k] = open_dev( L, b[i].path[k] );
+      }
+      ++piplan.nbanks ;
+   }
+
+   for( i = 0 ; i < h.ncs ; ++i ) {
+      cs = piplan.cs + i ;
+      cs->adc = c[i].adc ;
+      cs->bank = c[i].bank >= 0 ? piplan.bank + c[i].bank : NULL ;
+      cs->banksel = c[i].banksel ;
+      cs->scale = c[i].scale ;
+      cs->cmux = -1 ;
+      cs->ref = LUA_NOREF ;
+      c[i].path[PISNAP_PATHLEN -1] = '\0' ;
+      for( k = 0 ; k < i ; ++k ) {
+         if( strcmp( c[k].path, c[i].path ) == 0 ) {
+            break ;  /* Another bank of the same device */
+         }
+      }
+      cs->fd = k < i ? piplan.cs[k].fd : open_dev( L, c[i].path );
+      if( strstr( c[i].path, "spidev" ) == NULL ||
+            sscanf( strstr( c[i].path, "spidev" ), "spidev%d", &cs->bus ) != 1 ) {
+         cs->bus = -1 ;
+      }
+      ++piplan.ncs ;
+      if( init_cs( cs, c + i ) < 0 ) {
+         return luaL_error( L, "snapshot: initializing %s: %s", c[i].path, strerror( errno ) );
+      }
+   }
+
+   for( i = 0 ; i < h.nsensors ; ++i ) {
+      s = piplan.sensor + i ;
+      memcpy( s->name, d[i].name, sizeof(s->name) -1 );
+      s->kind = d[i].kind ;
+      s->emit = snapemit[i] = d[i].emit ;
+      snapepoch[i] = 0 ;
+      s->vxf = d[i].vxf ;
+      s->axf = d[i].axf ;
+      s->txf = d[i].txf ;
+      s->vcc = d[i].vcc ;
+      s->cj = d[i].cj ;
+      s->vref = d[i].vref ;
+      s->pullup = d[i].pullup ;
+      s->period = d[i].period ;
+      s->refv = NAN ;
+      s->epoch = 0 ;
+      s->ref = LUA_NOREF ;
+      load_chan( &d[i].v, &s->v );
+      load_chan( &d[i].a, &s->a );
+      load_chan( &d[i].t, &s->t );
+      if( pi_decim_plan( i, d[i].cic, d[i].fir ) < 0 ) {
+         return luaL_error( L, "snapshot: %s: can't decimate by cic=%d fir=%d",
+               s->name, d[i].cic, d[i].fir );
+      }
+      s->bus = pi_acq_bus( s );
+      ++piplan.nsensors ;
+   }
+   piplan.snapshot = 1 ;
+
+   if( verbose > 0 ) {
+      fprintf( stderr, "%s: %s: %d sensors on %d chip selects\n", ARGV0, path,
+            piplan.nsensors, piplan.ncs );
+   }
+   return 0 ;
+}
+
+/* pi_snapshot_select( name ... ) -- pi.compile( ) of a loaded snapshot
+ * @name -- sensors to select (default: those selected when it was taken)
+ * -----
+ * @n -- number of sensors selected
+ */
+static int pi_snapshot_select(lua_State * L)
+{
+   int  nargs = lua_gettop( L );
+   int  nsel = 0 ;
+   int  i, k ;
+
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      piplan.sensor[i].emit = nargs == 0 ? snapemit[i] : 0 ;
+   }
+   for( k = 1 ; k <= nargs ; ++k ) {
+      const char *  name = luaL_checkstring( L, k );
+      for( i = 0 ; i < piplan.nsensors ; ++i ) {
+         if( strcmp( name, "*" ) == 0 || strcmp( name, piplan.sensor[i].name ) == 0 ) {
+            piplan.sensor[i].emit = 1 ;
+            if( name[0] != '*' ) {
+               break ;
+            }
+         }
+      }
+      if( i == piplan.nsensors && name[0] != '*' ) {
+         return luaL_error( L, "Sensor %s not in the snapshot", name );
+      }
+   }
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      nsel += piplan.sensor[i].emit ;
+   }
+   lua_pushinteger( L, nsel );
+   return 1 ;
+}
+
+/* pi_snap_find( name ) -- Plan index of the sensor name of a loaded
+ *    snapshot, or -1
+ */
+int pi_snap_find( const char * name )
+{
+   int  i ;
+
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      if( strcmp( name, piplan.sensor[i].name ) == 0 ) {
+         return i ;
+      }
+   }
+   return -1 ;
+}
+
+/* pi_snap_read( L, idx, val ) -- Read sensor idx of a loaded snapshot
+ *    by name, as pi_acq_sample( ).  Reading a sensor again starts a new
+ *    sample epoch, the references are read once per pass over the
+ *    sensors (as sensor objects do, see pilib_obj.c).
+ */
+int pi_snap_read( lua_State * L, int idx, double * val )
+{
+   const struct pi_sensor *  s = piplan.sensor + idx ;
+
+   if( snapepoch[idx] == pi_acq_epoch( ) ) {
+      pi_acq_epoch_next( );
+   }
+   snapepoch[idx] = pi_acq_epoch( );
+   if( (s->vcc >= 0 && pi_acq_refresh( L, s->vcc ) < 0) ||
+         (s->cj >= 0 && pi_acq_refresh( L, s->cj ) < 0) ) {
+      return -1 ;
+   }
+   return pi_acq_sample( L, idx, val );
+}
+
+/* snapshot_app( name ... ) -- The default App (post_conf.lua) of a
+ *    loaded snapshot: read each sensor and print it
+ * @name -- sensors to read (default: those selected when it was taken)
+ */
+static int snapshot_app(lua_State * L)
+{
+   int  nargs = lua_gettop( L );
+   char  when[PIWALL_LEN] ;
+   double  val[3] ;
+   int64_t  start ;
+   const char *  name ;
+   int  i, k, n ;
+
+   if( nargs == 0 ) {
+      for( i = 0 ; i < piplan.nsensors ; ++i ) {
+         if( snapemit[i] ) {
+            lua_pushstring( L, piplan.sensor[i].name );
+         }
+      }
+      nargs = lua_gettop( L );
+   }
+
+   start = monotime_ns( );
+   printf( "# Starting at %s sec\n", wall_format( when, sizeof(when), mono2wall_ns( start ) ) );
+   for( k = 1 ; k <= nargs ; ++k ) {
+      name = luaL_checkstring( L, k );
+      i = pi_snap_find( name );
+      if( i < 0 ) {
+         printf( "%-10s NOT FOUND\n", name );
+         continue ;
+      }
+      n = pi_snap_read( L, i, val );
+      if( n < 0 ) {
+         printf( "%-10s UNREADABLE\n", name );
+         continue ;
+      }
+      switch( piplan.sensor[i].kind ) {
+      case PIKIND_POWER :
+         printf( "%-10s %8.3f Watts [ %7.3f Volts %7.3f Amps ]\n", name, val[0], val[1], val[2] );
+         break ;
+      case PIKIND_VOLT :
+      case PIKIND_VCC :
+         printf( "%-10s %8.3f Volts\n", name, val[0] );
+         break ;
+      case PIKIND_AMP :
+         printf( "%-10s %8.3f Amps\n", name, val[0] );
+         break ;
+      default :
+         printf( "%-10s %8.2f degC\n", name, val[0] );
+         break ;
+      }
+   }
+   printf( "# Completed in %.6f sec\n", (monotime_ns( ) - start) / 1000000000.0 );
+   return 0 ;
+}
+
+/* pi_snapshot_save( file ) -- Write the compiled plan (pi.compile) to
+ *    a snapshot file
+ * -----
+ * @n -- number of sensors in it
+ */
+int pi_snapshot_save(lua_State * L)
+{
+   const char *  path = luaL_checkstring( L, 1 );
+
+   if( pi_snap_save( L, path ) < 0 ) {
+      return luaL_error( L, "snapshot: writing %s: %s", path, strerror( errno ) );
+   }
+   lua_pushinteger( L, piplan.nsensors );
+   return 1 ;
+}
+
+/* pi_snapshot_load( file [, app] ) -- Make a snapshot the plan, instead
+ *    of running the config file
+ * @app -- true to run the default App from it (App becomes a query of
+ *    its sensors)
+ * -----
+ * @n -- number of sensors in it, or nil and why not if it is stale or
+ *    can't be read.  Once loaded, pi.compile( name ... ) only selects
+ *    among its sensors.
+ */
+int pi_snapshot_load(lua_State * L)
+{
+   const char *  path = luaL_checkstring( L, 1 );
+   int  app = lua_toboolean( L, 2 );
+   int  ret ;
+
+   ret = pi_snap_load( L, path, app );
+   if( ret != 0 ) {
+      lua_pushnil( L );
+      if( ret == 2 ) {
+         lua_pushstring( L, "the config file has its own App" );
+      } else if( ret > 0 ) {
+         lua_pushstring( L, "the configuration changed since it was taken" );
+      } else if( errno == EINVAL ) {
+         lua_pushstring( L, "not a snapshot of this build" );
+      } else {
+         lua_pushstring( L, strerror( errno ) );
+      }
+      return 2 ;
+   }
+
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_pushcfunction( L, pi_snapshot_select );
+   lua_setfield( L, -2, "compile" );
+   lua_pop( L, 1 );
+   if( app ) {
+      lua_pushcfunction( L, snapshot_app );
+      lua_setfield( L, LUA_GLOBALSINDEX, "App" );
+   }
+
+   lua_pushinteger( L, piplan.nsensors );
+   return 1 ;
+}
+
+/* ex: set sw=3 sta et : */
@@ -127,42 +127,69 @@ int pi_spi_maxspeed(lua_State * L)
 #pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
 #pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
 
+/* Completion time (monotime_ns) of the last SPI transaction made by
+ *      this thread, so a sample can be stamped with when its data was
+ *      actually read rather than when it was asked for
+ */
+__thread int64_t  spi_stamp ;
+
+#define PISPI_MAXMSGS 16  /* Messages in one pi.spi_message( ) */
+#define PISPI_MAXLEN 1000  /* Bytes in one of them */
+
+/* spi_transfer( fd, n, msgs ) -- SPI_IOC_MESSAGE(n) and stamp it
+ * -----
+ * @ret -- as ioctl( ), spi_stamp is only updated on success
+ */
+int spi_transfer( int fd, int n, struct spi_ioc_transfer * msgs )
+{
+   int  ret ;
+
+   ret = ioctl( fd, SPI_IOC_MESSAGE(n), msgs );
+   if( ret >= 0 ) {
+      spi_stamp = monotime_ns( );
+   }
+   return ret ;
+}
+
 /* pi_spi_message( spi, {msg} [, {msg} ...] ) -- Send messages
  * @spi -- fd of spi to affect
  * @msg -- table with struct spi_ioc_transfer values
  * --------
  * Returns list of tables with "rx_buf" filled in
+ *
+ * Up to PISPI_MAXMSGS messages of up to PISPI_MAXLEN bytes, the
+ *    transfers and receive buffers are on the stack rather than
+ *    allocated on every call.
  */
 int pi_spi_message(lua_State * L)
 {
    int  fd ;
-   struct spi_ioc_transfer *  msgs ;
+   struct spi_ioc_transfer  msgs[PISPI_MAXMSGS] ;
    int  cmsg ;  /* Current message in msgs */
    int  narg ;  /* Number of arguments to function */
    size_t  rxsize ;  /* storage required of rxbufs */
-   char *  rxbufs ;
+   char  rxbufs[PISPI_MAXMSGS * PISPI_MAXLEN] ;
    char *  crxbuf ;
-   struct timeval  before, after ;
+   int64_t  before = 0 ;
    int  ret ;
 
    fd = luaL_checkint( L, 1 );
    narg = lua_gettop( L );
+   pi_acq_touch( L );
    if( narg < 2 ) {
       return luaL_error( L, "too few arguments" );
    }
 
-   /* Allocate msgs array */
-   msgs = calloc( narg -1, sizeof(struct spi_ioc_transfer) );
-   if( msgs == NULL ) {
-      return luaL_error( L, "message buffer allocation failed" );
+   if( narg -1 > PISPI_MAXMSGS ) {
+      return luaL_error( L, "too many messages (%d, up to %d)", narg -1, PISPI_MAXMSGS );
    }
+   memset( msgs, 0, sizeof(msgs) );
 
    /* Walk list of arguments */
    rxsize = 0 ;
    for( cmsg = 0 ; cmsg <= narg -2 ; ++cmsg ) {
       /* Verify it's a table */
       if( lua_type( L, cmsg +2 ) != LUA_TTABLE ) {
-         free( msgs );
 /* <----- */
          return luaL_argerror( L, cmsg +2, "not a table" );
       }
@@ -172,8 +199,7 @@ int pi_spi_message(lua_State * L)
          size_t  len ;
          msgs[cmsg].tx_buf = (__u64) lua_tolstring( L, -1, &len );
          msgs[cmsg].len = len ;
-         if( len < 1 || len > 1000 ) {
-            free( msgs );
+         if( len < 1 || len > PISPI_MAXLEN ) {
 /* <----- */
             return luaL_argerror( L, cmsg +2, "invalid tx_buf message length (<1 or >1000)" );
          }
@@ -188,8 +214,7 @@ int pi_spi_message(lua_State * L)
          if( lua_isnumber( L, -1 ) ) {
             lua_Integer  len ;
             len = lua_tointeger( L, -1 );
-            if( len < 1 || len > 1000 ) {
-               free( msgs );
+            if( len < 1 || len > PISPI_MAXLEN ) {
 /* <----- */
                return luaL_argerror( L, cmsg +2, "invalid message len (<1 or >1000)" );
             }
@@ -198,7 +223,6 @@ int pi_spi_message(lua_State * L)
 
       /* Else throw error, invalid msg */
          } else {
-            free( msgs );
 /* <----- */
             return luaL_argerror( L, cmsg +2, "missing tx_buf or len value" );
          }
@@ -241,18 +265,10 @@ int pi_spi_message(lua_State * L)
       lua_pop( L, 1 );
    }
 
-   /* Allocate storage for rx_buf's */
-   rxbufs = malloc( rxsize );
-   if( rxbufs == NULL ) {
-      free( msgs );
-/* <----- */
-      return luaL_error( L, "rx_buf buffer allocation failed" );
-   }
-
    /* For all messages */
    crxbuf = rxbufs ;
    for( cmsg = 0 ; cmsg <= narg -2 ; ++cmsg ) {
-      /* Allocate rx_buf based on len */
+      /* rx_buf based on len */
       msgs[cmsg].rx_buf = (__u64) crxbuf ;
       crxbuf += msgs[cmsg].len ;
    }
@@ -262,21 +278,17 @@ int pi_spi_message(lua_State * L)
 
    /* Call ioctl */
    if( debug & DBG_SPI ) {
-      gettimeofday( &before, NULL );
+      before = monotime_ns( );
    }
-   ret = ioctl( fd, SPI_IOC_MESSAGE(narg -1), msgs );
+   ret = spi_transfer( fd, narg -1, msgs );
    if( ret == -1 ) {
-      int save_errno = errno ;
-      free( rxbufs );
-      free( msgs );
 /* <----- */
-      return luaL_error( L, "ioctl(%d,%d,...) call: %s", fd, narg -1, strerror(save_errno) );
+      return luaL_error( L, "ioctl(%d,%d,...) call: %s", fd, narg -1, strerror(errno) );
    }
    if( debug & DBG_SPI ) {
-      gettimeofday( &after, NULL );
-      fprintf( stderr, "DBG: ioctl(%d, %d, ...) took: %.6f sec, ret = %d\n",
+      fprintf( stderr, "DBG: ioctl(%d, %d, ...) took: %.9f sec, ret = %d\n",
          fd, narg -1,
-         after.tv_sec-before.tv_sec + (after.tv_usec-before.tv_usec)/1000000.0,
+         (spi_stamp - before) / 1000000000.0,
          ret
          );
    }
@@ -317,10 +329,6 @@ int pi_spi_message(lua_State * L)
       crxbuf += msgs[cmsg].len ;
    }
 
-   /* Drop the allocated SPI and rx_buf's */
-   free( rxbufs );
-   free( msgs );
-
    /* Drop the tx_buf strings */
    lua_settop( L, narg );
 
@@ -328,6 +336,39 @@ int pi_spi_message(lua_State * L)
    return narg -1 ;
 }
 
+/* bank_select( fds, nbits, cur, bank ) -- Set bank control bits from C
+ * @fds -- array of nbits fds for the bank control bits
+ * @nbits -- number of bank bits
+ * @cur -- current bank setting (-1 if unknown), updated
+ * @bank -- bank number to select
+ * --------
+ * @ret -- 0 on success, or -1 and sets errno
+ *
+ * NOTE: Same as pi_setbank, but the caller keeps "cur"
+ */
+int bank_select( const int * fds, int nbits, int * cur, int bank )
+{
+   int  idx ;
+
+   if( *cur >= 0 && ((*cur ^ bank) & ((1<<nbits)-1)) == 0 ) {
+/* <---- No changes */
+      return 0 ;
+   }
+
+   for( idx = 0 ; idx < nbits ; ++idx ) {
+      if( *cur < 0 || (bank ^ *cur) & (1<<idx) ) {
+         lseek( fds[idx], 0, SEEK_SET );
+         if( write( fds[idx], bank & (1<<idx) ? "1\n" : "0\n", 2 ) != 2 ) {
+            *cur = -1 ;  /* Partially changed */
+            return -1 ;
+         }
+      }
+   }
+   *cur = bank ;
+
+   return 0 ;
+}
+
 /* pi_setbank( bank, num ) -- Set bank control bits
  * @bank -- table of fd for bank control bits
  * @num -- bank number to select
@@ -351,7 +392,10 @@ int pi_setbank(lua_State * L)
    bankbits = lua_objlen( L, 1 );
    luaL_argcheck( L, bankbits >= 1 && bankbits <= 16, 1, "invalid number of bank bits (1 to 16)" );
 
-   /* Check for saved bank.cur value */
+   /* Check for saved bank.cur value, sensor objects leave theirs there
+    *    first (see pilib_acq.c)
+    */
+   pi_acq_touch( L );
    lua_getfield( L, 1, "cur" );
    if( lua_isnumber( L, -1 ) ) {
       cur = lua_tonumber( L, -1 );
@@ -0,0 +1,265 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Streaming statistics...
+ *   Welford mean and variance, min and max of each value of each
+ *   streamed sensor, and a DDSketch of its first value (watts of a
+ *   power sensor) for p50, p99 and p99.9, kept by the stream writer
+ *   on every record.  The sketch has fixed log-spaced bins, 1%
+ *   relative error from PISKETCH_MIN up, so memory does not grow
+ *   with the samples.  Reading resets them: each sensor has two banks,
+ *   a reader swaps them and takes the one the writer has left.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+#define PISKETCH_ALPHA 0.01  /* Relative accuracy of the quantiles */
+#define PISKETCH_MIN 1e-3  /* Smaller values (and negative) count as 0 */
+#define PISKETCH_BINS 1024  /* Up to PISKETCH_MIN * gamma^BINS, ~7e5 */
+
+/* What a sensor accumulated since the last reset */
+struct pi_stat_bank {
+   unsigned long  n ;
+   int  nval ;
+   double  start ;  /* First and last samples (wall clock sec) */
+   double  end ;
+   double  mean[3] ;
+   double  m2[3] ;  /* Sum of squared differences from the mean */
+   double  min[3] ;
+   double  max[3] ;
+   unsigned long  zero ;  /* Sketch, values below PISKETCH_MIN */
+   uint32_t  bin[PISKETCH_BINS] ;
+} ;
+
+/* A sensor.  The writer updates bank[active] with seq odd, see
+ *    pi_stats_take for the swap.
+ */
+struct pi_stat {
+   unsigned long  seq ;
+   int  active ;
+   struct pi_stat_bank  bank[2] ;
+} ;
+
+static struct pi_stat  stats[PIACQ_MAXSENSORS] ;
+static pthread_mutex_t  statlock = PTHREAD_MUTEX_INITIALIZER ;  /* Readers */
+
+static double  lngamma ;  /* log( (1 + alpha) / (1 - alpha) ) */
+static int  offset ;  /* Sketch index of bin[0] */
+
+/* pi_stats_reset( ) -- Forget all samples, a new stream starts */
+void pi_stats_reset( void )
+{
+   memset( stats, 0, sizeof(stats) );
+   lngamma = log( (1.0 + PISKETCH_ALPHA) / (1.0 - PISKETCH_ALPHA) );
+   offset = (int)ceil( log( PISKETCH_MIN ) / lngamma );
+}
+
+/* pi_stats_sample( sensor, t, val, n ) -- Add a sample, by the writer
+ *    thread
+ */
+void pi_stats_sample( int sensor, int64_t t, const double * val, int n )
+{
+   struct pi_stat *  s = stats + sensor ;
+   struct pi_stat_bank *  b ;
+   double  d ;
+   int  i ;
+
+   /* Sequentially consistent, so a reader swapping banks either sees
+    *    seq odd or this update sees the swap (pi_stats_take)
+    */
+   __atomic_store_n( &s->seq, s->seq +1, __ATOMIC_SEQ_CST );
+   b = s->bank + __atomic_load_n( &s->active, __ATOMIC_SEQ_CST );
+
+   if( b->n == 0 ) {
+      b->nval = n ;
+      b->start = mono2wall( t );
+      for( i = 0 ; i < 3 ; ++i ) {
+         b->mean[i] = b->m2[i] = 0 ;
+         b->min[i] = b->max[i] = i < n ? val[i] : NAN ;
+      }
+   }
+   b->end = mono2wall( t );
+   ++b->n ;
+   for( i = 0 ; i < n ; ++i ) {
+      d = val[i] - b->mean[i] ;
+      b->mean[i] += d / b->n ;
+      b->m2[i] += d * (val[i] - b->mean[i]) ;
+      if( val[i] < b->min[i] ) {
+         b->min[i] = val[i] ;
+      }
+      if( val[i] > b->max[i] ) {
+         b->max[i] = val[i] ;
+      }
+   }
+
+   if( n > 0 && val[0] >= PISKETCH_MIN ) {
+      i = (int)ceil( log( val[0] ) / lngamma ) - offset ;
+      ++b->bin[i < 0 ? 0 : i >= PISKETCH_BINS ? PISKETCH_BINS -1 : i] ;
+   } else {
+      ++b->zero ;
+   }
+
+   __atomic_store_n( &s->seq, s->seq +1, __ATOMIC_RELEASE );
+}
+
+/* Value at quantile q of the sketch of a bank */
+static double quantile( const struct pi_stat_bank * b, double q )
+{
+   unsigned long  rank = (unsigned long)(q * (b->n -1)) ;
+   unsigned long  count = b->zero ;
+   double  x = 0.0 ;
+   int  i ;
+
+   for( i = 0 ; count <= rank && i < PISKETCH_BINS ; ++i ) {
+      count += b->bin[i] ;
+   }
+   if( count > rank && i > 0 ) {
+      /* Middle of bin i-1, within alpha of all its values */
+      x = 2.0 * exp( (i -1 + offset) * lngamma ) / (1.0 + exp( lngamma )) ;
+   }
+   return x < b->min[0] ? b->min[0] : x > b->max[0] ? b->max[0] : x ;
+}
+
+/* Fill st from a bank */
+static void summarize( const struct pi_stat_bank * b, struct pi_stats * st )
+{
+   int  i ;
+
+   st->n = b->n ;
+   st->nval = b->nval ;
+   st->start = b->start ;
+   st->end = b->end ;
+   for( i = 0 ; i < 3 ; ++i ) {
+      st->mean[i] = b->mean[i] ;
+      st->sd[i] = b->n > 1 ? sqrt( b->m2[i] / (b->n -1) ) : 0.0 ;
+      st->min[i] = b->min[i] ;
+      st->max[i] = b->max[i] ;
+   }
+   st->p50 = quantile( b, 0.5 );
+   st->p99 = quantile( b, 0.99 );
+   st->p999 = quantile( b, 0.999 );
+}
+
+/* pi_stats_take( sensor, reset, st ) -- Statistics of a sensor
+ * @reset -- start over, the writer goes on in the other bank
+ * -----
+ * @ret -- 0, or -1 if there were no samples (st->n is 0)
+ */
+int pi_stats_take( int sensor, int reset, struct pi_stats * st )
+{
+   static struct pi_stat_bank  copy ;  /* Under statlock */
+   struct pi_stat *  s ;
+   struct pi_stat_bank *  b ;
+   unsigned long  seq ;
+
+   if( sensor < 0 || sensor >= piplan.nsensors ) {
+      return -1 ;
+   }
+   s = stats + sensor ;
+
+   pthread_mutex_lock( &statlock );
+   if( reset ) {
+      b = s->bank + s->active ;
+      __atomic_store_n( &s->active, !s->active, __ATOMIC_SEQ_CST );
+      /* An update that began before the swap may still be in b */
+      seq = __atomic_load_n( &s->seq, __ATOMIC_SEQ_CST );
+      if( seq & 1 ) {
+         while( __atomic_load_n( &s->seq, __ATOMIC_ACQUIRE ) == seq ) {
+            sched_yield( );
+         }
+      }
+      summarize( b, st );
+      b->n = 0 ;
+      b->zero = 0 ;
+      memset( b->bin, 0, sizeof(b->bin) );
+   } else {
+      do {
+         seq = __atomic_load_n( &s->seq, __ATOMIC_ACQUIRE );
+         copy = s->bank[__atomic_load_n( &s->active, __ATOMIC_RELAXED )] ;
+         __atomic_thread_fence( __ATOMIC_ACQUIRE );
+      } while( (seq & 1) || seq != __atomic_load_n( &s->seq, __ATOMIC_RELAXED ) );
+      summarize( &copy, st );
+   }
+   pthread_mutex_unlock( &statlock );
+
+   return st->n > 0 ? 0 : -1 ;
+}
+
+/* Push { v1, v2, v3 } from x[0 .. n-1] */
+static void push_values( lua_State * L, const double * x, int n )
+{
+   int  i ;
+
+   lua_createtable( L, n, 0 );
+   for( i = 0 ; i < n ; ++i ) {
+      lua_pushnumber( L, x[i] );
+      lua_rawseti( L, -2, i +1 );
+   }
+}
+
+/* pi_stats( name, [keep] ) -- Statistics of a sensor since last read
+ * @name -- sensor streamed by pi.stream( ) or pi.stream_start( )
+ * @keep -- true to leave them be, else they start over
+ * -----
+ * @stats -- { start=, stop=, n=, mean={ }, sd={ }, min={ }, max={ },
+ *    p50=, p99=, p999= } with a value each for watt, volt and amp of
+ *    power sensors, one for others, and the quantiles of the first,
+ *    or nil if there were no samples
+ */
+int pi_stats(lua_State * L)
+{
+   const char *  name = luaL_checkstring( L, 1 );
+   struct pi_stats  st ;
+   int  idx ;
+
+   for( idx = 0 ; idx < piplan.nsensors ; ++idx ) {
+      if( strcmp( piplan.sensor[idx].name, name ) == 0 ) {
+         break ;
+      }
+   }
+   if( pi_stats_take( idx, !lua_toboolean( L, 2 ), &st ) < 0 ) {
+      lua_pushnil( L );
+      return 1 ;
+   }
+
+   lua_newtable( L );
+   lua_pushnumber( L, st.start );
+   lua_setfield( L, -2, "start" );
+   lua_pushnumber( L, st.end );
+   lua_setfield( L, -2, "stop" );
+   lua_pushnumber( L, st.n );
+   lua_setfield( L, -2, "n" );
+   push_values( L, st.mean, st.nval );
+   lua_setfield( L, -2, "mean" );
+   push_values( L, st.sd, st.nval );
+   lua_setfield( L, -2, "sd" );
+   push_values( L, st.min, st.nval );
+   lua_setfield( L, -2, "min" );
+   push_values( L, st.max, st.nval );
+   lua_setfield( L, -2, "max" );
+   lua_pushnumber( L, st.p50 );
+   lua_setfield( L, -2, "p50" );
+   lua_pushnumber( L, st.p99 );
+   lua_setfield( L, -2, "p99" );
+   lua_pushnumber( L, st.p999 );
+   lua_setfield( L, -2, "p999" );
+
+   return 1 ;
+}
+
+/* ex: set sw=3 sta et : */
@@ -0,0 +1,1025 @@
+/* Copyright (c) 2014  Penguin Computing, Inc.
+ *  All rights reserved
+ */
+
+/* Library of functions to handle low-level details of access
+ *   to SPI hardware and Power Insight carriers
+ *
+ * Streaming acquisition...
+ *   Sample the acquisition plan (piacq.h) on absolute deadlines, one
+ *   loop per SPI bus, and hand timestamped records to a writer thread
+ *   through lock-free single producer, single consumer rings
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "pilib.h"
+#include "piglobal.h"
+#include "piacq.h"
+
+/* One sample of one sensor */
+struct pi_record {
+   int64_t  t ;  /* Completion of its last SPI transaction (monotime_ns) */
+   int  sensor ;  /* Plan index */
+   int  n ;  /* Number of values (1 or 3) */
+   double  val[3] ;
+   int  ncode ;  /* Raw ADC codes, when recording (see pilib_pib.c) */
+   int32_t  code[2] ;
+   double  refv ;
+} ;
+
+/* The rings between the sampling loops (producers) and the writer
+ *    thread (consumer), one per loop.  head is only written by the
+ *    producer and tail only by the consumer, so no locks are needed,
+ *    only the ordering the __atomic builtins provide.  When the writer
+ *    falls behind and a ring is full, records are dropped and counted
+ *    rather than stalling the sampling loop.
+ */
+#define PIRING_SIZE 4096  /* Power of 2 */
+struct pi_ring {
+   unsigned long  head ;  /* Next slot to write */
+   unsigned long  tail ;  /* Next slot to read */
+   unsigned long  dropped ;
+   struct pi_record  rec[PIRING_SIZE] ;
+} ;
+
+static int ring_push( struct pi_ring * r, const struct pi_record * rec )
+{
+   unsigned long  head = r->head ;
+
+   if( head - __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE ) >= PIRING_SIZE ) {
+      ++r->dropped ;
+      return -1 ;
+   }
+   r->rec[head & (PIRING_SIZE-1)] = *rec ;
+   __atomic_store_n( &r->head, head +1, __ATOMIC_RELEASE );
+   return 0 ;
+}
+
+/* Oldest record in the ring, NULL if empty, ring_pop( ) when done */
+static const struct pi_record * ring_peek( struct pi_ring * r )
+{
+   unsigned long  tail = r->tail ;
+
+   if( tail == __atomic_load_n( &r->head, __ATOMIC_ACQUIRE ) ) {
+      return NULL ;
+   }
+   return r->rec + (tail & (PIRING_SIZE-1)) ;
+}
+
+static void ring_pop( struct pi_ring * r )
+{
+   __atomic_store_n( &r->tail, r->tail +1, __ATOMIC_RELEASE );
+}
+
+/* Scheduling jitter: how late each scan woke up relative to its
+ *    deadline.  The histogram is log2 microseconds, bucket 0 is < 1us
+ *    and bucket k is [2^(k-1), 2^k) us, good enough for percentiles
+ *    without keeping every sample.
+ */
+#define PIJITTER_BUCKETS 24
+struct pi_jitter {
+   unsigned long  n ;
+   double  sum ;
+   double  sumsq ;
+   double  max ;
+   unsigned long  hist[PIJITTER_BUCKETS] ;
+} ;
+
+static void jitter_add( struct pi_jitter * j, double late )
+{
+   double  us = late * 1e6 ;
+   int  b = 0 ;
+
+   if( late < 0 ) {
+      late = us = 0 ;  /* Woke early (clock granularity) */
+   }
+   ++j->n ;
+   j->sum += late ;
+   j->sumsq += late * late ;
+   if( late > j->max ) {
+      j->max = late ;
+   }
+   while( us >= 1.0 && b < PIJITTER_BUCKETS -1 ) {
+      us /= 2 ;
+      ++b ;
+   }
+   ++j->hist[b] ;
+}
+
+/* Upper bound (sec) of the bucket holding the p'th fraction of scans */
+static double jitter_pct( const struct pi_jitter * j, double p )
+{
+   unsigned long  want = ceil( p * j->n );
+   unsigned long  have = 0 ;
+   int  b ;
+
+   for( b = 0 ; b < PIJITTER_BUCKETS ; ++b ) {
+      have += j->hist[b] ;
+      if( have >= want ) {
+         break ;
+      }
+   }
+   return ldexp( 1.0, b ) * 1e-6 ;
+}
+
+static void jitter_report( FILE * out, const struct pi_jitter * j,
+      double rate, unsigned long scans, double elapsed )
+{
+   double  mean, sd ;
+   int  b ;
+
+   if( j->n == 0 ) {
+      return ;
+   }
+   mean = j->sum / j->n ;
+   sd = j->sumsq / j->n - mean * mean ;
+   sd = sd > 0 ? sqrt( sd ) : 0 ;
+   fprintf( out, "# Jitter: intended %g scans/sec, achieved %.3f\n",
+         rate, elapsed > 0 ? scans / elapsed : 0 );
+   fprintf( out, "# Jitter: wakeup late by mean %.1fus, sd %.1fus, max %.1fus, p50 < %.0fus, p99 < %.0fus, p99.9 < %.0fus\n",
+         mean * 1e6, sd * 1e6, j->max * 1e6,
+         jitter_pct( j, 0.5 ) * 1e6, jitter_pct( j, 0.99 ) * 1e6,
+         jitter_pct( j, 0.999 ) * 1e6 );
+   if( verbose > 0 ) {
+      for( b = 0 ; b < PIJITTER_BUCKETS ; ++b ) {
+         if( j->hist[b] ) {
+            fprintf( out, "#   < %8.0fus  %lu\n", ldexp( 1.0, b ), j->hist[b] );
+         }
+      }
+   }
+}
+
+/* Absolute deadline as a timespec */
+static void deadline( struct timespec * ts, double t )
+{
+   ts->tv_sec = (time_t) t ;
+   ts->tv_nsec = (t - ts->tv_sec) * 1000000000.0 ;
+   if( ts->tv_nsec >= 1000000000 ) {
+      ts->tv_sec += 1 ;
+      ts->tv_nsec -= 1000000000 ;
+   }
+}
+
+/* A sampling loop, one per SPI bus when the sensors allow it (see
+ *    stream_plan), or one for everything.  Buses are independent
+ *    kernel controllers, so loops on different buses sample in
+ *    parallel.  Each has its own sensors, references to keep fresh
+ *    and ring, and never touches another bus's banks or chips.
+ */
+#define PISTREAM_MAXLOOPS 4
+struct pi_loop {
+   int  bus ;  /* SPI bus, -1 for the single loop */
+   lua_State *  L ;  /* NULL unless this loop may sample through Lua */
+   int  cpu ;  /* CPU to pin to, -1 for none */
+   int  nsensors ;
+   int  sensor[PIACQ_MAXSENSORS] ;  /* Plan index of emitted sensors */
+   int  nrefs ;
+   int  ref[PIACQ_MAXSENSORS] ;  /* Plan index of references to refresh */
+   unsigned long  scans ;
+   unsigned long  overruns ;
+   unsigned long  errors ;
+   unsigned long  samples ;
+   unsigned long  records ;
+   struct pi_jitter  jitter ;
+   pthread_t  thread ;
+   struct pi_ring  ring ;
+} ;
+
+static struct pi_loop  loops[PISTREAM_MAXLOOPS] ;
+static int  nloops ;
+
+/* Shared by all loops, set before they start */
+static double  period ;  /* 0 = as fast as possible */
+static double  start, stop ;
+static int  output ;  /* Records go to the writer */
+static struct pib_writer *  record ;  /* Binary file being written, or NULL */
+static int  codes ;  /* Records carry the raw codes for it */
+
+/* Binary file for the next stream (pi.stream_file), or NULL */
+static char *  recfile ;
+
+/* Set by SIGINT/SIGTERM, or when the sampling loops are done */
+static volatile sig_atomic_t  stopping ;
+static int  done ;
+
+/* Streaming in the background (pi.stream_start) */
+static int  running ;
+static pthread_t  bgloop, bgwriter ;
+
+/* The latest sample of each plan sensor, written by the writer thread
+ *    and read by anyone.  seq is odd while an update is in progress.
+ */
+struct pi_latest {
+   unsigned long  seq ;
+   int  n ;
+   int64_t  t ;
+   double  val[3] ;
+} ;
+static struct pi_latest  latest[PIACQ_MAXSENSORS] ;
+
+static void latest_put( const struct pi_record * rec )
+{
+   struct pi_latest *  l = latest + rec->sensor ;
+
+   __atomic_store_n( &l->seq, l->seq +1, __ATOMIC_RELAXED );
+   __atomic_thread_fence( __ATOMIC_RELEASE );
+   l->n = rec->n ;
+   l->t = rec->t ;
+   memcpy( l->val, rec->val, sizeof(l->val) );
+   __atomic_store_n( &l->seq, l->seq +1, __ATOMIC_RELEASE );
+}
+
+/* stream_latest( idx, val, t ) -- Latest streamed sample of a sensor
+ * @idx -- plan index
+ * @val -- filled with the values (1 or 3)
+ * @t -- filled with the time of the sample (monotime_ns)
+ * -----
+ * @ret -- number of values, 0 if none yet, -1 if not streaming
+ */
+int stream_latest( int idx, double * val, int64_t * t )
+{
+   struct pi_latest *  l = latest + idx ;
+   struct pi_latest  copy ;
+   unsigned long  seq ;
+
+   if( ! __atomic_load_n( &running, __ATOMIC_ACQUIRE ) ) {
+      return -1 ;
+   }
+   do {
+      seq = __atomic_load_n( &l->seq, __ATOMIC_ACQUIRE );
+      copy.n = l->n ;
+      copy.t = l->t ;
+      memcpy( copy.val, l->val, sizeof(copy.val) );
+      __atomic_thread_fence( __ATOMIC_ACQUIRE );
+   } while( (seq & 1) || seq != __atomic_load_n( &l->seq, __ATOMIC_RELAXED ) );
+
+   memcpy( val, copy.val, sizeof(copy.val) );
+   *t = copy.t ;
+   return seq == 0 ? 0 : copy.n ;
+}
+
+/* stream_running( ) -- Non-zero while streaming in the background */
+int stream_running( void )
+{
+   return __atomic_load_n( &running, __ATOMIC_ACQUIRE );
+}
+
+static void stream_stop( int sig )
+{
+   stopping = 1 ;
+}
+
+/* Writer thread, one text line per record:
+ *    time name value [volt amp]
+ * Records from the loops are merged oldest first.  Times are stamped
+ *    on the monotonic raw clock and mapped to wall clock seconds here
+ *    (see mono2wall), so they stay steady across clock adjustments.
+ * Every record also updates the latest samples and power records are
+ *    attributed to application phases (pilib_mark.c).  Threshold
+ *    events (pilib_event.c) are written as comments and captures
+ *    (pilib_capture.c) to their files when it's idle.  The history
+ *    (pilib_hist.c), rollups (pilib_rollup.c) and statistics
+ *    (pilib_stats.c) get every record.  Decimated sensors (see
+ *    pilib_decim.c) only have a record per output of their filters.
+ *    When recording to a binary file (pi.stream_file) the records go
+ *    there instead of text lines.  With no out (streaming in the
+ *    background) the events are left for the application.
+ */
+static void * stream_writer( void * arg )
+{
+   FILE *  out = arg ;
+   const struct pi_record *  rec ;
+   const struct pi_record *  p ;
+   char  when[PIWALL_LEN] ;
+   int  from ;
+   int  i ;
+   struct timespec  idle = { 0, 1000000 } ;  /* 1msec */
+
+   while( 1 ) {
+      rec = NULL ;
+      from = 0 ;
+      for( i = 0 ; i < nloops ; ++i ) {
+         p = ring_peek( &loops[i].ring );
+         if( p != NULL && (rec == NULL || p->t < rec->t) ) {
+            rec = p ;
+            from = i ;
+         }
+      }
+      if( rec == NULL ) {
+         if( __atomic_load_n( &done, __ATOMIC_ACQUIRE ) ) {
+            /* Drained, and no more coming */
+            break ;
+         }
+         if( out != NULL ) {
+            pi_event_report( out );
+            fflush( out );
+         }
+         pi_capture_dump( 0 );
+         nanosleep( &idle, NULL );
+         continue ;
+      }
+      latest_put( rec );
+      pi_hist_sample( rec->sensor, rec->t, rec->val, rec->n );
+      pi_rollup_sample( rec->sensor, rec->t, rec->val, rec->n );
+      pi_stats_sample( rec->sensor, rec->t, rec->val, rec->n );
+      if( rec->n == 3 && piplan.sensor[rec->sensor].kind == PIKIND_POWER ) {
+         pi_mark_sample( rec->sensor, rec->t, rec->val[0] );
+      }
+      if( record != NULL ) {
+         if( pib_put( record, rec->sensor, rec->t, rec->n, rec->val,
+               rec->code, rec->ncode, rec->refv ) < 0 ) {
+            fprintf( stderr, "%s: stream: writing %s: %s\n", ARGV0, recfile, strerror( errno ) );
+            pib_finish( record );
+            record = NULL ;
+         }
+      } else if( out == NULL ) {
+         /* Nothing to write */
+      } else if( rec->n == 3 ) {
+         fprintf( out, "%s %-10s %8.3f %7.3f %7.3f\n",
+               wall_format( when, sizeof(when), mono2wall_ns( rec->t ) ),
+               piplan.sensor[rec->sensor].name, rec->val[0], rec->val[1], rec->val[2] );
+      } else {
+         fprintf( out, "%s %-10s %8.3f\n",
+               wall_format( when, sizeof(when), mono2wall_ns( rec->t ) ),
+               piplan.sensor[rec->sensor].name, rec->val[0] );
+      }
+      ring_pop( &loops[from].ring );
+   }
+   if( out != NULL ) {
+      pi_event_report( out );
+      fflush( out );
+   }
+   pi_capture_dump( 1 );
+   pi_hist_flush( );
+   if( record != NULL ) {
+      if( pib_finish( record ) < 0 ) {
+         fprintf( stderr, "%s: stream: writing %s: %s\n", ARGV0, recfile, strerror( errno ) );
+      }
+      record = NULL ;
+   }
+
+   return NULL ;
+}
+
+/* Sampling loop, runs in its own thread or the caller's */
+static void * stream_loop( void * arg )
+{
+   struct pi_loop *  lp = arg ;
+   struct pi_sensor *  s ;
+   struct pi_record  rec ;
+   struct timespec  ts ;
+   double  next, now, t ;
+   int  i ;
+
+   pi_rt_enter( lp->cpu );
+
+   next = start ;
+   while( ! stopping && next < stop ) {
+      if( period > 0 ) {
+         if( lp->L != NULL ) {
+            pi_gc_idle( lp->L, next - pi_monotonic( ) );  /* See pilib_gc.c */
+         }
+         deadline( &ts, next );
+         while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR && ! stopping )
+            ;  /* Interrupted, keep waiting for the deadline */
+         if( stopping ) {
+            break ;
+         }
+      }
+
+      /* A new sample epoch, references first so the scan uses fresh
+       *    values, and emitted ones aren't read twice (pi_acq_refresh)
+       */
+      pi_acq_epoch_next( );
+      now = pi_monotonic( );
+      if( period > 0 ) {
+         jitter_add( &lp->jitter, now - next );
+      }
+      for( i = 0 ; i < lp->nrefs ; ++i ) {
+         s = piplan.sensor + lp->ref[i] ;
+         if( now >= s->due || isnan( s->refv ) ) {
+            if( pi_acq_refresh( lp->L, lp->ref[i] ) < 0 ) {
+               ++lp->errors ;
+            }
+            s->due = now + s->period ;
+         }
+      }
+
+      /* The scan */
+      for( i = 0 ; i < lp->nsensors ; ++i ) {
+         spi_stamp = 0 ;
+         rec.n = pi_acq_sample( lp->L, lp->sensor[i], rec.val );
+         if( rec.n < 0 ) {
+            ++lp->errors ;
+            continue ;
+         }
+         ++lp->samples ;
+         rec.t = spi_stamp != 0 ? spi_stamp : monotime_ns( );
+         pi_event_sample( lp->sensor[i], rec.t, rec.val, rec.n );
+         pi_capture_sample( lp->sensor[i], rec.t, rec.val, rec.n );
+         if( output && pi_decim_sample( lp->sensor[i], rec.val, rec.n ) ) {
+            rec.sensor = lp->sensor[i] ;
+            rec.refv = NAN ;
+            rec.ncode = codes && pi_decim_ratio( rec.sensor ) == 1 ?
+                  pi_acq_codes( rec.sensor, rec.code, &rec.refv ) : 0 ;
+            if( ring_push( &lp->ring, &rec ) == 0 ) {
+               ++lp->records ;
+            }
+         }
+      }
+      ++lp->scans ;
+
+      /* Capture triggered, take its samples and start the schedule over */
+      if( lp == loops ) {
+         pi_capture_poll( );
+      }
+      if( pi_capture_burst( lp->L, lp->sensor, lp->nsensors ) ) {
+         next = pi_monotonic( );
+      }
+
+      /* Next deadline, skipping (and counting) any we missed */
+      if( period > 0 ) {
+         next += period ;
+         t = pi_monotonic( );
+         if( next <= t ) {
+            unsigned long  missed = (unsigned long)((t - next) / period) +1 ;
+            lp->overruns += missed ;
+            next += missed * period ;
+         }
+      } else {
+         next = now ;
+      }
+   }
+
+   /* The last scan's period lasts until the stop, so duration seconds
+    *    at rate are rate * duration scans in duration seconds
+    */
+   if( period > 0 && ! stopping && stop < HUGE_VAL ) {
+      deadline( &ts, stop );
+      while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR && ! stopping )
+         ;
+   }
+
+   pi_rt_leave( );
+   return NULL ;
+}
+
+/* Add plan sensor idx to the loop for its bus */
+static int plan_add( int idx, int emit )
+{
+   struct pi_loop *  lp ;
+   int  i ;
+
+   for( i = 0 ; i < nloops ; ++i ) {
+      if( loops[i].bus == piplan.sensor[idx].bus ) {
+         break ;
+      }
+   }
+   if( i == nloops ) {
+      if( nloops >= PISTREAM_MAXLOOPS ) {
+         return -1 ;
+      }
+      loops[nloops++].bus = piplan.sensor[idx].bus ;
+   }
+   lp = loops + i ;
+   if( emit ) {
+      lp->sensor[lp->nsensors++] = idx ;
+   } else {
+      lp->ref[lp->nrefs++] = idx ;
+   }
+   return 0 ;
+}
+
+/* Divide the plan into sampling loops
+ * @serial -- one loop for everything
+ * -----
+ * One loop per SPI bus when every sensor is compiled and on a single
+ *    bus.  Lua sensors may touch any bus (and need the Lua state), so
+ *    if there are any, or when asked to, everything is in one loop on
+ *    the calling thread.  Without L (streaming in the background)
+ *    Lua sensors are left out.
+ */
+static void stream_plan( lua_State * L, int serial )
+{
+   struct pi_sensor *  s ;
+   int  i ;
+
+   for( i = 0 ; i < piplan.nsensors && L == NULL ; ++i ) {
+      s = piplan.sensor + i ;
+      if( s->kind == PIKIND_LUA && s->emit ) {
+         if( verbose > 0 ) {
+            fprintf( stderr, "%s: stream: %s can't be sampled in the background\n",
+                  ARGV0, s->name );
+         }
+         s->emit = 0 ;
+      }
+   }
+
+   for( i = 0 ; i < PISTREAM_MAXLOOPS ; ++i ) {
+      memset( loops + i, 0, offsetof( struct pi_loop, ring ) );
+      loops[i].ring.head = loops[i].ring.tail = loops[i].ring.dropped = 0 ;
+   }
+   nloops = 0 ;
+
+   for( i = 0 ; i < piplan.nsensors && ! serial ; ++i ) {
+      serial = piplan.sensor[i].bus < 0 && (L != NULL || piplan.sensor[i].kind != PIKIND_LUA) ;
+   }
+   for( i = 0 ; i < piplan.nsensors && ! serial ; ++i ) {
+      s = piplan.sensor + i ;
+      if( s->emit || s->kind == PIKIND_VCC || s->kind == PIKIND_CJ ) {
+         serial = plan_add( i, s->emit ) < 0 ;
+      }
+   }
+   if( serial || nloops < 2 ) {
+      for( i = 0 ; i < PISTREAM_MAXLOOPS ; ++i ) {
+         loops[i].nsensors = loops[i].nrefs = 0 ;
+      }
+      nloops = 1 ;
+      loops[0].bus = -1 ;
+      loops[0].L = L ;
+      for( i = 0 ; i < piplan.nsensors ; ++i ) {
+         s = piplan.sensor + i ;
+         if( s->emit ) {
+            loops[0].sensor[loops[0].nsensors++] = i ;
+         } else if( s->kind == PIKIND_VCC || s->kind == PIKIND_CJ ) {
+            loops[0].ref[loops[0].nrefs++] = i ;
+         }
+      }
+   }
+
+   /* Consecutive CPUs from rtcpu, so the loops don't share one */
+   for( i = 0 ; i < nloops ; ++i ) {
+      loops[i].cpu = rtcpu >= 0 ? rtcpu + i : -1 ;
+   }
+}
+
+/* Run the loops until stop (or interrupted), the first on this
+ *    thread.  Returns elapsed seconds.
+ */
+static double stream_run( lua_State * L, double duration )
+{
+   sigset_t  block, old ;
+   int  i ;
+   int  ret ;
+
+   start = pi_monotonic( );
+   stop = duration > 0 ? start + duration : HUGE_VAL ;
+   for( i = 0 ; i < piplan.nsensors ; ++i ) {
+      piplan.sensor[i].due = start + piplan.sensor[i].period ;
+   }
+
+   /* Only this thread takes SIGINT/SIGTERM */
+   sigemptyset( &block );
+   sigaddset( &block, SIGINT );
+   sigaddset( &block, SIGTERM );
+   pthread_sigmask( SIG_BLOCK, &block, &old );
+   for( i = 1 ; i < nloops ; ++i ) {
+      ret = pi_rt_create( &loops[i].thread, stream_loop, loops + i );
+      if( ret != 0 ) {
+         fprintf( stderr, "%s: stream: creating loop for spidev%d: %s\n", ARGV0,
+               loops[i].bus, strerror( ret ) );
+         stopping = 1 ;
+         nloops = i ;
+      }
+   }
+   pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+   stream_loop( loops );
+   stopping = 1 ;
+   for( i = 1 ; i < nloops ; ++i ) {
+      pthread_join( loops[i].thread, NULL );
+   }
+
+   return pi_monotonic( ) - start ;
+}
+
+/* Compile sensors named by arguments first to the top, returns the
+ *    number selected
+ */
+static int stream_compile( lua_State * L, int first )
+{
+   int  nargs = lua_gettop( L );
+   int  nsel ;
+   int  i ;
+
+   /* pi.compile( name ... ) */
+   lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+   lua_getfield( L, -1, "compile" );
+   for( i = first ; i <= nargs ; ++i ) {
+      lua_pushvalue( L, i );
+   }
+   lua_call( L, nargs >= first ? nargs - first +1 : 0, 1 );
+   nsel = lua_tointeger( L, -1 );
+   lua_settop( L, nargs );
+   return nsel ;
+}
+
+/* Start the binary file for the stream, if there is to be one */
+static int stream_record( lua_State * L, const char * who )
+{
+   record = NULL ;
+   codes = 0 ;
+   if( recfile != NULL ) {
+      record = pib_create( recfile );
+      if( record == NULL ) {
+         return luaL_error( L, "%s: can't create %s: %s", who, recfile, strerror( errno ) );
+      }
+      codes = 1 ;
+   }
+   return 0 ;
+}
+
+static void loop_name( char * buf, size_t len, const struct pi_loop * lp )
+{
+   if( lp->bus < 0 ) {
+      snprintf( buf, len, "all" );
+   } else {
+      snprintf( buf, len, "spidev%d", lp->bus );
+   }
+}
+
+/* pi_stream( rate, [duration], [name ...] ) -- Stream samples to stdout
+ * @rate -- scans per second, every selected sensor once per scan
+ * @duration -- optional seconds to run (default: until interrupted)
+ * @name -- optional sensors to stream (default: same as App)
+ * -----
+ * @scans -- number of scans completed
+ * @overruns -- scan deadlines missed (and skipped)
+ * @dropped -- records dropped because the writer fell behind
+ * @errors -- samples that failed
+ * @jitter -- worst scan wakeup latency (sec)
+ *
+ * Compiles the selected sensors with pi.compile( ) and samples them
+ *    in C on absolute CLOCK_MONOTONIC deadlines.  A scan that runs
+ *    past one or more deadlines counts them as overruns and the loop
+ *    resumes at the next deadline in the future, it never stretches
+ *    the period.  Reference sensors (Vcc, cold junctions) are read
+ *    once per scan before the sensors that need them, or on their own
+ *    schedule (see pi.schedule) without Update.epoch.
+ *
+ * When all the sensors are compiled, each SPI bus gets its own loop
+ *    and thread (see stream_plan), so a slow conversion on one bus
+ *    doesn't delay the others.  Counts are totals over the loops.
+ *
+ * The loops run under SCHED_FIFO and/or pinned to CPUs when rtprio
+ *    and rtcpu are set (see pilib_rt.c), the writer thread does not.
+ *    A jitter report of how late each scan started compared to its
+ *    deadline is printed with the stream statistics.
+ *
+ * With pi.gcpolicy( "paced" ) the Lua collector is stopped while
+ *    streaming and the loop sampling through Lua collects garbage in
+ *    its idle time before each deadline (see pilib_gc.c).
+ */
+int pi_stream(lua_State * L)
+{
+   lua_Number  rate ;
+   lua_Number  duration ;
+   int  nsel ;
+   double  elapsed ;
+   unsigned long  scans = 0 ;
+   unsigned long  overruns = 0 ;
+   unsigned long  errors = 0 ;
+   unsigned long  records = 0 ;
+   unsigned long  dropped = 0 ;
+   struct pi_jitter  jitter ;
+   struct pi_gcstats  gc ;
+   struct sigaction  sa, oldint, oldterm ;
+   pthread_t  writer ;
+   char  name[24] ;
+   int  i, b ;
+   int  ret ;
+
+   rate = luaL_checknumber( L, 1 );
+   luaL_argcheck( L, rate > 0, 1, "rate must be > 0" );
+   duration = luaL_optnumber( L, 2, 0.0 );
+   if( running ) {
+      return luaL_error( L, "stream: already streaming in the background" );
+   }
+
+   nsel = stream_compile( L, 3 );
+   if( nsel < 1 ) {
+      return luaL_error( L, "stream: no sensors selected" );
+   }
+   stream_plan( L, 0 );
+
+   period = 1.0 / rate ;
+   output = 1 ;
+   done = 0 ;
+   stopping = 0 ;
+   stream_record( L, "stream" );
+   pi_mark_reset( );
+   pi_rollup_reset( );
+   pi_stats_reset( );
+   pi_decim_reset( );
+   pi_event_arm( );
+   pi_capture_arm( );
+
+   memset( &sa, 0, sizeof(sa) );
+   sa.sa_handler = stream_stop ;
+   sigemptyset( &sa.sa_mask );
+   sigaction( SIGINT, &sa, &oldint );
+   sigaction( SIGTERM, &sa, &oldterm );
+
+   ret = pi_rt_create( &writer, stream_writer, stdout );
+   if( ret != 0 ) {
+      if( record != NULL ) {
+         pib_finish( record );
+         record = NULL ;
+      }
+      sigaction( SIGINT, &oldint, NULL );
+      sigaction( SIGTERM, &oldterm, NULL );
+      return luaL_error( L, "stream: creating writer thread: %s", strerror( ret ) );
+   }
+
+   if( verbose >= 0 ) {
+      fprintf( stdout, "# Streaming %d sensors at %g scans/sec, %d loop%s%s%s\n",
+            nsel, rate, nloops, nloops > 1 ? "s" : "",
+            record != NULL ? " to " : "", record != NULL ? recfile : "" );
+   }
+
+   pi_gc_get( &gc, 1 );
+   pi_gc_begin( L );
+   elapsed = stream_run( L, duration );
+   pi_gc_end( L );
+
+   __atomic_store_n( &done, 1, __ATOMIC_RELEASE );
+   pthread_join( writer, NULL );
+   sigaction( SIGINT, &oldint, NULL );
+   sigaction( SIGTERM, &oldterm, NULL );
+
+   /* Leave Lua's view of the hardware consistent with ours */
+   pi_acq_push( L );
+
+   /* Totals, scans are counted by the slowest loop */
+   memset( &jitter, 0, sizeof(jitter) );
+   for( i = 0 ; i < nloops ; ++i ) {
+      struct pi_loop *  lp = loops + i ;
+      if( i == 0 || lp->scans < scans ) {
+         scans = lp->scans ;
+      }
+      overruns += lp->overruns ;
+      errors += lp->errors ;
+      records += lp->records ;
+      dropped += lp->ring.dropped ;
+      jitter.n += lp->jitter.n ;
+      jitter.sum += lp->jitter.sum ;
+      jitter.sumsq += lp->jitter.sumsq ;
+      if( lp->jitter.max > jitter.max ) {
+         jitter.max = lp->jitter.max ;
+      }
+      for( b = 0 ; b < PIJITTER_BUCKETS ; ++b ) {
+         jitter.hist[b] += lp->jitter.hist[b] ;
+      }
+   }
+
+   if( verbose >= 0 ) {
+      fprintf( stderr, "# Stream: %lu scans in %.3f sec, %lu records, %lu overruns, %lu dropped, %lu errors\n",
+            scans, elapsed, records, overruns, dropped, errors );
+      if( nloops > 1 && verbose > 0 ) {
+         for( i = 0 ; i < nloops ; ++i ) {
+            loop_name( name, sizeof(name), loops + i );
+            fprintf( stderr, "#   %-9s %d sensors, %lu scans, %lu overruns, %lu errors, max late %.1fus\n",
+                  name, loops[i].nsensors, loops[i].scans, loops[i].overruns,
+                  loops[i].errors, loops[i].jitter.max * 1e6 );
+         }
+      }
+      jitter_report( stderr, &jitter, rate, scans, elapsed );
+      pi_gc_report( stderr );
+      pi_mark_report( stderr );
+   }
+
+   lua_pushnumber( L, scans );
+   lua_pushnumber( L, overruns );
+   lua_pushnumber( L, dropped );
+   lua_pushnumber( L, errors );
+   lua_pushnumber( L, jitter.max );
+   return 5 ;
+}
+
+/* pi_stream_bench( [duration], [name ...] ) -- Sampling throughput
+ * @duration -- seconds for each run (default: 1)
+ * @name -- optional sensors (default: same as App)
+ * -----
+ * @serial -- samples per second with one loop
+ * @parallel -- samples per second with a loop per bus
+ *
+ * Samples as fast as possible, first in a single loop, then split
+ *    into a loop per bus (if the sensors allow it), and reports the
+ *    rate for each loop and the total.  Nothing is written.
+ */
+int pi_stream_bench(lua_State * L)
+{
+   lua_Number  duration ;
+   double  elapsed ;
+   double  rates[2] = { 0, 0 } ;
+   unsigned long  samples ;
+   char  name[24] ;
+   int  run ;
+   int  i ;
+
+   duration = luaL_optnumber( L, 1, 1.0 );
+   luaL_argcheck( L, duration > 0, 1, "duration must be > 0" );
+   if( running ) {
+      return luaL_error( L, "stream_bench: already streaming in the background" );
+   }
+
+   if( stream_compile( L, 2 ) < 1 ) {
+      return luaL_error( L, "stream_bench: no sensors selected" );
+   }
+
+   period = 0 ;
+   output = 0 ;
+   codes = 0 ;
+   for( run = 0 ; run < 2 ; ++run ) {
+      stream_plan( L, run == 0 );
+      if( run == 1 && nloops < 2 ) {
+         if( verbose >= 0 ) {
+            fprintf( stderr, "# Bench: sensors can't be split by bus, parallel run skipped\n" );
+         }
+         rates[1] = rates[0] ;
+         break ;
+      }
+      stopping = 0 ;
+      elapsed = stream_run( L, duration );
+      pi_acq_push( L );
+
+      samples = 0 ;
+      for( i = 0 ; i < nloops ; ++i ) {
+         samples += loops[i].samples ;
+         if( verbose >= 0 ) {
+            loop_name( name, sizeof(name), loops + i );
+            fprintf( stderr, "# Bench %-8s %-9s %3d sensors %10.1f samples/sec\n",
+                  run == 0 ? "serial" : "parallel", name,
+                  loops[i].nsensors, loops[i].samples / elapsed );
+         }
+      }
+      rates[run] = samples / elapsed ;
+      if( verbose >= 0 ) {
+         fprintf( stderr, "# Bench %-8s total %10.1f samples/sec\n",
+               run == 0 ? "serial" : "parallel", rates[run] );
+      }
+   }
+   if( verbose >= 0 && rates[0] > 0 ) {
+      fprintf( stderr, "# Bench speedup %.2fx with %d loops\n", rates[1] / rates[0], nloops );
+   }
+
+   lua_pushnumber( L, rates[0] );
+   lua_pushnumber( L, rates[1] );
+   return 2 ;
+}
+
+/* Background sampling loops, see pi_stream_start */
+static void * stream_bg( void * arg )
+{
+   stream_run( NULL, 0 );
+   return NULL ;
+}
+
+/* pi_stream_start( rate, [name ...] ) -- Stream in the background
+ * @rate -- scans per second
+ * @name -- optional sensors to stream (default: same as App, "*" all)
+ * -----
+ * @count -- number of sensors streamed
+ *
+ * Like pi.stream( ) but returns right away, the loops and the writer
+ *    run in their own threads and nothing is written.  The samples are
+ *    kept as the latest sample of each sensor (see stream_latest) and
+ *    attributed to application phases (pi.mark_begin), and threshold
+ *    events are queued for pi.events( ).  Only compiled sensors can
+ *    be sampled without the Lua state, others are left out.  The
+ *    loops own the hardware until pi.stream_stop( ), so don't read
+ *    sensors through Lua meanwhile.
+ */
+int pi_stream_start(lua_State * L)
+{
+   lua_Number  rate ;
+   sigset_t  all, old ;
+   int  nsel ;
+   int  i ;
+   int  ret ;
+
+   rate = luaL_checknumber( L, 1 );
+   luaL_argcheck( L, rate > 0, 1, "rate must be > 0" );
+   if( running ) {
+      return luaL_error( L, "stream_start: already streaming in the background" );
+   }
+
+   if( stream_compile( L, 2 ) < 1 ) {
+      return luaL_error( L, "stream_start: no sensors selected" );
+   }
+   stream_plan( NULL, 0 );
+   for( nsel = 0, i = 0 ; i < nloops ; ++i ) {
+      nsel += loops[i].nsensors ;
+   }
+   if( nsel < 1 ) {
+      return luaL_error( L, "stream_start: no sensors can be sampled in the background" );
+   }
+
+   period = 1.0 / rate ;
+   output = 1 ;
+   done = 0 ;
+   stopping = 0 ;
+   stream_record( L, "stream_start" );
+   memset( latest, 0, sizeof(latest) );
+   pi_mark_reset( );
+   pi_rollup_reset( );
+   pi_stats_reset( );
+   pi_decim_reset( );
+   pi_event_arm( );
+   pi_capture_arm( );
+
+   /* Leave the application's signals to the application */
+   sigfillset( &all );
+   pthread_sigmask( SIG_BLOCK, &all, &old );
+   ret = pi_rt_create( &bgwriter, stream_writer, NULL );
+   if( ret == 0 ) {
+      ret = pi_rt_create( &bgloop, stream_bg, NULL );
+      if( ret != 0 ) {
+         __atomic_store_n( &done, 1, __ATOMIC_RELEASE );
+         pthread_join( bgwriter, NULL );
+      }
+   }
+   pthread_sigmask( SIG_SETMASK, &old, NULL );
+   if( ret != 0 ) {
+      if( record != NULL ) {
+         pib_finish( record );
+         record = NULL ;
+      }
+      return luaL_error( L, "stream_start: creating threads: %s", strerror( ret ) );
+   }
+   __atomic_store_n( &running, 1, __ATOMIC_RELEASE );
+
+   lua_pushinteger( L, nsel );
+   return 1 ;
+}
+
+/* pi_stream_stop( ) -- Stop streaming in the background
+ * -----
+ * @scans -- number of scans completed (by the slowest loop)
+ * @overruns -- scan deadlines missed
+ * @errors -- samples that failed
+ */
+int pi_stream_stop(lua_State * L)
+{
+   unsigned long  scans = 0 ;
+   unsigned long  overruns = 0 ;
+   unsigned long  errors = 0 ;
+   int  i ;
+
+   if( ! running ) {
+      return 0 ;
+   }
+   stopping = 1 ;
+   pthread_join( bgloop, NULL );
+   __atomic_store_n( &done, 1, __ATOMIC_RELEASE );
+   pthread_join( bgwriter, NULL );
+   __atomic_store_n( &running, 0, __ATOMIC_RELEASE );
+
+   /* The Lua tables own the hardware again */
+   pi_acq_push( L );
+
+   for( i = 0 ; i < nloops ; ++i ) {
+      if( i == 0 || loops[i].scans < scans ) {
+         scans = loops[i].scans ;
+      }
+      overruns += loops[i].overruns ;
+      errors += loops[i].errors ;
+   }
+   lua_pushnumber( L, scans );
+   lua_pushnumber( L, overruns );
+   lua_pushnumber( L, errors );
+   return 3 ;
+}
+
+/* pi_stream_file( [path] ) -- Record the streams to a binary file
+ * @path -- file for pi.stream( ) and pi.stream_start( ) to write,
+ *    nil to go back to text (pi.stream) or nothing (in the background)
+ * -----
+ * Raw ADC codes are written rather than values, see pilib_pib.c and
+ *    pibread.  Threshold events and the stream statistics are still
+ *    written as text.
+ */
+int pi_stream_file(lua_State * L)
+{
+   const char *  path = luaL_optstring( L, 1, NULL );
+
+   if( running ) {
+      return luaL_error( L, "stream_file: already streaming in the background" );
+   }
+   free( recfile );
+   recfile = path != NULL ? strdup( path ) : NULL ;
+   return 0 ;
+}
+
+/* ex: set sw=3 sta et : */
@@ -140,31 +140,35 @@ static double evalPoly( double x, const double * coeff, ssize_t n, double (*adj)
  * --------
  * Returns temperature in deg C
  */
+double volt2temp_K( double volts )
+{
+   double  mV = volts * 1000.0 ;
+
+   if( mV < invNegmVLIMIT || mV > invPosmVLIMIT ) {
+      return NAN ;
+   }
+
+   if( mV < 0 ) {
+      return evalPoly( mV, invNegmV, sizeof(invNegmV)/sizeof(*invNegmV)-1, NULL );
+   } else {
+      return evalPoly( mV, invPosmV, sizeof(invPosmV)/sizeof(*invPosmV)-1, NULL );
+   }
+}
+
 int pi_volt2temp_K(lua_State * L)
 {
    lua_Number  reading ;
    lua_Number  vref ;
-   lua_Number  temp ;
 
    reading = luaL_checknumber( L, 1 );
    vref = luaL_optnumber( L, 2, 1.0 );
-   reading *= vref * 1000.0 ;  /* to milli-Volts */
-   if( reading < invNegmVLIMIT || reading > invPosmVLIMIT ) {
 #ifdef RANGE2ERROR
+   if( reading * vref * 1000.0 < invNegmVLIMIT || reading * vref * 1000.0 > invPosmVLIMIT ) {
       return luaL_error( L, "bad arguments #1*#2 to volt2temp_K, out of range [%g, %g] mVolts", invNegmVLIMIT, invPosmVLIMIT );
-#else
-      lua_pushnumber( L, NAN );
-      return 1 ;
-#endif
-   }
-
-   if( reading < 0 ) {
-      temp = evalPoly( reading, invNegmV, sizeof(invNegmV)/sizeof(*invNegmV)-1, NULL );
-   } else {
-      temp = evalPoly( reading, invPosmV, sizeof(invPosmV)/sizeof(*invPosmV)-1, NULL );
    }
+#endif
 
-   lua_pushnumber( L, temp );
+   lua_pushnumber( L, volt2temp_K( reading * vref ) );
    return 1 ;
 }
 
@@ -175,32 +179,33 @@ int pi_volt2temp_K(lua_State * L)
  * --------
  * Returns "raw" reading expressed as a ratio of vref (may exceed [0,1) )
  */
+double temp2volt_K( double temp )
+{
+   if( temp < negTempLIMIT || temp > posTempLIMIT ) {
+      return NAN ;
+   }
+
+   if( temp < 0 ) {
+      return evalPoly( temp, negTemp, sizeof(negTemp)/sizeof(*negTemp)-1, NULL ) / 1000.0 ;
+   } else {
+      return evalPoly( temp, posTemp, sizeof(posTemp)/sizeof(*posTemp)-1, &posTempAdj ) / 1000.0 ;
+   }
+}
+
 int pi_temp2volt_K(lua_State * L)
 {
    lua_Number  temp ;
    lua_Number  vref ;
-   lua_Number  reading ;
 
    temp = luaL_checknumber( L, 1 );
    vref = luaL_optnumber( L, 2, 1.0 );
-
-   if( temp < negTempLIMIT || temp > posTempLIMIT ) {
 #ifdef RANGE2ERROR
+   if( temp < negTempLIMIT || temp > posTempLIMIT ) {
       return luaL_error( L, "bad argument #1 to temp2volt_K (out of range [%g, %g] degC)", negTempLimit, posTempLIMIT );
-#else
-      lua_pushnumber( L, NAN );
-      return 1 ;
-#endif
-   }
-
-   if( temp < 0 ) {
-      reading = evalPoly( temp, negTemp, sizeof(negTemp)/sizeof(*negTemp)-1, NULL );
-   } else {
-      reading = evalPoly( temp, posTemp, sizeof(posTemp)/sizeof(*posTemp)-1, &posTempAdj );
    }
-   reading /= 1000.0 * vref ; /* to Volts/Vref */
+#endif
 
-   lua_pushnumber( L, reading );
+   lua_pushnumber( L, temp2volt_K( temp ) / vref );  /* to Volts/Vref */
    return 1 ;
 }
 
@@ -248,11 +253,29 @@ int pi_temp2volt_K(lua_State * L)
  * --------
  * Returns temperature in degC
  */
+double rt2temp_PTS( double reading, double pullup )
+{
+   double  Rt_R0 ;
+
+   if( reading < 0.0 || reading >= 1.0 ) {
+      return NAN ;
+   }
+
+   Rt_R0 = (pullup*reading)/(1.0-reading) ;
+
+   if( Rt_R0 < 0.8 || Rt_R0 > 1.6 ) {
+      /* Out of range [-51,155] */
+      return NAN ;
+   }
+
+   /* Good enough (<.5LSB) for 16 bits w/10k pullup from -50 to 155 */
+   return (sqrt(PTS_A*PTS_A - 4*PTS_B + 4*PTS_B*Rt_R0) - PTS_A)/(2*PTS_B);
+}
+
 int pi_rt2temp_PTS(lua_State * L)
 {
    lua_Number  reading ;
    lua_Number  pullup ;
-   lua_Number  Rt_R0 ;
    lua_Number  temp ;
 
    reading = luaL_checknumber( L, 1 );
@@ -260,18 +283,12 @@ int pi_rt2temp_PTS(lua_State * L)
 
    pullup = luaL_checknumber( L, 2 );
 
-   Rt_R0 = (pullup*reading)/(1.0-reading) ;
-
-   if( Rt_R0 < 0.8 || Rt_R0 > 1.6 ) {
-      /* Out of range [-51,155] */
-      temp = NAN ;
+   temp = rt2temp_PTS( reading, pullup );
 #ifdef RANGE2ERROR
+   if( isnan( temp ) ) {
       return luaL_error( L, "bad arguments #1, #2 to rt2temp_PTS (Rt/R0 out of range [%g, %g])", 0.8, 1.6 );
-#endif
-   } else {
-      /* Good enough (<.5LSB) for 16 bits w/10k pullup from -50 to 155 */
-      temp = (sqrt(PTS_A*PTS_A - 4*PTS_B + 4*PTS_B*Rt_R0) - PTS_A)/(2*PTS_B);
    }
+#endif
 
    lua_pushnumber( L, temp );
    return 1 ;
@@ -342,6 +359,18 @@ int pi_temp2rt_PTS(lua_State * L)
  * --------
  * Returns temperature in degC
  */
+double rt2temp_44004( double reading )
+{
+   /* We use a set of coefficents fit to readings from 500 to 3600 of 4096 counts */
+   reading *= 4096.0 ;
+   if( reading > pos44004READING || reading < neg44004READING ) {
+      return NAN ;
+   }
+
+   /* These values produce results with less than +/- 0.3 degC errors and assume 1820 Ohm pullup to 2252 Ohm thermistor */
+   return 79.2012 - 0.0236906 * reading - 3.17644E-9 * (reading-2914.01)*(reading-2587.64)*(reading-1404.34) ;
+}
+
 int pi_rt2temp_44004(lua_State * L)
 {
    lua_Number  reading ;
@@ -350,17 +379,12 @@ int pi_rt2temp_44004(lua_State * L)
    reading = luaL_checknumber( L, 1 );
    luaL_argcheck( L, reading >= 0.0 && reading < 1.0, 1, "out of range [0,1)" );
 
-   /* We use a set of coefficents fit to readings from 500 to 3600 of 4096 counts */
-   reading *= 4096.0 ;
-   if( reading > pos44004READING || reading < neg44004READING ) {
-      temp = NAN ;
+   temp = rt2temp_44004( reading );
 #ifdef RANGE2ERROR
+   if( isnan( temp ) ) {
       return luaL_error( L, "argument #1 to rt2temp_44004 exceeds accuracy range [%g, %g]", neg44004READING, pos44004READING );
-#endif
-   } else {
-      /* These values produce results with less than +/- 0.3 degC errors and assume 1820 Ohm pullup to 2252 Ohm thermistor */
-      temp = 79.2012 - 0.0236906 * reading - 3.17644E-9 * (reading-2914.01)*(reading-2587.64)*(reading-1404.34) ;
    }
+#endif
 
    lua_pushnumber( L, temp );
    return 1 ;
@@ -4,14 +4,24 @@
 do
 
 -- Loop through configured sensors
---    Collect "update" sensors and update their values
+--    Collect "update" sensors and update their values, but for the
+--      Vcc and cold junction references (refreshed on first use)
+--    Give every sensor an age-bounded read method, s:read{ maxage=... }
+--    Oversample the ADS8344 channels of Sensors{ oversample=k }
+--    Bind the sensors sampled in C to their sensor objects
   local k, v, s
   for k, s in ipairs( S ) do
     if s.update ~= nil then
       table.insert(Update,s)
     end
+    if s.read == nil then
+      s.read = pi.read
+    end
+    pi.oversample( s )
   end
-  pi.doUpdate( )
+  for k, s in ipairs( S ) do pi.bind( s ) end
+  pi.doUpdate( true )
+  pi.schedule( )
 
 -- Default App function
   local function defaultApp (...)
@@ -29,9 +39,12 @@ do
       end
     end
 
-    -- Loop through args, read each and print
-    local start = pi.gettime( )
-    io.write( string.format( "# Starting at %.6f sec\n", start ) )
+    -- Initialize the chips of every arg together, then read each and print
+    local sensors = { }
+    for k, v in ipairs( args ) do table.insert( sensors, byName[v] ) end
+    pi.ready( sensors )
+    local start = pi.clock( )
+    io.write( string.format( "# Starting at %.6f sec\n", pi.gettime( ) ) )
     for k, v in ipairs( args ) do
       s = byName[v]
       if s == nil then
@@ -46,9 +59,13 @@ do
         io.write( string.format( "%-10s UNREADABLE\n", v ) )
       end
     end
-    io.write( string.format( "# Completed in %.6f sec\n", pi.gettime(start) ) )
+    io.write( string.format( "# Completed in %.6f sec\n", pi.clock( start ) ) )
   end
 
+-- A snapshot for the default App can't stand in for the config's own
+--   (pi.snapshot_save)
+  pi.defaultApp = defaultApp
+
 -- If user didn't provide an App global, export the default App
   if type(App) ~= "nil" and type(App) ~= "function" then
     error( "App global is type "..type(App)..", not a function" )
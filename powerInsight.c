@@ -15,11 +15,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include "powerInsight.h"
+#include "pilib.h"
 #include "piglobal.h"
+#include "piacq.h"
 
 /* Global variables */
 char *  ARGV0 = "powerInsight" ;
@@ -27,6 +30,9 @@ char *  libexecdir = PILIBDIR_DEFAULT ;
 char *  configfile = PICONFIGFILE_DEFAULT ;
 unsigned int  debug = PIDEBUG_DEFAULT ;
 int  verbose = PIVERBOSE_DEFAULT ;
+int  rtprio = 0 ;
+int  rtlock = 0 ;
+int  rtcpu = -1 ;
 
 /* The Lua state */
 lua_State * L = NULL ;
@@ -34,6 +40,39 @@ lua_State * L = NULL ;
 /* Shared space */
 char buffer[1024];
 
+/* Streaming mode (--stream), see pi_stream in pilib_stream.c */
+int  stream = 0 ;  /* 1 = stream, 2 = benchmark (--bench), 3 = spectrum,
+                     4 = snapshot */
+double  stream_rate = 10.0 ;
+double  stream_duration = 0.0 ;  /* 0 = until interrupted */
+char *  stream_out = NULL ;  /* Binary file (--out), see pilib_pib.c */
+
+/* Spectrum report (--spectrum), see pilib_fft.c */
+int  spectrum_size = 0 ;
+char *  spectrum_window = "hann" ;
+int  spectrum_average = 1 ;
+
+/* Plan snapshots (--snapshot, --load), see pilib_snap.c */
+char *  snapshot_out = NULL ;
+char *  snapshot_in = NULL ;
+
+static struct option  longOptions[] = {
+      { "stream",   no_argument,       NULL, 's' },
+      { "bench",    no_argument,       NULL, 'b' },
+      { "rate",     required_argument, NULL, 'r' },
+      { "duration", required_argument, NULL, 't' },
+      { "out",      required_argument, NULL, 'o' },
+      { "fifo",     required_argument, NULL, 'f' },
+      { "mlock",    no_argument,       NULL, 'm' },
+      { "cpu",      required_argument, NULL, 'p' },
+      { "spectrum", required_argument, NULL, 'S' },
+      { "window",   required_argument, NULL, 'w' },
+      { "average",  required_argument, NULL, 'a' },
+      { "snapshot", required_argument, NULL, 'N' },
+      { "load",     required_argument, NULL, 'L' },
+      { NULL, 0, NULL, 0 }
+   };
+
 /* Parse options.
  * Return 0 if OK, -1 if error (print usage and exit)
  */
@@ -46,7 +85,7 @@ int parseOptions( int argc, char** argv )
    /* Save command name for errors and other output */
    ARGV0 = argv[0] ;
 
-   while( -1 != (option = getopt( argc, argv, "uvqd:c:D:" )) ) {
+   while( -1 != (option = getopt_long( argc, argv, "uvqd:c:D:", longOptions, NULL )) ) {
       switch( option ) {
 
       case '?' : /* fallthrough */
@@ -69,8 +108,57 @@ int parseOptions( int argc, char** argv )
          if( verbose >= 2 )
             fprintf( stderr, "Library directory now: %s\n", libexecdir );
          break ;
+      case 's' : stream = 1 ; break ;
+      case 'b' : stream = 2 ; break ;
+      case 'r' :
+         stream_rate = strtod( optarg, NULL );
+         if( stream_rate <= 0 ) {
+            fprintf( stderr, "%s: --rate must be > 0\n", ARGV0 );
+            usage = -1 ;
+         }
+         break ;
+      case 't' :
+         stream_duration = strtod( optarg, NULL );
+         break ;
+      case 'o' : stream_out = optarg ; break ;
+      case 'f' :
+         rtprio = strtol( optarg, NULL, 0 );
+         if( rtprio < 1 || rtprio > 99 ) {
+            fprintf( stderr, "%s: --fifo priority must be 1 to 99\n", ARGV0 );
+            usage = -1 ;
+         }
+         break ;
+      case 'm' : rtlock = 1 ; break ;
+      case 'p' :
+         rtcpu = strtol( optarg, NULL, 0 );
+         if( rtcpu < 0 ) {
+            fprintf( stderr, "%s: --cpu must be >= 0\n", ARGV0 );
+            usage = -1 ;
+         }
+         break ;
+      case 'S' :
+         stream = 3 ;
+         spectrum_size = strtol( optarg, NULL, 0 );
+         break ;
+      case 'w' : spectrum_window = optarg ; break ;
+      case 'a' :
+         spectrum_average = strtol( optarg, NULL, 0 );
+         if( spectrum_average < 1 ) {
+            fprintf( stderr, "%s: --average must be >= 1\n", ARGV0 );
+            usage = -1 ;
+         }
+         break ;
+      case 'N' :
+         stream = 4 ;
+         snapshot_out = optarg ;
+         break ;
+      case 'L' : snapshot_in = optarg ; break ;
       }
    }
+   if( snapshot_in != NULL && stream == 4 ) {
+      fprintf( stderr, "%s: --load and --snapshot don't go together\n", ARGV0 );
+      usage = -1 ;
+   }
 
    return usage ;
    /* Also, argv[optind] is the first non-option argument */
@@ -80,6 +168,10 @@ void usage( )
 {
    printf(
 "usage: %s [-u] [-v] [-d flags] [-c file] [-D directory] [chan ...]\n"
+"       %s --stream [--rate N] [--duration T] [--out file] [options] [chan ...]\n"
+"       %s --bench [--duration T] [options] [chan ...]\n"
+"       %s --spectrum N [--window W] [--average K] [options] [chan ...]\n"
+"       %s --snapshot file [options] [chan ...]\n"
 "where:\n"
 "   -u  print this usage menu\n"
 "   -v  increments verbosity\n"
@@ -87,6 +179,21 @@ void usage( )
 "   -d  set one or more debug flags (bitmask)\n"
 "   -c  specify location of configuration file\n"
 "   -D  specify prefix for library files\n"
+"   --stream  sample the channels continuously, one line per sample\n"
+"   --rate  scans per second in stream mode (default: 10)\n"
+"   --duration  seconds to stream (default: until interrupted)\n"
+"   --out  write the stream to a binary file instead (read it with pibread)\n"
+"   --bench  measure sampling throughput, serial and one loop per SPI bus\n"
+"   --fifo  run the sampling loop SCHED_FIFO at this priority (1-99)\n"
+"   --mlock  pre-fault and lock memory once configured\n"
+"   --cpu  pin the sampling loop to this CPU\n"
+"   --spectrum  take N samples (a power of 2) of each channel back to back\n"
+"         and report the dominant frequencies of its current, -v every bin\n"
+"   --window  hann (default), hamming, blackman or rect\n"
+"   --average  windows of N samples averaged (default: 1)\n"
+"   --snapshot  write the compiled channels to a file and exit\n"
+"   --load  read, stream, bench or spectrum from a snapshot instead of the\n"
+"         config file, unless the config changed since it was written\n"
 "   chan  one or more channels to read and report:\n"
 "         eg: J1, J2, J3, ..., J15\n"
 "             T0 -- Main carrier temperature\n"
@@ -94,14 +201,28 @@ void usage( )
 "             T1, T2, ..., T6, T7, T8\n"
 "             TJ1, TJ2 -- Temp carrier junction temps\n"
          "",
-         ARGV0 );
+         ARGV0, ARGV0, ARGV0, ARGV0, ARGV0 );
    exit( 1 );
 }
 
+/* Startup timing (-v), time since *t of phase name, *t moves on */
+static void startup( const char * name, int64_t * t )
+{
+   int64_t  now = monotime_ns( );
+
+   if( verbose >= 1 ) {
+      fprintf( stderr, "# Startup: %-14s %.6f sec\n", name, (now - *t) / 1000000000.0 );
+   }
+   *t = now ;
+}
+
 int main( int argc, char ** argv )
 {
    int i ;
+   int nargs ;
    int ret ;
+   int loaded ;
+   int64_t  t ;
 
    if( parseOptions( argc, argv ) )
       usage( );
@@ -119,7 +240,8 @@ int main( int argc, char ** argv )
    }
 
    /* Create a Lua instance */
-   L = luaL_newstate( );
+   t = monotime_ns( );
+   L = pi_newstate( );  /* Pooled allocator, see pilib_alloc.c */
    if( L == NULL ) {
       fprintf( stderr, "%s: Memory allocation error creating Lua instance.\n", ARGV0 );
       exit( 1 );
@@ -131,6 +253,8 @@ int main( int argc, char ** argv )
    /* Register Power Insight library */
    pi_register( L );
 
+   startup( "Lua state", &t );
+
    /* Finish initialization with Lua code */
    strcpy( buffer, libexecdir );
    strcat( buffer, "/init_final.lc" );
@@ -141,42 +265,120 @@ int main( int argc, char ** argv )
       strcat( buffer, "/init_final.lc" );
       luaPI_doerror( L, ret, buffer );
    }
+   startup( "init_final", &t );
 
-   /* Now read the config file */
-   ret = luaL_loadfile( L, configfile );
-   if( ret != 0 || (ret = lua_pcall( L, 0, LUA_MULTRET, 0 )) ) {
-      strcpy( buffer, "Processing config file " );
-      strcat( buffer, configfile );
-      luaPI_doerror( L, ret, buffer );
-   }
-   if( (debug & DBG_LUA) && lua_gettop( L ) ) {
-      fprintf( stderr, "Config file returned %d values. Ignored\n", lua_gettop( L ) );
+   /* A snapshot (--load) stands in for the config file, pi.snapshot_load( in ) */
+   loaded = 0 ;
+   if( snapshot_in != NULL ) {
+      lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+      lua_getfield( L, -1, "snapshot_load" );
+      lua_remove( L, -2 );
+      lua_pushstring( L, snapshot_in );
+      lua_pushboolean( L, stream == 0 );  /* The default App, a query */
+      if( (ret = lua_pcall( L, 2, 2, 0 )) != 0 ) {
+         luaPI_doerror( L, ret, "Loading the snapshot" );
+      }
+      loaded = ! lua_isnil( L, -2 );
+      if( ! loaded && verbose >= 0 ) {
+         fprintf( stderr, "%s: %s: %s, reading %s\n", ARGV0, snapshot_in,
+               lua_tostring( L, -1 ), configfile );
+      }
+      lua_pop( L, 2 );
+      startup( "snapshot", &t );
    }
-   lua_pop( L, lua_gettop( L ));
 
-   /* Post-configfile initialization with Lua code */
-   strcpy( buffer, libexecdir );
-   strcat( buffer, "/post_conf.lc" );
-   ret = luaL_loadfile( L, buffer );
-   if( ret != 0 || (ret = lua_pcall( L, 0, 0, 0 )) ) {
-      strcpy( buffer, "Load/run " );
-      strcat( buffer, libexecdir );
+   if( ! loaded ) {
+      /* Now read the config file */
+      ret = luaL_loadfile( L, configfile );
+      if( ret != 0 || (ret = lua_pcall( L, 0, LUA_MULTRET, 0 )) ) {
+         strcpy( buffer, "Processing config file " );
+         strcat( buffer, configfile );
+         luaPI_doerror( L, ret, buffer );
+      }
+      if( (debug & DBG_LUA) && lua_gettop( L ) ) {
+         fprintf( stderr, "Config file returned %d values. Ignored\n", lua_gettop( L ) );
+      }
+      lua_pop( L, lua_gettop( L ));
+      startup( "config file", &t );
+
+      /* Post-configfile initialization with Lua code */
+      strcpy( buffer, libexecdir );
       strcat( buffer, "/post_conf.lc" );
-      luaPI_doerror( L, ret, buffer );
+      ret = luaL_loadfile( L, buffer );
+      if( ret != 0 || (ret = lua_pcall( L, 0, 0, 0 )) ) {
+         strcpy( buffer, "Load/run " );
+         strcat( buffer, libexecdir );
+         strcat( buffer, "/post_conf.lc" );
+         luaPI_doerror( L, ret, buffer );
+      }
+      startup( "post_conf", &t );
+   }
+
+   /* Configuration is complete, lock it in memory (--mlock) */
+   pi_rt_lock( L );
+
+   /* Binary stream file, pi.stream_file( out ) */
+   if( stream == 1 && stream_out != NULL ) {
+      lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+      lua_getfield( L, -1, "stream_file" );
+      lua_remove( L, -2 );
+      lua_pushstring( L, stream_out );
+      if( (ret = lua_pcall( L, 1, 0, 0 )) != 0 ) {
+         luaPI_doerror( L, ret, "Setting the stream file" );
+      }
    }
 
-   /* Push all args and Run "App" */
-   if( ! lua_checkstack( L, argc - optind +2 ) ) {
+   /* Push all args and Run "App", pi.stream( rate, duration, ... ) or
+    *    pi.stream_bench( duration, ... )
+    */
+   if( ! lua_checkstack( L, argc - optind +4 ) ) {
       fprintf( stderr, "%s: Too many arguments\n", ARGV0 );
       exit( 1 );
    }
-   lua_getfield( L, LUA_GLOBALSINDEX, "App" );
+   nargs = argc - optind ;
+   if( stream == 4 ) {
+      lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+      lua_getfield( L, -1, "snapshot" );
+      lua_remove( L, -2 );
+      lua_pushstring( L, snapshot_out );
+      nargs += 1 ;
+   } else if( stream == 3 ) {
+      lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+      lua_getfield( L, -1, "spectrum_report" );
+      lua_remove( L, -2 );
+      lua_pushinteger( L, spectrum_size );
+      lua_pushstring( L, spectrum_window );
+      lua_pushinteger( L, spectrum_average );
+      nargs += 3 ;
+   } else if( stream == 2 ) {
+      lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+      lua_getfield( L, -1, "stream_bench" );
+      lua_remove( L, -2 );
+      lua_pushnumber( L, stream_duration > 0 ? stream_duration : 1.0 );
+      nargs += 1 ;
+   } else if( stream ) {
+      lua_getfield( L, LUA_GLOBALSINDEX, "pi" );
+      lua_getfield( L, -1, "stream" );
+      lua_remove( L, -2 );
+      lua_pushnumber( L, stream_rate );
+      lua_pushnumber( L, stream_duration );
+      nargs += 2 ;
+   } else {
+      lua_getfield( L, LUA_GLOBALSINDEX, "App" );
+   }
    for( i = optind ; i < argc ; ++i ) {
       lua_pushstring( L, argv[i] );
    }
-   ret = lua_pcall( L, argc - optind, 0, 0 );
+   if( ! stream ) {
+      pi_rt_enter( rtcpu );  /* pi.stream does its own */
+   }
+   ret = lua_pcall( L, nargs, 0, 0 );
+   if( ! stream ) {
+      pi_rt_leave( );
+   }
    if( ret != 0 ) {
-      luaPI_doerror( L, ret, "Running application 'App'" );
+      luaPI_doerror( L, ret, stream == 4 ? "Writing the snapshot" :
+            stream ? "Streaming" : "Running application 'App'" );
    }
 
    return 0 ;
@@ -0,0 +1,110 @@
+/* Steady-state reads must not allocate
+ *
+ * Reads every J and T sensor until the Lua state settles, then reads
+ *      them 10,000 times counting Lua allocations (pidev_memstats) and
+ *      C allocations (malloc, calloc and realloc, interposed below).
+ *      Exits 1 if either grew.
+ *
+ * The config is run with a short Update.interval, and the warm-up
+ *      lasts a couple of intervals, so the reference refreshes are
+ *      settled too and the measured reads go through several of them.
+ *
+ * usage: test_alloc [config file] (default: powerinsight_v2-1.conf)
+ */
+#include "pidev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define READS 10000
+#define WARMUP 100
+#define INTERVAL 0.1  /* Update.interval (sec) */
+
+/* Count the C allocations of the whole process, libpidev included */
+extern void * __libc_malloc( size_t size );
+extern void * __libc_calloc( size_t n, size_t size );
+extern void * __libc_realloc( void * p, size_t size );
+
+static unsigned long  callocs ;
+
+void * malloc( size_t size ) { ++callocs ; return __libc_malloc( size ); }
+void * calloc( size_t n, size_t size ) { ++callocs ; return __libc_calloc( n, size ); }
+void * realloc( void * p, size_t size ) { ++callocs ; return __libc_realloc( p, size ); }
+
+/* Read each sensor once, return how many read */
+static int read_all( void ){
+    reading_t reading;
+    int i, n = 0;
+
+    for(i=1;i<=15;i++){
+        if(pidev_read(i, &reading)==PIERR_SUCCESS) { ++n ; }
+    }
+    for(i=1;i<=8;i++){
+        if(pidev_temp(i, &reading)==PIERR_SUCCESS) { ++n ; }
+    }
+    return n ;
+}
+
+static double now( void ){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9 ;
+}
+
+/* The config file, with Update.interval set to INTERVAL */
+static char * short_config( const char * config ){
+    static char path[] = "/tmp/test_alloc-XXXXXX";
+    FILE * f;
+    int fd;
+
+    fd = mkstemp(path);
+    if(fd < 0 || (f = fdopen(fd, "w")) == NULL) { perror("test_alloc") ; exit(1) ; }
+    fprintf(f, "dofile( [==[%s]==] )\nUpdate.interval = %g\n", config, INTERVAL);
+    fclose(f);
+    return path ;
+}
+
+int main( int argc, char ** argv ){
+    memstats_t before, after;
+    update_stats_t updates;
+    unsigned long c;
+    char * config;
+    double start;
+    int i, n;
+
+    config = short_config(argc > 1 ? argv[1] : "powerinsight_v2-1.conf");
+    pidev_setup("test_alloc", ".", config, 0, 0);
+    i = pidev_open();
+    unlink(config);
+    if(i!=PIERR_SUCCESS) { exit(1) ; }
+
+    start = now();
+    for(i=0;i<WARMUP || now() - start < 2 * INTERVAL;i++){
+        n = read_all();
+    }
+    printf("%d sensors\n", n);
+    if(n==0) { exit(1) ; }
+
+    pidev_update_stats(&updates, 1);
+    pidev_memstats(&before);
+    c = callocs;
+    for(i=0;i<READS;i++){
+        read_all();
+    }
+    c = callocs - c;
+    pidev_memstats(&after);
+    pidev_update_stats(&updates, 0);
+
+    printf("%d reads: %lu Lua allocations (%lu bytes held, was %lu), %lu C allocations\n",
+        READS * n, after.allocs - before.allocs, after.inuse, before.inuse, c);
+    printf("%lu reference refreshes\n", updates.refreshed);
+
+    if(after.allocs!=before.allocs || c!=0){
+        printf("FAIL: steady state reads allocate\n");
+        exit(1);
+    }
+    printf("OK\n");
+    return 0 ;
+}
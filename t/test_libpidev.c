@@ -7,6 +7,7 @@ int main(){
     int result;
     int i, j;
     reading_t reading;
+    memstats_t mem;
 
     printf("setup\n");
     pidev_setup("testpidev", ".", "powerinsight_v2-1.conf", 8, 1);
@@ -52,6 +53,10 @@ int main(){
         }
 
         malloc_stats( );
+        if( pidev_memstats( &mem ) == PIERR_SUCCESS ) {
+            printf("lua: %lu bytes (peak %lu), %lu allocs %lu frees, %lu of %lu pooled free\n",
+                mem.inuse, mem.peak, mem.allocs, mem.frees, mem.idle, mem.pooled);
+        }
         sleep( 1 );
     }
 